@@ -4,6 +4,10 @@
 #include <fstream>
 #include<shlobj.h>
 #include "tcpclient.h"
+#include "swarm.h"
+#include "sha256.h"
+#include "eventlog.h"
+#include <algorithm>
 // Static member initialization
 
 HANDLE                CWindowsService::m_ServiceStopEvent = INVALID_HANDLE_VALUE;
@@ -11,7 +15,14 @@ HANDLE                CWindowsService::m_hHttpQueue = NULL;
 HTTP_SERVER_SESSION_ID CWindowsService::m_SessionId = 0;
 HTTP_URL_GROUP_ID     CWindowsService::m_UrlGroupId = 0;
 DWORD                 CWindowsService::m_HttpPort = DEFAULT_HTTP_PORT;
-std::vector<localFileHandler> CWindowsService::localFiles;
+HashCache             CWindowsService::m_hashCache;
+ShareIndex            CWindowsService::m_shareIndex(CWindowsService::m_hashCache);
+FileListCache         CWindowsService::m_fileList;
+std::mutex            CWindowsService::m_shareLock;
+DownloadManager       CWindowsService::m_downloads;
+HANDLE                CWindowsService::m_hHttpPort = NULL;
+std::atomic<bool>     CWindowsService::m_httpStopping(false);
+std::atomic<LONG>     CWindowsService::m_httpReceives(0);
 TCPFileServer* CWindowsService::m_pTCPServer;
 
 /**
@@ -46,6 +57,11 @@ void CWindowsService::StartTCPServerThrd() {
 	
     // Create TCP server instance
 	m_pTCPServer = new TCPFileServer(8080, "C:\\SharedFiles");
+	// Once the share is picked, its index supplies files, hashes and proofs
+	m_pTCPServer->SetShareIndex(&m_shareIndex);
+	m_pTCPServer->SetCacheSize((size_t)GetChunkCacheSizeFromRegistry() * 1024 * 1024);
+	m_pTCPServer->SetUploadLimits((ULONG64)GetUploadLimitFromRegistry() * 1024, (ULONG64)GetPeerUploadLimitFromRegistry() * 1024);
+	m_pTCPServer->SetCompression(GetCompressionFromRegistry());
     
     // Initialize and start TCP server
     if (m_pTCPServer->Initialize() ) {
@@ -82,8 +98,17 @@ void CWindowsService::StopTCPServerThrd() {
 */
 DWORD WINAPI CWindowsService::ServiceWorkerThread(LPVOID lpParam){
 	
+	char szKernels[128];
+	sprintf_s(szKernels, "SHA-256 kernel: %s, Merkle leaves: %s", Sha256Implementation(), Sha256LanesImplementation());
+	WriteToEventLog(szKernels);
+
+	// Hashes from earlier runs, so the first file listing only hashes what changed
+	m_hashCache.Load(GetHashCachePath());
+	m_shareIndex.SetContentChunking(GetContentChunkingFromRegistry());
 	
 	StartTCPServerThrd();
+	m_downloads.SetLocalChunks(&m_shareIndex);
+	m_downloads.Start(GetMaxDownloadsFromRegistry());
 	
 	
 	WriteToEventLog("Starting HTTP API service");
@@ -95,43 +120,66 @@ DWORD WINAPI CWindowsService::ServiceWorkerThread(LPVOID lpParam){
 		return result;
 	}
 
-	// Allocate request buffer
-	PHTTP_REQUEST pRequest = (PHTTP_REQUEST)LocalAlloc(LPTR, sizeof(HTTP_REQUEST) + MAX_REQUEST_SIZE);
-	if (pRequest == NULL){
-		WriteToEventLog("Failed to allocate request buffer");
+	// Completions of the receives posted on the queue go to the worker pool
+	m_hHttpPort = CreateIoCompletionPort(m_hHttpQueue, NULL, 0, 0);
+	if (m_hHttpPort == NULL){
+		result = GetLastError();
+		WriteToEventLog("Failed to create HTTP completion port");
 		CleanupHttpServer();
-		return ERROR_NOT_ENOUGH_MEMORY;
+		return result;
 	}
 
-	HTTP_REQUEST_ID requestId = HTTP_NULL_ID;
-	DWORD bytesReceived = 0;
-
-	WriteToEventLog("HTTP API server ready");
+	// Allocate request buffers, each one stays posted until it carries a request
+	std::vector<HttpReceive> receives(HTTP_RECEIVE_BUFFERS);
+	for (size_t i = 0; i < receives.size(); i++){
+		receives[i].pRequest = (PHTTP_REQUEST)LocalAlloc(LMEM_FIXED, sizeof(HTTP_REQUEST) + MAX_REQUEST_SIZE);
+		if (receives[i].pRequest == NULL){
+			WriteToEventLog("Failed to allocate request buffer");
+			for (size_t j = 0; j < i; j++)
+				LocalFree(receives[j].pRequest);
+			CloseHandle(m_hHttpPort);
+			m_hHttpPort = NULL;
+			CleanupHttpServer();
+			return ERROR_NOT_ENOUGH_MEMORY;
+		}
+	}
 
-	// Main HTTP processing loop
-	while (WaitForSingleObject(m_ServiceStopEvent, 0) != WAIT_OBJECT_0){
-		ZeroMemory(pRequest, sizeof(HTTP_REQUEST) + MAX_REQUEST_SIZE);
+	m_httpStopping = false;
+	std::vector<std::thread> workers;
+	for (int i = 0; i < HTTP_WORKER_THREADS; i++){
+		workers.push_back(std::thread(&CWindowsService::HttpWorkerThread));
+	}
+	for (size_t i = 0; i < receives.size(); i++){
+		PostHttpReceive(&receives[i]);
+	}
 
-		result = HttpReceiveHttpRequest(m_hHttpQueue, requestId, 0, pRequest,
-			sizeof(HTTP_REQUEST) + MAX_REQUEST_SIZE, &bytesReceived, NULL);
+	WriteToEventLog("HTTP API server ready");
 
-		if (result == ERROR_SUCCESS){
-			ProcessHttpRequest(pRequest, pRequest->RequestId);
-			requestId = HTTP_NULL_ID;
-		}else if (result == ERROR_MORE_DATA){
-			SendJsonResponse(pRequest->RequestId, 413, "{\"error\":\"Request too large\"}");
-			requestId = HTTP_NULL_ID;
-		}else if (result != WAIT_TIMEOUT && result != ERROR_OPERATION_ABORTED){
-			Sleep(100);
-		}
+	// Requests are handled by the workers until the service stops
+	WaitForSingleObject(m_ServiceStopEvent, INFINITE);
 
-		if (WaitForSingleObject(m_ServiceStopEvent, 10) == WAIT_OBJECT_0)
-			break;
+	// Cancel the receives still posted and wait for the ones being handled
+	m_httpStopping = true;
+	HttpShutdownRequestQueue(m_hHttpQueue);
+	while (m_httpReceives > 0){
+		Sleep(10);
+	}
+	for (size_t i = 0; i < workers.size(); i++){
+		PostQueuedCompletionStatus(m_hHttpPort, 0, HTTP_STOP_KEY, NULL);
+	}
+	for (size_t i = 0; i < workers.size(); i++){
+		workers[i].join();
 	}
 
 	// Cleanup
-	LocalFree(pRequest);
+	for (size_t i = 0; i < receives.size(); i++){
+		LocalFree(receives[i].pRequest);
+	}
+	CloseHandle(m_hHttpPort);
+	m_hHttpPort = NULL;
 	CleanupHttpServer();
+	m_downloads.Stop();
+	m_shareIndex.Stop();
 	WriteToEventLog("HTTP API service stopped");
 	return ERROR_SUCCESS;
 }
@@ -240,6 +288,62 @@ void CWindowsService::CleanupHttpServer(){
 	HttpTerminate(HTTP_INITIALIZE_SERVER, NULL);
 }
 
+/**
+* @brief Post an overlapped receive for the next request on the queue
+*
+* The buffer is not cleared first, HTTP.sys fills in every field it hands
+* back. A receive counts as outstanding until a worker is done with it.
+*/
+DWORD CWindowsService::PostHttpReceive(HttpReceive* pReceive){
+	ZeroMemory(&pReceive->ov, sizeof(pReceive->ov));
+	m_httpReceives++;
+	DWORD result = HttpReceiveHttpRequest(m_hHttpQueue, HTTP_NULL_ID, 0, pReceive->pRequest,
+		sizeof(HTTP_REQUEST) + MAX_REQUEST_SIZE, NULL, &pReceive->ov);
+	// Even a receive that finds a request waiting completes through the port
+	if (result != ERROR_IO_PENDING && result != NO_ERROR){
+		m_httpReceives--;
+		if (!m_httpStopping)
+			WriteToEventLog("HttpReceiveHttpRequest failed");
+	}
+	return result;
+}
+
+/**
+* @brief Handle completed receives from the completion port until HTTP_STOP_KEY
+*
+* Each worker answers the request it dequeued and then posts the buffer
+* again, so up to HTTP_WORKER_THREADS requests run at once while the rest
+* of the buffers keep taking in new ones.
+*/
+void CWindowsService::HttpWorkerThread(){
+	for (;;){
+		DWORD bytes = 0;
+		ULONG_PTR key = 0;
+		LPOVERLAPPED ov = NULL;
+		BOOL ok = GetQueuedCompletionStatus(m_hHttpPort, &bytes, &key, &ov, INFINITE);
+		if (ov == NULL){
+			if (key == HTTP_STOP_KEY)
+				break;
+			continue;
+		}
+
+		HttpReceive* pReceive = CONTAINING_RECORD(ov, HttpReceive, ov);
+		PHTTP_REQUEST pRequest = pReceive->pRequest;
+		DWORD result = ok ? ERROR_SUCCESS : GetLastError();
+		if (result == ERROR_SUCCESS){
+			ProcessHttpRequest(pRequest, pRequest->RequestId);
+		}else if (result == ERROR_MORE_DATA){
+			SendJsonResponse(pRequest->RequestId, 413, "{\"error\":\"Request too large\"}");
+		}else if (result != ERROR_OPERATION_ABORTED && !m_httpStopping){
+			Sleep(100);
+		}
+
+		if (!m_httpStopping)
+			PostHttpReceive(pReceive);
+		m_httpReceives--;
+	}
+}
+
 /**
 * @brief Process incoming HTTP requests
 */
@@ -283,8 +387,18 @@ DWORD CWindowsService::ProcessHttpRequest(PHTTP_REQUEST pRequest, HTTP_REQUEST_I
 		return SendJsonResponse(RequestId, 200, "");
 	}
 
+	// Split off the query string
+	std::string query;
+	size_t queryStart = url.find('?');
+	if (queryStart != std::string::npos){
+		query = url.substr(queryStart + 1);
+		url.resize(queryStart);
+	}
+
 	// Route API requests
-	if (url.find("/api/") == 0){
+	if (url == "/api/files" && method == "GET"){
+		return HandleFileListRequest(pRequest, RequestId, query);
+	}else if (url.find("/api/") == 0){
         std::string response = HandleApiRequest(url.c_str(), method.c_str(), requestBody.c_str());
 		return SendJsonResponse(RequestId, 200, response.c_str());
 	}else{
@@ -296,22 +410,30 @@ DWORD CWindowsService::ProcessHttpRequest(PHTTP_REQUEST pRequest, HTTP_REQUEST_I
 /**
 * @brief Send JSON response with CORS headers
 */
-DWORD CWindowsService::SendJsonResponse(HTTP_REQUEST_ID RequestId, USHORT StatusCode, const char* pJsonContent){
+DWORD CWindowsService::SendJsonResponse(HTTP_REQUEST_ID RequestId, USHORT StatusCode, const char* pJsonContent, const char* pETag){
 	HTTP_RESPONSE response;
 	HTTP_DATA_CHUNK dataChunk;
 
 	// Initialize response
 	ZeroMemory(&response, sizeof(response));
 	response.StatusCode = StatusCode;
-	response.pReason = (StatusCode == 200) ? "OK" : (StatusCode == 404) ? "Not Found" : "Error";
+	response.pReason = (StatusCode == 200) ? "OK" : (StatusCode == 304) ? "Not Modified" : (StatusCode == 404) ? "Not Found" : "Error";
 	response.ReasonLength = (USHORT)strlen(response.pReason);
 
 	// Set JSON content type
 	response.Headers.KnownHeaders[HttpHeaderContentType].pRawValue = "application/json";
 	response.Headers.KnownHeaders[HttpHeaderContentType].RawValueLength = 16;
 
+	// Let the client revalidate instead of reusing the body blindly
+	if (pETag){
+		response.Headers.KnownHeaders[HttpHeaderEtag].pRawValue = pETag;
+		response.Headers.KnownHeaders[HttpHeaderEtag].RawValueLength = (USHORT)strlen(pETag);
+		response.Headers.KnownHeaders[HttpHeaderCacheControl].pRawValue = "no-cache";
+		response.Headers.KnownHeaders[HttpHeaderCacheControl].RawValueLength = 8;
+	}
+
 	// Add CORS headers
-	HTTP_UNKNOWN_HEADER corsHeaders[3];
+	HTTP_UNKNOWN_HEADER corsHeaders[4];
 	corsHeaders[0].pName = "Access-Control-Allow-Origin";
 	corsHeaders[0].NameLength = 27;
 	corsHeaders[0].pRawValue = "*";
@@ -324,10 +446,15 @@ DWORD CWindowsService::SendJsonResponse(HTTP_REQUEST_ID RequestId, USHORT Status
 
 	corsHeaders[2].pName = "Access-Control-Allow-Headers";
 	corsHeaders[2].NameLength = 28;
-	corsHeaders[2].pRawValue = "Content-Type, Authorization";
-	corsHeaders[2].RawValueLength = 27;
+	corsHeaders[2].pRawValue = "Content-Type, Authorization, If-None-Match";
+	corsHeaders[2].RawValueLength = 42;
 
-	response.Headers.UnknownHeaderCount = 3;
+	corsHeaders[3].pName = "Access-Control-Expose-Headers";
+	corsHeaders[3].NameLength = 29;
+	corsHeaders[3].pRawValue = "ETag";
+	corsHeaders[3].RawValueLength = 4;
+
+	response.Headers.UnknownHeaderCount = 4;
 	response.Headers.pUnknownHeaders = corsHeaders;
 
 	// Set response body
@@ -342,6 +469,83 @@ DWORD CWindowsService::SendJsonResponse(HTTP_REQUEST_ID RequestId, USHORT Status
 	return HttpSendHttpResponse(m_hHttpQueue, RequestId, 0, &response, NULL, NULL, NULL, 0, NULL, NULL);
 }
 
+// Value of name in a query string, empty if it is not there
+static std::string GetQueryParameter(const std::string& query, const char* name) {
+	size_t length = strlen(name);
+	size_t pos = 0;
+	while (pos < query.size()){
+		size_t end = query.find('&', pos);
+		if (end == std::string::npos)
+			end = query.size();
+		if (end - pos > length && query.compare(pos, length, name) == 0 && query[pos + length] == '=')
+			return query.substr(pos + length + 1, end - pos - length - 1);
+		pos = end + 1;
+	}
+	return "";
+}
+
+// True if an If-None-Match header names etag, or is "*"
+static bool ETagMatches(const HTTP_KNOWN_HEADER& header, const std::string& etag) {
+	if (header.pRawValue == NULL || header.RawValueLength == 0)
+		return false;
+	std::string value(header.pRawValue, header.RawValueLength);
+	size_t pos = 0;
+	while (pos < value.size()){
+		size_t end = value.find(',', pos);
+		if (end == std::string::npos)
+			end = value.size();
+		size_t first = value.find_first_not_of(" \t", pos);
+		size_t last = value.find_last_not_of(" \t", end - 1);
+		if (first != std::string::npos && first < end){
+			std::string tag = value.substr(first, last - first + 1);
+			if (tag.compare(0, 2, "W/") == 0)
+				tag.erase(0, 2);
+			if (tag == "*" || tag == etag)
+				return true;
+		}
+		pos = end + 1;
+	}
+	return false;
+}
+
+/**
+* @brief Serve /api/files from the cached listing
+*
+* The body is rendered once per catalog version, so an unchanged share is
+* served from memory. ?since=<version> returns only what changed after
+* the version of an earlier listing.
+*/
+DWORD CWindowsService::HandleFileListRequest(PHTTP_REQUEST pRequest, HTTP_REQUEST_ID RequestId, const std::string& query) {
+	// The folder is picked once, after that the index follows it on its own.
+	// Listings that come in meanwhile wait instead of opening more pickers.
+	{
+		std::lock_guard<std::mutex> lock(m_shareLock);
+		if (!m_shareIndex.IsRunning()){
+			std::string folder=ShowFolderSelection();
+			if (folder != "")
+				m_shareIndex.Start(folder);
+		}
+	}
+	if (!m_shareIndex.IsRunning()){
+		WriteToEventLog("Returning empty file list");
+		return SendJsonResponse(RequestId, 200, "{\"files\":[],\"count\":0,\"version\":0}");
+	}
+
+	ULONG64 since = 0;
+	std::string sinceValue = GetQueryParameter(query, "since");
+	if (!sinceValue.empty())
+		since = _strtoui64(sinceValue.c_str(), NULL, 10);
+
+	std::shared_ptr<const FileCatalog> catalog = m_shareIndex.GetFiles();
+	std::string etag = FileListCache::GetETag(*catalog, since);
+	if (ETagMatches(pRequest->Headers.KnownHeaders[HttpHeaderIfNoneMatch], etag)){
+		return SendJsonResponse(RequestId, 304, NULL, etag.c_str());
+	}
+
+	std::shared_ptr<const std::string> body = m_fileList.GetBody(catalog, since);
+	return SendJsonResponse(RequestId, 200, body->c_str(), etag.c_str());
+}
+
 /**
 * @brief Handle API endpoint requests
 */
@@ -350,36 +554,46 @@ std::string CWindowsService::HandleApiRequest(const char* pPath, const char* pMe
 
 	if (strcmp(pPath, "/api/status") == 0 && strcmp(pMethod, "GET") == 0){
 		json << "{\"status\":\"running\",\"port\":" << m_HttpPort << ",\"uptime\":" << (GetTickCount() / 1000) << "}";
-	}else if (strcmp(pPath, "/api/files") == 0 && strcmp(pMethod, "GET") == 0){
-		std::string folder=ShowFolderSelection();
-		if (folder != ""){
-			enumerateFiles(folder);
-			json << "{\"files\":[";
-			for (size_t i = 0; i < localFiles.size(); ++i) {
-				 auto& file = localFiles[i];
-				json << "{";
-				json << "\"filename\":\"" << file.getshortName() << "\",";
-				json << "\"size\":" << file.getFileSize() << ",";
-				json << "\"sha256\":\"" << file.getHash() << "\",";
-				json << "\"creation\":\"" << file.getCreationDate() << "\",";
-				json << "\"modified\":\"" << file.getLastWriteDate() << "\"";
-				json << "}";
-				if (i != localFiles.size() - 1)
-					json << ",";
-			}
-			json << "],\"count\":" << localFiles.size() << "}";
-		}else{
-			WriteToEventLog("Returning empty file list");
-			json << "{\"files\":[";
-			json << "],\"count\":" << "0, files not found" << "}";
-		}
-		/*json << "{\"files\":[";
-		json << "{\"name\":\"document.pdf\",\"size\":1024000,\"path\":\"C:\\\\Shared\\\\document.pdf\"},";
-		json << "{\"name\":\"image.jpg\",\"size\":512000,\"path\":\"C:\\\\Shared\\\\image.jpg\"}";
-		json << "],\"count\":2}";*/
-		//new code to write the real data
-		
-
+	}else if (strcmp(pPath, "/api/files/progress") == 0 && strcmp(pMethod, "GET") == 0){
+		// Cheap enough to poll while the share is being indexed
+		ShareProgress progress;
+		m_shareIndex.GetProgress(progress);
+		json << "{\"running\":" << (m_shareIndex.IsRunning() ? "true" : "false")
+			<< ",\"scanning\":" << (progress.scanning ? "true" : "false")
+			<< ",\"files\":" << progress.files
+			<< ",\"hash_pending\":" << progress.filesPending
+			<< ",\"bytes_pending\":" << progress.bytesPending
+			<< ",\"bytes_hashed\":" << progress.bytesHashed << "}";
+	}
+	else if (strcmp(pPath, "/api/server/cache") == 0 && strcmp(pMethod, "GET") == 0){
+		// Hit rates of the transfer server's caches, counted since it started
+		ChunkCacheStats chunks = {};
+		FileCacheStats files = {};
+		if (m_pTCPServer)
+			m_pTCPServer->GetCacheStats(chunks, files);
+		json << "{\"chunks\":{\"capacity_bytes\":" << chunks.capacityBytes
+			<< ",\"cached_bytes\":" << chunks.cachedBytes
+			<< ",\"lookups\":" << chunks.lookups
+			<< ",\"hits\":" << chunks.hits
+			<< ",\"checksum_hits\":" << chunks.checksumHits
+			<< ",\"hit_rate\":" << (chunks.lookups ? (double)chunks.hits / chunks.lookups : 0.0)
+			<< ",\"admitted\":" << chunks.admitted
+			<< ",\"evicted\":" << chunks.evicted
+			<< "},\"open_files\":{\"open\":" << files.open
+			<< ",\"hits\":" << files.hits
+			<< ",\"misses\":" << files.misses
+			<< ",\"hit_rate\":" << ((files.hits + files.misses) ? (double)files.hits / (files.hits + files.misses) : 0.0)
+			<< "}}";
+	}
+	else if (strcmp(pPath, "/api/server/upload") == 0 && strcmp(pMethod, "GET") == 0){
+		// Upload limits in force and how often they held a chunk back
+		UploadStats upload = {};
+		if (m_pTCPServer)
+			m_pTCPServer->GetUploadStats(upload);
+		json << "{\"total_limit\":" << upload.totalRate
+			<< ",\"peer_limit\":" << upload.peerRate
+			<< ",\"bytes_sent\":" << upload.bytes
+			<< ",\"delayed_chunks\":" << upload.delayed << "}";
 	}
 	else if (strncmp(pPath, "/api/file/", 10) == 0 && strcmp(pMethod, "GET") == 0){
 		const char* filename = pPath + 10;
@@ -389,9 +603,12 @@ std::string CWindowsService::HandleApiRequest(const char* pPath, const char* pMe
 		json << "{\"success\":true,\"message\":\"File uploaded successfully\"}";
 	}
     else if (strcmp(pPath, "/api/download") == 0 && strcmp(pMethod, "POST") == 0) {
-        // Handle file download request using TCP client
+        // Queue the download, its progress is under /api/downloads/{id}
         json << HandleDownloadRequest(pRequestBody);
     }
+    else if (strcmp(pPath, "/api/downloads") == 0 || strncmp(pPath, "/api/downloads/", 15) == 0) {
+        json << HandleDownloadJobRequest(pPath, pMethod);
+    }
     else if (strcmp(pPath, "/api/peers") == 0 && strcmp(pMethod, "GET") == 0) {
         json << "{\"peers\":[{\"id\":\"peer1\",\"ip\":\"192.168.1.100\",\"port\":8847}],\"count\":1}";
     }
@@ -412,58 +629,129 @@ std::string CWindowsService::HandleDownloadRequest(const char* pRequestBody) {
     
     std::string requestJson(pRequestBody);
     
-    // Extract filename and IP addresses from JSON
+    // Extract filename, content hash and IP addresses from JSON
     std::string filename = ExtractJsonValue(requestJson, "filename");
-    std::string firstIP = ExtractFirstIP(requestJson, "ip_addresses");
+    std::string hash = ExtractJsonValue(requestJson, "hash");
+    std::string merkleRoot = ExtractJsonValue(requestJson, "merkle_root");
+    std::vector<std::string> peerIPs = ExtractIPList(requestJson, "ip_addresses");
     
-    if (filename.empty() || firstIP.empty()) {
+    if ((filename.empty() && hash.empty()) || peerIPs.empty()) {
         return "{\"success\":false,\"message\":\"Missing filename or IP addresses\"}";
     }
+    if (!hash.empty() && !IsSha256Hex(hash)) {
+        return "{\"success\":false,\"message\":\"Invalid SHA-256 hash\"}";
+    }
+    if (!merkleRoot.empty() && !IsSha256Hex(merkleRoot)) {
+        return "{\"success\":false,\"message\":\"Invalid Merkle root\"}";
+    }
+    // With a hash the peers serve the content whatever they call it
+    if (filename.empty()) {
+        filename = hash;
+    }
     
-    // Log the download request
+    DownloadRequest request;
+    request.filename = filename;
+    request.sha256Hex = hash;
+    request.merkleRootHex = merkleRoot;
+    request.peerIPs = peerIPs;
+    request.outputPath = "C:\\Downloads\\" + filename;
+    std::string priority = ExtractJsonValue(requestJson, "priority");
+    request.priority = (priority == "high") ? 1 : (priority == "low") ? -1 : 0;
+
+    bool merged = false;
+    DWORD id = m_downloads.Submit(request, merged);
+
     char logMsg[512];
-    sprintf_s(logMsg, "Download request: %s from %s", filename.c_str(), firstIP.c_str());
+    sprintf_s(logMsg, "Download request: %s from %u peer(s), first %s, %s job %lu", filename.c_str(), (unsigned)peerIPs.size(), peerIPs[0].c_str(), merged ? "joined" : "queued as", id);
     WriteToEventLog(logMsg);
     
-    // Create output path
-    std::string outputPath = "C:\\Downloads\\" + filename;
-    
-    // Use TCP client to download file
-    bool downloadSuccess = DownloadFileFromPeer(firstIP, filename, outputPath);
-    
-    if (downloadSuccess) {
-        return "{\"success\":true,\"message\":\"File downloaded successfully\",\"filename\":\"" + filename + "\",\"source_ip\":\"" + firstIP + "\"}";
-    } else {
-        return "{\"success\":false,\"message\":\"Download failed\",\"filename\":\"" + filename + "\",\"source_ip\":\"" + firstIP + "\"}";
+    std::string sources;
+    for (size_t i = 0; i < peerIPs.size(); ++i) {
+        if (i > 0)
+            sources += ",";
+        sources += "\"" + peerIPs[i] + "\"";
     }
+    
+    std::ostringstream json;
+    json << "{\"success\":true,\"id\":" << id << ",\"merged\":" << (merged ? "true" : "false")
+        << ",\"message\":\"" << (merged ? "Joined a download already going" : "Download queued")
+        << "\",\"filename\":\"" << filename << "\",\"source_ip\":\"" << peerIPs[0] << "\",\"source_ips\":[" << sources << "]}";
+    return json.str();
+}
+
+// One download job as JSON
+static void WriteDownloadJson(std::ostringstream& json, const DownloadStatus& status) {
+    json << "{\"id\":" << status.id
+        << ",\"state\":\"" << DownloadManager::GetStateName(status.state)
+        << "\",\"filename\":\"" << status.request.filename
+        << "\",\"hash\":\"" << status.request.sha256Hex
+        << "\",\"priority\":" << status.request.priority
+        << ",\"requests\":" << status.requests
+        << ",\"peers\":" << status.request.peerIPs.size()
+        << ",\"bytes_done\":" << status.bytesDone
+        << ",\"bytes_total\":" << status.bytesTotal
+        << ",\"rate\":" << (ULONG64)status.rate
+        << ",\"eta\":" << status.etaSeconds << "}";
 }
+
 /**
- * @brief Download file from peer using TCP client
+ * @brief Handle /api/downloads: list jobs, show one, or pause, resume or cancel it
  */
-bool CWindowsService::DownloadFileFromPeer(const std::string& serverIP, const std::string& filename, const std::string& outputPath) {
-    // Create TCP client instance from your client.h
-	TCPFileClient client("", 0);
-    
-    // Initialize client
-    if (!client.Initialize()) {
-        WriteToEventLog("Failed to initialize TCP client");
-        return false;
+std::string CWindowsService::HandleDownloadJobRequest(const char* pPath, const char* pMethod) {
+    std::ostringstream json;
+    if (strcmp(pPath, "/api/downloads") == 0) {
+        if (strcmp(pMethod, "GET") != 0) {
+            return "{\"error\":\"Unknown API endpoint\",\"path\":\"/api/downloads\"}";
+        }
+        std::vector<DownloadStatus> jobs;
+        m_downloads.GetAll(jobs);
+        json << "{\"downloads\":[";
+        for (size_t i = 0; i < jobs.size(); i++) {
+            if (i > 0)
+                json << ",";
+            WriteDownloadJson(json, jobs[i]);
+        }
+        json << "],\"count\":" << jobs.size() << "}";
+        return json.str();
     }
-    
-    // Download file using the client
-    bool result = client.DownloadFileFromServer(serverIP, filename, outputPath);
-    
-    if (result) {
-        char logMsg[512];
-        sprintf_s(logMsg, "Successfully downloaded %s from %s", filename.c_str(), serverIP.c_str());
-        WriteToEventLog(logMsg);
-    } else {
-        char logMsg[512];
-        sprintf_s(logMsg, "Failed to download %s from %s", filename.c_str(), serverIP.c_str());
-        WriteToEventLog(logMsg);
+
+    // /api/downloads/{id} or /api/downloads/{id}/{action}
+    char* end = NULL;
+    DWORD id = strtoul(pPath + 15, &end, 10);
+    std::string action = (*end == '/') ? end + 1 : "";
+    if (end == pPath + 15 || (*end != 0 && *end != '/')) {
+        return "{\"error\":\"Invalid download id\"}";
     }
-    
-    return result;
+
+    bool done = false;
+    if (action.empty() && strcmp(pMethod, "GET") == 0) {
+        DownloadStatus status;
+        if (!m_downloads.GetStatus(id, status)) {
+            return "{\"error\":\"Download not found\"}";
+        }
+        WriteDownloadJson(json, status);
+        return json.str();
+    }else if (action.empty() && strcmp(pMethod, "DELETE") == 0) {
+        done = m_downloads.Cancel(id);
+    }else if (action == "cancel" && strcmp(pMethod, "POST") == 0) {
+        done = m_downloads.Cancel(id);
+    }else if (action == "pause" && strcmp(pMethod, "POST") == 0) {
+        done = m_downloads.Pause(id);
+    }else if (action == "resume" && strcmp(pMethod, "POST") == 0) {
+        done = m_downloads.Resume(id);
+    }else {
+        json << "{\"error\":\"Unknown API endpoint\",\"path\":\"" << pPath << "\"}";
+        return json.str();
+    }
+
+    DownloadStatus status;
+    if (!m_downloads.GetStatus(id, status)) {
+        return "{\"success\":false,\"message\":\"Download not found\"}";
+    }
+    json << "{\"success\":" << (done ? "true" : "false") << ",\"download\":";
+    WriteDownloadJson(json, status);
+    json << "}";
+    return json.str();
 }
 /**
  * @brief Extract JSON value by key
@@ -494,53 +782,115 @@ std::string CWindowsService::ExtractJsonValue(const std::string& json, const std
     return json.substr(valueStart, valueEnd - valueStart);
 }
 /**
- * @brief Extract first IP address from JSON array
+ * @brief Extract all IP addresses from JSON array
  */
-std::string CWindowsService::ExtractFirstIP(const std::string& json, const std::string& arrayKey) {
+std::vector<std::string> CWindowsService::ExtractIPList(const std::string& json, const std::string& arrayKey) {
+    std::vector<std::string> ips;
     std::string searchKey = "\"" + arrayKey + "\"";
     size_t keyPos = json.find(searchKey);
     if (keyPos == std::string::npos) {
-        return "";
+        return ips;
     }
     
     size_t arrayStart = json.find('[', keyPos);
     if (arrayStart == std::string::npos) {
-        return "";
+        return ips;
     }
     
-    size_t firstQuote = json.find('"', arrayStart);
-    if (firstQuote == std::string::npos) {
-        return "";
+    size_t arrayEnd = json.find(']', arrayStart);
+    if (arrayEnd == std::string::npos) {
+        return ips;
     }
-    firstQuote++; // Skip opening quote
     
-    size_t secondQuote = json.find('"', firstQuote);
-    if (secondQuote == std::string::npos) {
-        return "";
+    size_t pos = arrayStart;
+    while (true) {
+        size_t firstQuote = json.find('"', pos);
+        if (firstQuote == std::string::npos || firstQuote > arrayEnd) {
+            break;
+        }
+        firstQuote++; // Skip opening quote
+        
+        size_t secondQuote = json.find('"', firstQuote);
+        if (secondQuote == std::string::npos || secondQuote > arrayEnd) {
+            break;
+        }
+        
+        std::string ip = json.substr(firstQuote, secondQuote - firstQuote);
+        if (!ip.empty() && std::find(ips.begin(), ips.end(), ip) == ips.end()) {
+            ips.push_back(ip);
+        }
+        pos = secondQuote + 1;
     }
     
-    return json.substr(firstQuote, secondQuote - firstQuote);
+    return ips;
 }
-/*brief Get HTTP port from registry configuration
+/*brief Read a DWORD from the service's Parameters key; dwDefault if the value is missing or not a REG_DWORD
 */
-DWORD CWindowsService::GetHttpPortFromRegistry(){
+DWORD CWindowsService::ReadParameterDword(LPCTSTR pszName, DWORD dwDefault){
 	HKEY hKey;
-	DWORD dwPort = DEFAULT_HTTP_PORT;
+	DWORD dwResult = dwDefault;
 
 	if (RegOpenKeyEx(HKEY_LOCAL_MACHINE,
 		_T("SYSTEM\\CurrentControlSet\\Services\\P2pWindowsService\\Parameters"),
 		0, KEY_READ, &hKey) == ERROR_SUCCESS)
 	{
+		DWORD dwType = 0;
+		DWORD dwValue = 0;
 		DWORD dwSize = sizeof(DWORD);
-		RegQueryValueEx(hKey, _T("HttpPort"), NULL, NULL, (LPBYTE)&dwPort, &dwSize);
-		if (dwPort < 1024 || dwPort > 65535)
-			dwPort = DEFAULT_HTTP_PORT;
+		if (RegQueryValueEx(hKey, pszName, NULL, &dwType, (LPBYTE)&dwValue, &dwSize) == ERROR_SUCCESS &&
+			dwType == REG_DWORD && dwSize == sizeof(DWORD))
+			dwResult = dwValue;
 		RegCloseKey(hKey);
 	}
 
+	return dwResult;
+}
+
+/*brief Get HTTP port from registry configuration
+*/
+DWORD CWindowsService::GetHttpPortFromRegistry(){
+	DWORD dwPort = ReadParameterDword(_T("HttpPort"), DEFAULT_HTTP_PORT);
+	if (dwPort < 1024 || dwPort > 65535)
+		dwPort = DEFAULT_HTTP_PORT;
 	return dwPort;
 }
 
+/*brief Get the content chunking switch from registry configuration
+*/
+bool CWindowsService::GetContentChunkingFromRegistry(){
+	return ReadParameterDword(_T("ContentChunking"), 0) != 0;
+}
+
+/*brief Get the chunk cache size in MB from registry configuration
+*/
+DWORD CWindowsService::GetChunkCacheSizeFromRegistry(){
+	return ReadParameterDword(_T("ChunkCacheMB"), CHUNK_CACHE_DEFAULT_MB);
+}
+
+/*brief Get the total upload limit in KB/s from registry configuration
+*/
+DWORD CWindowsService::GetUploadLimitFromRegistry(){
+	return ReadParameterDword(_T("UploadLimitKBps"), 0);
+}
+
+/*brief Get the per-peer upload limit in KB/s from registry configuration
+*/
+DWORD CWindowsService::GetPeerUploadLimitFromRegistry(){
+	return ReadParameterDword(_T("PeerUploadLimitKBps"), 0);
+}
+
+/*brief Get whether the transfer server compresses chunks from registry configuration
+*/
+bool CWindowsService::GetCompressionFromRegistry(){
+	return ReadParameterDword(_T("Compression"), 1) != 0;
+}
+
+/*brief Get how many downloads run at once from registry configuration
+*/
+DWORD CWindowsService::GetMaxDownloadsFromRegistry(){
+	return ReadParameterDword(_T("MaxDownloads"), DOWNLOAD_DEFAULT_ACTIVE);
+}
+
 std::string CWindowsService::ShowFolderSelection()
 {
 	std::string result = "";
@@ -588,101 +938,17 @@ std::string CWindowsService::ShowFolderSelection()
 /**
 * @brief Write message to Windows Event Log
 */
-void CWindowsService::WriteToEventLog(char* pszMessage)
+void CWindowsService::WriteToEventLog(const char* pszMessage)
 {
-
-	static char logFilePath[MAX_PATH] = { 0 };
-
-	// Build the log file path once
-	if (logFilePath[0] == 0) 
-	{
-		char tempPath[MAX_PATH];
-		if (GetTempPathA(MAX_PATH, tempPath)) 
-		{
-			StringCchPrintfA(logFilePath, MAX_PATH, "%s%s", tempPath, "MyServiceApp.log");
-		}
-		else 
-		{
-			return; // Failed to get temp path
-		}
-	}
-
-
-	// Open the log file in append mode
-	HANDLE hFile = CreateFileA(
-		logFilePath,
-		FILE_APPEND_DATA,
-		FILE_SHARE_READ,
-		NULL,
-		OPEN_ALWAYS,
-		FILE_ATTRIBUTE_NORMAL,
-		NULL
-		);
-
-	if (hFile != INVALID_HANDLE_VALUE) 
-	{
-		DWORD written;
-		SYSTEMTIME st;
-		GetLocalTime(&st);
-
-		char buffer[1024];
-		StringCchPrintfA(buffer, 1024, "[%04d-%02d-%02d %02d:%02d:%02d] %s\r\n",
-			st.wYear, st.wMonth, st.wDay,
-			st.wHour, st.wMinute, st.wSecond,
-			pszMessage);
-
-		WriteFile(hFile, buffer, lstrlenA(buffer), &written, NULL);
-		CloseHandle(hFile);
-	}
-
-
+	WriteLogMessage(pszMessage);
 }
 
-void CWindowsService::enumerateFiles(std::string folderPath)
+std::string CWindowsService::GetHashCachePath()
 {
-	//clear local files array
-	localFiles.clear();
-	// Make search pattern: folder\*
-	std::string searchPattern = folderPath;
-	if (!searchPattern.empty() && searchPattern.back() != '\\')
-		searchPattern += '\\';
-	searchPattern += "*";
-
-	WIN32_FIND_DATAA findData;
-	HANDLE hFind = FindFirstFileA(searchPattern.c_str(), &findData);
-
-	if (hFind == INVALID_HANDLE_VALUE)
-	{
-		WriteToEventLog("FindFirstFileA failed , empty folder or system error");
-		return ; // No files found or error
-	}
-	do
-	{
-		// Skip "." and ".."
-		if (strcmp(findData.cFileName, ".") == 0 || strcmp(findData.cFileName, "..") == 0)
-			continue;
-
-		// Only include normal files (not directories)
-		if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-			continue;
-
-		// skip hidden/system files:
-		 if (findData.dwFileAttributes & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM))
-		    continue;
-
-		// Full path
-		std::string fullPath = folderPath;
-		if (!fullPath.empty() && fullPath.back() != '\\')
-			fullPath += '\\';
-		fullPath += findData.cFileName;
-		localFileHandler f(fullPath);
-		f.setfileSize(findData.nFileSizeLow, findData.nFileSizeHigh);
-		f.setCreationDate(findData.ftCreationTime);
-		f.setWriteTime(findData.ftLastWriteTime);
-		localFiles.push_back(f);
-
-	} while (FindNextFileA(hFind, &findData));
-
-	FindClose(hFind);
-	
-}
\ No newline at end of file
+	char appData[MAX_PATH];
+	if (FAILED(SHGetFolderPathA(NULL, CSIDL_COMMON_APPDATA, NULL, SHGFP_TYPE_CURRENT, appData)))
+		return "";
+	std::string folder = std::string(appData) + "\\P2pSrv";
+	CreateDirectoryA(folder.c_str(), NULL);
+	return folder + "\\hashcache.bin";
+}
@@ -17,7 +17,12 @@
 #include <vector>
 #include <thread>
 #include <atomic>
+#include <mutex>
 #include "fileOps.h"
+#include "hashcache.h"
+#include "shareindex.h"
+#include "filelist.h"
+#include "downloadmanager.h"
 // Forward declaration for TCPServer
 class TCPFileServer;
 
@@ -31,6 +36,12 @@ class TCPFileServer;
 #define DEFAULT_HTTP_PORT   8847
 #define HTTP_URL_PREFIX     L"http://+:%d/"
 #define MAX_REQUEST_SIZE    4096
+// Threads handling API requests, so a slow call does not hold up the others
+#define HTTP_WORKER_THREADS 8
+// Receives kept posted on the request queue, enough to refill every worker at once
+#define HTTP_RECEIVE_BUFFERS 16
+// Completion key that makes an HTTP worker return
+#define HTTP_STOP_KEY       1
 
 /**
 * @brief Minimal Windows Service with HTTP API server
@@ -77,7 +88,20 @@ private:
 	static HTTP_SERVER_SESSION_ID m_SessionId;
 	static HTTP_URL_GROUP_ID     m_UrlGroupId;
 	static DWORD                 m_HttpPort;
-	static std::vector<localFileHandler> localFiles;
+	static HashCache m_hashCache;	// hashes of shared files from earlier scans
+	static ShareIndex m_shareIndex;	// the shared folder, kept current in the background
+	static FileListCache m_fileList;	// rendered /api/files responses
+	static std::mutex m_shareLock;	// held while the shared folder is picked and indexing starts
+	static DownloadManager m_downloads;	// downloads asked for through /api/download
+
+	// One receive posted on the request queue, reused once its request is answered
+	struct HttpReceive {
+		OVERLAPPED ov;
+		PHTTP_REQUEST pRequest;	// sizeof(HTTP_REQUEST) + MAX_REQUEST_SIZE bytes
+	};
+	static HANDLE                m_hHttpPort;	// completion port of the request queue
+	static std::atomic<bool>     m_httpStopping;
+	static std::atomic<LONG>     m_httpReceives;	// posted and not yet handled
 
     // TCP Server member - clean architecture approach
 	static TCPFileServer* m_pTCPServer;
@@ -89,6 +113,16 @@ private:
 	*/
 	static void CleanupHttpServer();
 
+	/**
+	* @brief Post an overlapped receive for the next request on the queue
+	*/
+	static DWORD PostHttpReceive(HttpReceive* pReceive);
+
+	/**
+	* @brief Handle completed receives from the completion port until HTTP_STOP_KEY
+	*/
+	static void HttpWorkerThread();
+
 	/**
 	* @brief Process incoming HTTP requests
 	*/
@@ -97,31 +131,75 @@ private:
 	/**
 	* @brief Send JSON response with CORS headers
 	*/
-	static DWORD SendJsonResponse(HTTP_REQUEST_ID RequestId, USHORT StatusCode, const char* pJsonContent);
+	static DWORD SendJsonResponse(HTTP_REQUEST_ID RequestId, USHORT StatusCode, const char* pJsonContent, const char* pETag = NULL);
+
+	/**
+	* @brief Serve /api/files from the cached listing, answering If-None-Match and ?since=
+	*/
+	static DWORD HandleFileListRequest(PHTTP_REQUEST pRequest, HTTP_REQUEST_ID RequestId, const std::string& query);
 
 	/**
 	* @brief Handle API endpoint requests
 	*/
     static std::string HandleApiRequest(const char* pPath, const char* pMethod, const char* pRequestBody = nullptr);
 
+	/**
+	* @brief DWORD value pszName under the service's Parameters key, dwDefault if it is missing or of another type
+	*/
+	static DWORD ReadParameterDword(LPCTSTR pszName, DWORD dwDefault);
+
 	/**
 	* @brief Get HTTP port from registry configuration
 	*/
 	static DWORD GetHttpPortFromRegistry();
 
+	/**
+	* @brief Whether shared files are cut into content-defined chunks (ContentChunking value, default off)
+	*/
+	static bool GetContentChunkingFromRegistry();
+
+	/**
+	* @brief RAM for the transfer server's chunk cache (ChunkCacheMB value, 0 turns it off)
+	*/
+	static DWORD GetChunkCacheSizeFromRegistry();
+
+	/**
+	* @brief Upload limit for all peers together in KB/s (UploadLimitKBps value, default 0 for none)
+	*/
+	static DWORD GetUploadLimitFromRegistry();
+
+	/**
+	* @brief Upload limit for each peer address in KB/s (PeerUploadLimitKBps value, default 0 for none)
+	*/
+	static DWORD GetPeerUploadLimitFromRegistry();
+
+	/**
+	* @brief Whether chunks are compressed for peers that ask (Compression value, default on)
+	*/
+	static bool GetCompressionFromRegistry();
+
+	/**
+	* @brief Downloads that run at once (MaxDownloads value, default DOWNLOAD_DEFAULT_ACTIVE)
+	*/
+	static DWORD GetMaxDownloadsFromRegistry();
+
+	/**
+	* @brief Path of the hash cache file under the common application data folder
+	*/
+	static std::string GetHashCachePath();
+
     // TCP Client integration functions
     static std::string HandleDownloadRequest(const char* pRequestBody);
-    static bool DownloadFileFromPeer(const std::string& serverIP, const std::string& filename, const std::string& outputPath);
+    static std::string HandleDownloadJobRequest(const char* pPath, const char* pMethod);
     static std::string ExtractJsonValue(const std::string& json, const std::string& key);
-    static std::string ExtractFirstIP(const std::string& json, const std::string& arrayKey);
+    static std::vector<std::string> ExtractIPList(const std::string& json, const std::string& arrayKey);
     
 	/**
 	* @brief Write message to Windows Event Log
 	*/
-	static void WriteToEventLog(char* pszMessage);
+	static void WriteToEventLog(const char* pszMessage);
 
 	static std::string ShowFolderSelection();
-	static void enumerateFiles(std::string);
 };
 
 #endif // WINDOWS_SERVICE_H
@@ -0,0 +1,590 @@
+#include "asyncclient.h"
+#include "eventlog.h"
+#include <mswsock.h>
+#include <ws2tcpip.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+/**
+* @brief AsyncBackend on an I/O completion port
+*
+* Sockets are overlapped and tied to the port with their connection as the
+* completion key; ConnectEx, WSASend and WSARecv queue their result there.
+* Wake posts a packet without an OVERLAPPED.
+*/
+class IocpBackend : public AsyncBackend {
+public:
+	IocpBackend() : m_hPort(NULL), m_connectEx(NULL) {}
+
+	bool Open() {
+		// ConnectEx is only reachable through a function pointer
+		SOCKET s = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+		GUID connectExId = WSAID_CONNECTEX;
+		DWORD bytes = 0;
+		if (s == INVALID_SOCKET ||
+			WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &connectExId, sizeof(connectExId),
+				&m_connectEx, sizeof(m_connectEx), &bytes, NULL, NULL) == SOCKET_ERROR) {
+			WriteLogMessage("Async engine: ConnectEx is not available");
+			if (s != INVALID_SOCKET) {
+				closesocket(s);
+			}
+			return false;
+		}
+		closesocket(s);
+
+		m_hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+		if (m_hPort == NULL) {
+			WriteLogMessage("Async engine: failed to create completion port");
+			return false;
+		}
+		return true;
+	}
+
+	void Close() {
+		if (m_hPort != NULL) {
+			CloseHandle(m_hPort);
+			m_hPort = NULL;
+		}
+	}
+
+	SOCKET CreateSocket(void* key) {
+		SOCKET s = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+		if (s == INVALID_SOCKET) {
+			WriteLogMessage("Async engine: socket creation failed");
+			return INVALID_SOCKET;
+		}
+		// ConnectEx wants a bound socket
+		sockaddr_in localAddr = {};
+		localAddr.sin_family = AF_INET;
+		if (bind(s, (sockaddr*)&localAddr, sizeof(localAddr)) == SOCKET_ERROR ||
+			CreateIoCompletionPort((HANDLE)s, m_hPort, (ULONG_PTR)key, 0) == NULL) {
+			closesocket(s);
+			return INVALID_SOCKET;
+		}
+		// Requests are small and pipelined, don't let Nagle hold them back
+		BOOL noDelay = TRUE;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+		return s;
+	}
+
+	bool Connect(SOCKET s, const sockaddr_in& address, AsyncOp* op) {
+		ZeroMemory(&op->ov, sizeof(op->ov));
+		return m_connectEx(s, (const sockaddr*)&address, sizeof(address), NULL, 0, NULL, &op->ov) ||
+			WSAGetLastError() == WSA_IO_PENDING;
+	}
+
+	bool Send(SOCKET s, const char* data, DWORD size, AsyncOp* op) {
+		ZeroMemory(&op->ov, sizeof(op->ov));
+		WSABUF buf;
+		buf.buf = (char*)data;
+		buf.len = size;
+		return WSASend(s, &buf, 1, NULL, 0, &op->ov, NULL) == 0 || WSAGetLastError() == WSA_IO_PENDING;
+	}
+
+	bool Receive(SOCKET s, char* buffer, DWORD size, AsyncOp* op) {
+		ZeroMemory(&op->ov, sizeof(op->ov));
+		WSABUF buf;
+		buf.buf = buffer;
+		buf.len = size;
+		DWORD flags = 0;
+		return WSARecv(s, &buf, 1, NULL, &flags, &op->ov, NULL) == 0 || WSAGetLastError() == WSA_IO_PENDING;
+	}
+
+	void Wait(DWORD timeoutMs, void*& key, AsyncOp*& op, DWORD& error, DWORD& bytes) {
+		OVERLAPPED* ov = NULL;
+		ULONG_PTR completionKey = 0;
+		bytes = 0;
+		BOOL ok = GetQueuedCompletionStatus(m_hPort, &bytes, &completionKey, &ov, timeoutMs);
+		error = ok ? ERROR_SUCCESS : GetLastError();
+		key = (void*)completionKey;
+		op = (ov != NULL) ? CONTAINING_RECORD(ov, AsyncOp, ov) : NULL;
+	}
+
+	void Wake() {
+		PostQueuedCompletionStatus(m_hPort, 0, 0, NULL);
+	}
+
+private:
+	HANDLE m_hPort;
+	LPFN_CONNECTEX m_connectEx;
+};
+
+// Constructor
+AsyncTransferEngine::AsyncTransferEngine()
+	: m_backend(new IocpBackend()), m_running(false), m_stopping(false), m_operationTimeout(ASYNC_OPERATION_TIMEOUT_MS),
+	m_connectionCount(0), m_nextConnectionId(1), m_nextTimerId(1) {
+}
+
+// Destructor
+AsyncTransferEngine::~AsyncTransferEngine() {
+	Stop();
+}
+
+// Open the backend and start the engine thread
+bool AsyncTransferEngine::Start() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_running) {
+		return true;
+	}
+
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+		WriteLogMessage("Async engine: WSAStartup failed");
+		return false;
+	}
+	if (!m_backend->Open()) {
+		m_backend->Close();
+		WSACleanup();
+		return false;
+	}
+
+	m_stopping = false;
+	m_running = true;
+	m_thread = std::thread(&AsyncTransferEngine::EngineThread, this);
+	return true;
+}
+
+// Close every connection and wait for the engine thread to run out of work
+void AsyncTransferEngine::Stop() {
+	if (!m_thread.joinable()) {
+		return;
+	}
+	Post([this] { StopAll(); });
+	m_thread.join();
+	m_backend->Close();
+	WSACleanup();
+}
+
+// Queue a task for the engine thread
+bool AsyncTransferEngine::Post(const Task& task) {
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (!m_running) {
+			return false;
+		}
+		m_tasks.push_back(task);
+	}
+	m_backend->Wake();
+	return true;
+}
+
+// Take completions, tasks and timers until stopped with nothing left to do
+void AsyncTransferEngine::EngineThread() {
+	ULONGLONG nextSweep = GetTickCount64() + ASYNC_TIMEOUT_SWEEP_MS;
+
+	while (true) {
+		ULONGLONG now = GetTickCount64();
+		DWORD timeout = ASYNC_TIMEOUT_SWEEP_MS;
+		for (std::map<DWORD, Timer>::iterator it = m_timers.begin(); it != m_timers.end(); ++it) {
+			timeout = (std::min)(timeout, (it->second.due > now) ? (DWORD)(it->second.due - now) : (DWORD)0);
+		}
+
+		void* key = NULL;
+		AsyncOp* op = NULL;
+		DWORD error = ERROR_SUCCESS;
+		DWORD bytes = 0;
+		m_backend->Wait(timeout, key, op, error, bytes);
+		if (op != NULL) {
+			OnCompletion((Connection*)key, op, error, bytes);
+		}
+		else if (!RunTasks()) {
+			break;
+		}
+
+		now = GetTickCount64();
+		RunTimers(now);
+		if (now >= nextSweep) {
+			SweepTimeouts(now);
+			nextSweep = now + ASYNC_TIMEOUT_SWEEP_MS;
+		}
+		ReleaseClosed();
+	}
+}
+
+// Run the queued tasks; false once stopping has nothing left to wait for
+bool AsyncTransferEngine::RunTasks() {
+	std::deque<Task> tasks;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		tasks.swap(m_tasks);
+	}
+	for (size_t i = 0; i < tasks.size(); i++) {
+		tasks[i]();
+	}
+	ReleaseClosed();
+
+	if (!m_stopping || !m_connections.empty()) {
+		return true;
+	}
+	// Posts from here on are refused, those already queued still run
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (!m_tasks.empty()) {
+		return true;
+	}
+	m_running = false;
+	return false;
+}
+
+// Run the timers that are due, in the order they were added
+void AsyncTransferEngine::RunTimers(ULONGLONG now) {
+	std::map<DWORD, Timer>::iterator it = m_timers.begin();
+	while (it != m_timers.end()) {
+		if (it->second.due > now) {
+			++it;
+			continue;
+		}
+		// The task may add and cancel timers
+		DWORD id = it->first;
+		Task task = it->second.task;
+		m_timers.erase(it);
+		task();
+		it = m_timers.upper_bound(id);
+	}
+}
+
+// Close the socket of every connection whose pending operation is overdue
+void AsyncTransferEngine::SweepTimeouts(ULONGLONG now) {
+	std::vector<Connection*> overdue;
+	for (std::map<DWORD, Connection*>::iterator it = m_connections.begin(); it != m_connections.end(); ++it) {
+		Connection* connection = it->second;
+		bool waiting = connection->awaiting > 0 || connection->receivingPayload || connection->recvOffset > 0;
+		if (connection->closing) {
+			continue;
+		}
+		if (connection->connectOp.pending && now >= connection->connectOp.deadline) {
+			// The connect completes with an error and moves on to the next port
+			closesocket(connection->socket);
+			connection->socket = INVALID_SOCKET;
+		}
+		else if ((connection->sendOp.pending && now >= connection->sendOp.deadline) ||
+			(connection->recvOp.pending && waiting && now >= connection->recvOp.deadline)) {
+			overdue.push_back(connection);
+		}
+	}
+	for (size_t i = 0; i < overdue.size(); i++) {
+		std::string msg = "Async engine: operation timed out with " + overdue[i]->ip;
+		WriteLogMessage(msg.c_str());
+		CloseConnection(overdue[i]);
+	}
+}
+
+// Close every connection and drop the timers; sessions hear OnClosed as usual
+void AsyncTransferEngine::StopAll() {
+	m_stopping = true;
+	m_timers.clear();
+	std::vector<Connection*> open;
+	for (std::map<DWORD, Connection*>::iterator it = m_connections.begin(); it != m_connections.end(); ++it) {
+		open.push_back(it->second);
+	}
+	for (size_t i = 0; i < open.size(); i++) {
+		CloseConnection(open[i]);
+	}
+}
+
+// Start connecting session; OnClosed reports a connect that fails later
+DWORD AsyncTransferEngine::Connect(const std::string& ip, int port, AsyncSession* session) {
+	sockaddr_in address = {};
+	if (m_stopping || inet_pton(AF_INET, ip.c_str(), &address.sin_addr) <= 0) {
+		return 0;
+	}
+
+	Connection* connection = new Connection();
+	connection->id = m_nextConnectionId++;
+	connection->session = session;
+	connection->ip = ip;
+	connection->port = port;
+	connection->portIndex = 0;
+	connection->socket = INVALID_SOCKET;
+	connection->connectOp.pending = connection->sendOp.pending = connection->recvOp.pending = false;
+	connection->pendingOps = 0;
+	connection->connected = false;
+	connection->closing = false;
+	connection->sendOffset = 0;
+	connection->awaiting = 0;
+	connection->payload = NULL;
+	connection->payloadSize = 0;
+	connection->receivingPayload = false;
+	connection->recvOffset = 0;
+	m_connections[connection->id] = connection;
+	m_connectionCount++;
+
+	StartConnect(connection);
+	return connection->id;
+}
+
+// Queue bytes behind whatever the connection is sending
+bool AsyncTransferEngine::Send(DWORD connectionId, const void* data, DWORD size, DWORD responses) {
+	Connection* connection = Find(connectionId);
+	if (connection == NULL || !connection->connected) {
+		return false;
+	}
+	if (connection->awaiting == 0 && responses > 0) {
+		// The receive has been idle, its deadline starts now
+		connection->recvOp.deadline = GetTickCount64() + m_operationTimeout;
+	}
+	connection->awaiting += responses;
+	connection->queued.insert(connection->queued.end(), (const char*)data, (const char*)data + size);
+
+	if (connection->sendOp.pending) {
+		return true;
+	}
+	// Both buffers keep their capacity, so a steady stream of requests does not allocate
+	connection->sending.swap(connection->queued);
+	connection->queued.clear();
+	connection->sendOffset = 0;
+	if (!IssueSend(connection)) {
+		CloseConnection(connection);
+		return false;
+	}
+	return true;
+}
+
+void AsyncTransferEngine::Close(DWORD connectionId) {
+	Connection* connection = Find(connectionId);
+	if (connection != NULL) {
+		CloseConnection(connection);
+	}
+}
+
+DWORD AsyncTransferEngine::AddTimer(DWORD delayMs, const Task& task) {
+	if (m_stopping) {
+		return 0;
+	}
+	DWORD id = m_nextTimerId++;
+	Timer& timer = m_timers[id];
+	timer.due = GetTickCount64() + delayMs;
+	timer.task = task;
+	return id;
+}
+
+void AsyncTransferEngine::CancelTimer(DWORD timerId) {
+	m_timers.erase(timerId);
+}
+
+// Connection by ID, NULL once it is closing
+AsyncTransferEngine::Connection* AsyncTransferEngine::Find(DWORD connectionId) {
+	std::map<DWORD, Connection*>::iterator it = m_connections.find(connectionId);
+	if (it == m_connections.end() || it->second->closing) {
+		return NULL;
+	}
+	return it->second;
+}
+
+// Connect to the next candidate port, closes the connection when none are left
+void AsyncTransferEngine::StartConnect(Connection* connection) {
+	size_t portCount = (connection->port != 0) ? 1 : SERVER_PORT_COUNT;
+
+	while (connection->portIndex < portCount) {
+		int port = (connection->port != 0) ? connection->port : SERVER_PORTS[connection->portIndex];
+		connection->portIndex++;
+
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons((u_short)port);
+		inet_pton(AF_INET, connection->ip.c_str(), &address.sin_addr);
+
+		connection->socket = m_backend->CreateSocket(connection);
+		if (connection->socket == INVALID_SOCKET) {
+			break;
+		}
+		AsyncOp& op = connection->connectOp;
+		op.deadline = GetTickCount64() + m_operationTimeout;
+		if (m_backend->Connect(connection->socket, address, &op)) {
+			op.pending = true;
+			connection->pendingOps++;
+			return;
+		}
+		closesocket(connection->socket);
+		connection->socket = INVALID_SOCKET;
+	}
+
+	std::string msg = "Async engine: could not connect to " + connection->ip;
+	WriteLogMessage(msg.c_str());
+	CloseConnection(connection);
+}
+
+// Send the rest of the current batch
+bool AsyncTransferEngine::IssueSend(Connection* connection) {
+	AsyncOp& op = connection->sendOp;
+	op.deadline = GetTickCount64() + m_operationTimeout;
+	if (!m_backend->Send(connection->socket, &connection->sending[connection->sendOffset],
+		(DWORD)connection->sending.size() - connection->sendOffset, &op)) {
+		WriteLogMessage("Async engine: failed to send request");
+		return false;
+	}
+	op.pending = true;
+	connection->pendingOps++;
+	return true;
+}
+
+// Receive the rest of the current header or payload
+bool AsyncTransferEngine::IssueRecv(Connection* connection) {
+	AsyncOp& op = connection->recvOp;
+	op.deadline = GetTickCount64() + m_operationTimeout;
+
+	char* buffer;
+	DWORD size;
+	if (connection->receivingPayload) {
+		buffer = connection->payload + connection->recvOffset;
+		size = connection->payloadSize - connection->recvOffset;
+	}
+	else {
+		buffer = (char*)&connection->header + connection->recvOffset;
+		size = sizeof(connection->header) - connection->recvOffset;
+	}
+	if (!m_backend->Receive(connection->socket, buffer, size, &op)) {
+		WriteLogMessage("Async engine: failed to receive response");
+		return false;
+	}
+	op.pending = true;
+	connection->pendingOps++;
+	return true;
+}
+
+// Route a finished operation to its handler
+void AsyncTransferEngine::OnCompletion(Connection* connection, AsyncOp* op, DWORD error, DWORD bytes) {
+	op->pending = false;
+	connection->pendingOps--;
+
+	if (connection->closing) {
+		if (connection->pendingOps == 0) {
+			m_closed.push_back(connection);
+		}
+		return;
+	}
+
+	if (op == &connection->connectOp) {
+		OnConnected(connection, error);
+	}
+	else if (error != ERROR_SUCCESS || bytes == 0) {
+		// A closed connection completes with 0 bytes, a reset or timed out one with an error
+		std::string msg = "Async engine: connection to " + connection->ip + " lost";
+		WriteLogMessage(msg.c_str());
+		CloseConnection(connection);
+	}
+	else if (op == &connection->sendOp) {
+		OnSent(connection, bytes);
+	}
+	else {
+		OnReceived(connection, bytes);
+	}
+}
+
+// Connected: start receiving and let the session speak first
+void AsyncTransferEngine::OnConnected(Connection* connection, DWORD error) {
+	if (error != ERROR_SUCCESS || connection->socket == INVALID_SOCKET) {
+		if (connection->socket != INVALID_SOCKET) {
+			closesocket(connection->socket);
+			connection->socket = INVALID_SOCKET;
+		}
+		StartConnect(connection);
+		return;
+	}
+
+	setsockopt(connection->socket, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0);
+	connection->connected = true;
+	if (!connection->session->OnConnected()) {
+		CloseConnection(connection);
+		return;
+	}
+	if (!connection->closing && !IssueRecv(connection)) {
+		CloseConnection(connection);
+	}
+}
+
+// Part of a batch went out
+void AsyncTransferEngine::OnSent(Connection* connection, DWORD bytes) {
+	connection->sendOffset += bytes;
+	if (connection->sendOffset < connection->sending.size()) {
+		if (!IssueSend(connection)) {
+			CloseConnection(connection);
+		}
+		return;
+	}
+
+	connection->sending.clear();
+	if (connection->queued.empty()) {
+		return;
+	}
+	connection->sending.swap(connection->queued);
+	connection->sendOffset = 0;
+	if (!IssueSend(connection)) {
+		CloseConnection(connection);
+	}
+}
+
+// Part of a header or payload came in
+void AsyncTransferEngine::OnReceived(Connection* connection, DWORD bytes) {
+	connection->recvOffset += bytes;
+
+	if (!connection->receivingPayload) {
+		if (connection->recvOffset < sizeof(connection->header)) {
+			if (!IssueRecv(connection)) {
+				CloseConnection(connection);
+			}
+			return;
+		}
+		DWORD size = 0;
+		connection->payload = connection->session->OnResponseHeader(connection->header, size);
+		if (connection->closing) {
+			return;
+		}
+		if (connection->payload == NULL) {
+			CloseConnection(connection);
+			return;
+		}
+		connection->payloadSize = size;
+		connection->receivingPayload = true;
+		connection->recvOffset = 0;
+	}
+
+	if (connection->recvOffset < connection->payloadSize) {
+		if (!IssueRecv(connection)) {
+			CloseConnection(connection);
+		}
+		return;
+	}
+
+	connection->receivingPayload = false;
+	connection->recvOffset = 0;
+	if (connection->awaiting > 0) {
+		connection->awaiting--;
+	}
+	if (!connection->session->OnResponse(connection->header, connection->payload)) {
+		CloseConnection(connection);
+		return;
+	}
+	if (!connection->closing && !IssueRecv(connection)) {
+		CloseConnection(connection);
+	}
+}
+
+// Close the socket; pending operations complete with an error, then OnClosed follows
+void AsyncTransferEngine::CloseConnection(Connection* connection) {
+	if (connection->closing) {
+		return;
+	}
+	connection->closing = true;
+	if (connection->socket != INVALID_SOCKET) {
+		closesocket(connection->socket);
+		connection->socket = INVALID_SOCKET;
+	}
+	if (connection->pendingOps == 0) {
+		m_closed.push_back(connection);
+	}
+}
+
+// Tell sessions about their closed connections and free them. Done between
+// events, so OnClosed never runs inside a call the session made.
+void AsyncTransferEngine::ReleaseClosed() {
+	while (!m_closed.empty()) {
+		std::vector<Connection*> closed;
+		closed.swap(m_closed);
+		for (size_t i = 0; i < closed.size(); i++) {
+			m_connections.erase(closed[i]->id);
+			m_connectionCount--;
+			closed[i]->session->OnClosed();
+			delete closed[i];
+		}
+	}
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <winsock2.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+#include "tcpdef.h"
+
+// Time a single connect, send or receive may take before its connection is dropped
+#define ASYNC_OPERATION_TIMEOUT_MS 30000
+// How often the engine thread looks for operations past their deadline
+#define ASYNC_TIMEOUT_SWEEP_MS 250
+
+// One connect, send or receive the engine has started on a socket
+struct AsyncOp {
+	OVERLAPPED ov;		// for the IOCP backend
+	bool pending;
+	ULONGLONG deadline;
+};
+
+/**
+* @brief The operating system side of AsyncTransferEngine
+*
+* The engine keeps at most one connect, one send and one receive pending per
+* socket and hears back about each through Wait, whether it succeeded,
+* failed or was cut short by closesocket. IocpBackend, the one the service
+* uses, issues them as overlapped calls and waits on an I/O completion port.
+* A Linux build would put an epoll backend behind the same calls: it keeps
+* the requested operation per socket, performs it with a non-blocking call
+* once epoll reports the socket ready and hands the result back from Wait.
+*/
+class AsyncBackend {
+public:
+	virtual ~AsyncBackend() {}
+	virtual bool Open() = 0;
+	virtual void Close() = 0;
+	// A TCP socket whose operations come back from Wait with key
+	virtual SOCKET CreateSocket(void* key) = 0;
+	// False if the operation could not be started, otherwise Wait reports it
+	virtual bool Connect(SOCKET s, const sockaddr_in& address, AsyncOp* op) = 0;
+	virtual bool Send(SOCKET s, const char* data, DWORD size, AsyncOp* op) = 0;
+	virtual bool Receive(SOCKET s, char* buffer, DWORD size, AsyncOp* op) = 0;
+	// Next finished operation; op is NULL after Wake or when timeoutMs passed without one
+	virtual void Wait(DWORD timeoutMs, void*& key, AsyncOp*& op, DWORD& error, DWORD& bytes) = 0;
+	// Make Wait return, from any thread
+	virtual void Wake() = 0;
+};
+
+/**
+* @brief What runs over one engine connection, see AsyncTransferEngine::Connect
+*
+* Every answer in the chunk protocol is a ChunkResponse followed by a
+* payload; the engine receives the header, asks the session where the
+* payload goes and hands over both once they are in. MSG_HELLO_RESPONSE
+* and the bare status answers carry no payload whatever chunkSize says, so
+* the session gives the length. All calls come on the engine thread;
+* returning false closes the connection.
+*/
+class AsyncSession {
+public:
+	virtual ~AsyncSession() {}
+	virtual bool OnConnected() = 0;
+	// Where the payload of this response goes and how long it is, NULL to refuse it
+	virtual char* OnResponseHeader(const ChunkResponse& header, DWORD& payloadSize) = 0;
+	virtual bool OnResponse(const ChunkResponse& header, char* payload) = 0;
+	// Could not connect, lost, timed out or closed; the last call for the connection
+	virtual void OnClosed() = 0;
+};
+
+/**
+* @brief Runs many peer connections on a single thread
+*
+* TCPFileClient blocks its caller for every send and receive. The engine
+* instead keeps each connection as a small state machine: a connect, one
+* send of whatever the session queued and one receive of the next response
+* are pending at a time, and one thread takes their completions from the
+* AsyncBackend and advances the connection they belong to. The protocol
+* above that is the session's; SwarmDownloader runs its peers this way, so
+* all the downloads of a DownloadManager share one thread.
+*
+* Every pending operation has a deadline. When it passes the socket is
+* closed: a connect moves on to the next discovery port, anything else
+* ends the connection. A receive only runs against its deadline while an
+* answer is expected, so a session may keep an idle connection open.
+*
+* Only Start, Stop, Post and GetConnectionCount may be called from other
+* threads. Everything else, and every session and timer callback, belongs
+* to the engine thread.
+*/
+class AsyncTransferEngine {
+public:
+	typedef std::function<void()> Task;
+
+	AsyncTransferEngine();
+	~AsyncTransferEngine();
+	AsyncTransferEngine(const AsyncTransferEngine&) = delete;
+	AsyncTransferEngine& operator=(const AsyncTransferEngine&) = delete;
+
+	bool Start();
+	// Close what is still open, run what is still queued and wait for the engine thread
+	void Stop();
+	// Run task on the engine thread; false if the engine is not running
+	bool Post(const Task& task);
+	DWORD GetConnectionCount() const { return m_connectionCount; }
+
+	/**
+	* @brief Connect session to ip, returns the connection ID or 0 if it cannot start
+	* @param port Port of the peer, 0 to try SERVER_PORTS in turn
+	*/
+	DWORD Connect(const std::string& ip, int port, AsyncSession* session);
+	// Queue requests on a connection that bring responses answers back
+	bool Send(DWORD connectionId, const void* data, DWORD size, DWORD responses);
+	// End a connection; its session hears OnClosed once the socket has let go
+	void Close(DWORD connectionId);
+	// Run task after delayMs unless cancelled first; 0 while stopping
+	DWORD AddTimer(DWORD delayMs, const Task& task);
+	void CancelTimer(DWORD timerId);
+	void SetOperationTimeout(DWORD timeoutMs) { m_operationTimeout = timeoutMs; }
+
+private:
+	struct Connection {
+		DWORD id;
+		AsyncSession* session;
+		std::string ip;
+		int port;
+		size_t portIndex;
+		SOCKET socket;
+		AsyncOp connectOp;
+		AsyncOp sendOp;
+		AsyncOp recvOp;
+		DWORD pendingOps;
+		bool connected;
+		bool closing;
+
+		// Sends queued while one is under way go out together after it
+		std::vector<char> queued;
+		std::vector<char> sending;
+		DWORD sendOffset;
+		DWORD awaiting;			// responses still to come
+
+		// Response being received: the header, then payloadSize bytes into payload
+		ChunkResponse header;
+		char* payload;
+		DWORD payloadSize;
+		bool receivingPayload;
+		DWORD recvOffset;
+	};
+
+	struct Timer {
+		ULONGLONG due;
+		Task task;
+	};
+
+	std::unique_ptr<AsyncBackend> m_backend;
+	std::thread m_thread;
+	bool m_running;
+	bool m_stopping;
+	DWORD m_operationTimeout;
+	std::atomic<DWORD> m_connectionCount;
+
+	std::mutex m_lock;	// guards m_tasks
+	std::deque<Task> m_tasks;
+
+	// Engine thread only
+	std::map<DWORD, Connection*> m_connections;
+	std::vector<Connection*> m_closed;	// no operation pending, OnClosed still due
+	std::map<DWORD, Timer> m_timers;
+	DWORD m_nextConnectionId;
+	DWORD m_nextTimerId;
+
+	void EngineThread();
+	bool RunTasks();
+	void RunTimers(ULONGLONG now);
+	void SweepTimeouts(ULONGLONG now);
+	void StopAll();
+
+	Connection* Find(DWORD connectionId);
+	void StartConnect(Connection* connection);
+	bool IssueSend(Connection* connection);
+	bool IssueRecv(Connection* connection);
+	void OnCompletion(Connection* connection, AsyncOp* op, DWORD error, DWORD bytes);
+	void OnConnected(Connection* connection, DWORD error);
+	void OnSent(Connection* connection, DWORD bytes);
+	void OnReceived(Connection* connection, DWORD bytes);
+	void CloseConnection(Connection* connection);
+	void ReleaseClosed();
+};
@@ -0,0 +1,51 @@
+#include "bufferpool.h"
+#include "eventlog.h"
+
+// Constructor - commits bufferCount page-aligned buffers in one region
+ChunkBufferPool::ChunkBufferPool(DWORD bufferCount, DWORD bufferSize)
+	: m_memory(NULL), m_bufferSize(0), m_bufferCount(0) {
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	DWORD pageSize = si.dwPageSize;
+	DWORD stride = (bufferSize + pageSize - 1) / pageSize * pageSize;
+
+	m_memory = (char*)VirtualAlloc(NULL, (SIZE_T)stride * bufferCount, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (m_memory == NULL) {
+		WriteLogMessage("Failed to allocate chunk buffer pool");
+		return;
+	}
+
+	m_bufferSize = bufferSize;
+	m_bufferCount = bufferCount;
+	m_free.reserve(bufferCount);
+	for (DWORD i = bufferCount; i > 0; i--) {
+		m_free.push_back(m_memory + (SIZE_T)stride * (i - 1));
+	}
+}
+
+// Destructor
+ChunkBufferPool::~ChunkBufferPool() {
+	if (m_memory != NULL) {
+		VirtualFree(m_memory, 0, MEM_RELEASE);
+	}
+}
+
+// Take a buffer, NULL if all are in use
+char* ChunkBufferPool::Acquire() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_free.empty()) {
+		return NULL;
+	}
+	char* buffer = m_free.back();
+	m_free.pop_back();
+	return buffer;
+}
+
+// Return a buffer taken with Acquire
+void ChunkBufferPool::Release(char* buffer) {
+	if (buffer == NULL) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_free.push_back(buffer);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <windows.h>
+#include <vector>
+#include <mutex>
+
+/**
+* @brief Fixed set of page-aligned chunk buffers carved from one allocation
+*
+* All memory is reserved in the constructor; Acquire and Release only move
+* pointers on a preallocated free list, so the receive path does no heap
+* allocation per chunk. Acquire returns NULL when every buffer is in use;
+* size the pool for the number of chunks a caller keeps in flight.
+*/
+class ChunkBufferPool {
+private:
+	char* m_memory;
+	DWORD m_bufferSize;
+	DWORD m_bufferCount;
+	std::vector<char*> m_free;
+	std::mutex m_lock;
+
+public:
+	ChunkBufferPool(DWORD bufferCount, DWORD bufferSize);
+	~ChunkBufferPool();
+	ChunkBufferPool(const ChunkBufferPool&) = delete;
+	ChunkBufferPool& operator=(const ChunkBufferPool&) = delete;
+
+	char* Acquire();
+	void Release(char* buffer);
+
+	DWORD GetBufferSize() const { return m_bufferSize; }
+	DWORD GetBufferCount() const { return m_bufferCount; }
+};
@@ -0,0 +1,99 @@
+#include "cdc.h"
+
+#include <string.h>
+#include <algorithm>
+
+// Bits of the gear hash that must be zero for a cut before and after
+// CDC_AVG_SIZE: two more and two fewer than log2(CDC_AVG_SIZE)
+#define CDC_MASK_SMALL (~0ULL << (64 - 18))
+#define CDC_MASK_LARGE (~0ULL << (64 - 14))
+
+static ULONG64 s_gear[256];
+
+// The gear table is SplitMix64 from a fixed seed, the same on every peer
+static struct CdcInit {
+	CdcInit() {
+		ULONG64 seed = 0x5032504344433031ULL;	// "P2PCDC01"
+		for (int i = 0; i < 256; i++) {
+			ULONG64 z = (seed += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			s_gear[i] = z ^ (z >> 31);
+		}
+	}
+} s_cdcInit;
+
+// Constructor
+ContentChunker::ContentChunker() {
+	Reset();
+}
+
+// Start a new stream at offset 0
+void ContentChunker::Reset() {
+	m_hasher.Reset();
+	m_gear = 0;
+	m_offset = 0;
+	m_size = 0;
+}
+
+// Close the current chunk, its bytes are all in m_hasher
+void ContentChunker::EndChunk(ChunkList& chunks) {
+	ContentChunk chunk;
+	chunk.offset = m_offset;
+	chunk.size = m_size;
+	m_hasher.Final(chunk.sha256);
+	chunks.push_back(chunk);
+
+	m_hasher.Reset();
+	m_gear = 0;
+	m_offset += m_size;
+	m_size = 0;
+}
+
+// Append data to the stream; chunks that end in it are added to chunks
+void ContentChunker::Update(const void* data, size_t size, ChunkList& chunks) {
+	const BYTE* p = (const BYTE*)data;
+	const BYTE* end = p + size;
+	const BYTE* unhashed = p;
+	while (p < end) {
+		size_t available = end - p;
+		if (m_size < CDC_MIN_SIZE) {
+			size_t skip = (std::min)(available, (size_t)(CDC_MIN_SIZE - m_size));
+			p += skip;
+			m_size += (DWORD)skip;
+			continue;
+		}
+
+		// Roll up to the next size where the rules change
+		DWORD limit = (m_size < CDC_AVG_SIZE) ? CDC_AVG_SIZE : CDC_MAX_SIZE;
+		ULONG64 mask = (m_size < CDC_AVG_SIZE) ? CDC_MASK_SMALL : CDC_MASK_LARGE;
+		size_t count = (std::min)(available, (size_t)(limit - m_size));
+		ULONG64 gear = m_gear;
+		bool cut = false;
+		size_t i = 0;
+		while (i < count) {
+			gear = (gear << 1) + s_gear[p[i++]];
+			if ((gear & mask) == 0) {
+				cut = true;
+				break;
+			}
+		}
+		m_gear = gear;
+		p += i;
+		m_size += (DWORD)i;
+
+		if (cut || m_size == CDC_MAX_SIZE) {
+			m_hasher.Update(unhashed, p - unhashed);
+			unhashed = p;
+			EndChunk(chunks);
+		}
+	}
+	m_hasher.Update(unhashed, p - unhashed);
+}
+
+// End of the stream: whatever is left is the last chunk
+void ContentChunker::Finish(ChunkList& chunks) {
+	if (m_size > 0) {
+		EndChunk(chunks);
+	}
+}
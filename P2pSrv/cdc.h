@@ -0,0 +1,54 @@
+#pragma once
+
+#include <windows.h>
+#include <vector>
+
+#include "sha256.h"
+
+// Content-defined chunk sizes. A cut is never made before CDC_MIN_SIZE and
+// always made at CDC_MAX_SIZE; CDC_AVG_SIZE must be a power of two. Peers
+// only find each other's chunks if they cut the same way, so these and the
+// gear table must not change.
+#define CDC_MIN_SIZE (16 * 1024)
+#define CDC_AVG_SIZE (64 * 1024)
+#define CDC_MAX_SIZE (256 * 1024)
+
+struct ContentChunk {
+	ULONG64 offset;
+	DWORD size;
+	BYTE sha256[SHA256_DIGEST_SIZE];
+};
+
+typedef std::vector<ContentChunk> ChunkList;
+
+/**
+* @brief Splits a stream into content-defined chunks and hashes each one
+*
+* FastCDC: a gear hash rolls over the bytes and a chunk ends where its top
+* bits are all zero. Below CDC_AVG_SIZE more bits have to be zero than
+* above it, which pulls chunk sizes towards the average, and the first
+* CDC_MIN_SIZE bytes of a chunk are not even looked at. Because the cut
+* points depend only on nearby bytes, an insertion or deletion moves the
+* boundaries around it and leaves every other chunk of the file as it was,
+* so two versions of a file share most of their chunks.
+*
+* Feed the file in order with Update, in pieces of any size, then Finish.
+*/
+class ContentChunker {
+private:
+	Sha256 m_hasher;
+	ULONG64 m_gear;
+	ULONG64 m_offset;	// where the current chunk starts
+	DWORD m_size;		// bytes of it seen so far
+
+	void EndChunk(ChunkList& chunks);
+
+public:
+	ContentChunker();
+	ContentChunker(const ContentChunker&) = delete;
+	ContentChunker& operator=(const ContentChunker&) = delete;
+
+	void Reset();
+	void Update(const void* data, size_t size, ChunkList& chunks);
+	void Finish(ChunkList& chunks);
+};
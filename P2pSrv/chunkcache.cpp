@@ -0,0 +1,229 @@
+#include "chunkcache.h"
+#include "eventlog.h"
+
+#include <string.h>
+#include <algorithm>
+
+// No entry or slot
+#define CHUNK_CACHE_NONE 0xFFFFFFFF
+
+size_t ChunkCache::KeyHash::operator()(const Key& key) const {
+	ULONG64 h = key.file.fileIndex ^ ((ULONG64)key.file.volume << 32);
+	h = (h ^ key.file.lastWriteTime) * 0x9E3779B97F4A7C15ULL;
+	h = (h ^ key.file.size ^ ((ULONG64)key.block << 20)) * 0xBF58476D1CE4E5B9ULL;
+	return (size_t)(h ^ (h >> 31));
+}
+
+// Constructor - reserves the blocks and every entry up front
+ChunkCache::ChunkCache(size_t capacityBytes)
+	: m_memory(NULL), m_slotCount(0) {
+	memset(&m_stats, 0, sizeof(m_stats));
+	m_probation.head = m_probation.tail = CHUNK_CACHE_NONE;
+	m_probation.count = 0;
+	m_protected = m_probation;
+
+	DWORD slots = (DWORD)(std::min)(capacityBytes / BLOCK_SIZE, (size_t)MAXDWORD / (CHUNK_CACHE_GHOSTS_PER_SLOT + 1));
+	if (slots == 0) {
+		return;
+	}
+	m_memory = (BYTE*)VirtualAlloc(NULL, (SIZE_T)slots * BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (m_memory == NULL) {
+		WriteLogMessage("Failed to allocate the chunk cache, serving from disk only");
+		return;
+	}
+	m_slotCount = slots;
+	m_stats.capacityBytes = (size_t)slots * BLOCK_SIZE;
+
+	m_freeSlots.reserve(slots);
+	for (DWORD i = slots; i > 0; i--) {
+		m_freeSlots.push_back(i - 1);
+	}
+	m_slotOwner.assign(slots, CHUNK_CACHE_NONE);
+
+	DWORD entries = slots * (CHUNK_CACHE_GHOSTS_PER_SLOT + 1);
+	m_entries.resize(entries);
+	m_freeEntries.reserve(entries);
+	for (DWORD i = entries; i > 0; i--) {
+		m_freeEntries.push_back(i - 1);
+	}
+	m_index.reserve(entries);
+}
+
+// Destructor
+ChunkCache::~ChunkCache() {
+	if (m_memory != NULL) {
+		VirtualFree(m_memory, 0, MEM_RELEASE);
+	}
+}
+
+// What is known about count blocks from firstBlock. Blocks found in RAM
+// are pinned and move to the front of the LRU list.
+void ChunkCache::Lookup(const FileIdentity& file, DWORD firstBlock, DWORD count, CachedBlock* blocks) {
+	for (DWORD i = 0; i < count; i++) {
+		blocks[i].data = NULL;
+		blocks[i].known = false;
+		blocks[i].admit = false;
+	}
+	if (m_slotCount == 0) {
+		return;
+	}
+
+	Key key;
+	key.file = file;
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_stats.lookups += count;
+	for (DWORD i = 0; i < count; i++) {
+		key.block = firstBlock + i;
+		std::unordered_map<Key, DWORD, KeyHash>::iterator found = m_index.find(key);
+		if (found == m_index.end()) {
+			continue;
+		}
+
+		Entry& entry = m_entries[found->second];
+		blocks[i].crc32c = entry.crc32c;
+		blocks[i].length = entry.length;
+		blocks[i].known = true;
+		if (entry.slot != CHUNK_CACHE_NONE) {
+			Unlink(m_protected, found->second);
+			PushFront(m_protected, found->second);
+			entry.refs++;
+			blocks[i].data = m_memory + (SIZE_T)entry.slot * BLOCK_SIZE;
+			m_stats.hits++;
+		}
+		else {
+			// Probation is first in first out, a second request only marks it
+			blocks[i].admit = true;
+			m_stats.checksumHits++;
+		}
+	}
+}
+
+// Unpin the blocks a Lookup returned
+void ChunkCache::Release(const CachedBlock* blocks, DWORD count) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	for (DWORD i = 0; i < count; i++) {
+		if (blocks[i].data != NULL) {
+			DWORD slot = (DWORD)((blocks[i].data - m_memory) / BLOCK_SIZE);
+			m_entries[m_slotOwner[slot]].refs--;
+		}
+	}
+}
+
+void ChunkCache::Store(const FileIdentity& file, DWORD block, DWORD crc32c, DWORD length, const BYTE* data) {
+	if (m_slotCount == 0) {
+		return;
+	}
+
+	Key key;
+	key.file = file;
+	key.block = block;
+	std::lock_guard<std::mutex> lock(m_lock);
+	std::unordered_map<Key, DWORD, KeyHash>::iterator found = m_index.find(key);
+	if (found == m_index.end()) {
+		DWORD index = NewEntry();
+		Entry& entry = m_entries[index];
+		entry.key = key;
+		entry.crc32c = crc32c;
+		entry.length = length;
+		entry.slot = CHUNK_CACHE_NONE;
+		entry.refs = 0;
+		PushFront(m_probation, index);
+		m_index[key] = index;
+		return;
+	}
+
+	// Another peer may have brought it in meanwhile
+	DWORD index = found->second;
+	if (data == NULL || m_entries[index].slot != CHUNK_CACHE_NONE) {
+		return;
+	}
+	DWORD slot = TakeSlot();
+	if (slot == CHUNK_CACHE_NONE) {
+		return;
+	}
+	Entry& entry = m_entries[index];
+	memcpy(m_memory + (SIZE_T)slot * BLOCK_SIZE, data, length);
+	entry.slot = slot;
+	m_slotOwner[slot] = index;
+	Unlink(m_probation, index);
+	PushFront(m_protected, index);
+	m_stats.admitted++;
+}
+
+void ChunkCache::GetStats(ChunkCacheStats& stats) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	stats = m_stats;
+	stats.cachedBytes = (size_t)m_protected.count * BLOCK_SIZE;
+}
+
+void ChunkCache::Unlink(Queue& queue, DWORD entry) {
+	Entry& e = m_entries[entry];
+	if (e.prev != CHUNK_CACHE_NONE) {
+		m_entries[e.prev].next = e.next;
+	}
+	else {
+		queue.head = e.next;
+	}
+	if (e.next != CHUNK_CACHE_NONE) {
+		m_entries[e.next].prev = e.prev;
+	}
+	else {
+		queue.tail = e.prev;
+	}
+	queue.count--;
+}
+
+void ChunkCache::PushFront(Queue& queue, DWORD entry) {
+	Entry& e = m_entries[entry];
+	e.prev = CHUNK_CACHE_NONE;
+	e.next = queue.head;
+	if (queue.head != CHUNK_CACHE_NONE) {
+		m_entries[queue.head].prev = entry;
+	}
+	else {
+		queue.tail = entry;
+	}
+	queue.head = entry;
+	queue.count++;
+}
+
+// A free entry, forgetting the oldest block on probation when there is none.
+// There always is one: the protected list never holds more than m_slotCount.
+DWORD ChunkCache::NewEntry() {
+	if (!m_freeEntries.empty()) {
+		DWORD index = m_freeEntries.back();
+		m_freeEntries.pop_back();
+		return index;
+	}
+	DWORD index = m_probation.tail;
+	Unlink(m_probation, index);
+	m_index.erase(m_entries[index].key);
+	return index;
+}
+
+// A free slot, evicting the least recently used unpinned block if needed;
+// CHUNK_CACHE_NONE if every block is being sent
+DWORD ChunkCache::TakeSlot() {
+	if (!m_freeSlots.empty()) {
+		DWORD slot = m_freeSlots.back();
+		m_freeSlots.pop_back();
+		return slot;
+	}
+	DWORD index = m_protected.tail;
+	while (index != CHUNK_CACHE_NONE && m_entries[index].refs > 0) {
+		index = m_entries[index].prev;
+	}
+	if (index == CHUNK_CACHE_NONE) {
+		return CHUNK_CACHE_NONE;
+	}
+
+	// The evicted block keeps its checksum on probation
+	Entry& entry = m_entries[index];
+	DWORD slot = entry.slot;
+	entry.slot = CHUNK_CACHE_NONE;
+	m_slotOwner[slot] = CHUNK_CACHE_NONE;
+	Unlink(m_protected, index);
+	PushFront(m_probation, index);
+	m_stats.evicted++;
+	return slot;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <windows.h>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+#include "tcpdef.h"
+#include "filecache.h"
+
+// RAM given to the chunk cache when the registry does not say otherwise
+#define CHUNK_CACHE_DEFAULT_MB 256
+// Blocks remembered by checksum only, for every block held in RAM
+#define CHUNK_CACHE_GHOSTS_PER_SLOT 4
+
+// What the cache knows about one BLOCK_SIZE block of a file
+struct CachedBlock {
+	const BYTE* data;	// copy in RAM, pinned until Release; NULL if not cached
+	DWORD crc32c;
+	DWORD length;
+	bool known;			// crc32c and length are set
+	bool admit;			// asked for before: Store the data once it is at hand
+};
+
+struct ChunkCacheStats {
+	ULONG64 lookups;		// blocks asked for
+	ULONG64 hits;			// of those, found in RAM
+	ULONG64 checksumHits;	// found with their checksum only
+	ULONG64 admitted;
+	ULONG64 evicted;
+	size_t cachedBytes;
+	size_t capacityBytes;
+};
+
+/**
+* @brief Recently served blocks in RAM, with their CRC32C
+*
+* Works in BLOCK_SIZE blocks of a file version (FileIdentity), so peers
+* that negotiated different chunk sizes share the entries; a chunk's
+* CRC32C is combined from those of its blocks.
+*
+* Admission is 2Q-style: a block seen for the first time only gets an
+* entry on the probation queue, which holds its checksum but no data. Asked
+* for again while still there, it is copied into RAM and moves to the
+* protected LRU list. A peer reading a large file once therefore costs no
+* RAM and pushes nothing out, while a file that several peers are pulling
+* is read from disk once more and then served from memory. Blocks evicted
+* from the protected list fall back to probation and keep their checksum.
+*
+* All memory is reserved in the constructor. Data returned by Lookup is
+* pinned until Release, so it can be sent without copying while other
+* threads use the cache; eviction passes over pinned blocks.
+*/
+class ChunkCache {
+public:
+	explicit ChunkCache(size_t capacityBytes);
+	~ChunkCache();
+	ChunkCache(const ChunkCache&) = delete;
+	ChunkCache& operator=(const ChunkCache&) = delete;
+
+	void Lookup(const FileIdentity& file, DWORD firstBlock, DWORD count, CachedBlock* blocks);
+	void Release(const CachedBlock* blocks, DWORD count);
+	// Remember a block's checksum, and its data when admit was set (else NULL)
+	void Store(const FileIdentity& file, DWORD block, DWORD crc32c, DWORD length, const BYTE* data);
+	void GetStats(ChunkCacheStats& stats);
+
+private:
+	struct Key {
+		FileIdentity file;
+		DWORD block;
+
+		bool operator==(const Key& other) const { return block == other.block && file == other.file; }
+	};
+	struct KeyHash {
+		size_t operator()(const Key& key) const;
+	};
+	struct Entry {
+		Key key;
+		DWORD crc32c;
+		DWORD length;
+		DWORD slot;		// CHUNK_CACHE_NONE while on probation
+		DWORD refs;
+		DWORD prev;
+		DWORD next;
+	};
+	struct Queue {
+		DWORD head;		// most recent
+		DWORD tail;
+		DWORD count;
+	};
+
+	BYTE* m_memory;
+	DWORD m_slotCount;
+	std::vector<DWORD> m_freeSlots;
+	std::vector<DWORD> m_slotOwner;		// entry of each slot
+	std::vector<Entry> m_entries;
+	std::vector<DWORD> m_freeEntries;
+	std::unordered_map<Key, DWORD, KeyHash> m_index;
+	Queue m_probation;
+	Queue m_protected;
+	std::mutex m_lock;
+	ChunkCacheStats m_stats;
+
+	void Unlink(Queue& queue, DWORD entry);
+	void PushFront(Queue& queue, DWORD entry);
+	DWORD NewEntry();
+	DWORD TakeSlot();
+};
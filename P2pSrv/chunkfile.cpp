@@ -0,0 +1,379 @@
+#include "chunkfile.h"
+#include "eventlog.h"
+#include <algorithm>
+
+#define CHUNK_MAP_MAGIC 0x43503250	// "P2PC"
+// MapHeader::fileSize while no short final chunk has been written
+#define FILE_SIZE_UNKNOWN ((ULONGLONG)-1)
+// Most read back at once when hashing blocks that arrived ahead of the cursor
+#define HASH_READ_SIZE (1024 * 1024)
+
+// Constructor
+ChunkFile::ChunkFile()
+	: m_hFile(INVALID_HANDLE_VALUE), m_hMap(INVALID_HANDLE_VALUE), m_totalBlocks(0),
+	m_blocksDone(0), m_fileSize(FILE_SIZE_UNKNOWN), m_sinceCheckpoint(0), m_hashedBytes(0), m_hashMismatch(false) {
+}
+
+// Destructor
+ChunkFile::~ChunkFile() {
+	Close();
+}
+
+// Check the finished file against this SHA-256; call before Open
+void ChunkFile::SetExpectedHash(const std::string& sha256Hex) {
+	m_expectedHash = sha256Hex;
+	std::transform(m_expectedHash.begin(), m_expectedHash.end(), m_expectedHash.begin(), ::tolower);
+	m_hasher.Reset();
+	m_hashedBytes = 0;
+}
+
+// Open the output file, resuming from its sidecar bitmap when there is one
+bool ChunkFile::Open(const std::string& path) {
+	Close();
+	m_path = path;
+	m_bitmap.clear();
+	m_totalBlocks = 0;
+	m_blocksDone = 0;
+	m_fileSize = FILE_SIZE_UNKNOWN;
+	m_sinceCheckpoint = 0;
+	m_hashedBytes = 0;
+	m_hashMismatch = false;
+	if (!m_expectedHash.empty()) {
+		m_hasher.Reset();
+	}
+
+	std::string mapPath = path + CHUNK_MAP_EXTENSION;
+	m_hMap = CreateFileA(mapPath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_hMap == INVALID_HANDLE_VALUE) {
+		WriteLogMessage("Cannot open chunk map file");
+		return false;
+	}
+
+	// Without a usable bitmap nothing in an existing file can be trusted
+	bool resume = LoadMap();
+	// Read access is for hashing blocks that arrived out of order
+	m_hFile = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		resume ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_hFile == INVALID_HANDLE_VALUE) {
+		WriteLogMessage("Cannot create output file");
+		Close();
+		return false;
+	}
+
+	// A bitmap whose data file is gone describes nothing
+	if (resume && GetLastError() != ERROR_ALREADY_EXISTS) {
+		resume = false;
+		m_bitmap.clear();
+		m_totalBlocks = 0;
+		m_blocksDone = 0;
+		m_fileSize = FILE_SIZE_UNKNOWN;
+	}
+
+	if (resume) {
+		char msg[MAX_PATH + 64];
+		sprintf_s(msg, "Resuming %s: %lu/%lu blocks on disk", path.c_str(), m_blocksDone, m_totalBlocks);
+		WriteLogMessage(msg);
+	}
+	return true;
+}
+
+// Read the sidecar bitmap, false if there is none or it is not ours
+bool ChunkFile::LoadMap() {
+	MapHeader header;
+	DWORD bytesRead = 0;
+	if (!ReadFile(m_hMap, &header, sizeof(header), &bytesRead, NULL) || bytesRead != sizeof(header) ||
+		header.magic != CHUNK_MAP_MAGIC || header.blockSize != BLOCK_SIZE || header.totalBlocks == 0) {
+		return false;
+	}
+
+	std::vector<BYTE> bitmap((header.totalBlocks + 7) / 8);
+	if (!ReadFile(m_hMap, bitmap.data(), (DWORD)bitmap.size(), &bytesRead, NULL) || bytesRead != bitmap.size()) {
+		return false;
+	}
+
+	m_bitmap.swap(bitmap);
+	m_totalBlocks = header.totalBlocks;
+	m_fileSize = header.fileSize;
+	for (DWORD i = 0; i < m_totalBlocks; i++) {
+		if (m_bitmap[i / 8] & (1 << (i % 8))) {
+			m_blocksDone++;
+		}
+	}
+	return true;
+}
+
+// Size the file for totalBlocks; a different block count means a different
+// file on the peer, so whatever was resumed is thrown away
+bool ChunkFile::Prepare(DWORD totalBlocks) {
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (totalBlocks != m_totalBlocks) {
+			if (m_totalBlocks != 0) {
+				WriteLogMessage("Remote file changed, restarting download from scratch");
+			}
+			m_bitmap.assign((totalBlocks + 7) / 8, 0);
+			m_totalBlocks = totalBlocks;
+			m_blocksDone = 0;
+			m_fileSize = FILE_SIZE_UNKNOWN;
+		}
+	}
+
+	// Reserve the whole file up front so it does not grow chunk by chunk
+	LARGE_INTEGER size;
+	size.QuadPart = (LONGLONG)totalBlocks * BLOCK_SIZE;
+	if (!SetFilePointerEx(m_hFile, size, NULL, FILE_BEGIN) || !SetEndOfFile(m_hFile)) {
+		WriteLogMessage("Failed to preallocate output file");
+		return false;
+	}
+	return Checkpoint();
+}
+
+// Write one verified chunk covering blockCount blocks from firstBlock, safe to
+// call from several threads. A chunk shorter than its blocks is the end of the
+// file; the blocks past its data are marked done too.
+bool ChunkFile::WriteChunk(DWORD firstBlock, DWORD blockCount, const char* data, DWORD size) {
+	ULARGE_INTEGER offset;
+	offset.QuadPart = (ULONGLONG)firstBlock * BLOCK_SIZE;
+
+	OVERLAPPED ov = {};
+	ov.Offset = offset.LowPart;
+	ov.OffsetHigh = offset.HighPart;
+
+	DWORD written = 0;
+	if (!WriteFile(m_hFile, data, size, &written, &ov) || written != size) {
+		WriteLogMessage("Failed to write chunk to output file");
+		return false;
+	}
+
+	bool checkpoint = false;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		DWORD lastBlock = (std::min)(firstBlock + blockCount, m_totalBlocks);
+		for (DWORD i = firstBlock; i < lastBlock; i++) {
+			BYTE bit = (BYTE)(1 << (i % 8));
+			if (!(m_bitmap[i / 8] & bit)) {
+				m_bitmap[i / 8] |= bit;
+				m_blocksDone++;
+			}
+		}
+		if ((ULONGLONG)size < (ULONGLONG)blockCount * BLOCK_SIZE) {
+			m_fileSize = offset.QuadPart + size;
+		}
+		m_sinceCheckpoint += blockCount;
+		if (m_sinceCheckpoint >= CHUNK_MAP_CHECKPOINT) {
+			m_sinceCheckpoint = 0;
+			checkpoint = true;
+		}
+	}
+	if (!m_expectedHash.empty() && !AdvanceHash(offset.QuadPart, data, size)) {
+		return false;
+	}
+	return checkpoint ? Checkpoint() : true;
+}
+
+// Hash from the cursor as far as the file is contiguous on disk: the part of
+// data at the cursor from memory, blocks already written after it from disk
+bool ChunkFile::AdvanceHash(ULONGLONG offset, const char* data, DWORD size) {
+	std::lock_guard<std::mutex> hashLock(m_hashLock);
+
+	if (offset <= m_hashedBytes && m_hashedBytes < offset + size) {
+		DWORD skip = (DWORD)(m_hashedBytes - offset);
+		if (!m_hasher.Update(data + skip, size - skip)) {
+			return false;
+		}
+		m_hashedBytes = offset + size;
+	}
+
+	if (m_hashBuffer.empty()) {
+		m_hashBuffer.resize(HASH_READ_SIZE);
+	}
+	while (true) {
+		ULONGLONG end;
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			if (m_hashedBytes % BLOCK_SIZE != 0) {
+				break;	// only the end of the file is not on a block boundary
+			}
+			DWORD block = (DWORD)(m_hashedBytes / BLOCK_SIZE);
+			DWORD last = (std::min)(block + HASH_READ_SIZE / BLOCK_SIZE, m_totalBlocks);
+			while (block < last && (m_bitmap[block / 8] & (1 << (block % 8)))) {
+				block++;
+			}
+			end = (ULONGLONG)block * BLOCK_SIZE;
+			if (m_fileSize != FILE_SIZE_UNKNOWN) {
+				end = (std::min)(end, m_fileSize);
+			}
+		}
+		if (end <= m_hashedBytes) {
+			break;
+		}
+
+		ULARGE_INTEGER pos;
+		pos.QuadPart = m_hashedBytes;
+		OVERLAPPED ov = {};
+		ov.Offset = pos.LowPart;
+		ov.OffsetHigh = pos.HighPart;
+		DWORD length = (DWORD)(end - m_hashedBytes);
+		DWORD bytesRead = 0;
+		if (!ReadFile(m_hFile, m_hashBuffer.data(), length, &bytesRead, &ov) || bytesRead != length ||
+			!m_hasher.Update(m_hashBuffer.data(), length)) {
+			WriteLogMessage("Failed to hash downloaded data");
+			return false;
+		}
+		m_hashedBytes = end;
+	}
+	return true;
+}
+
+// Hash whatever is left and compare with the expected hash. On a mismatch
+// the chunk map is cleared, nothing on disk can be told apart from the bad data.
+bool ChunkFile::VerifyHash(ULONGLONG fileSize) {
+	if (!AdvanceHash(0, NULL, 0)) {
+		return false;
+	}
+
+	std::string actual;
+	if (m_hashedBytes != fileSize || !m_hasher.FinalHex(actual) || actual != m_expectedHash) {
+		WriteLogMessage("SHA-256 of the download does not match, discarding it");
+		m_hashMismatch = true;
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			std::fill(m_bitmap.begin(), m_bitmap.end(), (BYTE)0);
+			m_blocksDone = 0;
+			m_fileSize = FILE_SIZE_UNKNOWN;
+		}
+		Checkpoint();
+		m_hashedBytes = 0;
+		m_hasher.Reset();
+		return false;
+	}
+	WriteLogMessage("SHA-256 of the download verified");
+	return true;
+}
+
+// Flush the data file, then save the bitmap
+bool ChunkFile::Checkpoint() {
+	std::lock_guard<std::mutex> checkpointLock(m_checkpointLock);
+
+	// Snapshot first: every bit in it belongs to a write that the flush below covers
+	MapHeader header;
+	std::vector<BYTE>& bitmap = m_snapshot;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		header.magic = CHUNK_MAP_MAGIC;
+		header.blockSize = BLOCK_SIZE;
+		header.totalBlocks = m_totalBlocks;
+		header.reserved = 0;
+		header.fileSize = m_fileSize;
+		bitmap.assign(m_bitmap.begin(), m_bitmap.end());
+	}
+
+	if (!FlushFileBuffers(m_hFile)) {
+		WriteLogMessage("Failed to flush output file");
+		return false;
+	}
+
+	OVERLAPPED ov = {};
+	DWORD written = 0;
+	if (!WriteFile(m_hMap, &header, sizeof(header), &written, &ov) || written != sizeof(header)) {
+		WriteLogMessage("Failed to write chunk map");
+		return false;
+	}
+	ov.Offset = sizeof(header);
+	if (!bitmap.empty() && (!WriteFile(m_hMap, bitmap.data(), (DWORD)bitmap.size(), &written, &ov) || written != bitmap.size())) {
+		WriteLogMessage("Failed to write chunk map");
+		return false;
+	}
+	return true;
+}
+
+// All chunks are on disk: trim the file to its real length and drop the sidecar
+bool ChunkFile::Complete() {
+	LARGE_INTEGER size;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (m_totalBlocks == 0 || m_blocksDone != m_totalBlocks) {
+			WriteLogMessage("Download is missing chunks");
+			return false;
+		}
+		// Without a short final chunk the file ends on a block boundary
+		size.QuadPart = (m_fileSize != FILE_SIZE_UNKNOWN) ? (LONGLONG)m_fileSize : (LONGLONG)m_totalBlocks * BLOCK_SIZE;
+	}
+
+	if (!m_expectedHash.empty() && !VerifyHash((ULONGLONG)size.QuadPart)) {
+		return false;
+	}
+
+	if (!SetFilePointerEx(m_hFile, size, NULL, FILE_BEGIN) || !SetEndOfFile(m_hFile)) {
+		WriteLogMessage("Failed to set output file size");
+		return false;
+	}
+
+	CloseHandle(m_hFile);
+	m_hFile = INVALID_HANDLE_VALUE;
+	CloseHandle(m_hMap);
+	m_hMap = INVALID_HANDLE_VALUE;
+	std::string mapPath = m_path + CHUNK_MAP_EXTENSION;
+	DeleteFileA(mapPath.c_str());
+	return true;
+}
+
+// Close the files, saving progress so the download can be resumed
+void ChunkFile::Close() {
+	if (m_hFile != INVALID_HANDLE_VALUE && m_hMap != INVALID_HANDLE_VALUE && m_totalBlocks != 0) {
+		Checkpoint();
+	}
+	if (m_hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+	if (m_hMap != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_hMap);
+		m_hMap = INVALID_HANDLE_VALUE;
+	}
+}
+
+// Block count, 0 while unknown
+DWORD ChunkFile::GetTotalBlocks() const {
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_totalBlocks;
+}
+
+// Number of blocks on disk
+DWORD ChunkFile::GetBlocksDone() const {
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_blocksDone;
+}
+
+// Whether a block is already on disk
+bool ChunkFile::IsBlockDone(DWORD blockIndex) const {
+	std::lock_guard<std::mutex> lock(m_lock);
+	return blockIndex < m_totalBlocks && (m_bitmap[blockIndex / 8] & (1 << (blockIndex % 8))) != 0;
+}
+
+// Lowest block still missing; 0 while the block count is unknown and
+// GetTotalBlocks() once everything is on disk
+DWORD ChunkFile::FirstMissingBlock() const {
+	std::lock_guard<std::mutex> lock(m_lock);
+	for (DWORD i = 0; i < m_totalBlocks; i++) {
+		if (!(m_bitmap[i / 8] & (1 << (i % 8)))) {
+			return i;
+		}
+	}
+	return m_totalBlocks;
+}
+
+// First block of every spanBlocks-aligned chunk that still has a missing
+// block, in file order
+void ChunkFile::GetMissingChunks(DWORD spanBlocks, std::vector<DWORD>& firstBlocks) const {
+	std::lock_guard<std::mutex> lock(m_lock);
+	firstBlocks.clear();
+	for (DWORD i = 0; i < m_totalBlocks; i++) {
+		if (!(m_bitmap[i / 8] & (1 << (i % 8)))) {
+			DWORD first = i - i % spanBlocks;
+			firstBlocks.push_back(first);
+			i = first + spanBlocks - 1;
+		}
+	}
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "tcpdef.h"
+#include "sha256.h"
+
+// Extension of the sidecar file that tracks which chunks are on disk
+#define CHUNK_MAP_EXTENSION ".chunks"
+// Verified blocks between two checkpoints of the sidecar bitmap (16 MB)
+#define CHUNK_MAP_CHECKPOINT 1024
+
+/**
+* @brief Download target that is assembled in place and can be resumed
+*
+* Progress is tracked in BLOCK_SIZE blocks, whatever chunk size the peers
+* agreed on, so a download can resume with a different chunk size. Every
+* chunk is written at firstBlock * BLOCK_SIZE with a positional write, so
+* chunks can arrive in any order and from several threads at once.
+* Which blocks are already on disk is kept in a bitmap, saved next to the
+* output as <output>.chunks. The bitmap is only saved after the data file
+* has been flushed, so a bit on disk always means the chunk is on disk too.
+* Opening a download that has a sidecar picks up where it stopped.
+* Complete() trims the file to its real length and deletes the sidecar.
+*
+* With SetExpectedHash the file is hashed as it is written: whenever the
+* block at the hash cursor lands, it is hashed straight from the caller's
+* buffer, and blocks that had arrived ahead of it are read back while they
+* are still in the cache. Complete() then only has to compare digests.
+*/
+class ChunkFile {
+private:
+	struct MapHeader {
+		DWORD magic;
+		DWORD blockSize;
+		DWORD totalBlocks;
+		DWORD reserved;
+		ULONGLONG fileSize;	// exact size once the short final chunk is in
+	};
+
+	HANDLE m_hFile;
+	HANDLE m_hMap;
+	std::string m_path;
+
+	mutable std::mutex m_lock;
+	std::mutex m_checkpointLock;
+	std::vector<BYTE> m_bitmap;
+	std::vector<BYTE> m_snapshot;	// bitmap copy written by Checkpoint, kept to avoid reallocating
+	DWORD m_totalBlocks;
+	DWORD m_blocksDone;
+	ULONGLONG m_fileSize;
+	DWORD m_sinceCheckpoint;
+
+	// Incremental SHA-256, only with an expected hash
+	std::mutex m_hashLock;
+	std::string m_expectedHash;
+	Sha256 m_hasher;
+	ULONGLONG m_hashedBytes;
+	bool m_hashMismatch;
+	std::vector<char> m_hashBuffer;
+
+	bool LoadMap();
+	bool Checkpoint();
+	bool AdvanceHash(ULONGLONG offset, const char* data, DWORD size);
+	bool VerifyHash(ULONGLONG fileSize);
+
+public:
+	ChunkFile();
+	~ChunkFile();
+
+	void SetExpectedHash(const std::string& sha256Hex);
+	bool Open(const std::string& path);
+	bool Prepare(DWORD totalBlocks);
+	bool WriteChunk(DWORD firstBlock, DWORD blockCount, const char* data, DWORD size);
+	bool Complete();
+	void Close();
+
+	DWORD GetTotalBlocks() const;
+	DWORD GetBlocksDone() const;
+	bool IsBlockDone(DWORD blockIndex) const;
+	DWORD FirstMissingBlock() const;
+	void GetMissingChunks(DWORD spanBlocks, std::vector<DWORD>& firstBlocks) const;
+	const std::string& GetPath() const { return m_path; }
+	// The last Complete() found the wrong SHA-256 and discarded the download
+	bool HashMismatch() const { return m_hashMismatch; }
+};
@@ -0,0 +1,78 @@
+#include "chunkindex.h"
+
+#include <string.h>
+
+// Constructor
+ChunkIndex::ChunkIndex()
+	: m_totalBytes(0), m_uniqueBytes(0) {
+}
+
+// Index the chunks of path, replacing what it had before
+void ChunkIndex::AddFile(const std::string& path, const std::shared_ptr<const ChunkList>& chunks) {
+	RemoveFile(path);
+	if (!chunks || chunks->empty()) {
+		return;
+	}
+
+	std::map<std::string, std::shared_ptr<const ChunkList> >::iterator file =
+		m_files.insert(std::make_pair(path, chunks)).first;
+	for (size_t i = 0; i < chunks->size(); i++) {
+		const ContentChunk& chunk = (*chunks)[i];
+		ChunkDigest digest;
+		memcpy(digest.bytes, chunk.sha256, sizeof(digest.bytes));
+		if (m_chunks.count(digest) == 0) {
+			m_uniqueBytes += chunk.size;
+		}
+		ChunkRef ref;
+		ref.path = &file->first;
+		ref.chunk = &chunk;
+		m_chunks.insert(std::make_pair(digest, ref));
+		m_totalBytes += chunk.size;
+	}
+}
+
+void ChunkIndex::RemoveFile(const std::string& path) {
+	std::map<std::string, std::shared_ptr<const ChunkList> >::iterator file = m_files.find(path);
+	if (file == m_files.end()) {
+		return;
+	}
+
+	const ChunkList& chunks = *file->second;
+	for (size_t i = 0; i < chunks.size(); i++) {
+		ChunkDigest digest;
+		memcpy(digest.bytes, chunks[i].sha256, sizeof(digest.bytes));
+		std::pair<ChunkMap::iterator, ChunkMap::iterator> range = m_chunks.equal_range(digest);
+		for (ChunkMap::iterator it = range.first; it != range.second; ++it) {
+			if (it->second.chunk == &chunks[i]) {
+				m_chunks.erase(it);
+				break;
+			}
+		}
+		if (m_chunks.count(digest) == 0) {
+			m_uniqueBytes -= chunks[i].size;
+		}
+		m_totalBytes -= chunks[i].size;
+	}
+	m_files.erase(file);
+}
+
+void ChunkIndex::Clear() {
+	m_chunks.clear();
+	m_files.clear();
+	m_totalBytes = 0;
+	m_uniqueBytes = 0;
+}
+
+// Some file holding a chunk with this digest
+bool ChunkIndex::Find(const BYTE digest[SHA256_DIGEST_SIZE], ChunkLocation& location) const {
+	ChunkDigest key;
+	memcpy(key.bytes, digest, sizeof(key.bytes));
+	ChunkMap::const_iterator it = m_chunks.find(key);
+	if (it == m_chunks.end()) {
+		return false;
+	}
+	location.path = *it->second.path;
+	location.offset = it->second.chunk->offset;
+	location.size = it->second.chunk->size;
+	return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <string.h>
+
+#include "cdc.h"
+
+// Where a chunk can be read from
+struct ChunkLocation {
+	std::string path;
+	ULONG64 offset;
+	DWORD size;
+};
+
+/**
+* @brief Content-defined chunks of every shared file, by digest
+*
+* Maps each chunk's SHA-256 to the files and offsets holding it, so a chunk
+* can be served or copied from any file that contains it instead of only
+* from the file it was asked for in. Chunk lists are shared with the
+* files and the hash cache, the index only adds a slot per chunk.
+*
+* Not synchronized; the ShareIndex that owns it holds its lock around every
+* call.
+*/
+class ChunkIndex {
+public:
+	ChunkIndex();
+	ChunkIndex(const ChunkIndex&) = delete;
+	ChunkIndex& operator=(const ChunkIndex&) = delete;
+
+	void AddFile(const std::string& path, const std::shared_ptr<const ChunkList>& chunks);
+	void RemoveFile(const std::string& path);
+	void Clear();
+	bool Find(const BYTE digest[SHA256_DIGEST_SIZE], ChunkLocation& location) const;
+
+	size_t GetChunkCount() const { return m_chunks.size(); }
+	ULONG64 GetTotalBytes() const { return m_totalBytes; }
+	// Bytes left once every duplicate chunk is counted once
+	ULONG64 GetUniqueBytes() const { return m_uniqueBytes; }
+
+private:
+	struct ChunkDigest {
+		BYTE bytes[SHA256_DIGEST_SIZE];
+		bool operator==(const ChunkDigest& other) const { return memcmp(bytes, other.bytes, sizeof(bytes)) == 0; }
+	};
+	// The digest is already uniformly distributed, its first bytes will do
+	struct ChunkDigestHash {
+		size_t operator()(const ChunkDigest& digest) const {
+			size_t hash;
+			memcpy(&hash, digest.bytes, sizeof(hash));
+			return hash;
+		}
+	};
+	struct ChunkRef {
+		const std::string* path;	// key in m_files
+		const ContentChunk* chunk;	// in that file's list
+	};
+	typedef std::unordered_multimap<ChunkDigest, ChunkRef, ChunkDigestHash> ChunkMap;
+
+	std::map<std::string, std::shared_ptr<const ChunkList> > m_files;
+	ChunkMap m_chunks;
+	ULONG64 m_totalBytes;
+	ULONG64 m_uniqueBytes;
+};
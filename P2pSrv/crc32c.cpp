@@ -0,0 +1,195 @@
+#include "crc32c.h"
+
+#include <intrin.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+
+// Reflected CRC32C polynomial
+#define CRC32C_POLY 0x82F63B78
+
+// Bytes per stream in one interleaved block of the hardware path
+#define CRC32C_LONG_BLOCK 8192
+#define CRC32C_SHORT_BLOCK 256
+
+typedef DWORD (*Crc32cFunc)(DWORD crc, const unsigned char* p, size_t size);
+
+static DWORD s_table[8][256];
+static DWORD s_longShift[2];
+static DWORD s_shortShift[2];
+static DWORD s_x2n[64];		// x^(2^k)
+static Crc32cFunc s_crcFunc;
+
+// Multiply two polynomials modulo CRC32C_POLY (bit 31 is x^0)
+static DWORD MultModP(DWORD a, DWORD b) {
+	DWORD product = 0;
+	for (DWORD m = 0x80000000; m != 0; m >>= 1) {
+		if (a & m) {
+			product ^= b;
+		}
+		b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return product;
+}
+
+// x^n modulo CRC32C_POLY
+static DWORD XPowModP(DWORD n) {
+	DWORD result = 0x80000000;
+	DWORD square = 0x40000000;	// x^1
+	while (n != 0) {
+		if (n & 1) {
+			result = MultModP(result, square);
+		}
+		square = MultModP(square, square);
+		n >>= 1;
+	}
+	return result;
+}
+
+// x^(8 * length) modulo CRC32C_POLY
+static DWORD XPow8nModP(ULONG64 length) {
+	ULONG64 n = length * 8;
+	DWORD result = 0x80000000;
+	for (int k = 0; n != 0; k++, n >>= 1) {
+		if (n & 1) {
+			result = MultModP(result, s_x2n[k]);
+		}
+	}
+	return result;
+}
+
+// Portable path: slicing-by-8
+static DWORD Crc32cSoftware(DWORD crc, const unsigned char* p, size_t size) {
+	while (size && ((ULONG_PTR)p & 7)) {
+		crc = s_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		size--;
+	}
+	while (size >= 8) {
+		DWORD lo = *(const DWORD*)p ^ crc;
+		DWORD hi = *(const DWORD*)(p + 4);
+		crc = s_table[7][lo & 0xFF] ^ s_table[6][(lo >> 8) & 0xFF] ^
+			s_table[5][(lo >> 16) & 0xFF] ^ s_table[4][lo >> 24] ^
+			s_table[3][hi & 0xFF] ^ s_table[2][(hi >> 8) & 0xFF] ^
+			s_table[1][(hi >> 16) & 0xFF] ^ s_table[0][hi >> 24];
+		p += 8;
+		size -= 8;
+	}
+	while (size--) {
+		crc = s_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+// CRC32 instruction over 8 bytes
+static inline DWORD CrcWord(DWORD crc, ULONG64 word) {
+#if defined(_M_X64) || defined(__x86_64__)
+	return (DWORD)_mm_crc32_u64(crc, word);
+#else
+	crc = _mm_crc32_u32(crc, (DWORD)word);
+	return _mm_crc32_u32(crc, (DWORD)(word >> 32));
+#endif
+}
+
+// Advance crc over 'length' zero bytes, shift = x^(8 * length - 33)
+static inline ULONG64 ClmulShift(DWORD crc, DWORD shift) {
+	__m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc), _mm_cvtsi32_si128((int)shift), 0);
+#if defined(_M_X64) || defined(__x86_64__)
+	return (ULONG64)_mm_cvtsi128_si64(product);
+#else
+	return (ULONG64)(DWORD)_mm_cvtsi128_si32(product) |
+		((ULONG64)(DWORD)_mm_extract_epi32(product, 1) << 32);
+#endif
+}
+
+// Three independent CRC chains over consecutive blocks of 'block' bytes,
+// merged with carry-less multiplies so the CRC32 latency is hidden
+static inline DWORD Crc32cInterleaved(DWORD crc, const unsigned char*& p, size_t& size, size_t block, const DWORD* shift) {
+	while (size >= 3 * block) {
+		DWORD crc0 = crc, crc1 = 0, crc2 = 0;
+		const unsigned char* end = p + block;
+		do {
+			crc0 = CrcWord(crc0, *(const ULONG64*)p);
+			crc1 = CrcWord(crc1, *(const ULONG64*)(p + block));
+			crc2 = CrcWord(crc2, *(const ULONG64*)(p + 2 * block));
+			p += 8;
+		} while (p < end);
+		crc = CrcWord(0, ClmulShift(crc0, shift[1]) ^ ClmulShift(crc1, shift[0])) ^ crc2;
+		p += 2 * block;
+		size -= 3 * block;
+	}
+	return crc;
+}
+
+// SSE4.2 + PCLMULQDQ path
+static DWORD Crc32cHardware(DWORD crc, const unsigned char* p, size_t size) {
+	while (size && ((ULONG_PTR)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		size--;
+	}
+	crc = Crc32cInterleaved(crc, p, size, CRC32C_LONG_BLOCK, s_longShift);
+	crc = Crc32cInterleaved(crc, p, size, CRC32C_SHORT_BLOCK, s_shortShift);
+	while (size >= 8) {
+		crc = CrcWord(crc, *(const ULONG64*)p);
+		p += 8;
+		size -= 8;
+	}
+	while (size--) {
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+	return crc;
+}
+
+// Build the tables and pick an implementation before main runs
+static struct Crc32cInit {
+	Crc32cInit() {
+		for (DWORD n = 0; n < 256; n++) {
+			DWORD crc = n;
+			for (int k = 0; k < 8; k++) {
+				crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+			}
+			s_table[0][n] = crc;
+		}
+		for (DWORD n = 0; n < 256; n++) {
+			for (int k = 1; k < 8; k++) {
+				s_table[k][n] = s_table[0][s_table[k - 1][n] & 0xFF] ^ (s_table[k - 1][n] >> 8);
+			}
+		}
+
+		s_x2n[0] = 0x40000000;
+		for (int k = 1; k < 64; k++) {
+			s_x2n[k] = MultModP(s_x2n[k - 1], s_x2n[k - 1]);
+		}
+
+		s_longShift[0] = XPowModP(8 * CRC32C_LONG_BLOCK - 33);
+		s_longShift[1] = XPowModP(8 * 2 * CRC32C_LONG_BLOCK - 33);
+		s_shortShift[0] = XPowModP(8 * CRC32C_SHORT_BLOCK - 33);
+		s_shortShift[1] = XPowModP(8 * 2 * CRC32C_SHORT_BLOCK - 33);
+
+		int info[4];
+		__cpuid(info, 1);
+		bool sse42 = (info[2] & (1 << 20)) != 0;
+		bool pclmul = (info[2] & (1 << 1)) != 0;
+		s_crcFunc = (sse42 && pclmul) ? Crc32cHardware : Crc32cSoftware;
+	}
+} s_crc32cInit;
+
+DWORD Crc32c(const void* data, size_t size, DWORD crc) {
+	return ~s_crcFunc(~crc, (const unsigned char*)data, size);
+}
+
+// Shifting crcA over lengthB zero bytes leaves what A contributes to the
+// CRC of A|B; the pre- and post-inversions of both cancel out
+DWORD Crc32cCombine(DWORD crcA, DWORD crcB, size_t lengthB) {
+	return MultModP(XPow8nModP(lengthB), crcA) ^ crcB;
+}
+
+bool Crc32cHardwareAccelerated() {
+	return s_crcFunc == Crc32cHardware;
+}
+
+DWORD AdditiveChecksum(const char* data, DWORD size) {
+	DWORD checksum = 0;
+	for (DWORD i = 0; i < size; i++) {
+		checksum += (unsigned char)data[i];
+	}
+	return checksum;
+}
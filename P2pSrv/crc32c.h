@@ -0,0 +1,32 @@
+#pragma once
+
+#include <windows.h>
+
+/**
+* @brief CRC32C (Castagnoli) checksum
+*
+* Uses the SSE4.2 CRC32 instruction with three interleaved streams merged by
+* PCLMULQDQ when the CPU has both, and slicing-by-8 tables otherwise. The
+* choice is made once at startup.
+*
+* @param crc Previous result when checksumming a buffer in pieces, 0 to start
+*/
+DWORD Crc32c(const void* data, size_t size, DWORD crc = 0);
+
+/**
+* @brief CRC32C of a piece A followed by a piece B, from the CRCs of both
+*
+* Lets a checksum over consecutive pieces be put together from checksums
+* kept for each piece, without reading the data again.
+*/
+DWORD Crc32cCombine(DWORD crcA, DWORD crcB, size_t lengthB);
+
+/**
+* @brief True when Crc32c runs on the SSE4.2/PCLMUL path
+*/
+bool Crc32cHardwareAccelerated();
+
+/**
+* @brief Byte sum used by peers that do not speak CRC32C
+*/
+DWORD AdditiveChecksum(const char* data, DWORD size);
@@ -0,0 +1,152 @@
+#include "dirwalker.h"
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+struct WalkQueue {
+	std::mutex lock;
+	std::deque<std::string> dirs;
+};
+
+static bool IsWalkedEntry(DWORD attributes) {
+	return (attributes & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_REPARSE_POINT)) == 0;
+}
+
+// List one directory: subdirectories go to subdirs, files to files
+static void ListDirectory(const std::string& root, const std::string& dir, std::vector<std::string>& subdirs, std::vector<WalkEntry>& files) {
+	std::string pattern = JoinSharePath(root, dir);
+	if (!pattern.empty() && pattern.back() != '\\') {
+		pattern += '\\';
+	}
+	pattern += '*';
+
+	WIN32_FIND_DATAA findData;
+	HANDLE hFind = FindFirstFileExA(pattern.c_str(), FindExInfoBasic, &findData, FindExSearchNameMatch,
+		NULL, FIND_FIRST_EX_LARGE_FETCH);
+	if (hFind == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	do {
+		if (strcmp(findData.cFileName, ".") == 0 || strcmp(findData.cFileName, "..") == 0 ||
+			!IsWalkedEntry(findData.dwFileAttributes)) {
+			continue;
+		}
+		std::string path = dir.empty() ? findData.cFileName : dir + '\\' + findData.cFileName;
+		if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			subdirs.push_back(path);
+		}
+		else {
+			WalkEntry entry;
+			entry.relativePath = path;
+			entry.attributes = findData.dwFileAttributes;
+			entry.size = ((ULONG64)findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+			entry.creationTime = findData.ftCreationTime;
+			entry.lastWriteTime = findData.ftLastWriteTime;
+			files.push_back(entry);
+		}
+	} while (FindNextFileA(hFind, &findData));
+	FindClose(hFind);
+}
+
+// Constructor
+DirectoryWalker::DirectoryWalker(DWORD threadCount)
+	: m_threadCount(threadCount), m_directories(0) {
+	if (m_threadCount == 0) {
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		m_threadCount = info.dwNumberOfProcessors * DIR_WALK_THREADS_PER_CORE;
+	}
+	m_threadCount = (std::max)((DWORD)1, (std::min)(m_threadCount, (DWORD)MAX_DIR_WALK_THREADS));
+}
+
+ULONGLONG DirectoryWalker::Walk(const std::string& root, const std::string& startDir, const BatchCallback& onFiles) {
+	std::vector<WalkQueue> queues(m_threadCount);
+	std::atomic<ULONGLONG> filesFound(0);
+	std::atomic<ULONGLONG> dirsListed(0);
+	// Directories queued or being listed; the walk is over when it drops to 0
+	std::atomic<LONG> outstanding(1);
+	queues[0].dirs.push_back(startDir);
+
+	std::vector<std::thread> threads;
+	for (DWORD t = 0; t < m_threadCount; t++) {
+		threads.push_back(std::thread([&, t]() {
+			std::vector<std::string> subdirs;
+			std::vector<WalkEntry> files;
+			DWORD idleRounds = 0;
+
+			while (true) {
+				std::string dir;
+				bool found = false;
+				{
+					std::lock_guard<std::mutex> lock(queues[t].lock);
+					if (!queues[t].dirs.empty()) {
+						dir.swap(queues[t].dirs.back());
+						queues[t].dirs.pop_back();
+						found = true;
+					}
+				}
+				for (DWORD i = 1; !found && i < m_threadCount; i++) {
+					WalkQueue& victim = queues[(t + i) % m_threadCount];
+					std::lock_guard<std::mutex> lock(victim.lock);
+					if (!victim.dirs.empty()) {
+						dir.swap(victim.dirs.front());
+						victim.dirs.pop_front();
+						found = true;
+					}
+				}
+
+				if (!found) {
+					if (outstanding == 0) {
+						break;
+					}
+					// Someone is still listing and may queue more, back off a little
+					if (++idleRounds < 64) {
+						std::this_thread::yield();
+					}
+					else {
+						Sleep(1);
+					}
+					continue;
+				}
+				idleRounds = 0;
+
+				subdirs.clear();
+				files.clear();
+				ListDirectory(root, dir, subdirs, files);
+				if (!subdirs.empty()) {
+					outstanding += (LONG)subdirs.size();
+					std::lock_guard<std::mutex> lock(queues[t].lock);
+					for (size_t i = 0; i < subdirs.size(); i++) {
+						queues[t].dirs.push_back(std::string());
+						queues[t].dirs.back().swap(subdirs[i]);
+					}
+				}
+				if (!files.empty()) {
+					filesFound += files.size();
+					onFiles(files);
+				}
+				dirsListed++;
+				outstanding--;
+			}
+		}));
+	}
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i].join();
+	}
+
+	m_directories = dirsListed;
+	return filesFound;
+}
+
+std::string JoinSharePath(const std::string& root, const std::string& relativePath) {
+	if (relativePath.empty()) {
+		return root;
+	}
+	if (!root.empty() && root.back() != '\\') {
+		return root + '\\' + relativePath;
+	}
+	return root + relativePath;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+#include <functional>
+
+// Walker threads when none are asked for: listing is mostly waiting on
+// metadata reads, so more threads than cores still pay off
+#define DIR_WALK_THREADS_PER_CORE 2
+#define MAX_DIR_WALK_THREADS 32
+
+struct WalkEntry {
+	std::string relativePath;	// from the share root, '\' separated
+	DWORD attributes;
+	ULONG64 size;
+	FILETIME creationTime;
+	FILETIME lastWriteTime;
+};
+
+/**
+* @brief Lists a directory tree on several threads at once
+*
+* Every thread keeps its own queue of directories still to list. It takes
+* work from the back of its own queue, depth first, and when that runs dry
+* steals from the front of another thread's queue. The stolen directories
+* are the oldest, high up in the tree, with the most work under them.
+* Each directory's files go to the callback as soon as the directory is
+* listed, from whichever thread listed it, so hashing can start while the
+* walk is still going. Hidden and system entries and reparse points are
+* skipped, so junction loops can't trap the walk.
+*/
+class DirectoryWalker {
+public:
+	typedef std::function<void(const std::vector<WalkEntry>& files)> BatchCallback;
+
+	explicit DirectoryWalker(DWORD threadCount = 0);
+
+	// Walk root from startDir ("" for the whole tree), returns the files found
+	ULONGLONG Walk(const std::string& root, const std::string& startDir, const BatchCallback& onFiles);
+	DWORD GetThreadCount() const { return m_threadCount; }
+	ULONGLONG GetDirectoryCount() const { return m_directories; }
+
+private:
+	DWORD m_threadCount;
+	ULONGLONG m_directories;	// listed by the last Walk
+};
+
+// Full path of a share-relative name
+std::string JoinSharePath(const std::string& root, const std::string& relativePath);
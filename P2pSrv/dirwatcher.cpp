@@ -0,0 +1,139 @@
+#include "dirwatcher.h"
+#include "eventlog.h"
+
+/**
+* @brief DirectoryWatcher over ReadDirectoryChangesW
+*
+* One overlapped read is kept outstanding on the folder handle, so changes
+* made while the caller is busy applying the last batch are buffered by the
+* system instead of lost.
+*/
+class Win32DirectoryWatcher : public DirectoryWatcher {
+private:
+	HANDLE m_hDir;
+	HANDLE m_hStopEvent;
+	OVERLAPPED m_ov;
+	bool m_pending;
+	bool m_recursive;
+	DWORD m_buffer[DIR_WATCH_BUFFER_SIZE / sizeof(DWORD)];	// records are DWORD-aligned
+
+	bool IssueRead();
+
+public:
+	Win32DirectoryWatcher(HANDLE hDir, bool recursive);
+	virtual ~Win32DirectoryWatcher();
+
+	virtual bool Wait(std::vector<DirectoryChange>& changes);
+	virtual void Stop();
+};
+
+// Constructor
+Win32DirectoryWatcher::Win32DirectoryWatcher(HANDLE hDir, bool recursive)
+	: m_hDir(hDir), m_pending(false), m_recursive(recursive) {
+	ZeroMemory(&m_ov, sizeof(m_ov));
+	m_ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	m_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+// Destructor
+Win32DirectoryWatcher::~Win32DirectoryWatcher() {
+	if (m_pending) {
+		DWORD bytes;
+		CancelIoEx(m_hDir, &m_ov);
+		GetOverlappedResult(m_hDir, &m_ov, &bytes, TRUE);
+	}
+	CloseHandle(m_hDir);
+	if (m_ov.hEvent != NULL) {
+		CloseHandle(m_ov.hEvent);
+	}
+	if (m_hStopEvent != NULL) {
+		CloseHandle(m_hStopEvent);
+	}
+}
+
+bool Win32DirectoryWatcher::IssueRead() {
+	ResetEvent(m_ov.hEvent);
+	if (!ReadDirectoryChangesW(m_hDir, m_buffer, sizeof(m_buffer), m_recursive ? TRUE : FALSE,
+		FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE |
+		FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_ATTRIBUTES,
+		NULL, &m_ov, NULL)) {
+		WriteLogMessage("ReadDirectoryChangesW failed");
+		return false;
+	}
+	m_pending = true;
+	return true;
+}
+
+bool Win32DirectoryWatcher::Wait(std::vector<DirectoryChange>& changes) {
+	changes.clear();
+	if (m_ov.hEvent == NULL || m_hStopEvent == NULL || (!m_pending && !IssueRead())) {
+		return false;
+	}
+
+	HANDLE handles[2] = { m_hStopEvent, m_ov.hEvent };
+	if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+		return false;
+	}
+	DWORD bytes = 0;
+	BOOL ok = GetOverlappedResult(m_hDir, &m_ov, &bytes, FALSE);
+	m_pending = false;
+	if (!ok && GetLastError() != ERROR_NOTIFY_ENUM_DIR) {
+		return false;
+	}
+
+	// Read again straight away so nothing is missed while the caller works
+	IssueRead();
+
+	// An empty result means the buffer overflowed
+	if (!ok || bytes == 0) {
+		DirectoryChange change;
+		change.type = DirectoryChange::CHANGE_OVERFLOW;
+		changes.push_back(change);
+		return true;
+	}
+
+	const BYTE* record = (const BYTE*)m_buffer;
+	while (true) {
+		const FILE_NOTIFY_INFORMATION* info = (const FILE_NOTIFY_INFORMATION*)record;
+		DirectoryChange change;
+		switch (info->Action) {
+		case FILE_ACTION_ADDED: change.type = DirectoryChange::CHANGE_ADDED; break;
+		case FILE_ACTION_REMOVED: change.type = DirectoryChange::CHANGE_REMOVED; break;
+		case FILE_ACTION_RENAMED_OLD_NAME: change.type = DirectoryChange::CHANGE_RENAMED_FROM; break;
+		case FILE_ACTION_RENAMED_NEW_NAME: change.type = DirectoryChange::CHANGE_RENAMED_TO; break;
+		default: change.type = DirectoryChange::CHANGE_MODIFIED; break;
+		}
+
+		// Names come as UTF-16, the rest of the service uses ANSI paths
+		int wideLength = (int)(info->FileNameLength / sizeof(WCHAR));
+		int length = WideCharToMultiByte(CP_ACP, 0, info->FileName, wideLength, NULL, 0, NULL, NULL);
+		if (length > 0) {
+			change.name.resize(length);
+			WideCharToMultiByte(CP_ACP, 0, info->FileName, wideLength, &change.name[0], length, NULL, NULL);
+			changes.push_back(change);
+		}
+
+		if (info->NextEntryOffset == 0) {
+			break;
+		}
+		record += info->NextEntryOffset;
+	}
+	return true;
+}
+
+void Win32DirectoryWatcher::Stop() {
+	if (m_hStopEvent != NULL) {
+		SetEvent(m_hStopEvent);
+	}
+}
+
+DirectoryWatcher* DirectoryWatcher::Create(const std::string& folder, bool recursive) {
+	HANDLE hDir = CreateFileA(folder.c_str(), FILE_LIST_DIRECTORY,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+	if (hDir == INVALID_HANDLE_VALUE) {
+		WriteLogMessage("Cannot open shared folder for change notifications");
+		return NULL;
+	}
+	return new Win32DirectoryWatcher(hDir, recursive);
+}
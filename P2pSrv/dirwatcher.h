@@ -0,0 +1,41 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+// Size of the buffer the system fills with change records. Changes that
+// don't fit between two reads are reported as one CHANGE_OVERFLOW.
+#define DIR_WATCH_BUFFER_SIZE (64 * 1024)
+
+struct DirectoryChange {
+	enum Type {
+		CHANGE_ADDED,
+		CHANGE_REMOVED,
+		CHANGE_MODIFIED,
+		CHANGE_RENAMED_FROM,	// always followed by the matching CHANGE_RENAMED_TO
+		CHANGE_RENAMED_TO,
+		CHANGE_OVERFLOW		// changes were lost, rescan the folder
+	};
+	Type type;
+	std::string name;	// relative to the watched folder
+};
+
+/**
+* @brief Reports file changes under a folder as they happen
+*
+* Wait blocks until the system has changes to report and returns them in
+* the order they happened. Stop may be called from any thread and makes a
+* blocked Wait return false. Create picks the implementation for the
+* platform the service is built for.
+*/
+class DirectoryWatcher {
+public:
+	virtual ~DirectoryWatcher() {}
+
+	virtual bool Wait(std::vector<DirectoryChange>& changes) = 0;
+	virtual void Stop() = 0;
+
+	// NULL if folder cannot be watched
+	static DirectoryWatcher* Create(const std::string& folder, bool recursive);
+};
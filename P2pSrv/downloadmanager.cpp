@@ -0,0 +1,351 @@
+#include "downloadmanager.h"
+#include "swarm.h"
+#include "chunkfile.h"
+#include "eventlog.h"
+
+#include <string.h>
+#include <algorithm>
+
+// Constructor
+DownloadManager::DownloadManager()
+	: m_started(false), m_stopping(false), m_maxActive(0), m_active(0), m_nextId(1), m_localChunks(NULL) {
+}
+
+// Destructor
+DownloadManager::~DownloadManager() {
+	Stop();
+}
+
+void DownloadManager::Start(DWORD maxActive) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_started) {
+		return;
+	}
+	if (!m_engine.Start()) {
+		WriteLogMessage("Download manager: cannot start the transfer engine");
+		return;
+	}
+	m_started = true;
+	m_stopping = false;
+	m_maxActive = (std::max)((DWORD)1, (std::min)(maxActive, (DWORD)DOWNLOAD_MAX_ACTIVE));
+	char msg[96];
+	sprintf_s(msg, "Download manager: up to %lu downloads at once", m_maxActive);
+	WriteLogMessage(msg);
+	StartQueued();
+}
+
+void DownloadManager::Stop() {
+	std::unique_lock<std::mutex> lock(m_lock);
+	m_stopping = true;
+	for (std::map<DWORD, Job>::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it) {
+		// Paused rather than cancelled, the partial output is kept for next time
+		if (it->second.swarm != NULL) {
+			it->second.state = DOWNLOAD_PAUSED;
+			it->second.swarm->Cancel();
+		}
+	}
+	m_idle.wait(lock, [this] { return m_active == 0; });
+	m_started = false;
+	lock.unlock();
+
+	// Runs the deletes the finished swarms posted
+	m_engine.Stop();
+	lock.lock();
+	m_jobs.clear();
+}
+
+DWORD DownloadManager::Submit(const DownloadRequest& request, bool& merged) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	Job* job = FindActive(request);
+	if (job != NULL) {
+		merged = true;
+		job->requests++;
+		// Extra peers and a hash the job lacked are used from its next run on
+		for (size_t i = 0; i < request.peerIPs.size(); i++) {
+			if (std::find(job->request.peerIPs.begin(), job->request.peerIPs.end(), request.peerIPs[i]) == job->request.peerIPs.end()) {
+				job->request.peerIPs.push_back(request.peerIPs[i]);
+			}
+		}
+		if (job->request.sha256Hex.empty() && !request.sha256Hex.empty()) {
+			job->request.sha256Hex = request.sha256Hex;
+			job->request.merkleRootHex = request.merkleRootHex;
+		}
+		job->request.priority = (std::max)(job->request.priority, request.priority);
+		// Asking again for a paused download carries it on
+		if (job->state == DOWNLOAD_PAUSED) {
+			job->state = DOWNLOAD_QUEUED;
+			StartQueued();
+		}
+		return job->id;
+	}
+
+	merged = false;
+	DWORD id = m_nextId++;
+	Job& added = m_jobs[id];
+	added.id = id;
+	added.state = DOWNLOAD_QUEUED;
+	added.request = request;
+	added.requests = 1;
+	added.running = false;
+	added.started = false;
+	added.swarm = NULL;
+	added.bytesDone = 0;
+	added.bytesTotal = 0;
+	added.sampleBytes = 0;
+	added.sampleTime = 0;
+	added.rate = 0;
+	Prune();
+	StartQueued();
+	return id;
+}
+
+bool DownloadManager::GetStatus(DWORD id, DownloadStatus& status) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	std::map<DWORD, Job>::iterator it = m_jobs.find(id);
+	if (it == m_jobs.end()) {
+		return false;
+	}
+	Measure(it->second, status);
+	return true;
+}
+
+void DownloadManager::GetAll(std::vector<DownloadStatus>& jobs) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	jobs.resize(m_jobs.size());
+	size_t i = 0;
+	for (std::map<DWORD, Job>::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it) {
+		Measure(it->second, jobs[i++]);
+	}
+}
+
+bool DownloadManager::Cancel(DWORD id) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	std::map<DWORD, Job>::iterator it = m_jobs.find(id);
+	if (it == m_jobs.end()) {
+		return false;
+	}
+	Job& job = it->second;
+	if (job.state != DOWNLOAD_QUEUED && job.state != DOWNLOAD_RUNNING && job.state != DOWNLOAD_PAUSED) {
+		return false;
+	}
+	job.state = DOWNLOAD_CANCELLED;
+	if (job.swarm != NULL) {
+		// OnFinished deletes the output once the swarm has let go of it
+		job.swarm->Cancel();
+	}
+	else {
+		DeleteOutput(job);
+	}
+	return true;
+}
+
+bool DownloadManager::Pause(DWORD id) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	std::map<DWORD, Job>::iterator it = m_jobs.find(id);
+	if (it == m_jobs.end()) {
+		return false;
+	}
+	Job& job = it->second;
+	if (job.state != DOWNLOAD_QUEUED && job.state != DOWNLOAD_RUNNING) {
+		return false;
+	}
+	job.state = DOWNLOAD_PAUSED;
+	if (job.swarm != NULL) {
+		job.swarm->Cancel();
+	}
+	return true;
+}
+
+bool DownloadManager::Resume(DWORD id) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	std::map<DWORD, Job>::iterator it = m_jobs.find(id);
+	if (it == m_jobs.end() || it->second.state != DOWNLOAD_PAUSED) {
+		return false;
+	}
+	// A job still winding down from its pause starts again once its swarm has finished
+	it->second.state = DOWNLOAD_QUEUED;
+	StartQueued();
+	return true;
+}
+
+const char* DownloadManager::GetStateName(DownloadState state) {
+	switch (state) {
+	case DOWNLOAD_QUEUED:    return "queued";
+	case DOWNLOAD_RUNNING:   return "running";
+	case DOWNLOAD_PAUSED:    return "paused";
+	case DOWNLOAD_COMPLETED: return "completed";
+	case DOWNLOAD_FAILED:    return "failed";
+	case DOWNLOAD_CANCELLED: return "cancelled";
+	default:                 return "unknown";
+	}
+}
+
+// Job that is still going for the same content or output; m_lock must be held
+DownloadManager::Job* DownloadManager::FindActive(const DownloadRequest& request) {
+	for (std::map<DWORD, Job>::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it) {
+		Job& job = it->second;
+		if (job.state != DOWNLOAD_QUEUED && job.state != DOWNLOAD_RUNNING && job.state != DOWNLOAD_PAUSED) {
+			continue;
+		}
+		// The output is named after the file, so one name means one transfer
+		if ((!request.sha256Hex.empty() && _stricmp(job.request.sha256Hex.c_str(), request.sha256Hex.c_str()) == 0) ||
+			_stricmp(job.request.outputPath.c_str(), request.outputPath.c_str()) == 0) {
+			return &job;
+		}
+	}
+	return NULL;
+}
+
+// Queued job to run next: highest priority, oldest first; m_lock must be held
+DownloadManager::Job* DownloadManager::NextJob() {
+	Job* next = NULL;
+	for (std::map<DWORD, Job>::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it) {
+		Job& job = it->second;
+		if (job.state == DOWNLOAD_QUEUED && !job.running && (next == NULL || job.request.priority > next->request.priority)) {
+			next = &job;
+		}
+	}
+	return next;
+}
+
+// Fill in status, taking a new rate sample from a running swarm; m_lock must be held
+void DownloadManager::Measure(Job& job, DownloadStatus& status) {
+	status.id = job.id;
+	status.state = job.state;
+	status.request = job.request;
+	status.requests = job.requests;
+	status.rate = 0;
+	status.etaSeconds = (job.state == DOWNLOAD_COMPLETED) ? 0 : -1;
+
+	if (job.swarm != NULL) {
+		SwarmProgress progress;
+		job.swarm->GetProgress(progress);
+		if (progress.bytesTotal != 0) {
+			job.bytesDone = progress.bytesDone;
+			job.bytesTotal = progress.bytesTotal;
+		}
+		ULONGLONG now = GetTickCount64();
+		if (now - job.sampleTime >= DOWNLOAD_RATE_INTERVAL_MS) {
+			double rate = (double)(progress.bytesReceived - job.sampleBytes) * 1000 / (double)(now - job.sampleTime);
+			job.rate = (job.rate == 0) ? rate : (job.rate + rate) / 2;
+			job.sampleBytes = progress.bytesReceived;
+			job.sampleTime = now;
+		}
+		if (job.state == DOWNLOAD_RUNNING) {
+			status.rate = job.rate;
+			if (job.rate > 0 && job.bytesTotal != 0) {
+				status.etaSeconds = (LONG64)((double)(job.bytesTotal - job.bytesDone) / job.rate + 0.5);
+			}
+		}
+	}
+	status.bytesDone = job.bytesDone;
+	status.bytesTotal = job.bytesTotal;
+}
+
+// Drop the oldest finished jobs beyond DOWNLOAD_HISTORY; m_lock must be held
+void DownloadManager::Prune() {
+	size_t finished = 0;
+	for (std::map<DWORD, Job>::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it) {
+		if (it->second.state >= DOWNLOAD_COMPLETED && !it->second.running) {
+			finished++;
+		}
+	}
+	std::map<DWORD, Job>::iterator it = m_jobs.begin();
+	while (finished > DOWNLOAD_HISTORY && it != m_jobs.end()) {
+		if (it->second.state >= DOWNLOAD_COMPLETED && !it->second.running) {
+			it = m_jobs.erase(it);
+			finished--;
+		}
+		else {
+			++it;
+		}
+	}
+}
+
+// Remove a cancelled job's partial output and its chunk map. A job that never
+// ran leaves alone whatever was already at its output path.
+void DownloadManager::DeleteOutput(const Job& job) {
+	if (!job.started) {
+		return;
+	}
+	DeleteFileA(job.request.outputPath.c_str());
+	DeleteFileA((job.request.outputPath + CHUNK_MAP_EXTENSION).c_str());
+}
+
+// Start queued jobs while fewer than m_maxActive run; m_lock must be held
+void DownloadManager::StartQueued() {
+	while (m_started && !m_stopping && m_active < m_maxActive) {
+		Job* job = NextJob();
+		if (job == NULL) {
+			break;
+		}
+
+		const DownloadRequest& request = job->request;
+		SwarmDownloader* swarm = new SwarmDownloader(request.peerIPs, request.filename, request.outputPath);
+		if (!request.sha256Hex.empty()) {
+			swarm->SetContentHash(request.sha256Hex);
+		}
+		if (!request.merkleRootHex.empty()) {
+			swarm->SetMerkleRoot(request.merkleRootHex);
+		}
+		swarm->SetLocalChunks(m_localChunks);
+		job->state = DOWNLOAD_RUNNING;
+		job->running = true;
+		job->swarm = swarm;
+		job->sampleBytes = 0;
+		job->sampleTime = GetTickCount64();
+		job->rate = 0;
+
+		char msg[512];
+		sprintf_s(msg, "Download %lu: %s from %u peer(s)", job->id, request.filename.c_str(), (unsigned)request.peerIPs.size());
+		WriteLogMessage(msg);
+
+		DWORD id = job->id;
+		if (!swarm->Start(&m_engine, [this, id](bool result) { OnFinished(id, result); })) {
+			job->swarm = NULL;
+			job->running = false;
+			job->state = DOWNLOAD_FAILED;
+			delete swarm;
+			continue;
+		}
+		job->started = true;
+		m_active++;
+	}
+}
+
+// A job's swarm has finished; runs on the engine thread
+void DownloadManager::OnFinished(DWORD id, bool result) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	Job& job = m_jobs[id];
+	SwarmDownloader* swarm = job.swarm;
+	SwarmProgress progress;
+	swarm->GetProgress(progress);
+	if (progress.bytesTotal != 0) {
+		job.bytesDone = progress.bytesDone;
+		job.bytesTotal = progress.bytesTotal;
+	}
+	job.swarm = NULL;
+	job.running = false;
+	job.rate = 0;
+
+	// A pause or cancel that came in as the last chunk landed is too late
+	if (result) {
+		job.state = DOWNLOAD_COMPLETED;
+	}
+	else if (job.state == DOWNLOAD_RUNNING) {
+		job.state = DOWNLOAD_FAILED;
+	}
+	else if (job.state == DOWNLOAD_CANCELLED) {
+		DeleteOutput(job);
+	}
+	char msg[64];
+	sprintf_s(msg, "Download %lu: %s", job.id, GetStateName(job.state));
+	WriteLogMessage(msg);
+
+	// This call is the swarm's last, but it is still on the stack
+	m_engine.Post([swarm] { delete swarm; });
+	m_active--;
+	Prune();
+	StartQueued();
+	m_idle.notify_all();
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <winsock2.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+
+#include "asyncclient.h"
+
+class SwarmDownloader;
+class ShareIndex;
+
+// Downloads running at once unless the MaxDownloads registry value says otherwise
+#define DOWNLOAD_DEFAULT_ACTIVE 3
+#define DOWNLOAD_MAX_ACTIVE 16
+// Finished jobs kept for GET /api/downloads, the oldest is dropped first
+#define DOWNLOAD_HISTORY 64
+// Shortest interval a job's transfer rate is measured over
+#define DOWNLOAD_RATE_INTERVAL_MS 1000
+
+enum DownloadState {
+	DOWNLOAD_QUEUED,
+	DOWNLOAD_RUNNING,
+	DOWNLOAD_PAUSED,
+	DOWNLOAD_COMPLETED,
+	DOWNLOAD_FAILED,
+	DOWNLOAD_CANCELLED
+};
+
+// What a POST /api/download asks for
+struct DownloadRequest {
+	std::string filename;
+	std::string sha256Hex;		// empty to download by name
+	std::string merkleRootHex;	// empty to take the first peer's
+	std::vector<std::string> peerIPs;
+	std::string outputPath;
+	int priority;				// higher runs first
+};
+
+// A job as the API reports it
+struct DownloadStatus {
+	DWORD id;
+	DownloadState state;
+	DownloadRequest request;
+	DWORD requests;			// POSTs merged into this job
+	ULONG64 bytesDone;
+	ULONG64 bytesTotal;		// 0 until a peer has answered
+	double rate;			// bytes per second, 0 when not running
+	LONG64 etaSeconds;		// -1 while unknown
+};
+
+/**
+* @brief Runs swarm downloads in the background for the HTTP API
+*
+* Submit queues a job and returns its ID straight away. Up to maxActive
+* queued jobs run at once, picked by priority, first come first served
+* within one, each with a SwarmDownloader. The swarms all run their peers
+* on the manager's AsyncTransferEngine, so every transfer shares its one
+* thread; a job that ends starts the next from the engine thread. A request for content or a
+* file that a queued, running or paused job already has is merged into
+* that job instead of starting a second transfer to the same output.
+*
+* Pause cancels the swarm but keeps its chunk map, so Resume queues the
+* job again and it carries on where it stopped. Cancel also deletes the
+* partial output. The rate is measured whenever a job's status is read,
+* over at least DOWNLOAD_RATE_INTERVAL_MS, and smoothed between reads.
+*/
+class DownloadManager {
+public:
+	DownloadManager();
+	~DownloadManager();
+	DownloadManager(const DownloadManager&) = delete;
+	DownloadManager& operator=(const DownloadManager&) = delete;
+
+	// Shared files jobs may copy chunks from, see SwarmDownloader; call before Start
+	void SetLocalChunks(ShareIndex* index) { m_localChunks = index; }
+	void Start(DWORD maxActive);
+	// Pause what is running and stop the engine; the jobs are forgotten
+	void Stop();
+	// ID of the job that will serve request; merged if it joined one already there
+	DWORD Submit(const DownloadRequest& request, bool& merged);
+	bool GetStatus(DWORD id, DownloadStatus& status);
+	void GetAll(std::vector<DownloadStatus>& jobs);
+	// False if the job is not there or is in a state the call does not apply to
+	bool Cancel(DWORD id);
+	bool Pause(DWORD id);
+	bool Resume(DWORD id);
+
+	static const char* GetStateName(DownloadState state);
+
+private:
+	struct Job {
+		DWORD id;
+		DownloadState state;
+		DownloadRequest request;
+		DWORD requests;
+		bool running;			// its swarm has not finished, whatever state was asked for since
+		bool started;			// has run at least once, so the output at outputPath is its own
+		SwarmDownloader* swarm;	// while running
+		ULONG64 bytesDone;		// as of the last run
+		ULONG64 bytesTotal;
+		ULONG64 sampleBytes;	// received by the run when the rate was last measured
+		ULONGLONG sampleTime;
+		double rate;
+	};
+
+	AsyncTransferEngine m_engine;
+	std::mutex m_lock;
+	std::condition_variable m_idle;	// signalled whenever a swarm finishes
+	bool m_started;
+	bool m_stopping;
+	DWORD m_maxActive;
+	DWORD m_active;		// swarms running
+	std::map<DWORD, Job> m_jobs;	// by ID, so also in submission order
+	DWORD m_nextId;
+	ShareIndex* m_localChunks;
+
+	Job* FindActive(const DownloadRequest& request);
+	Job* NextJob();
+	void Measure(Job& job, DownloadStatus& status);
+	void Prune();
+	void DeleteOutput(const Job& job);
+	void StartQueued();
+	void OnFinished(DWORD id, bool result);
+};
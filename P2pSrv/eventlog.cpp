@@ -0,0 +1,60 @@
+#include "eventlog.h"
+
+#include <windows.h>
+#include <strsafe.h>
+#include <mutex>
+
+// Callers on different threads would otherwise fail to open the file while
+// another one has it open, and race to build the path
+static std::mutex s_logLock;
+
+void WriteLogMessage(const char* pszMessage)
+{
+	std::lock_guard<std::mutex> lock(s_logLock);
+
+	static char logFilePath[MAX_PATH] = { 0 };
+
+	// Build the log file path once
+	if (logFilePath[0] == 0)
+	{
+		char tempPath[MAX_PATH];
+		if (GetTempPathA(MAX_PATH, tempPath))
+		{
+			StringCchPrintfA(logFilePath, MAX_PATH, "%s%s", tempPath, "MyServiceApp.log");
+		}
+		else
+		{
+			return; // Failed to get temp path
+		}
+	}
+
+
+	// Open the log file in append mode
+	HANDLE hFile = CreateFileA(
+		logFilePath,
+		FILE_APPEND_DATA,
+		FILE_SHARE_READ,
+		NULL,
+		OPEN_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL
+		);
+
+	if (hFile != INVALID_HANDLE_VALUE)
+	{
+		DWORD written;
+		SYSTEMTIME st;
+		GetLocalTime(&st);
+
+		char buffer[1024];
+		StringCchPrintfA(buffer, 1024, "[%04d-%02d-%02d %02d:%02d:%02d] %s\r\n",
+			st.wYear, st.wMonth, st.wDay,
+			st.wHour, st.wMinute, st.wSecond,
+			pszMessage);
+
+		WriteFile(hFile, buffer, lstrlenA(buffer), &written, NULL);
+		CloseHandle(hFile);
+	}
+
+
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+/**
+* @brief Append a timestamped line to %TEMP%\MyServiceApp.log
+*
+* Shared by the service, the TCP client and the download helpers so they all
+* log to the same file.
+*/
+void WriteLogMessage(const char* pszMessage);
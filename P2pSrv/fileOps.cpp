@@ -1,111 +1,35 @@
 #include "fileOps.h"
+#include "filehasher.h"
 
 #include <sstream>
 #include <iomanip>
 
-#pragma comment(lib, "bcrypt.lib")
-
 void localFileHandler::calcHash()
 {
-	HANDLE hFile = INVALID_HANDLE_VALUE;
-	HANDLE hMapping = NULL;
-	LPVOID pFileData = NULL;
-	BCRYPT_ALG_HANDLE hAlg = NULL;
-	BCRYPT_HASH_HANDLE hHash = NULL;
-	NTSTATUS status;
-	DWORD hashObjectSize = 0, cbData = 0;
-	std::vector<BYTE> hashObject;
-	std::vector<BYTE> hash(32); // SHA-256 = 32 bytes
-
-	// Open the file
-	hFile = CreateFileA(
-		fileName.c_str(),
-		GENERIC_READ,
-		FILE_SHARE_READ,
-		NULL,
-		OPEN_EXISTING,
-		FILE_ATTRIBUTE_NORMAL,
-		NULL);
-
-	if (hFile == INVALID_HANDLE_VALUE) {
-		std::cerr << "Failed to open file.\n";
-		return;
-	}
-
-	// Create a file mapping
-	hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
-	if (!hMapping) {
-		std::cerr << "Failed to create file mapping.\n";
-		CloseHandle(hFile);
-		return;
-	}
-
-	// Map the file into memory
-	pFileData = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
-	if (!pFileData) {
-		std::cerr << "Failed to map view of file.\n";
-		CloseHandle(hMapping);
-		CloseHandle(hFile);
-		return;
-	}
-
-	// Open SHA-256 algorithm provider
-	status = BCryptOpenAlgorithmProvider(&hAlg, BCRYPT_SHA256_ALGORITHM, NULL, 0);
-	if (!BCRYPT_SUCCESS(status)) {
-		std::cerr << "Failed to open algorithm provider.\n";
-		goto Cleanup;
-	}
-
-	// Get hash object size
-	status = BCryptGetProperty(hAlg, BCRYPT_OBJECT_LENGTH, (PUCHAR)&hashObjectSize, sizeof(DWORD), &cbData, 0);
-	if (!BCRYPT_SUCCESS(status)) {
-		std::cerr << "Failed to get hash object size.\n";
-		goto Cleanup;
-	}
-
-	hashObject.resize(hashObjectSize);
-
-	// Create hash object
-	status = BCryptCreateHash(hAlg, &hHash, hashObject.data(), hashObjectSize, NULL, 0, 0);
-	if (!BCRYPT_SUCCESS(status)) {
-		std::cerr << "Failed to create hash object.\n";
-		goto Cleanup;
-	}
-
-	// Get file size
-	LARGE_INTEGER fileSize;
-	if (!GetFileSizeEx(hFile, &fileSize)) {
-		std::cerr << "Failed to get file size.\n";
-		goto Cleanup;
-	}
-
-	// Hash the file data
-	status = BCryptHashData(hHash, static_cast<PUCHAR>(pFileData), static_cast<ULONG>(fileSize.QuadPart), 0);
-	if (!BCRYPT_SUCCESS(status)) {
-		std::cerr << "Failed to hash file data.\n";
-		goto Cleanup;
-	}
-
-	// Finalize the hash
-	status = BCryptFinishHash(hHash, hash.data(), static_cast<ULONG>(hash.size()), 0);
-	if (!BCRYPT_SUCCESS(status)) {
-		std::cerr << "Failed to finish hash.\n";
-		goto Cleanup;
-	}
+	FileHasher hasher;
+	calcHash(hasher);
+}
 
-	// Convert hash to hex string
-	char hexBuffer[65] = {};
-	for (size_t i = 0; i < hash.size(); ++i) {
-		sprintf_s(hexBuffer + i * 2, 3, "%02x", hash[i]);
+// Hash the file with a hasher owned by the calling thread, returns the bytes
+// read; contentChunks also cuts it into content-defined chunks
+ULONGLONG localFileHandler::calcHash(FileHasher& hasher, bool contentChunks)
+{
+	std::string hash;
+	std::vector<MerkleHash> leaves;
+	std::shared_ptr<ChunkList> chunkList;
+	if (contentChunks)
+		chunkList = std::make_shared<ChunkList>();
+	ULONGLONG bytesRead = 0;
+	if (!hasher.HashFile(fileName, hash, leaves, bytesRead, chunkList.get())) {
+		std::cerr << "Failed to hash file.\n";
+		return bytesRead;
 	}
-	sha256Hash = std::string(hexBuffer);
-
-Cleanup:
-	if (pFileData) UnmapViewOfFile(pFileData);
-	if (hMapping) CloseHandle(hMapping);
-	if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
-	if (hHash) BCryptDestroyHash(hHash);
-	if (hAlg) BCryptCloseAlgorithmProvider(hAlg, 0);
+	std::shared_ptr<MerkleTree> tree = std::make_shared<MerkleTree>();
+	tree->Build(leaves);
+	sha256Hash = hash;
+	merkleTree = tree;
+	chunks = chunkList;
+	return bytesRead;
 }
 
 std::string FileTimeToString(const FILETIME& ft) {
@@ -134,16 +58,24 @@ std::string FileTimeToString(const FILETIME& ft) {
 	return oss.str();
 }
 
-std::string localFileHandler::getCreationDate()
+std::string localFileHandler::getCreationDate() const
 {
 	return FileTimeToString(ftCreationTime);
 }
-std::string localFileHandler::getLastWriteDate()
+std::string localFileHandler::getLastWriteDate() const
 {
 	return FileTimeToString(ftLastWriteTime);
 }
 
-std::string localFileHandler::getshortName()
+std::string localFileHandler::getMerkleRoot() const
+{
+	if (!merkleTree || merkleTree->IsEmpty()) {
+		return "";
+	}
+	return DigestToHex(merkleTree->GetRoot().bytes, SHA256_DIGEST_SIZE);
+}
+
+std::string localFileHandler::getshortName() const
 {
 	size_t pos = fileName.find_last_of("\\/");
 	if (pos != std::string::npos) {
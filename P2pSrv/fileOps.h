@@ -1,23 +1,33 @@
 #ifndef __FILE_OPS__
 #define __FILE_OPS__
 #include <windows.h>  //for file API's
-#include <bcrypt.h>  //for sha-256 encryption
 #include <fileapi.h> //for file attribute struct
 #include <string>
 #include <cstdint>
 #include <iostream>
 #include <vector>
+#include <memory>
+#include "merkle.h"
+#include "cdc.h"
 using namespace std;
 
+class FileHasher;
+
+// Local time as YYYY-MM-DD HH:MM:SS
+std::string FileTimeToString(const FILETIME& ft);
+
 class localFileHandler
 {
 private:
 
 	std::string fileName;	// Full file name (with path)
+	std::string relativeName;	// path under the share root
 	std::string sha256Hash;	// SHA-256 hash as file fingerprint
 	FILETIME ftCreationTime;
 	FILETIME ftLastWriteTime;
 	ULONG64 fileSize;
+	std::shared_ptr<const MerkleTree> merkleTree;	// over MERKLE_LEAF_SIZE pieces, shared with the hash cache
+	std::shared_ptr<const ChunkList> chunks;	// content-defined chunks, if they were asked for
 	
 
 public:
@@ -28,34 +38,52 @@ public:
 		
 	}
 
-	// Parameterized constructor
-	localFileHandler(const std::string& name)
+	// Parameterized constructor; the file is not read until calcHash, pass
+	// hashNow = true to hash it on the spot
+	localFileHandler(const std::string& name, bool hashNow = false)
 		: fileName(name)
 	{
-		calcHash();
+		if (hashNow)
+			calcHash();
 	}
 
 	// Destructor
 	~localFileHandler() = default;
 
 	// Getters
-	std::string getFileName()  { return fileName; }
-	std::string getshortName();
-	std::string getHash()  { return sha256Hash; }
-	std::string getCreationDate();
-	std::string getLastWriteDate();
-	std::string getFileSize() { return std::to_string(fileSize); }
+	std::string getFileName() const { return fileName; }
+	std::string getshortName() const;
+	std::string getRelativeName() const { return relativeName; }
+	std::string getHash() const { return sha256Hash; }
+	std::string getCreationDate() const;
+	std::string getLastWriteDate() const;
+	std::string getFileSize() const { return std::to_string(fileSize); }
+	ULONG64 getSize() const { return fileSize; }
+	FILETIME getCreationTime() const { return ftCreationTime; }
+	FILETIME getWriteTime() const { return ftLastWriteTime; }
+	std::shared_ptr<const MerkleTree> getMerkleTree() const { return merkleTree; }
+	std::string getMerkleRoot() const;
+	std::shared_ptr<const ChunkList> getChunks() const { return chunks; }
 	void calcHash();
+	ULONGLONG calcHash(FileHasher& hasher, bool contentChunks = false);
 
 	// Setters
+	void setRelativeName(const std::string& name) { relativeName = name; }
 	void setCreationDate(FILETIME t){ ftCreationTime = t; }
 	void setWriteTime(FILETIME t){ ftLastWriteTime = t; }
+	void setHash(const std::string& hash, const std::shared_ptr<const MerkleTree>& tree,
+		const std::shared_ptr<const ChunkList>& chunkList = std::shared_ptr<const ChunkList>()) {
+		sha256Hash = hash;
+		merkleTree = tree;
+		chunks = chunkList;
+	}
 	void setfileSize(DWORD lo, DWORD hi);
 
 	/*void setFileName(const std::string& name) { fileName = name; }
 	void setFileIndex(uint64_t index) { fileIndex = index; }
 	void setFileInfo(const WIN32_FILE_ATTRIBUTE_DATA& info) { fileInfo = info; }
 	void calcHash();
+	ULONGLONG calcHash(FileHasher& hasher);
 	// Utility: Reset file index
 	void resetIndex() { fileIndex = 0; }*/
 };
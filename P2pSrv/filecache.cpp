@@ -0,0 +1,153 @@
+#include "filecache.h"
+
+#include <algorithm>
+
+SharedFile::~SharedFile() {
+	if (mapping != NULL) {
+		CloseHandle(mapping);
+	}
+	if (file != INVALID_HANDLE_VALUE) {
+		CloseHandle(file);
+	}
+}
+
+// Constructor
+OpenFileCache::OpenFileCache(size_t capacity)
+	: m_capacity((std::max)(capacity, (size_t)1)), m_hits(0), m_misses(0) {
+}
+
+// The file at path, from the cache when its handle is still current
+std::shared_ptr<const SharedFile> OpenFileCache::Open(const std::string& path, bool reopen) {
+	ULONGLONG now = GetTickCount64();
+	std::shared_ptr<const SharedFile> file;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		// Close what has not been asked for in a while, oldest at the back
+		while (!m_entries.empty() && now - m_entries.back().used >= FILE_CACHE_IDLE_MS) {
+			Remove(--m_entries.end());
+		}
+
+		std::map<std::string, EntryList::iterator>::iterator found = m_byPath.find(path);
+		if (found != m_byPath.end()) {
+			EntryList::iterator it = found->second;
+			if (reopen) {
+				Remove(it);
+			}
+			else if (now - it->validated < FILE_CACHE_REVALIDATE_MS) {
+				it->used = now;
+				m_entries.splice(m_entries.begin(), m_entries, it);
+				m_hits++;
+				return it->file;
+			}
+			else {
+				file = it->file;
+			}
+		}
+		if (!file) {
+			m_misses++;
+		}
+	}
+
+	// Checked and opened outside the lock, a slow volume must not hold up the other peers
+	if (file) {
+		bool current = IsCurrent(*file);
+		std::lock_guard<std::mutex> lock(m_lock);
+		// Another thread may have replaced or dropped the entry meanwhile
+		std::map<std::string, EntryList::iterator>::iterator found = m_byPath.find(path);
+		bool same = found != m_byPath.end() && found->second->file == file;
+		if (current) {
+			if (same) {
+				EntryList::iterator it = found->second;
+				it->validated = now;
+				it->used = now;
+				m_entries.splice(m_entries.begin(), m_entries, it);
+			}
+			m_hits++;
+			return file;
+		}
+		if (same) {
+			Remove(found->second);
+		}
+		m_misses++;
+	}
+	file = OpenFile(path);
+	if (!file) {
+		return file;
+	}
+
+	std::lock_guard<std::mutex> lock(m_lock);
+	std::map<std::string, EntryList::iterator>::iterator found = m_byPath.find(path);
+	if (found != m_byPath.end()) {
+		Remove(found->second);
+	}
+	Entry entry;
+	entry.file = file;
+	entry.validated = now;
+	entry.used = now;
+	m_entries.push_front(entry);
+	m_byPath[path] = m_entries.begin();
+	while (m_entries.size() > m_capacity) {
+		Remove(--m_entries.end());
+	}
+	return file;
+}
+
+// Close every cached handle; files still being sent stay open until then
+void OpenFileCache::Clear() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_entries.clear();
+	m_byPath.clear();
+}
+
+void OpenFileCache::GetStats(FileCacheStats& stats) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	stats.hits = m_hits;
+	stats.misses = m_misses;
+	stats.open = m_entries.size();
+}
+
+// Whether the path still names the file the handle has open, unchanged
+bool OpenFileCache::IsCurrent(const SharedFile& file) {
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExA(file.path.c_str(), GetFileExInfoStandard, &data)) {
+		return false;
+	}
+	ULONG64 size = ((ULONG64)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+	ULONG64 lastWrite = ((ULONG64)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+	return size == file.identity.size && lastWrite == file.identity.lastWriteTime;
+}
+
+void OpenFileCache::Remove(EntryList::iterator it) {
+	m_byPath.erase(it->file->path);
+	m_entries.erase(it);
+}
+
+// Open path for reading and map it; writers and deleters are not locked out
+std::shared_ptr<const SharedFile> OpenFileCache::OpenFile(const std::string& path) {
+	std::shared_ptr<SharedFile> file(new SharedFile());
+	file->path = path;
+	file->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file->file == INVALID_HANDLE_VALUE) {
+		return std::shared_ptr<const SharedFile>();
+	}
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle(file->file, &info)) {
+		return std::shared_ptr<const SharedFile>();
+	}
+	file->identity.volume = info.dwVolumeSerialNumber;
+	file->identity.fileIndex = ((ULONG64)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+	file->identity.lastWriteTime = ((ULONG64)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+	file->identity.size = ((ULONG64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+
+	// An empty file can't be mapped, and has nothing to checksum
+	if (file->identity.size > 0) {
+		file->mapping = CreateFileMappingA(file->file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (file->mapping == NULL) {
+			return std::shared_ptr<const SharedFile>();
+		}
+	}
+	return file;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+// Open files kept by the cache
+#define FILE_CACHE_CAPACITY 128
+// A cached handle is checked against the path when it was last checked longer ago than this
+#define FILE_CACHE_REVALIDATE_MS 2000
+// Handles unused for this long are closed, so the share stays writable
+#define FILE_CACHE_IDLE_MS 30000
+
+// Which file, and which version of it; equal identities have equal contents
+struct FileIdentity {
+	DWORD volume;
+	ULONG64 fileIndex;
+	ULONG64 lastWriteTime;	// FILETIME as one integer
+	ULONG64 size;
+
+	bool operator==(const FileIdentity& other) const {
+		return volume == other.volume && fileIndex == other.fileIndex &&
+			lastWriteTime == other.lastWriteTime && size == other.size;
+	}
+};
+
+/**
+* @brief A file opened for serving, shared by every connection that sends it
+*
+* The handle and the read-only mapping are never used with the file
+* pointer, so any number of threads can read and transmit through them.
+*/
+struct SharedFile {
+	std::string path;
+	HANDLE file;
+	HANDLE mapping;		// NULL for an empty file
+	FileIdentity identity;
+
+	SharedFile() : file(INVALID_HANDLE_VALUE), mapping(NULL) {}
+	~SharedFile();
+	SharedFile(const SharedFile&) = delete;
+	SharedFile& operator=(const SharedFile&) = delete;
+};
+
+struct FileCacheStats {
+	ULONG64 hits;
+	ULONG64 misses;
+	size_t open;
+};
+
+/**
+* @brief Most recently served files, kept open
+*
+* Opening a file means resolving its path, checking access and creating a
+* section for the mapping, which costs more than sending a chunk from the
+* cache. Peers pulling the same files share one handle per file. A handle
+* is checked against its path every FILE_CACHE_REVALIDATE_MS and reopened
+* when the file was replaced or written to, and closed once nobody asked
+* for it for FILE_CACHE_IDLE_MS, so the share does not stay locked against
+* truncation. Connections keep the files they are sending alive after
+* the cache dropped them.
+*/
+class OpenFileCache {
+public:
+	explicit OpenFileCache(size_t capacity = FILE_CACHE_CAPACITY);
+	OpenFileCache(const OpenFileCache&) = delete;
+	OpenFileCache& operator=(const OpenFileCache&) = delete;
+
+	// NULL if the file can't be opened; reopen skips the cached handle
+	std::shared_ptr<const SharedFile> Open(const std::string& path, bool reopen = false);
+	void Clear();
+	void GetStats(FileCacheStats& stats);
+
+private:
+	struct Entry {
+		std::shared_ptr<const SharedFile> file;
+		ULONGLONG validated;
+		ULONGLONG used;
+	};
+	typedef std::list<Entry> EntryList;
+
+	size_t m_capacity;
+	std::mutex m_lock;
+	EntryList m_entries;	// most recently used first
+	std::map<std::string, EntryList::iterator> m_byPath;
+	ULONG64 m_hits;
+	ULONG64 m_misses;
+
+	static bool IsCurrent(const SharedFile& file);
+	void Remove(EntryList::iterator it);
+	static std::shared_ptr<const SharedFile> OpenFile(const std::string& path);
+};
@@ -0,0 +1,229 @@
+#include "filecatalog.h"
+
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+
+#define INDEX_EMPTY 0xFFFFFFFF
+
+// Constructor
+FileCatalog::FileCatalog(const std::string& root)
+	: m_root(root), m_pendingCount(0), m_version(0), m_deltaBase(0) {
+	if (!m_root.empty() && m_root.back() != '\\') {
+		m_root += '\\';
+	}
+	m_directories.push_back(Intern("", 0));
+	m_directoryIds[""] = 0;
+}
+
+void FileCatalog::Reserve(size_t count) {
+	m_entries.reserve(count);
+	m_trees.reserve(count);
+	m_arena.reserve(m_arena.size() + count * 24);
+}
+
+// Copy a string into the arena, returns its offset
+DWORD FileCatalog::Intern(const char* str, size_t length) {
+	DWORD offset = (DWORD)m_arena.size();
+	m_arena.insert(m_arena.end(), str, str + length);
+	m_arena.push_back('\0');
+	return offset;
+}
+
+// Add a file; relativePath is '\' separated under the root. A file not
+// hashed yet has an empty sha256Hex and no tree.
+bool FileCatalog::Add(const std::string& relativePath, ULONG64 size, const FILETIME& creationTime, const FILETIME& lastWriteTime,
+	const std::string& sha256Hex, const std::shared_ptr<const MerkleTree>& tree) {
+	CatalogEntry entry;
+	if (sha256Hex.empty() || !tree) {
+		memset(entry.sha256, 0, sizeof(entry.sha256));
+		m_pendingCount++;
+	}
+	else if (!HexToDigest(sha256Hex, entry.sha256, sizeof(entry.sha256))) {
+		return false;
+	}
+
+	size_t split = relativePath.find_last_of('\\');
+	std::string directory = (split == std::string::npos) ? "" : relativePath.substr(0, split);
+	const char* name = relativePath.c_str() + (split == std::string::npos ? 0 : split + 1);
+
+	std::map<std::string, DWORD>::iterator it = m_directoryIds.find(directory);
+	if (it == m_directoryIds.end()) {
+		it = m_directoryIds.insert(std::make_pair(directory, (DWORD)m_directories.size())).first;
+		m_directories.push_back(Intern(directory.c_str(), directory.size()));
+	}
+
+	entry.size = size;
+	entry.creationTime = ((ULONG64)creationTime.dwHighDateTime << 32) | creationTime.dwLowDateTime;
+	entry.lastWriteTime = ((ULONG64)lastWriteTime.dwHighDateTime << 32) | lastWriteTime.dwLowDateTime;
+	entry.directory = it->second;
+	entry.nameOffset = Intern(name, strlen(name));
+	entry.version = 0;
+	m_entries.push_back(entry);
+	m_trees.push_back(tree);
+	return true;
+}
+
+// Case-insensitive FNV-1a
+size_t FileCatalog::NameHash(const char* name) {
+	size_t hash = 2166136261u;
+	for (; *name != '\0'; name++) {
+		hash = (hash ^ (BYTE)tolower((BYTE)*name)) * 16777619u;
+	}
+	return hash;
+}
+
+// Build the lookup tables, at most half full so probes stay short
+void FileCatalog::BuildIndexes() {
+	m_directoryIds.clear();
+	size_t slots = 16;
+	while (slots < m_entries.size() * 2) {
+		slots *= 2;
+	}
+	size_t mask = slots - 1;
+	m_hashIndex.assign(slots, INDEX_EMPTY);
+	m_nameIndex.assign(slots, INDEX_EMPTY);
+
+	for (size_t i = 0; i < m_entries.size(); i++) {
+		// The digest is already uniformly distributed, its first bytes will do
+		size_t slot;
+		if (!IsHashPending(i)) {
+			memcpy(&slot, m_entries[i].sha256, sizeof(slot));
+			for (slot &= mask; m_hashIndex[slot] != INDEX_EMPTY; slot = (slot + 1) & mask) {
+			}
+			m_hashIndex[slot] = (DWORD)i;
+		}
+
+		for (slot = NameHash(GetShortName(i)) & mask; m_nameIndex[slot] != INDEX_EMPTY; slot = (slot + 1) & mask) {
+		}
+		m_nameIndex[slot] = (DWORD)i;
+	}
+}
+
+// Number the catalog and find what changed since previous, the catalog
+// published just before this one from the same index
+void FileCatalog::SetVersion(ULONG64 version, const FileCatalog& previous) {
+	m_version = version;
+	if (previous.m_version == 0 || previous.m_root != m_root) {
+		// Nothing to compare with, a client has to start from the full list
+		m_deltaBase = version;
+		for (size_t i = 0; i < m_entries.size(); i++) {
+			m_entries[i].version = version;
+		}
+		return;
+	}
+	m_deltaBase = previous.m_deltaBase;
+	m_removed = previous.m_removed;
+
+	// Both were added in path order, so walk them side by side
+	size_t count = m_entries.size();
+	size_t previousCount = previous.m_entries.size();
+	size_t i = 0;
+	size_t j = 0;
+	std::string path = (i < count) ? GetRelativePath(i) : "";
+	std::string previousPath = (j < previousCount) ? previous.GetRelativePath(j) : "";
+	while (i < count || j < previousCount) {
+		int order = (i == count) ? 1 : (j == previousCount) ? -1 : path.compare(previousPath);
+		if (order > 0) {
+			RemovedFile removed;
+			removed.version = version;
+			removed.relativePath = previousPath;
+			m_removed.push_back(removed);
+		}
+		else {
+			CatalogEntry& entry = m_entries[i];
+			entry.version = version;
+			if (order == 0) {
+				const CatalogEntry& old = previous.m_entries[j];
+				if (old.size == entry.size && old.lastWriteTime == entry.lastWriteTime &&
+					previous.IsHashPending(j) == IsHashPending(i) &&
+					memcmp(old.sha256, entry.sha256, SHA256_DIGEST_SIZE) == 0) {
+					entry.version = old.version;
+				}
+			}
+			if (++i < count) {
+				path = GetRelativePath(i);
+			}
+		}
+		if (order >= 0 && ++j < previousCount) {
+			previousPath = previous.GetRelativePath(j);
+		}
+	}
+
+	// Forget the oldest removals; a delta from before them would be incomplete
+	if (m_removed.size() > CATALOG_MAX_REMOVED) {
+		size_t drop = m_removed.size() - CATALOG_MAX_REMOVED;
+		m_deltaBase = (std::max)(m_deltaBase, m_removed[drop - 1].version);
+		m_removed.erase(m_removed.begin(), m_removed.begin() + drop);
+	}
+}
+
+std::string FileCatalog::GetRelativePath(size_t index) const {
+	const CatalogEntry& entry = m_entries[index];
+	if (entry.directory == 0) {
+		return GetShortName(index);
+	}
+	return std::string(&m_arena[m_directories[entry.directory]]) + '\\' + GetShortName(index);
+}
+
+std::string FileCatalog::GetFullPath(size_t index) const {
+	return m_root + GetRelativePath(index);
+}
+
+FILETIME FileCatalog::ToFileTime(ULONG64 time) {
+	FILETIME ft;
+	ft.dwLowDateTime = (DWORD)time;
+	ft.dwHighDateTime = (DWORD)(time >> 32);
+	return ft;
+}
+
+std::string FileCatalog::GetHashHex(size_t index) const {
+	return DigestToHex(m_entries[index].sha256, SHA256_DIGEST_SIZE);
+}
+
+// Bytes held by the catalog, not counting the Merkle trees it shares
+size_t FileCatalog::GetMemoryUsage() const {
+	return sizeof(*this) + m_arena.capacity() + m_directories.capacity() * sizeof(DWORD) +
+		m_entries.capacity() * sizeof(CatalogEntry) + m_trees.capacity() * sizeof(m_trees[0]) +
+		(m_hashIndex.capacity() + m_nameIndex.capacity()) * sizeof(DWORD) +
+		m_removed.capacity() * sizeof(RemovedFile);
+}
+
+// Index of a file with this content, CATALOG_NOT_FOUND if none
+size_t FileCatalog::FindByHash(const BYTE digest[SHA256_DIGEST_SIZE]) const {
+	if (m_hashIndex.empty()) {
+		return CATALOG_NOT_FOUND;
+	}
+	size_t mask = m_hashIndex.size() - 1;
+	size_t slot;
+	memcpy(&slot, digest, sizeof(slot));
+	for (slot &= mask; m_hashIndex[slot] != INDEX_EMPTY; slot = (slot + 1) & mask) {
+		if (memcmp(m_entries[m_hashIndex[slot]].sha256, digest, SHA256_DIGEST_SIZE) == 0) {
+			return m_hashIndex[slot];
+		}
+	}
+	return CATALOG_NOT_FOUND;
+}
+
+size_t FileCatalog::FindByHash(const std::string& sha256Hex) const {
+	BYTE digest[SHA256_DIGEST_SIZE];
+	if (!HexToDigest(sha256Hex, digest, sizeof(digest))) {
+		return CATALOG_NOT_FOUND;
+	}
+	return FindByHash(digest);
+}
+
+// Index of a file with this short name, CATALOG_NOT_FOUND if none. With
+// the same name in several directories any one of them is returned.
+size_t FileCatalog::FindByName(const std::string& shortName) const {
+	if (m_nameIndex.empty()) {
+		return CATALOG_NOT_FOUND;
+	}
+	size_t mask = m_nameIndex.size() - 1;
+	for (size_t slot = NameHash(shortName.c_str()) & mask; m_nameIndex[slot] != INDEX_EMPTY; slot = (slot + 1) & mask) {
+		if (_stricmp(GetShortName(m_nameIndex[slot]), shortName.c_str()) == 0) {
+			return m_nameIndex[slot];
+		}
+	}
+	return CATALOG_NOT_FOUND;
+}
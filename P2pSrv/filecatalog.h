@@ -0,0 +1,101 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+
+#include "sha256.h"
+#include "merkle.h"
+
+#define CATALOG_NOT_FOUND ((size_t)-1)
+// Removed paths remembered for delta listings, older ones need a full list
+#define CATALOG_MAX_REMOVED 16384
+
+struct CatalogEntry {
+	BYTE sha256[SHA256_DIGEST_SIZE];
+	ULONG64 size;
+	ULONG64 creationTime;	// FILETIME as one integer
+	ULONG64 lastWriteTime;
+	DWORD directory;		// index into the interned directories, 0 is the root
+	DWORD nameOffset;		// short name in the arena, NUL terminated
+	ULONG64 version;		// catalog version in which the file last changed
+};
+
+struct RemovedFile {
+	ULONG64 version;		// first catalog version without the file
+	std::string relativePath;
+};
+
+/**
+* @brief Read-only list of shared files, compact and indexed
+*
+* Names live in one character arena: every directory is stored once and
+* entries point at their directory and their own short name, so a deep tree
+* costs little more than its file names. Digests are kept as 32 bytes and
+* times as integers. Two open-addressed tables of entry indexes answer
+* lookups by SHA-256 and by short name (case-insensitive, as on the file
+* system) in constant time, so the transfer server never scans the list.
+* Files still waiting to be hashed are listed too, without a digest or a
+* tree; they are left out of the hash lookup but found by name.
+*
+* Every catalog published by the share index carries a version. SetVersion
+* compares it with the one before, so each entry records the version in
+* which it last changed and the removed paths are carried forward; that is
+* enough to list what changed after any version back to GetDeltaBase.
+*
+* Fill it with Add, then call BuildIndexes and SetVersion once; after that
+* the catalog is never changed and may be read from any number of threads.
+*/
+class FileCatalog {
+public:
+	explicit FileCatalog(const std::string& root);
+	FileCatalog(const FileCatalog&) = delete;
+	FileCatalog& operator=(const FileCatalog&) = delete;
+
+	void Reserve(size_t count);
+	bool Add(const std::string& relativePath, ULONG64 size, const FILETIME& creationTime, const FILETIME& lastWriteTime,
+		const std::string& sha256Hex, const std::shared_ptr<const MerkleTree>& tree);
+	void BuildIndexes();
+	void SetVersion(ULONG64 version, const FileCatalog& previous);
+
+	size_t GetCount() const { return m_entries.size(); }
+	const CatalogEntry& GetEntry(size_t index) const { return m_entries[index]; }
+	const char* GetShortName(size_t index) const { return &m_arena[m_entries[index].nameOffset]; }
+	std::string GetRelativePath(size_t index) const;
+	std::string GetFullPath(size_t index) const;
+	std::string GetHashHex(size_t index) const;
+	FILETIME GetCreationTime(size_t index) const { return ToFileTime(m_entries[index].creationTime); }
+	FILETIME GetWriteTime(size_t index) const { return ToFileTime(m_entries[index].lastWriteTime); }
+	const std::shared_ptr<const MerkleTree>& GetMerkleTree(size_t index) const { return m_trees[index]; }
+	bool IsHashPending(size_t index) const { return !m_trees[index]; }
+	size_t GetPendingCount() const { return m_pendingCount; }
+	size_t GetMemoryUsage() const;
+
+	ULONG64 GetVersion() const { return m_version; }
+	ULONG64 GetDeltaBase() const { return m_deltaBase; }
+	const std::vector<RemovedFile>& GetRemoved() const { return m_removed; }
+
+	size_t FindByHash(const BYTE digest[SHA256_DIGEST_SIZE]) const;
+	size_t FindByHash(const std::string& sha256Hex) const;
+	size_t FindByName(const std::string& shortName) const;
+
+private:
+	std::string m_root;
+	std::vector<char> m_arena;
+	std::vector<DWORD> m_directories;			// arena offsets, [0] is the root ("")
+	std::map<std::string, DWORD> m_directoryIds;	// only while adding
+	std::vector<CatalogEntry> m_entries;
+	std::vector<std::shared_ptr<const MerkleTree> > m_trees;
+	std::vector<DWORD> m_hashIndex;	// entry index or empty, size a power of two
+	std::vector<DWORD> m_nameIndex;
+	size_t m_pendingCount;
+	ULONG64 m_version;
+	ULONG64 m_deltaBase;	// oldest version changes can be listed from
+	std::vector<RemovedFile> m_removed;	// oldest first
+
+	DWORD Intern(const char* str, size_t length);
+	static FILETIME ToFileTime(ULONG64 time);
+	static size_t NameHash(const char* name);
+};
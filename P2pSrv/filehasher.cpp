@@ -0,0 +1,249 @@
+#include "filehasher.h"
+#include "eventlog.h"
+
+#include <winioctl.h>
+#include <algorithm>
+
+// Constructor
+FileHasher::FileHasher()
+	: m_buffers(HASH_WINDOW_DEPTH, HASH_WINDOW_READ_SIZE) {
+	for (int i = 0; i < HASH_WINDOW_DEPTH; i++) {
+		ZeroMemory(&m_slots[i].ov, sizeof(OVERLAPPED));
+		m_slots[i].ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		m_slots[i].buffer = m_buffers.Acquire();
+		m_slots[i].requested = 0;
+		m_slots[i].pending = false;
+	}
+}
+
+// Destructor
+FileHasher::~FileHasher() {
+	for (int i = 0; i < HASH_WINDOW_DEPTH; i++) {
+		if (m_slots[i].ov.hEvent != NULL) {
+			CloseHandle(m_slots[i].ov.hEvent);
+		}
+		if (m_slots[i].buffer != NULL) {
+			m_buffers.Release(m_slots[i].buffer);
+		}
+	}
+}
+
+// Start reading the window block at offset into slot
+bool FileHasher::IssueRead(HANDLE hFile, WindowSlot& slot, ULONGLONG offset, ULONGLONG fileSize) {
+	slot.requested = (DWORD)(std::min)((ULONGLONG)HASH_WINDOW_READ_SIZE, fileSize - offset);
+	slot.ov.Offset = (DWORD)offset;
+	slot.ov.OffsetHigh = (DWORD)(offset >> 32);
+	ResetEvent(slot.ov.hEvent);
+	if (!ReadFile(hFile, slot.buffer, slot.requested, NULL, &slot.ov) && GetLastError() != ERROR_IO_PENDING) {
+		return false;
+	}
+	slot.pending = true;
+	return true;
+}
+
+// Cancel and wait out reads still in flight, so their buffers can be reused
+void FileHasher::DrainReads(HANDLE hFile) {
+	CancelIoEx(hFile, NULL);
+	for (int i = 0; i < HASH_WINDOW_DEPTH; i++) {
+		if (m_slots[i].pending) {
+			DWORD bytes;
+			GetOverlappedResult(hFile, &m_slots[i].ov, &bytes, TRUE);
+			m_slots[i].pending = false;
+		}
+	}
+}
+
+// Hash a file in one sequential pass. leaves gets one MerkleHash per
+// MERKLE_LEAF_SIZE piece, a single empty leaf for an empty file; chunks, if
+// given, gets its content-defined chunks.
+bool FileHasher::HashFile(const std::string& path, std::string& sha256Hex, std::vector<MerkleHash>& leaves, ULONGLONG& bytesRead,
+	ChunkList* chunks) {
+	leaves.clear();
+	bytesRead = 0;
+	if (chunks != NULL) {
+		chunks->clear();
+		m_chunker.Reset();
+	}
+	for (int i = 0; i < HASH_WINDOW_DEPTH; i++) {
+		if (m_slots[i].buffer == NULL || m_slots[i].ov.hEvent == NULL) {
+			return false;
+		}
+	}
+
+	HANDLE hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(hFile, &size) || !m_fileHash.Reset()) {
+		CloseHandle(hFile);
+		return false;
+	}
+	ULONGLONG fileSize = (ULONGLONG)size.QuadPart;
+	leaves.reserve((size_t)((fileSize + MERKLE_LEAF_SIZE - 1) / MERKLE_LEAF_SIZE));
+
+	// Fill the window, then hash blocks in file order and reissue each
+	// slot for the next block past the window as soon as it is hashed
+	bool ok = true;
+	ULONGLONG nextOffset = 0;
+	for (int i = 0; i < HASH_WINDOW_DEPTH && nextOffset < fileSize && ok; i++) {
+		ok = IssueRead(hFile, m_slots[i], nextOffset, fileSize);
+		nextOffset += HASH_WINDOW_READ_SIZE;
+	}
+
+	for (int i = 0; ok && bytesRead < fileSize; i = (i + 1) % HASH_WINDOW_DEPTH) {
+		WindowSlot& slot = m_slots[i];
+		DWORD bytes = 0;
+		BOOL done = GetOverlappedResult(hFile, &slot.ov, &bytes, TRUE);
+		slot.pending = false;
+		// A short read means the file shrank under us
+		if (!done || bytes != slot.requested) {
+			ok = false;
+			break;
+		}
+
+		ok = m_fileHash.Update(slot.buffer, bytes);
+		if (chunks != NULL) {
+			m_chunker.Update(slot.buffer, bytes, *chunks);
+		}
+		DWORD leaf = 0;
+		for (; ok && bytes - leaf >= SHA256_LANES * MERKLE_LEAF_SIZE; leaf += SHA256_LANES * MERKLE_LEAF_SIZE) {
+			leaves.resize(leaves.size() + SHA256_LANES);
+			MerkleTree::HashLeaves(m_leafLanes, slot.buffer + leaf, &leaves[leaves.size() - SHA256_LANES]);
+		}
+		for (; ok && leaf < bytes; leaf += MERKLE_LEAF_SIZE) {
+			leaves.push_back(MerkleHash());
+			ok = MerkleTree::HashLeaf(m_leafHash, slot.buffer + leaf, (std::min)(bytes - leaf, (DWORD)MERKLE_LEAF_SIZE), leaves.back());
+		}
+		bytesRead += bytes;
+
+		if (ok && nextOffset < fileSize) {
+			ok = IssueRead(hFile, slot, nextOffset, fileSize);
+			nextOffset += HASH_WINDOW_READ_SIZE;
+		}
+	}
+
+	if (!ok) {
+		DrainReads(hFile);
+	}
+	CloseHandle(hFile);
+
+	if (ok && leaves.empty()) {
+		leaves.push_back(MerkleHash());
+		ok = MerkleTree::HashLeaf(m_leafHash, NULL, 0, leaves.back());
+	}
+	if (ok && chunks != NULL) {
+		m_chunker.Finish(*chunks);
+	}
+	return ok && m_fileHash.FinalHex(sha256Hex);
+}
+
+// Whether the volume holding path reports a seek penalty (a spinning disk)
+static bool HasSeekPenalty(const std::string& path) {
+	char volume[MAX_PATH];
+	if (!GetVolumePathNameA(path.c_str(), volume, MAX_PATH)) {
+		return false;
+	}
+	// "C:\" -> "\\.\C:"
+	std::string device = std::string("\\\\.\\") + volume;
+	if (!device.empty() && device[device.size() - 1] == '\\') {
+		device.erase(device.size() - 1);
+	}
+
+	HANDLE hVolume = CreateFileA(device.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (hVolume == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	STORAGE_PROPERTY_QUERY query = {};
+	query.PropertyId = StorageDeviceSeekPenaltyProperty;
+	query.QueryType = PropertyStandardQuery;
+	DEVICE_SEEK_PENALTY_DESCRIPTOR penalty = {};
+	DWORD bytes = 0;
+	BOOL ok = DeviceIoControl(hVolume, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&penalty, sizeof(penalty), &bytes, NULL);
+	CloseHandle(hVolume);
+	return ok && bytes >= sizeof(penalty) && penalty.IncursSeekPenalty;
+}
+
+DWORD ChooseHashWorkerCount(const std::string& path) {
+	if (HasSeekPenalty(path)) {
+		return SEEK_PENALTY_HASH_WORKERS;
+	}
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (std::max)((DWORD)1, (std::min)(info.dwNumberOfProcessors, (DWORD)MAX_HASH_WORKERS));
+}
+
+// Constructor
+HashWorkerPool::HashWorkerPool()
+	: m_busy(0), m_stopping(false) {
+}
+
+// Destructor
+HashWorkerPool::~HashWorkerPool() {
+	Stop();
+}
+
+// Start workers threads, at most MAX_HASH_WORKERS
+void HashWorkerPool::Start(DWORD workers) {
+	if (!m_threads.empty()) {
+		return;
+	}
+	m_stopping = false;
+	workers = (std::max)((DWORD)1, (std::min)(workers, (DWORD)MAX_HASH_WORKERS));
+	for (DWORD i = 0; i < workers; i++) {
+		m_threads.push_back(std::thread(&HashWorkerPool::WorkerThread, this));
+	}
+}
+
+void HashWorkerPool::Stop() {
+	if (m_threads.empty()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_stopping = true;
+		m_jobs.clear();
+		m_work.notify_all();
+		m_idle.notify_all();
+	}
+	for (size_t i = 0; i < m_threads.size(); i++) {
+		m_threads[i].join();
+	}
+	m_threads.clear();
+}
+
+void HashWorkerPool::Submit(const Job& job) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_jobs.push_back(job);
+	m_work.notify_one();
+}
+
+void HashWorkerPool::Wait() {
+	std::unique_lock<std::mutex> lock(m_lock);
+	m_idle.wait(lock, [this] { return m_stopping || (m_jobs.empty() && m_busy == 0); });
+}
+
+// Run jobs with this thread's hasher until stopped
+void HashWorkerPool::WorkerThread() {
+	FileHasher hasher;
+	std::unique_lock<std::mutex> lock(m_lock);
+	while (true) {
+		m_work.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+		if (m_stopping) {
+			break;
+		}
+		Job job = m_jobs.front();
+		m_jobs.pop_front();
+		m_busy++;
+		lock.unlock();
+		job(hasher);
+		lock.lock();
+		m_busy--;
+		if (m_jobs.empty() && m_busy == 0) {
+			m_idle.notify_all();
+		}
+	}
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "sha256.h"
+#include "merkle.h"
+#include "bufferpool.h"
+#include "cdc.h"
+
+// Each read of the hashing window, a multiple of MERKLE_LEAF_SIZE
+#define HASH_WINDOW_READ_SIZE (1024 * 1024)
+// Reads kept in flight per file
+#define HASH_WINDOW_DEPTH 4
+// Upper bound on hashing threads, whatever the core count
+#define MAX_HASH_WORKERS 16
+// Hashing threads on a disk that seeks; more would only thrash its head
+#define SEEK_PENALTY_HASH_WORKERS 2
+
+/**
+* @brief Streams files through a small window of overlapped reads and hashes them
+*
+* HASH_WINDOW_DEPTH reads are kept outstanding ahead of the hash, so the disk
+* never waits on the CPU and memory stays at a few buffers however large the
+* file is. One pass gives both the file's SHA-256 and its Merkle leaves;
+* full leaves are hashed SHA256_LANES at a time. Asked for them, the same
+* pass also cuts the file into content-defined chunks.
+* A hasher is not thread-safe; every hashing thread keeps its own.
+*/
+class FileHasher {
+private:
+	struct WindowSlot {
+		OVERLAPPED ov;
+		char* buffer;
+		DWORD requested;
+		bool pending;
+	};
+
+	ChunkBufferPool m_buffers;
+	WindowSlot m_slots[HASH_WINDOW_DEPTH];
+	Sha256 m_fileHash;
+	Sha256 m_leafHash;
+	Sha256Lanes m_leafLanes;
+	ContentChunker m_chunker;
+
+	bool IssueRead(HANDLE hFile, WindowSlot& slot, ULONGLONG offset, ULONGLONG fileSize);
+	void DrainReads(HANDLE hFile);
+
+public:
+	FileHasher();
+	~FileHasher();
+	FileHasher(const FileHasher&) = delete;
+	FileHasher& operator=(const FileHasher&) = delete;
+
+	bool HashFile(const std::string& path, std::string& sha256Hex, std::vector<MerkleHash>& leaves, ULONGLONG& bytesRead,
+		ChunkList* chunks = NULL);
+};
+
+/**
+* @brief Hashing threads, each with its own FileHasher, that run queued jobs
+*
+* A job is handed the hasher of the thread it runs on. ShareIndex hashes its
+* share on one of these, sized by ChooseHashWorkerCount. Stop drops the jobs
+* that have not started and waits for the ones that have.
+*/
+class HashWorkerPool {
+public:
+	typedef std::function<void(FileHasher&)> Job;
+
+	HashWorkerPool();
+	~HashWorkerPool();
+	HashWorkerPool(const HashWorkerPool&) = delete;
+	HashWorkerPool& operator=(const HashWorkerPool&) = delete;
+
+	void Start(DWORD workers);
+	void Stop();
+	DWORD GetWorkerCount() const { return (DWORD)m_threads.size(); }
+	void Submit(const Job& job);
+	// Until every job submitted so far has run
+	void Wait();
+
+private:
+	std::vector<std::thread> m_threads;
+	std::mutex m_lock;
+	std::condition_variable m_work;
+	std::condition_variable m_idle;
+	std::deque<Job> m_jobs;
+	DWORD m_busy;
+	bool m_stopping;
+
+	void WorkerThread();
+};
+
+// Number of threads worth hashing files under path with
+DWORD ChooseHashWorkerCount(const std::string& path);
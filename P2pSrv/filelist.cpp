@@ -0,0 +1,147 @@
+#include "filelist.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+#include "fileOps.h"
+#include "eventlog.h"
+
+// Version a delta from since starts at, 0 when the full list has to be sent
+ULONG64 FileListCache::GetDeltaStart(const FileCatalog& catalog, ULONG64 since) {
+	if (since < catalog.GetDeltaBase() || since > catalog.GetVersion()) {
+		return 0;
+	}
+	return since;
+}
+
+std::string FileListCache::GetETag(const FileCatalog& catalog, ULONG64 since) {
+	char etag[64];
+	ULONG64 start = GetDeltaStart(catalog, since);
+	if (start == 0) {
+		sprintf_s(etag, "\"%llu\"", catalog.GetVersion());
+	}
+	else {
+		sprintf_s(etag, "\"%llu-%llu\"", catalog.GetVersion(), start);
+	}
+	return etag;
+}
+
+// Response body for catalog, the full list or the changes after since
+std::shared_ptr<const std::string> FileListCache::GetBody(const std::shared_ptr<const FileCatalog>& catalog, ULONG64 since) {
+	ULONG64 start = GetDeltaStart(*catalog, since);
+	if (start != 0) {
+		return std::make_shared<std::string>(RenderDelta(*catalog, start));
+	}
+
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_catalog != catalog) {
+		ULONGLONG started = GetTickCount64();
+		std::shared_ptr<std::string> json = std::make_shared<std::string>();
+		json->reserve(catalog->GetCount() * 320 + 64);
+
+		char number[32];
+		sprintf_s(number, "%llu", catalog->GetVersion());
+		*json += "{\"version\":";
+		*json += number;
+		*json += ",\"files\":[";
+		for (size_t i = 0; i < catalog->GetCount(); i++) {
+			if (i != 0)
+				*json += ',';
+			AppendEntry(*json, *catalog, i);
+		}
+		sprintf_s(number, "%u", (unsigned)catalog->GetCount());
+		*json += "],\"count\":";
+		*json += number;
+		sprintf_s(number, "%u", (unsigned)catalog->GetPendingCount());
+		*json += ",\"hash_pending\":";
+		*json += number;
+		*json += '}';
+
+		m_catalog = catalog;
+		m_full = json;
+
+		char msg[128];
+		sprintf_s(msg, "File list rendered: %u files, %u bytes, %llu ms", (unsigned)catalog->GetCount(),
+			(unsigned)json->size(), GetTickCount64() - started);
+		WriteLogMessage(msg);
+	}
+	return m_full;
+}
+
+// Files changed and paths removed after since; small, so built per request
+std::string FileListCache::RenderDelta(const FileCatalog& catalog, ULONG64 since) {
+	char number[32];
+	std::string json = "{\"version\":";
+	sprintf_s(number, "%llu", catalog.GetVersion());
+	json += number;
+	json += ",\"since\":";
+	sprintf_s(number, "%llu", since);
+	json += number;
+
+	json += ",\"files\":[";
+	bool first = true;
+	if (since != catalog.GetVersion()) {
+		for (size_t i = 0; i < catalog.GetCount(); i++) {
+			if (catalog.GetEntry(i).version > since) {
+				if (!first)
+					json += ',';
+				AppendEntry(json, catalog, i);
+				first = false;
+			}
+		}
+	}
+
+	json += "],\"removed\":[";
+	first = true;
+	const std::vector<RemovedFile>& removed = catalog.GetRemoved();
+	for (size_t i = removed.size(); i > 0 && removed[i - 1].version > since; i--) {
+		if (!first)
+			json += ',';
+		AppendPath(json, removed[i - 1].relativePath);
+		first = false;
+	}
+
+	json += "],\"count\":";
+	sprintf_s(number, "%u", (unsigned)catalog.GetCount());
+	json += number;
+	json += ",\"hash_pending\":";
+	sprintf_s(number, "%u", (unsigned)catalog.GetPendingCount());
+	json += number;
+	json += '}';
+	return json;
+}
+
+void FileListCache::AppendEntry(std::string& json, const FileCatalog& catalog, size_t index) {
+	const CatalogEntry& file = catalog.GetEntry(index);
+	const std::shared_ptr<const MerkleTree>& tree = catalog.GetMerkleTree(index);
+	char number[32];
+
+	json += "{\"filename\":\"";
+	json += catalog.GetShortName(index);
+	json += "\",\"path\":";
+	AppendPath(json, catalog.GetRelativePath(index));
+	json += ",\"size\":";
+	sprintf_s(number, "%llu", file.size);
+	json += number;
+	json += ",\"hash_pending\":";
+	json += catalog.IsHashPending(index) ? "true" : "false";
+	json += ",\"sha256\":\"";
+	if (!catalog.IsHashPending(index))
+		json += catalog.GetHashHex(index);
+	json += "\",\"merkle_root\":\"";
+	if (tree)
+		json += DigestToHex(tree->GetRoot().bytes, SHA256_DIGEST_SIZE);
+	json += "\",\"creation\":\"";
+	json += FileTimeToString(catalog.GetCreationTime(index));
+	json += "\",\"modified\":\"";
+	json += FileTimeToString(catalog.GetWriteTime(index));
+	json += "\"}";
+}
+
+// Quoted, with '/' separators as the web interface expects
+void FileListCache::AppendPath(std::string& json, std::string path) {
+	std::replace(path.begin(), path.end(), '\\', '/');
+	json += '"';
+	json += path;
+	json += '"';
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <memory>
+#include <mutex>
+
+#include "filecatalog.h"
+
+/**
+* @brief Serialized /api/files responses, rendered once per catalog version
+*
+* The full list is built the first time it is asked for after the catalog
+* changed and then handed out as a shared buffer, so polling a share that
+* has not changed neither walks the catalog nor formats a time stamp.
+* Responses are named by an ETag made from the catalog version; a client
+* that sends it back in If-None-Match can be answered with a 304.
+*
+* Files still being hashed are listed with "hash_pending" and no digests;
+* they come back in a later delta once their hashes are known. The
+* top-level "hash_pending" counts them.
+*
+* A client that keeps the "version" of its last listing may ask for the
+* changes after it: the files added or changed since then and the paths
+* removed since then. A path can appear in both when it was removed and
+* came back, so removals are applied first. If the catalog no longer
+* remembers that far back the full list is sent instead.
+*/
+class FileListCache {
+public:
+	FileListCache() {}
+	FileListCache(const FileListCache&) = delete;
+	FileListCache& operator=(const FileListCache&) = delete;
+
+	static ULONG64 GetDeltaStart(const FileCatalog& catalog, ULONG64 since);
+	static std::string GetETag(const FileCatalog& catalog, ULONG64 since);
+	std::shared_ptr<const std::string> GetBody(const std::shared_ptr<const FileCatalog>& catalog, ULONG64 since);
+
+private:
+	std::mutex m_lock;
+	std::shared_ptr<const FileCatalog> m_catalog;	// the one m_full was rendered from
+	std::shared_ptr<const std::string> m_full;
+
+	static std::string RenderDelta(const FileCatalog& catalog, ULONG64 since);
+	static void AppendEntry(std::string& json, const FileCatalog& catalog, size_t index);
+	static void AppendPath(std::string& json, std::string path);
+};
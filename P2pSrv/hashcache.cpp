@@ -0,0 +1,237 @@
+#include "hashcache.h"
+#include "sha256.h"
+#include "eventlog.h"
+
+#include <string.h>
+
+// Constructor
+HashCache::HashCache()
+	: m_dirty(false) {
+}
+
+// Read the cache file at path. A missing file is an empty cache; entries for
+// files that no longer exist are dropped.
+bool HashCache::Load(const std::string& path) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_path = path;
+	m_entries.clear();
+	m_dirty = false;
+
+	HANDLE hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return GetLastError() == ERROR_FILE_NOT_FOUND || GetLastError() == ERROR_PATH_NOT_FOUND;
+	}
+
+	LARGE_INTEGER size;
+	std::vector<char> data;
+	bool ok = GetFileSizeEx(hFile, &size) != 0 && size.QuadPart < 0x7FFFFFFF;
+	if (ok) {
+		data.resize((size_t)size.QuadPart);
+		DWORD bytesRead = 0;
+		ok = data.empty() || (ReadFile(hFile, &data[0], (DWORD)data.size(), &bytesRead, NULL) && bytesRead == data.size());
+	}
+	CloseHandle(hFile);
+
+	// Parse with bounds checks, a truncated or foreign file is just a cold cache
+	const char* p = data.data();
+	const char* end = p + data.size();
+	DWORD header[3];
+	if (!ok || end - p < (ptrdiff_t)sizeof(header)) {
+		WriteLogMessage("Hash cache unreadable, starting empty");
+		return false;
+	}
+	memcpy(header, p, sizeof(header));
+	p += sizeof(header);
+	if (header[0] != HASH_CACHE_MAGIC || header[1] < 1 || header[1] > HASH_CACHE_VERSION) {
+		WriteLogMessage("Hash cache has an unknown format, starting empty");
+		return false;
+	}
+
+	DWORD dropped = 0;
+	for (DWORD i = 0; i < header[2]; i++) {
+		DWORD pathLength, leafCount;
+		Entry entry;
+		BYTE digest[SHA256_DIGEST_SIZE];
+		if (end - p < (ptrdiff_t)sizeof(DWORD)) {
+			break;
+		}
+		memcpy(&pathLength, p, sizeof(DWORD));
+		p += sizeof(DWORD);
+		if ((ULONGLONG)(end - p) < (ULONGLONG)pathLength + sizeof(ULONG64) + sizeof(FILETIME) + sizeof(digest) + sizeof(DWORD)) {
+			break;
+		}
+		std::string fileName(p, pathLength);
+		p += pathLength;
+		memcpy(&entry.fileSize, p, sizeof(ULONG64));
+		p += sizeof(ULONG64);
+		memcpy(&entry.lastWrite, p, sizeof(FILETIME));
+		p += sizeof(FILETIME);
+		memcpy(digest, p, sizeof(digest));
+		p += sizeof(digest);
+		memcpy(&leafCount, p, sizeof(DWORD));
+		p += sizeof(DWORD);
+		if ((ULONGLONG)(end - p) < (ULONGLONG)leafCount * sizeof(MerkleHash)) {
+			break;
+		}
+		entry.leaves.resize(leafCount);
+		if (leafCount > 0) {
+			memcpy(&entry.leaves[0], p, leafCount * sizeof(MerkleHash));
+		}
+		p += leafCount * sizeof(MerkleHash);
+
+		// Chunk sizes and digests; offsets follow from the sizes
+		std::shared_ptr<ChunkList> chunks;
+		if (header[1] >= 2) {
+			DWORD chunkCount;
+			if (end - p < (ptrdiff_t)sizeof(DWORD)) {
+				break;
+			}
+			memcpy(&chunkCount, p, sizeof(DWORD));
+			p += sizeof(DWORD);
+			if ((ULONGLONG)(end - p) < (ULONGLONG)chunkCount * (sizeof(DWORD) + SHA256_DIGEST_SIZE)) {
+				break;
+			}
+			if (chunkCount > 0) {
+				chunks = std::make_shared<ChunkList>(chunkCount);
+				ULONG64 offset = 0;
+				for (DWORD c = 0; c < chunkCount; c++) {
+					ContentChunk& chunk = (*chunks)[c];
+					memcpy(&chunk.size, p, sizeof(DWORD));
+					p += sizeof(DWORD);
+					memcpy(chunk.sha256, p, SHA256_DIGEST_SIZE);
+					p += SHA256_DIGEST_SIZE;
+					chunk.offset = offset;
+					offset += chunk.size;
+				}
+			}
+		}
+
+		if (leafCount == 0 || GetFileAttributesA(fileName.c_str()) == INVALID_FILE_ATTRIBUTES) {
+			dropped++;
+			continue;
+		}
+		// Swap the leaves in, VS2013 does not move Entry on assignment
+		Entry& stored = m_entries[fileName];
+		stored.fileSize = entry.fileSize;
+		stored.lastWrite = entry.lastWrite;
+		stored.sha256 = DigestToHex(digest, sizeof(digest));
+		stored.leaves.swap(entry.leaves);
+		stored.chunks = chunks;
+	}
+	m_dirty = dropped > 0;
+
+	char msg[128];
+	sprintf_s(msg, "Hash cache loaded, %u entries, %lu stale dropped", (unsigned)m_entries.size(), dropped);
+	WriteLogMessage(msg);
+	return true;
+}
+
+// Write the cache back if it changed since the last Load or Save
+bool HashCache::Save() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (!m_dirty || m_path.empty()) {
+		return true;
+	}
+
+	std::vector<char> data;
+	DWORD header[3] = { HASH_CACHE_MAGIC, HASH_CACHE_VERSION, (DWORD)m_entries.size() };
+	data.insert(data.end(), (char*)header, (char*)(header + 3));
+	for (std::map<std::string, Entry>::const_iterator it = m_entries.begin(); it != m_entries.end(); ++it) {
+		const Entry& entry = it->second;
+		const std::vector<MerkleHash>& leaves = entry.tree ? entry.tree->GetLeaves() : entry.leaves;
+		DWORD pathLength = (DWORD)it->first.size();
+		DWORD leafCount = (DWORD)leaves.size();
+		BYTE digest[SHA256_DIGEST_SIZE];
+		HexToDigest(entry.sha256, digest, sizeof(digest));
+
+		data.insert(data.end(), (char*)&pathLength, (char*)(&pathLength + 1));
+		data.insert(data.end(), it->first.begin(), it->first.end());
+		data.insert(data.end(), (char*)&entry.fileSize, (char*)(&entry.fileSize + 1));
+		data.insert(data.end(), (char*)&entry.lastWrite, (char*)(&entry.lastWrite + 1));
+		data.insert(data.end(), (char*)digest, (char*)(digest + sizeof(digest)));
+		data.insert(data.end(), (char*)&leafCount, (char*)(&leafCount + 1));
+		if (leafCount > 0) {
+			data.insert(data.end(), (char*)&leaves[0], (char*)(&leaves[0] + leafCount));
+		}
+		DWORD chunkCount = entry.chunks ? (DWORD)entry.chunks->size() : 0;
+		data.insert(data.end(), (char*)&chunkCount, (char*)(&chunkCount + 1));
+		for (DWORD c = 0; c < chunkCount; c++) {
+			const ContentChunk& chunk = (*entry.chunks)[c];
+			data.insert(data.end(), (char*)&chunk.size, (char*)(&chunk.size + 1));
+			data.insert(data.end(), (char*)chunk.sha256, (char*)(chunk.sha256 + SHA256_DIGEST_SIZE));
+		}
+	}
+
+	std::string tempPath = m_path + ".tmp";
+	HANDLE hFile = CreateFileA(tempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		WriteLogMessage("Failed to write hash cache");
+		return false;
+	}
+	DWORD written = 0;
+	bool ok = WriteFile(hFile, data.data(), (DWORD)data.size(), &written, NULL) && written == data.size() &&
+		FlushFileBuffers(hFile);
+	CloseHandle(hFile);
+	if (!ok || !MoveFileExA(tempPath.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		DeleteFileA(tempPath.c_str());
+		WriteLogMessage("Failed to write hash cache");
+		return false;
+	}
+	m_dirty = false;
+	return true;
+}
+
+// Hash, tree and chunks (null if none were stored) of fileName if it has
+// not changed since it was stored
+bool HashCache::Lookup(const std::string& fileName, ULONG64 fileSize, const FILETIME& lastWrite,
+	std::string& sha256, std::shared_ptr<const MerkleTree>& tree, std::shared_ptr<const ChunkList>& chunks) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	std::map<std::string, Entry>::iterator it = m_entries.find(fileName);
+	if (it == m_entries.end()) {
+		return false;
+	}
+	Entry& entry = it->second;
+	if (entry.fileSize != fileSize || CompareFileTime(&entry.lastWrite, &lastWrite) != 0) {
+		return false;
+	}
+	if (!entry.tree) {
+		std::shared_ptr<MerkleTree> built = std::make_shared<MerkleTree>();
+		built->Build(entry.leaves);
+		entry.tree = built;
+	}
+	sha256 = entry.sha256;
+	tree = entry.tree;
+	chunks = entry.chunks;
+	return true;
+}
+
+// Remember the hash of fileName as of this size and write time
+void HashCache::Store(const std::string& fileName, ULONG64 fileSize, const FILETIME& lastWrite,
+	const std::string& sha256, const std::shared_ptr<const MerkleTree>& tree,
+	const std::shared_ptr<const ChunkList>& chunks) {
+	if (!IsSha256Hex(sha256) || !tree || tree->IsEmpty()) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(m_lock);
+	Entry& entry = m_entries[fileName];
+	entry.fileSize = fileSize;
+	entry.lastWrite = lastWrite;
+	entry.sha256 = sha256;
+	entry.leaves.clear();
+	entry.tree = tree;
+	entry.chunks = chunks;
+	m_dirty = true;
+}
+
+void HashCache::Remove(const std::string& fileName) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_entries.erase(fileName) > 0) {
+		m_dirty = true;
+	}
+}
+
+size_t HashCache::GetEntryCount() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_entries.size();
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "merkle.h"
+#include "cdc.h"
+
+#define HASH_CACHE_MAGIC 0x43483250	// "P2HC"
+#define HASH_CACHE_VERSION 2	// 1 had no chunk lists, still read
+
+/**
+* @brief On-disk cache of file hashes keyed by path, size and last write time
+*
+* A file whose size and modification time still match its entry gets the
+* stored SHA-256 and Merkle tree back without being read. Anything else is a
+* miss and must be hashed again. Trees are kept as their leaves on disk and
+* rebuilt the first time an entry is used, then shared with every
+* localFileHandler that asks, so a rescan of an unchanged share reads no
+* file data at all. Content-defined chunk lists are kept too, for files
+* that were hashed with them; on disk only their sizes and digests.
+*
+* The cache is written to a temporary file and moved over the old one, so a
+* crash during Save leaves the previous cache intact.
+*/
+class HashCache {
+private:
+	struct Entry {
+		ULONG64 fileSize;
+		FILETIME lastWrite;
+		std::string sha256;
+		std::vector<MerkleHash> leaves;		// until tree is built
+		std::shared_ptr<const MerkleTree> tree;
+		std::shared_ptr<const ChunkList> chunks;
+	};
+
+	std::mutex m_lock;
+	std::map<std::string, Entry> m_entries;
+	std::string m_path;
+	bool m_dirty;
+
+public:
+	HashCache();
+	HashCache(const HashCache&) = delete;
+	HashCache& operator=(const HashCache&) = delete;
+
+	bool Load(const std::string& path);
+	bool Save();
+
+	bool Lookup(const std::string& fileName, ULONG64 fileSize, const FILETIME& lastWrite,
+		std::string& sha256, std::shared_ptr<const MerkleTree>& tree, std::shared_ptr<const ChunkList>& chunks);
+	void Store(const std::string& fileName, ULONG64 fileSize, const FILETIME& lastWrite,
+		const std::string& sha256, const std::shared_ptr<const MerkleTree>& tree,
+		const std::shared_ptr<const ChunkList>& chunks);
+	void Remove(const std::string& fileName);
+	size_t GetEntryCount();
+};
@@ -0,0 +1,235 @@
+#include "lz4.h"
+
+#include <string.h>
+#include <intrin.h>
+
+// Shortest match the format can express
+#define LZ4_MIN_MATCH 4
+// The last match must start this far before the end of the input...
+#define LZ4_MF_LIMIT 12
+// ...and the last bytes are always literals
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MAX_DISTANCE 65535
+// Misses in a row before the search starts skipping ahead, as 2^n
+#define LZ4_SKIP_TRIGGER 6
+
+static DWORD Read32(const BYTE* p) {
+	DWORD value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static ULONG64 Read64(const BYTE* p) {
+	ULONG64 value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+// Copy in 8-byte steps, writing up to 7 bytes past dst + length
+static void WildCopy(BYTE* dst, const BYTE* src, size_t length) {
+	BYTE* end = dst + length;
+	do {
+		memcpy(dst, src, 8);
+		dst += 8;
+		src += 8;
+	} while (dst < end);
+}
+
+// Bytes p and ref have in common before limit, 8 at a time
+static size_t CommonLength(const BYTE* p, const BYTE* ref, const BYTE* limit) {
+	const BYTE* start = p;
+	while (p + 8 <= limit) {
+		ULONG64 diff = Read64(p) ^ Read64(ref);
+		if (diff != 0) {
+			unsigned long bit;
+			_BitScanForward64(&bit, diff);
+			return (p - start) + bit / 8;
+		}
+		p += 8;
+		ref += 8;
+	}
+	while (p < limit && *p == *ref) {
+		p++;
+		ref++;
+	}
+	return p - start;
+}
+
+static DWORD Hash4(DWORD sequence) {
+	return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+// Write the 255-run that extends a length field past its 4-bit nibble
+static BYTE* WriteLength(BYTE* op, DWORD length) {
+	while (length >= 255) {
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = (BYTE)length;
+	return op;
+}
+
+// Emit literals from anchor up to ip and, if matchLength is not 0, the match
+// after them. NULL when it does not fit before opEnd.
+static BYTE* WriteSequence(BYTE* op, BYTE* opEnd, const BYTE* anchor, const BYTE* ip, DWORD offset, DWORD matchLength) {
+	DWORD literals = (DWORD)(ip - anchor);
+	size_t needed = 1 + literals + ((literals >= 15) ? (literals - 15) / 255 + 1 : 0);
+	if (matchLength != 0) {
+		DWORD length = matchLength - LZ4_MIN_MATCH;
+		needed += 2 + ((length >= 15) ? (length - 15) / 255 + 1 : 0);
+	}
+	if ((size_t)(opEnd - op) < needed) {
+		return NULL;
+	}
+
+	BYTE* token = op++;
+	*token = (BYTE)((literals >= 15) ? 15 << 4 : literals << 4);
+	if (literals >= 15) {
+		op = WriteLength(op, literals - 15);
+	}
+	memcpy(op, anchor, literals);
+	op += literals;
+	if (matchLength == 0) {
+		return op;
+	}
+
+	*op++ = (BYTE)offset;
+	*op++ = (BYTE)(offset >> 8);
+	DWORD length = matchLength - LZ4_MIN_MATCH;
+	*token |= (BYTE)((length >= 15) ? 15 : length);
+	if (length >= 15) {
+		op = WriteLength(op, length - 15);
+	}
+	return op;
+}
+
+DWORD Lz4Compress(const BYTE* src, DWORD srcSize, BYTE* dst, DWORD dstCapacity) {
+	DWORD table[1 << LZ4_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	const BYTE* ip = src;
+	const BYTE* anchor = src;
+	const BYTE* end = src + srcSize;
+	BYTE* op = dst;
+	BYTE* opEnd = dst + dstCapacity;
+
+	if (srcSize > LZ4_MF_LIMIT) {
+		const BYTE* matchLimit = end - LZ4_LAST_LITERALS;
+		const BYTE* mfLimit = end - LZ4_MF_LIMIT;
+		table[Hash4(Read32(ip))] = 0;
+		ip++;
+		DWORD misses = 1 << LZ4_SKIP_TRIGGER;
+
+		while (ip < mfLimit) {
+			DWORD sequence = Read32(ip);
+			DWORD hash = Hash4(sequence);
+			const BYTE* ref = src + table[hash];
+			table[hash] = (DWORD)(ip - src);
+			if (ref >= ip || ip - ref > LZ4_MAX_DISTANCE || Read32(ref) != sequence) {
+				ip += misses++ >> LZ4_SKIP_TRIGGER;
+				continue;
+			}
+			misses = 1 << LZ4_SKIP_TRIGGER;
+
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			const BYTE* matchEnd = ip + LZ4_MIN_MATCH;
+			matchEnd += CommonLength(matchEnd, ref + LZ4_MIN_MATCH, matchLimit);
+
+			op = WriteSequence(op, opEnd, anchor, ip, (DWORD)(ip - ref), (DWORD)(matchEnd - ip));
+			if (op == NULL) {
+				return 0;
+			}
+			ip = matchEnd;
+			anchor = ip;
+			// Index a position inside the match too, repeats tend to line up there
+			if (ip < mfLimit) {
+				table[Hash4(Read32(ip - 2))] = (DWORD)(ip - 2 - src);
+			}
+		}
+	}
+
+	op = WriteSequence(op, opEnd, anchor, end, 0, 0);
+	return (op == NULL) ? 0 : (DWORD)(op - dst);
+}
+
+int Lz4Decompress(const BYTE* src, DWORD srcSize, BYTE* dst, DWORD dstCapacity) {
+	const BYTE* ip = src;
+	const BYTE* ipEnd = src + srcSize;
+	BYTE* op = dst;
+	BYTE* opEnd = dst + dstCapacity;
+
+	while (ip < ipEnd) {
+		BYTE token = *ip++;
+		size_t literals = token >> 4;
+		if (literals == 15) {
+			BYTE b;
+			do {
+				if (ip >= ipEnd) {
+					return -1;
+				}
+				b = *ip++;
+				literals += b;
+			} while (b == 255);
+		}
+		if (literals > (size_t)(ipEnd - ip) || literals > (size_t)(opEnd - op)) {
+			return -1;
+		}
+		// Short runs are copied a word at a time while both buffers have room to spare
+		if (literals <= 16 && ipEnd - ip >= 24 && opEnd - op >= 24) {
+			memcpy(op, ip, 16);
+		}
+		else {
+			memcpy(op, ip, literals);
+		}
+		op += literals;
+		ip += literals;
+		// The last sequence has no match
+		if (ip == ipEnd) {
+			break;
+		}
+
+		if (ipEnd - ip < 2) {
+			return -1;
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - dst)) {
+			return -1;
+		}
+		size_t length = token & 15;
+		if (length == 15) {
+			BYTE b;
+			do {
+				if (ip >= ipEnd) {
+					return -1;
+				}
+				b = *ip++;
+				length += b;
+			} while (b == 255);
+		}
+		length += LZ4_MIN_MATCH;
+		if (length > (size_t)(opEnd - op)) {
+			return -1;
+		}
+
+		const BYTE* match = op - offset;
+		if (offset >= 8 && (size_t)(opEnd - op) >= length + 8) {
+			WildCopy(op, match, length);
+			op += length;
+		}
+		else if (offset >= length) {
+			memcpy(op, match, length);
+			op += length;
+		}
+		else {
+			// Overlapping copy repeats the last offset bytes
+			for (size_t i = 0; i < length; i++) {
+				*op++ = *match++;
+			}
+		}
+	}
+	return (int)(op - dst);
+}
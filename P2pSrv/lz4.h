@@ -0,0 +1,25 @@
+#pragma once
+
+#include <windows.h>
+
+// Match finder table of Lz4Compress, 2^bits entries on the stack
+#define LZ4_HASH_BITS 12
+
+/**
+* @brief Compress into the LZ4 block format
+*
+* Greedy single-pass compressor with the reference implementation's skip
+* acceleration, so data that does not compress is passed over quickly. Any
+* LZ4 block decoder can read the output.
+*
+* @return Compressed size, 0 when it would not fit in dstCapacity; a tight
+* capacity doubles as a cut-off for data that does not compress well enough
+*/
+DWORD Lz4Compress(const BYTE* src, DWORD srcSize, BYTE* dst, DWORD dstCapacity);
+
+/**
+* @brief Decode an LZ4 block, checking every length and offset against both buffers
+*
+* @return Decoded size, or -1 when the block is malformed or does not fit
+*/
+int Lz4Decompress(const BYTE* src, DWORD srcSize, BYTE* dst, DWORD dstCapacity);
@@ -0,0 +1,108 @@
+#include "merkle.h"
+
+#include <string.h>
+
+// Build the tree from its leaves; leaves is left empty
+void MerkleTree::Build(std::vector<MerkleHash>& leaves) {
+	m_levels.clear();
+	if (leaves.empty()) {
+		return;
+	}
+
+	Sha256 hasher;
+	m_levels.push_back(std::vector<MerkleHash>());
+	m_levels.back().swap(leaves);
+	while (m_levels.back().size() > 1) {
+		const std::vector<MerkleHash>& level = m_levels.back();
+		std::vector<MerkleHash> parents((level.size() + 1) / 2);
+		for (size_t i = 0; i < parents.size(); i++) {
+			if (2 * i + 1 < level.size()) {
+				HashNode(hasher, level[2 * i], level[2 * i + 1], parents[i]);
+			}
+			else {
+				parents[i] = level[2 * i];
+			}
+		}
+		m_levels.push_back(std::vector<MerkleHash>());
+		m_levels.back().swap(parents);
+	}
+}
+
+// Siblings of leafIndex from the bottom up, concatenated
+bool MerkleTree::GetProof(DWORD leafIndex, std::vector<BYTE>& proof) const {
+	proof.clear();
+	if (m_levels.empty() || leafIndex >= m_levels[0].size()) {
+		return false;
+	}
+	size_t index = leafIndex;
+	for (size_t level = 0; level + 1 < m_levels.size(); level++) {
+		size_t sibling = index ^ 1;
+		if (sibling < m_levels[level].size()) {
+			const BYTE* bytes = m_levels[level][sibling].bytes;
+			proof.insert(proof.end(), bytes, bytes + SHA256_DIGEST_SIZE);
+		}
+		index /= 2;
+	}
+	return true;
+}
+
+bool MerkleTree::HashLeaf(Sha256& hasher, const void* data, size_t size, MerkleHash& leaf) {
+	static const BYTE prefix = 0x00;
+	return hasher.Reset() && hasher.Update(&prefix, 1) && hasher.Update(data, size) && hasher.Final(leaf.bytes);
+}
+
+// SHA256_LANES full leaves, stored one after another at data
+void MerkleTree::HashLeaves(Sha256Lanes& hasher, const void* data, MerkleHash leaves[SHA256_LANES]) {
+	static const BYTE prefix = 0x00;
+	const void* prefixes[SHA256_LANES];
+	const void* pieces[SHA256_LANES];
+	for (int lane = 0; lane < SHA256_LANES; lane++) {
+		prefixes[lane] = &prefix;
+		pieces[lane] = (const BYTE*)data + lane * MERKLE_LEAF_SIZE;
+	}
+	BYTE digests[SHA256_LANES][SHA256_DIGEST_SIZE];
+	hasher.Reset();
+	hasher.Update(prefixes, 1);
+	hasher.Update(pieces, MERKLE_LEAF_SIZE);
+	hasher.Final(digests);
+	for (int lane = 0; lane < SHA256_LANES; lane++) {
+		memcpy(leaves[lane].bytes, digests[lane], SHA256_DIGEST_SIZE);
+	}
+}
+
+bool MerkleTree::HashNode(Sha256& hasher, const MerkleHash& left, const MerkleHash& right, MerkleHash& node) {
+	static const BYTE prefix = 0x01;
+	return hasher.Reset() && hasher.Update(&prefix, 1) && hasher.Update(left.bytes, SHA256_DIGEST_SIZE) &&
+		hasher.Update(right.bytes, SHA256_DIGEST_SIZE) && hasher.Final(node.bytes);
+}
+
+// Walk from a leaf to the root with the proof and compare
+bool MerkleTree::VerifyLeaf(Sha256& hasher, const MerkleHash& leaf, DWORD leafIndex, DWORD leafCount,
+	const BYTE* proof, size_t proofSize, const MerkleHash& root) {
+	if (leafIndex >= leafCount) {
+		return false;
+	}
+
+	MerkleHash node = leaf;
+	size_t index = leafIndex;
+	size_t count = leafCount;
+	size_t used = 0;
+	while (count > 1) {
+		size_t sibling = index ^ 1;
+		if (sibling < count) {
+			if (used + SHA256_DIGEST_SIZE > proofSize) {
+				return false;
+			}
+			MerkleHash other;
+			memcpy(other.bytes, proof + used, SHA256_DIGEST_SIZE);
+			used += SHA256_DIGEST_SIZE;
+			bool ok = (index & 1) ? HashNode(hasher, other, node, node) : HashNode(hasher, node, other, node);
+			if (!ok) {
+				return false;
+			}
+		}
+		index /= 2;
+		count = (count + 1) / 2;
+	}
+	return used == proofSize && memcmp(node.bytes, root.bytes, SHA256_DIGEST_SIZE) == 0;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <windows.h>
+#include <vector>
+
+#include "tcpdef.h"
+#include "sha256.h"
+
+// Leaves cover this much of the file whatever chunk size a session uses;
+// the last leaf covers what is left (an empty file has one empty leaf)
+#define MERKLE_LEAF_SIZE CHUNK_SIZE
+// Longest proof: one sibling per level of a tree over 2^32 leaves
+#define MERKLE_MAX_PROOF_SIZE (32 * SHA256_DIGEST_SIZE)
+
+struct MerkleHash {
+	BYTE bytes[SHA256_DIGEST_SIZE];
+};
+
+/**
+* @brief Merkle tree over a file's MERKLE_LEAF_SIZE pieces
+*
+* Leaves are SHA-256(0x00 | piece), inner nodes SHA-256(0x01 | left | right);
+* the prefixes keep a leaf from passing for an inner node. A level with an
+* odd count carries its last node up unchanged. A proof is the list of
+* siblings from the leaf up, leaving out levels where the node had none.
+* With the root and the leaf count a single piece can be checked on its own.
+*/
+class MerkleTree {
+private:
+	std::vector<std::vector<MerkleHash> > m_levels;	// [0] leaves ... back() root
+
+public:
+	void Build(std::vector<MerkleHash>& leaves);
+	void Clear() { m_levels.clear(); }
+	bool IsEmpty() const { return m_levels.empty(); }
+	DWORD GetLeafCount() const { return m_levels.empty() ? 0 : (DWORD)m_levels[0].size(); }
+	const MerkleHash& GetRoot() const { return m_levels.back()[0]; }
+	const std::vector<MerkleHash>& GetLeaves() const { return m_levels[0]; }
+	bool GetProof(DWORD leafIndex, std::vector<BYTE>& proof) const;
+
+	static bool HashLeaf(Sha256& hasher, const void* data, size_t size, MerkleHash& leaf);
+	static void HashLeaves(Sha256Lanes& hasher, const void* data, MerkleHash leaves[SHA256_LANES]);
+	static bool HashNode(Sha256& hasher, const MerkleHash& left, const MerkleHash& right, MerkleHash& node);
+	static bool VerifyLeaf(Sha256& hasher, const MerkleHash& leaf, DWORD leafIndex, DWORD leafCount,
+		const BYTE* proof, size_t proofSize, const MerkleHash& root);
+};
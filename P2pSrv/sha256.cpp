@@ -0,0 +1,536 @@
+#include "sha256.h"
+
+#include <string.h>
+#include <intrin.h>
+#include <immintrin.h>
+#include <algorithm>
+
+typedef void (*Sha256Func)(DWORD state[8], const BYTE* data, size_t blocks);
+typedef void (*Sha256LanesFunc)(DWORD state[8][SHA256_LANES], const BYTE* const data[SHA256_LANES], size_t blocks);
+
+static const DWORD s_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const DWORD s_initial[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static Sha256Func s_compress;
+static Sha256LanesFunc s_compressLanes;
+static const char* s_name;
+static const char* s_lanesName;
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static DWORD LoadBigEndian(const BYTE* p) {
+	return ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | p[3];
+}
+
+static void StoreBigEndian(BYTE* p, DWORD value) {
+	p[0] = (BYTE)(value >> 24);
+	p[1] = (BYTE)(value >> 16);
+	p[2] = (BYTE)(value >> 8);
+	p[3] = (BYTE)value;
+}
+
+// Portable kernel, FIPS 180-4 as written
+static void Sha256Portable(DWORD state[8], const BYTE* data, size_t blocks) {
+	DWORD w[64];
+	for (; blocks > 0; blocks--, data += SHA256_BLOCK_SIZE) {
+		for (int t = 0; t < 16; t++) {
+			w[t] = LoadBigEndian(data + 4 * t);
+		}
+		for (int t = 16; t < 64; t++) {
+			DWORD s0 = ROTR(w[t - 15], 7) ^ ROTR(w[t - 15], 18) ^ (w[t - 15] >> 3);
+			DWORD s1 = ROTR(w[t - 2], 17) ^ ROTR(w[t - 2], 19) ^ (w[t - 2] >> 10);
+			w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+		}
+
+		DWORD a = state[0], b = state[1], c = state[2], d = state[3];
+		DWORD e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int t = 0; t < 64; t++) {
+			DWORD t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + s_k[t] + w[t];
+			DWORD t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+// Four rounds on the SHA extensions; msg holds W[4g..4g+3]
+#define SHANI_ROUNDS(g, msg) { \
+	__m128i wk = _mm_add_epi32(msg, _mm_loadu_si128((const __m128i*)&s_k[4 * (g)])); \
+	cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk); \
+	abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0E)); }
+
+// W[4g..4g+3] from the four groups before it; w4 holds W[4(g-4)..] on entry
+#define SHANI_SCHEDULE(w4, w3, w2, w1) \
+	w4 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w4, w3), _mm_alignr_epi8(w1, w2, 4)), w1)
+
+// SHA extensions kernel; the instructions want the state as ABEF and CDGH
+static void Sha256ShaNi(DWORD state[8], const BYTE* data, size_t blocks) {
+	const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i dcba = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+	__m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+	__m128i abef = _mm_alignr_epi8(dcba, efgh, 8);
+	__m128i cdgh = _mm_blend_epi16(efgh, dcba, 0xF0);
+
+	for (; blocks > 0; blocks--, data += SHA256_BLOCK_SIZE) {
+		__m128i abefSaved = abef;
+		__m128i cdghSaved = cdgh;
+
+		__m128i w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 0)), swap);
+		SHANI_ROUNDS(0, w0);
+		__m128i w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), swap);
+		SHANI_ROUNDS(1, w1);
+		__m128i w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), swap);
+		SHANI_ROUNDS(2, w2);
+		__m128i w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), swap);
+		SHANI_ROUNDS(3, w3);
+		for (int g = 4; g < 16; g += 4) {
+			SHANI_SCHEDULE(w0, w1, w2, w3);
+			SHANI_ROUNDS(g, w0);
+			SHANI_SCHEDULE(w1, w2, w3, w0);
+			SHANI_ROUNDS(g + 1, w1);
+			SHANI_SCHEDULE(w2, w3, w0, w1);
+			SHANI_ROUNDS(g + 2, w2);
+			SHANI_SCHEDULE(w3, w0, w1, w2);
+			SHANI_ROUNDS(g + 3, w3);
+		}
+
+		abef = _mm_add_epi32(abef, abefSaved);
+		cdgh = _mm_add_epi32(cdgh, cdghSaved);
+	}
+
+	__m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+	__m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+	_mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(feba, dchg, 0xF0));
+	_mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+
+#define ROTR8(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+// Rows of eight words become columns: afterwards r[j] holds word j of every row
+static void Transpose8(__m256i r[8]) {
+	__m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+	__m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+	__m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+	__m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+	__m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+	__m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+	__m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+	__m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+	__m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+	__m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+	__m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+	__m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+	__m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+	__m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+	__m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+	__m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+	r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+	r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+	r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+	r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+	r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+	r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+	r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+	r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+// AVX2 kernel, one message per 32-bit slot
+static void Sha256Avx2Lanes(DWORD state[8][SHA256_LANES], const BYTE* const data[SHA256_LANES], size_t blocks) {
+	const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	__m256i s[8];
+	for (int i = 0; i < 8; i++) {
+		s[i] = _mm256_loadu_si256((const __m256i*)state[i]);
+	}
+
+	for (size_t offset = 0; offset < blocks * SHA256_BLOCK_SIZE; offset += SHA256_BLOCK_SIZE) {
+		__m256i w[16];
+		for (int half = 0; half < 2; half++) {
+			__m256i* rows = w + 8 * half;
+			for (int lane = 0; lane < SHA256_LANES; lane++) {
+				rows[lane] = _mm256_loadu_si256((const __m256i*)(data[lane] + offset + 32 * half));
+			}
+			Transpose8(rows);
+			for (int i = 0; i < 8; i++) {
+				rows[i] = _mm256_shuffle_epi8(rows[i], swap);
+			}
+		}
+
+		__m256i a = s[0], b = s[1], c = s[2], d = s[3];
+		__m256i e = s[4], f = s[5], g = s[6], h = s[7];
+		for (int t = 0; t < 64; t++) {
+			__m256i wt = w[t & 15];
+			if (t >= 16) {
+				__m256i w15 = w[(t - 15) & 15];
+				__m256i w2 = w[(t - 2) & 15];
+				__m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(w15, 7), ROTR8(w15, 18)), _mm256_srli_epi32(w15, 3));
+				__m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(w2, 17), ROTR8(w2, 19)), _mm256_srli_epi32(w2, 10));
+				wt = _mm256_add_epi32(_mm256_add_epi32(wt, s0), _mm256_add_epi32(w[(t - 7) & 15], s1));
+				w[t & 15] = wt;
+			}
+			__m256i sum1 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(e, 6), ROTR8(e, 11)), ROTR8(e, 25));
+			__m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+			__m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, sum1),
+				_mm256_add_epi32(_mm256_add_epi32(ch, _mm256_set1_epi32((int)s_k[t])), wt));
+			__m256i sum0 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(a, 2), ROTR8(a, 13)), ROTR8(a, 22));
+			__m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+			h = g;
+			g = f;
+			f = e;
+			e = _mm256_add_epi32(d, t1);
+			d = c;
+			c = b;
+			b = a;
+			a = _mm256_add_epi32(t1, _mm256_add_epi32(sum0, maj));
+		}
+		s[0] = _mm256_add_epi32(s[0], a);
+		s[1] = _mm256_add_epi32(s[1], b);
+		s[2] = _mm256_add_epi32(s[2], c);
+		s[3] = _mm256_add_epi32(s[3], d);
+		s[4] = _mm256_add_epi32(s[4], e);
+		s[5] = _mm256_add_epi32(s[5], f);
+		s[6] = _mm256_add_epi32(s[6], g);
+		s[7] = _mm256_add_epi32(s[7], h);
+	}
+
+	for (int i = 0; i < 8; i++) {
+		_mm256_storeu_si256((__m256i*)state[i], s[i]);
+	}
+}
+
+// Lanes one after another through the single-stream kernel
+static void Sha256SerialLanes(DWORD state[8][SHA256_LANES], const BYTE* const data[SHA256_LANES], size_t blocks) {
+	for (int lane = 0; lane < SHA256_LANES; lane++) {
+		DWORD laneState[8];
+		for (int i = 0; i < 8; i++) {
+			laneState[i] = state[i][lane];
+		}
+		s_compress(laneState, data[lane], blocks);
+		for (int i = 0; i < 8; i++) {
+			state[i][lane] = laneState[i];
+		}
+	}
+}
+
+// Final padding after the buffered tail of a message; returns 1 or 2 blocks
+static size_t PadMessage(BYTE tail[2 * SHA256_BLOCK_SIZE], const BYTE* buffered, size_t count, ULONG64 length) {
+	size_t blocks = (count + 9 > SHA256_BLOCK_SIZE) ? 2 : 1;
+	size_t end = blocks * SHA256_BLOCK_SIZE;
+	memcpy(tail, buffered, count);
+	tail[count] = 0x80;
+	memset(tail + count + 1, 0, end - 8 - count - 1);
+	StoreBigEndian(tail + end - 8, (DWORD)(length >> 29));
+	StoreBigEndian(tail + end - 4, (DWORD)(length << 3));
+	return blocks;
+}
+
+// Constructor
+Sha256::Sha256() {
+	Reset();
+}
+
+// Start over with no data hashed
+bool Sha256::Reset() {
+	memcpy(m_state, s_initial, sizeof(m_state));
+	m_length = 0;
+	m_buffered = 0;
+	return true;
+}
+
+// Add data to the hash
+bool Sha256::Update(const void* data, size_t size) {
+	const BYTE* p = (const BYTE*)data;
+	m_length += size;
+	if (m_buffered > 0) {
+		size_t part = (std::min)(size, SHA256_BLOCK_SIZE - m_buffered);
+		memcpy(m_buffer + m_buffered, p, part);
+		m_buffered += part;
+		p += part;
+		size -= part;
+		if (m_buffered < SHA256_BLOCK_SIZE) {
+			return true;
+		}
+		s_compress(m_state, m_buffer, 1);
+		m_buffered = 0;
+	}
+
+	// Whole blocks straight from the caller's buffer
+	size_t blocks = size / SHA256_BLOCK_SIZE;
+	if (blocks > 0) {
+		s_compress(m_state, p, blocks);
+		p += blocks * SHA256_BLOCK_SIZE;
+		size -= blocks * SHA256_BLOCK_SIZE;
+	}
+	if (size > 0) {
+		memcpy(m_buffer, p, size);
+		m_buffered = size;
+	}
+	return true;
+}
+
+// Finish the hash; Reset() before hashing anything else
+bool Sha256::Final(BYTE digest[SHA256_DIGEST_SIZE]) {
+	BYTE tail[2 * SHA256_BLOCK_SIZE];
+	s_compress(m_state, tail, PadMessage(tail, m_buffer, m_buffered, m_length));
+	for (int i = 0; i < 8; i++) {
+		StoreBigEndian(digest + 4 * i, m_state[i]);
+	}
+	return true;
+}
+
+// Finish the hash as lowercase hex
+bool Sha256::FinalHex(std::string& hex) {
+	BYTE digest[SHA256_DIGEST_SIZE];
+	if (!Final(digest)) {
+		return false;
+	}
+	hex = DigestToHex(digest, sizeof(digest));
+	return true;
+}
+
+// Constructor
+Sha256Lanes::Sha256Lanes() {
+	Reset();
+}
+
+void Sha256Lanes::Reset() {
+	for (int i = 0; i < 8; i++) {
+		for (int lane = 0; lane < SHA256_LANES; lane++) {
+			m_state[i][lane] = s_initial[i];
+		}
+	}
+	m_length = 0;
+	m_buffered = 0;
+}
+
+void Sha256Lanes::Update(const void* const data[SHA256_LANES], size_t size) {
+	const BYTE* p[SHA256_LANES];
+	for (int lane = 0; lane < SHA256_LANES; lane++) {
+		p[lane] = (const BYTE*)data[lane];
+	}
+	m_length += size;
+	if (m_buffered > 0) {
+		size_t part = (std::min)(size, SHA256_BLOCK_SIZE - m_buffered);
+		for (int lane = 0; lane < SHA256_LANES; lane++) {
+			memcpy(m_buffer[lane] + m_buffered, p[lane], part);
+			p[lane] += part;
+		}
+		m_buffered += part;
+		size -= part;
+		if (m_buffered < SHA256_BLOCK_SIZE) {
+			return;
+		}
+		const BYTE* buffers[SHA256_LANES];
+		for (int lane = 0; lane < SHA256_LANES; lane++) {
+			buffers[lane] = m_buffer[lane];
+		}
+		s_compressLanes(m_state, buffers, 1);
+		m_buffered = 0;
+	}
+
+	size_t blocks = size / SHA256_BLOCK_SIZE;
+	if (blocks > 0) {
+		s_compressLanes(m_state, p, blocks);
+		for (int lane = 0; lane < SHA256_LANES; lane++) {
+			p[lane] += blocks * SHA256_BLOCK_SIZE;
+		}
+		size -= blocks * SHA256_BLOCK_SIZE;
+	}
+	if (size > 0) {
+		for (int lane = 0; lane < SHA256_LANES; lane++) {
+			memcpy(m_buffer[lane], p[lane], size);
+		}
+		m_buffered = size;
+	}
+}
+
+// Finish all lanes; Reset() before hashing anything else
+void Sha256Lanes::Final(BYTE digests[SHA256_LANES][SHA256_DIGEST_SIZE]) {
+	BYTE tails[SHA256_LANES][2 * SHA256_BLOCK_SIZE];
+	const BYTE* tailBlocks[SHA256_LANES];
+	size_t blocks = 0;
+	for (int lane = 0; lane < SHA256_LANES; lane++) {
+		blocks = PadMessage(tails[lane], m_buffer[lane], m_buffered, m_length);
+		tailBlocks[lane] = tails[lane];
+	}
+	s_compressLanes(m_state, tailBlocks, blocks);
+	for (int lane = 0; lane < SHA256_LANES; lane++) {
+		for (int i = 0; i < 8; i++) {
+			StoreBigEndian(digests[lane] + 4 * i, m_state[i][lane]);
+		}
+	}
+}
+
+// FIPS 180-2 examples and the two-block example of the NIST test set
+static const struct {
+	const char* message;
+	const char* digest;
+} s_testVectors[] = {
+	{ "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+	{ "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+	{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+		"248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+	{ "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+		"cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1" },
+};
+
+// Check the kernels in use against the test vectors. Every lane gets the
+// same message, fed in uneven pieces so the buffering is covered too.
+static bool Sha256SelfTest() {
+	Sha256 hasher;
+	Sha256Lanes lanes;
+	for (size_t i = 0; i < sizeof(s_testVectors) / sizeof(s_testVectors[0]); i++) {
+		const char* message = s_testVectors[i].message;
+		size_t length = strlen(message);
+		std::string hex;
+		hasher.Reset();
+		hasher.Update(message, length / 3);
+		hasher.Update(message + length / 3, length - length / 3);
+		if (!hasher.FinalHex(hex) || hex != s_testVectors[i].digest) {
+			return false;
+		}
+
+		const void* pieces[SHA256_LANES];
+		for (int lane = 0; lane < SHA256_LANES; lane++) {
+			pieces[lane] = message;
+		}
+		lanes.Reset();
+		lanes.Update(pieces, length / 2);
+		for (int lane = 0; lane < SHA256_LANES; lane++) {
+			pieces[lane] = message + length / 2;
+		}
+		lanes.Update(pieces, length - length / 2);
+		BYTE digests[SHA256_LANES][SHA256_DIGEST_SIZE];
+		lanes.Final(digests);
+		for (int lane = 0; lane < SHA256_LANES; lane++) {
+			if (DigestToHex(digests[lane], SHA256_DIGEST_SIZE) != s_testVectors[i].digest) {
+				return false;
+			}
+		}
+	}
+
+	// A million 'a', long enough to go through the multi-block paths
+	std::string million(1000000, 'a');
+	std::string hex;
+	hasher.Reset();
+	hasher.Update(million.data(), million.size());
+	return hasher.FinalHex(hex) && hex == "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0";
+}
+
+// Pick the kernels once, before anything is hashed
+static struct Sha256Init {
+	Sha256Init() {
+		int info[4];
+		__cpuid(info, 0);
+		int maxLeaf = info[0];
+		__cpuid(info, 1);
+		bool ssse3 = (info[2] & (1 << 9)) != 0;
+		bool sse41 = (info[2] & (1 << 19)) != 0;
+		// AVX registers are only usable if the OS saves them on a context switch
+		bool osAvx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+		bool sha = false;
+		bool avx2 = false;
+		if (maxLeaf >= 7) {
+			__cpuidex(info, 7, 0);
+			sha = (info[1] & (1 << 29)) != 0 && ssse3 && sse41;
+			avx2 = (info[1] & (1 << 5)) != 0 && osAvx;
+		}
+
+		s_compress = sha ? Sha256ShaNi : Sha256Portable;
+		s_name = sha ? "SHA-NI" : "portable";
+		// One stream at a time on the SHA extensions beats eight on AVX2
+		s_compressLanes = (avx2 && !sha) ? Sha256Avx2Lanes : Sha256SerialLanes;
+		s_lanesName = (avx2 && !sha) ? "AVX2 x8" : s_name;
+
+		if ((sha || avx2) && !Sha256SelfTest()) {
+			s_compress = Sha256Portable;
+			s_compressLanes = Sha256SerialLanes;
+			s_name = "portable, accelerated kernel failed its self-test";
+			s_lanesName = s_name;
+		}
+	}
+} s_sha256Init;
+
+const char* Sha256Implementation() {
+	return s_name;
+}
+
+const char* Sha256LanesImplementation() {
+	return s_lanesName;
+}
+
+bool IsSha256Hex(const std::string& str) {
+	if (str.size() != SHA256_HEX_LENGTH) {
+		return false;
+	}
+	for (size_t i = 0; i < str.size(); i++) {
+		if (!isxdigit((unsigned char)str[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+std::string DigestToHex(const BYTE* digest, size_t size) {
+	static const char digits[] = "0123456789abcdef";
+	std::string hex(size * 2, '0');
+	for (size_t i = 0; i < size; i++) {
+		hex[i * 2] = digits[digest[i] >> 4];
+		hex[i * 2 + 1] = digits[digest[i] & 0xF];
+	}
+	return hex;
+}
+
+static int HexValue(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+bool HexToDigest(const std::string& hex, BYTE* digest, size_t size) {
+	if (hex.size() != size * 2) {
+		return false;
+	}
+	for (size_t i = 0; i < size; i++) {
+		int high = HexValue(hex[i * 2]);
+		int low = HexValue(hex[i * 2 + 1]);
+		if (high < 0 || low < 0) {
+			return false;
+		}
+		digest[i] = (BYTE)((high << 4) | low);
+	}
+	return true;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+// Length of a SHA-256 written as lowercase hex, the form the tracker and
+// localFileHandler use
+#define SHA256_HEX_LENGTH (SHA256_DIGEST_SIZE * 2)
+// Messages Sha256Lanes hashes side by side
+#define SHA256_LANES 8
+
+/**
+* @brief Incremental SHA-256
+*
+* Data can be fed in any number of Update calls, so a file can be hashed as
+* its chunks arrive instead of in a second pass once it is complete.
+*
+* The compression runs on the SHA extensions when the CPU has them and on
+* portable C otherwise; the choice is made once at startup, after checking
+* the fast kernel against the FIPS 180-2 test vectors. Nothing is allocated
+* and nothing can fail, the bool results are kept for the callers that chain
+* them.
+*/
+class Sha256 {
+private:
+	DWORD m_state[8];
+	BYTE m_buffer[SHA256_BLOCK_SIZE];
+	ULONG64 m_length;
+	size_t m_buffered;
+
+public:
+	Sha256();
+	Sha256(const Sha256&) = delete;
+	Sha256& operator=(const Sha256&) = delete;
+
+	bool Reset();
+	bool Update(const void* data, size_t size);
+	bool Final(BYTE digest[SHA256_DIGEST_SIZE]);
+	bool FinalHex(std::string& hex);
+};
+
+/**
+* @brief SHA-256 of SHA256_LANES equally long messages at once
+*
+* Without SHA extensions but with AVX2, the lanes run in the eight 32-bit
+* slots of a vector register, which hashes them about four times faster
+* than one after another. Elsewhere they go one after another through the
+* Sha256 kernel, which the SHA extensions make faster still. Meant for
+* Merkle leaves, which come in runs of equal size.
+*/
+class Sha256Lanes {
+private:
+	DWORD m_state[8][SHA256_LANES];	// word-major, as the vector kernel wants it
+	BYTE m_buffer[SHA256_LANES][SHA256_BLOCK_SIZE];
+	ULONG64 m_length;
+	size_t m_buffered;
+
+public:
+	Sha256Lanes();
+	Sha256Lanes(const Sha256Lanes&) = delete;
+	Sha256Lanes& operator=(const Sha256Lanes&) = delete;
+
+	void Reset();
+	// Append size bytes to every lane, data[i] for lane i
+	void Update(const void* const data[SHA256_LANES], size_t size);
+	void Final(BYTE digests[SHA256_LANES][SHA256_DIGEST_SIZE]);
+};
+
+// Kernels in use, e.g. "SHA-NI" and "AVX2 x8", for the log
+const char* Sha256Implementation();
+const char* Sha256LanesImplementation();
+
+// Whether str is a SHA-256 in hex, either case
+bool IsSha256Hex(const std::string& str);
+// Lowercase hex of a digest
+std::string DigestToHex(const BYTE* digest, size_t size);
+// Parse size bytes of hex, either case; false if hex is not exactly that
+bool HexToDigest(const std::string& hex, BYTE* digest, size_t size);
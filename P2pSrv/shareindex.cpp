@@ -0,0 +1,461 @@
+#include "shareindex.h"
+#include "eventlog.h"
+
+#include <chrono>
+#include <set>
+#include <algorithm>
+
+static bool SameVersion(const localFileHandler& file, ULONG64 size, const FILETIME& written) {
+	FILETIME fileWritten = file.getWriteTime();
+	return file.getSize() == size && CompareFileTime(&fileWritten, &written) == 0;
+}
+
+static bool SameVersion(const localFileHandler& file, const WIN32_FILE_ATTRIBUTE_DATA& info) {
+	return SameVersion(file, ((ULONG64)info.nFileSizeHigh << 32) | info.nFileSizeLow, info.ftLastWriteTime);
+}
+
+// Constructor
+ShareIndex::ShareIndex(HashCache& cache)
+	: m_cache(cache), m_watcher(NULL), m_running(false), m_hashing(0),
+	m_snapshot(std::make_shared<FileCatalog>("")), m_snapshotStale(false), m_snapshotTime(0), m_scanning(false), m_bytesHashed(0),
+	m_contentChunking(false) {
+	// Milliseconds since 1601
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+	m_version = (((ULONG64)now.dwHighDateTime << 32) | now.dwLowDateTime) / 10000;
+}
+
+// Destructor
+ShareIndex::~ShareIndex() {
+	Stop();
+}
+
+// Walk folder, then keep the index current until Stop
+bool ShareIndex::Start(const std::string& folder) {
+	Stop();
+
+	DirectoryWatcher* watcher = DirectoryWatcher::Create(folder, true);
+	if (watcher == NULL) {
+		return false;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_folder = folder;
+		if (!m_folder.empty() && m_folder.back() != '\\')
+			m_folder += '\\';
+		m_watcher = watcher;
+		m_running = true;
+		m_files.clear();
+		m_pending.clear();
+		m_chunkIndex.Clear();
+		m_hashing = 0;
+		m_bytesHashed = 0;
+		m_snapshotStale = true;
+	}
+
+	// Hashers first, so they pick up files while the walk is still running
+	m_hashPool.Start(ChooseHashWorkerCount(folder));
+	m_scheduleThread = std::thread(&ShareIndex::ScheduleThread, this);
+
+	// The watcher is open before the walk, so nothing changed in between is missed
+	Scan();
+
+	m_watchThread = std::thread(&ShareIndex::WatchThread, this);
+
+	std::string msg = "Sharing " + folder;
+	WriteLogMessage(msg.c_str());
+	return true;
+}
+
+void ShareIndex::Stop() {
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (!m_running) {
+			return;
+		}
+		m_running = false;
+		m_watcher->Stop();
+		m_changed.notify_all();
+	}
+
+	m_watchThread.join();
+	m_scheduleThread.join();
+	m_hashPool.Stop();
+	delete m_watcher;
+	m_watcher = NULL;
+	m_cache.Save();
+}
+
+bool ShareIndex::IsRunning() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_running;
+}
+
+std::string ShareIndex::GetFolder() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_folder;
+}
+
+void ShareIndex::SetContentChunking(bool enabled) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_contentChunking = enabled;
+}
+
+// Some shared file holding a content-defined chunk with this digest
+bool ShareIndex::FindChunk(const BYTE digest[SHA256_DIGEST_SIZE], ChunkLocation& location) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_chunkIndex.Find(digest, location);
+}
+
+std::shared_ptr<const ChunkList> ShareIndex::GetChunks(const std::string& path) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	std::map<std::string, localFileHandler>::iterator it = m_files.find(path);
+	if (it == m_files.end()) {
+		return std::shared_ptr<const ChunkList>();
+	}
+	return it->second.getChunks();
+}
+
+// Whether FindChunk has anything to find
+bool ShareIndex::HasChunks() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_chunkIndex.GetChunkCount() != 0;
+}
+
+void ShareIndex::GetProgress(ShareProgress& progress) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	progress.scanning = m_scanning;
+	progress.files = m_files.size();
+	progress.filesPending = m_pending.size() + m_hashing;
+	progress.bytesPending = 0;
+	progress.bytesHashed = m_bytesHashed;
+	for (std::map<std::string, localFileHandler>::iterator it = m_files.begin(); it != m_files.end(); ++it) {
+		if (it->second.getHash().empty()) {
+			progress.bytesPending += it->second.getSize();
+		}
+	}
+}
+
+// Files as of now, hashed or not
+std::shared_ptr<const FileCatalog> ShareIndex::GetFiles() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	ULONGLONG now = GetTickCount64();
+	bool hashing = !m_pending.empty() || m_hashing > 0;
+	if (m_snapshotStale && (!hashing || now - m_snapshotTime >= SHARE_SNAPSHOT_INTERVAL_MS)) {
+		ULONGLONG started = now;
+		std::shared_ptr<FileCatalog> files = std::make_shared<FileCatalog>(m_folder);
+		files->Reserve(m_files.size());
+		for (std::map<std::string, localFileHandler>::iterator it = m_files.begin(); it != m_files.end(); ++it) {
+			const localFileHandler& file = it->second;
+			FILETIME created = file.getCreationTime();
+			FILETIME written = file.getWriteTime();
+			files->Add(file.getRelativeName(), file.getSize(), created, written, file.getHash(), file.getMerkleTree());
+		}
+		files->BuildIndexes();
+		files->SetVersion(++m_version, *m_snapshot);
+		m_snapshot = files;
+		m_snapshotStale = false;
+		m_snapshotTime = GetTickCount64();
+
+		char msg[160];
+		sprintf_s(msg, "File catalog rebuilt: %u files, %u bytes per file, %llu ms", (unsigned)files->GetCount(),
+			(unsigned)(files->GetMemoryUsage() / (std::max)(files->GetCount(), (size_t)1)), GetTickCount64() - started);
+		WriteLogMessage(msg);
+	}
+	return m_snapshot;
+}
+
+// Bring the index in line with a full walk of the tree
+void ShareIndex::Scan() {
+	std::string folder = GetFolder();
+	std::set<std::string> seen;
+	DirectoryWalker walker;
+	ULONGLONG started = GetTickCount64();
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_scanning = true;
+	}
+
+	ULONGLONG files = walker.Walk(folder, "", [this, &folder, &seen](const std::vector<WalkEntry>& batch) {
+		std::lock_guard<std::mutex> lock(m_lock);
+		for (size_t i = 0; i < batch.size(); i++) {
+			seen.insert(JoinSharePath(folder, batch[i].relativePath));
+			UpdateFile(batch[i], 0);
+		}
+	});
+
+	// Whatever the walk did not see is gone
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_scanning = false;
+	std::map<std::string, localFileHandler>::iterator it = m_files.begin();
+	while (it != m_files.end()) {
+		if (seen.count(it->first) == 0) {
+			m_pending.erase(it->first);
+			m_cache.Remove(it->first);
+			m_chunkIndex.RemoveFile(it->first);
+			it = m_files.erase(it);
+			m_snapshotStale = true;
+		}
+		else {
+			++it;
+		}
+	}
+
+	char msg[192];
+	sprintf_s(msg, "Walked %llu directories, %llu files in %llu ms on %lu threads, %u to hash",
+		walker.GetDirectoryCount(), files, GetTickCount64() - started, walker.GetThreadCount(), (unsigned)m_pending.size());
+	WriteLogMessage(msg);
+}
+
+// Add everything under a directory that just appeared
+void ShareIndex::WalkDirectory(const std::string& relativeDir) {
+	DirectoryWalker walker;
+	walker.Walk(GetFolder(), relativeDir, [this](const std::vector<WalkEntry>& batch) {
+		std::lock_guard<std::mutex> lock(m_lock);
+		for (size_t i = 0; i < batch.size(); i++) {
+			UpdateFile(batch[i], SHARE_HASH_SETTLE_MS);
+		}
+	});
+}
+
+// Record the current version of a file, from the cache if possible, else
+// queue it to be hashed settleMs from now; m_lock must be held
+void ShareIndex::UpdateFile(const WalkEntry& entry, DWORD settleMs) {
+	std::string path = JoinSharePath(m_folder, entry.relativePath);
+	std::map<std::string, localFileHandler>::iterator it = m_files.find(path);
+	if (it != m_files.end() && SameVersion(it->second, entry.size, entry.lastWriteTime) &&
+		(!it->second.getHash().empty() || m_pending.count(path) > 0)) {
+		return;
+	}
+
+	localFileHandler file(path, false);
+	file.setRelativeName(entry.relativePath);
+	file.setfileSize((DWORD)entry.size, (DWORD)(entry.size >> 32));
+	file.setCreationDate(entry.creationTime);
+	file.setWriteTime(entry.lastWriteTime);
+
+	std::string hash;
+	std::shared_ptr<const MerkleTree> tree;
+	std::shared_ptr<const ChunkList> chunks;
+	// Hashed before chunking was turned on counts as a miss
+	if (m_cache.Lookup(path, entry.size, entry.lastWriteTime, hash, tree, chunks) && (chunks || !m_contentChunking)) {
+		file.setHash(hash, tree, chunks);
+		m_chunkIndex.AddFile(path, chunks);
+		m_pending.erase(path);
+	}
+	else {
+		m_chunkIndex.RemoveFile(path);
+		m_pending[path] = GetTickCount64() + settleMs;
+		m_changed.notify_one();
+	}
+	m_files[path] = file;
+	m_snapshotStale = true;
+}
+
+// m_lock must be held
+void ShareIndex::RemoveFile(const std::string& path) {
+	m_pending.erase(path);
+	if (m_files.erase(path) > 0) {
+		m_snapshotStale = true;
+	}
+	m_cache.Remove(path);
+	m_chunkIndex.RemoveFile(path);
+}
+
+// Drop every file under the directory path, handing them to removed if
+// given; m_lock must be held
+void ShareIndex::RemoveTree(const std::string& path, std::vector<localFileHandler>* removed) {
+	std::string prefix = path + '\\';
+	std::map<std::string, localFileHandler>::iterator it = m_files.lower_bound(prefix);
+	while (it != m_files.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+		if (removed != NULL && !it->second.getHash().empty()) {
+			removed->push_back(it->second);
+		}
+		m_pending.erase(it->first);
+		m_cache.Remove(it->first);
+		m_chunkIndex.RemoveFile(it->first);
+		it = m_files.erase(it);
+		m_snapshotStale = true;
+	}
+}
+
+void ShareIndex::ApplyChanges(const std::vector<DirectoryChange>& changes) {
+	std::string folder = GetFolder();
+	std::vector<std::string> newDirs;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		// What the last CHANGE_RENAMED_FROM took out, if it had been hashed
+		std::string renamedFrom;
+		std::vector<localFileHandler> renamed;
+
+		for (size_t i = 0; i < changes.size(); i++) {
+			const DirectoryChange& change = changes[i];
+			std::string path = folder + change.name;
+
+			if (change.type == DirectoryChange::CHANGE_REMOVED || change.type == DirectoryChange::CHANGE_RENAMED_FROM) {
+				// The path is gone, so it can't be asked whether it was a directory
+				renamed.clear();
+				renamedFrom = change.name;
+				std::map<std::string, localFileHandler>::iterator it = m_files.find(path);
+				if (it != m_files.end() && !it->second.getHash().empty()) {
+					renamed.push_back(it->second);
+				}
+				RemoveFile(path);
+				RemoveTree(path, &renamed);
+				if (change.type == DirectoryChange::CHANGE_REMOVED) {
+					renamed.clear();
+				}
+				continue;
+			}
+
+			WIN32_FILE_ATTRIBUTE_DATA info;
+			if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &info) ||
+				(info.dwFileAttributes & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_REPARSE_POINT)) != 0) {
+				// Gone again already, or not something we share
+				RemoveFile(path);
+				RemoveTree(path, NULL);
+				renamed.clear();
+				continue;
+			}
+
+			// Same bytes under a new name: carry the hashes over instead of reading the files
+			if (change.type == DirectoryChange::CHANGE_RENAMED_TO) {
+				for (size_t j = 0; j < renamed.size(); j++) {
+					localFileHandler& file = renamed[j];
+					std::string relative = change.name + file.getRelativeName().substr(renamedFrom.size());
+					std::string newPath = folder + relative;
+					WIN32_FILE_ATTRIBUTE_DATA moved;
+					if (!GetFileAttributesExA(newPath.c_str(), GetFileExInfoStandard, &moved) ||
+						!SameVersion(file, moved)) {
+						continue;
+					}
+					localFileHandler copy(newPath, false);
+					copy.setRelativeName(relative);
+					copy.setfileSize(moved.nFileSizeLow, moved.nFileSizeHigh);
+					copy.setCreationDate(moved.ftCreationTime);
+					copy.setWriteTime(moved.ftLastWriteTime);
+					copy.setHash(file.getHash(), file.getMerkleTree(), file.getChunks());
+					m_files[newPath] = copy;
+					m_cache.Store(newPath, copy.getSize(), moved.ftLastWriteTime, copy.getHash(), copy.getMerkleTree(), copy.getChunks());
+					m_chunkIndex.AddFile(newPath, copy.getChunks());
+					m_snapshotStale = true;
+				}
+				renamed.clear();
+			}
+
+			if (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				// A directory's own changes don't matter, only new ones have files to add
+				if (change.type != DirectoryChange::CHANGE_MODIFIED) {
+					newDirs.push_back(change.name);
+				}
+				continue;
+			}
+
+			WalkEntry entry;
+			entry.relativePath = change.name;
+			entry.attributes = info.dwFileAttributes;
+			entry.size = ((ULONG64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+			entry.creationTime = info.ftCreationTime;
+			entry.lastWriteTime = info.ftLastWriteTime;
+			UpdateFile(entry, SHARE_HASH_SETTLE_MS);
+		}
+	}
+
+	// Walked without the lock, the walker's threads take it for each batch
+	for (size_t i = 0; i < newDirs.size(); i++) {
+		WalkDirectory(newDirs[i]);
+	}
+}
+
+void ShareIndex::WatchThread() {
+	std::vector<DirectoryChange> changes;
+	while (m_watcher->Wait(changes)) {
+		if (!changes.empty() && changes[0].type == DirectoryChange::CHANGE_OVERFLOW) {
+			WriteLogMessage("Share changes were lost, rescanning");
+			Scan();
+		}
+		else {
+			ApplyChanges(changes);
+		}
+	}
+}
+
+// Hand queued files to the hashing pool once they have settled, no more at
+// a time than it has threads so the rest stay in m_pending
+void ShareIndex::ScheduleThread() {
+	std::unique_lock<std::mutex> lock(m_lock);
+	while (m_running) {
+		if (m_hashing >= m_hashPool.GetWorkerCount()) {
+			m_changed.wait(lock);
+			continue;
+		}
+		// Earliest file due
+		ULONGLONG now = GetTickCount64();
+		std::map<std::string, ULONGLONG>::iterator next = m_pending.end();
+		for (std::map<std::string, ULONGLONG>::iterator it = m_pending.begin(); it != m_pending.end(); ++it) {
+			if (next == m_pending.end() || it->second < next->second) {
+				next = it;
+			}
+		}
+		if (next == m_pending.end()) {
+			m_changed.wait(lock);
+			continue;
+		}
+		if (next->second > now) {
+			m_changed.wait_for(lock, std::chrono::milliseconds(next->second - now));
+			continue;
+		}
+
+		std::string path = next->first;
+		m_pending.erase(next);
+		std::map<std::string, localFileHandler>::iterator entry = m_files.find(path);
+		if (entry == m_files.end()) {
+			continue;
+		}
+		localFileHandler file = entry->second;
+		bool contentChunks = m_contentChunking;
+		m_hashing++;
+		m_hashPool.Submit([this, path, file, contentChunks](FileHasher& hasher) {
+			HashFile(hasher, path, file, contentChunks);
+		});
+	}
+}
+
+// Hash one file on a pool thread and record the result
+void ShareIndex::HashFile(FileHasher& hasher, const std::string& path, localFileHandler file, bool contentChunks) {
+	ULONGLONG bytesRead = file.calcHash(hasher, contentChunks);
+	// The file may have been written to while it was read
+	WIN32_FILE_ATTRIBUTE_DATA info;
+	bool unchanged = GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &info) && SameVersion(file, info);
+
+	std::unique_lock<std::mutex> lock(m_lock);
+	m_hashing--;
+	m_bytesHashed += bytesRead;
+	m_changed.notify_all();
+	std::map<std::string, localFileHandler>::iterator entry = m_files.find(path);
+	if (entry == m_files.end() || m_pending.count(path) > 0 ||
+		!SameVersion(entry->second, file.getSize(), file.getWriteTime())) {
+		// Removed or changed again meanwhile, a newer event has it
+	}
+	else if (file.getHash().empty() || !unchanged) {
+		m_pending[path] = GetTickCount64() + SHARE_HASH_RETRY_MS;
+	}
+	else {
+		entry->second.setHash(file.getHash(), file.getMerkleTree(), file.getChunks());
+		m_cache.Store(path, file.getSize(), file.getWriteTime(), file.getHash(), file.getMerkleTree(), file.getChunks());
+		m_chunkIndex.AddFile(path, file.getChunks());
+		m_snapshotStale = true;
+	}
+
+	// Write the cache out once the queue has drained
+	if (m_pending.empty() && m_hashing == 0) {
+		if (m_contentChunking) {
+			char msg[160];
+			sprintf_s(msg, "Chunk index: %u chunks, %llu MB of %llu MB unique", (unsigned)m_chunkIndex.GetChunkCount(),
+				m_chunkIndex.GetUniqueBytes() >> 20, m_chunkIndex.GetTotalBytes() >> 20);
+			WriteLogMessage(msg);
+		}
+		lock.unlock();
+		m_cache.Save();
+	}
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "fileOps.h"
+#include "filehasher.h"
+#include "hashcache.h"
+#include "dirwatcher.h"
+#include "dirwalker.h"
+#include "filecatalog.h"
+#include "chunkindex.h"
+
+// A changed file is hashed once it has been left alone this long
+#define SHARE_HASH_SETTLE_MS 500
+// Retry delay for a file that could not be read, e.g. still open for writing
+#define SHARE_HASH_RETRY_MS 5000
+// While files are being hashed the catalog is rebuilt at most this often
+#define SHARE_SNAPSHOT_INTERVAL_MS 1000
+
+// How far indexing has got
+struct ShareProgress {
+	bool scanning;			// a walk of the tree is running
+	ULONG64 files;
+	ULONG64 filesPending;	// queued or being hashed
+	ULONG64 bytesPending;
+	ULONG64 bytesHashed;	// read by the hashers since Start
+};
+
+/**
+* @brief Files of the shared tree, kept current by a directory watcher
+*
+* Start walks the whole tree once with a DirectoryWalker; after that a
+* watcher thread applies change notifications to the index as they arrive
+* and only rescans when the system reports that changes were lost. Files
+* whose hash is not in the HashCache are queued and hashed by background
+* threads, which start on the first directories while the walk goes on.
+* A file that changes is hashed once it stops changing, so one that is
+* still being written is read once at the end. Renamed files and
+* directories keep their hashes.
+*
+* GetFiles returns an immutable FileCatalog of the files, listed as soon
+* as the walk finds them; those not hashed yet are marked pending and fill
+* in as the hashers get to them. It is rebuilt only when the index changed
+* since the last call, and no more than once a second while hashing goes
+* on, so serving the list costs no disk access at all. Each rebuild gets the next version
+* number; numbering starts from the clock, so a version handed out before
+* a restart never names a different list afterwards.
+*
+* With content chunking on, files are also cut into content-defined chunks
+* as they are hashed. GetChunks hands a file's chunks to peers that want to
+* know which of them they already have, and FindChunk looks a chunk up by
+* digest across the whole share for the downloader.
+*/
+class ShareIndex {
+public:
+	ShareIndex(HashCache& cache);
+	~ShareIndex();
+	ShareIndex(const ShareIndex&) = delete;
+	ShareIndex& operator=(const ShareIndex&) = delete;
+
+	bool Start(const std::string& folder);
+	void Stop();
+	bool IsRunning();
+	std::string GetFolder();
+	std::shared_ptr<const FileCatalog> GetFiles();
+	void GetProgress(ShareProgress& progress);
+	// Takes effect at the next Start
+	void SetContentChunking(bool enabled);
+	bool FindChunk(const BYTE digest[SHA256_DIGEST_SIZE], ChunkLocation& location);
+	// Null if the file at path is not indexed or was not cut
+	std::shared_ptr<const ChunkList> GetChunks(const std::string& path);
+	bool HasChunks();
+
+private:
+	HashCache& m_cache;
+	std::string m_folder;
+	DirectoryWatcher* m_watcher;
+	std::thread m_watchThread;
+	std::thread m_scheduleThread;
+	HashWorkerPool m_hashPool;
+
+	std::mutex m_lock;
+	std::condition_variable m_changed;
+	bool m_running;
+	std::map<std::string, localFileHandler> m_files;	// by full path
+	std::map<std::string, ULONGLONG> m_pending;		// full path -> when to hash it
+	DWORD m_hashing;		// handed to m_hashPool and not back yet
+	std::shared_ptr<const FileCatalog> m_snapshot;
+	bool m_snapshotStale;
+	ULONGLONG m_snapshotTime;
+	bool m_scanning;
+	ULONG64 m_bytesHashed;
+	ULONG64 m_version;	// of the last catalog built
+	bool m_contentChunking;
+	ChunkIndex m_chunkIndex;
+
+	void Scan();
+	void WalkDirectory(const std::string& relativeDir);
+	void UpdateFile(const WalkEntry& entry, DWORD settleMs);
+	void RemoveFile(const std::string& path);
+	void RemoveTree(const std::string& path, std::vector<localFileHandler>* removed);
+	void ApplyChanges(const std::vector<DirectoryChange>& changes);
+	void WatchThread();
+	void ScheduleThread();
+	void HashFile(FileHasher& hasher, const std::string& path, localFileHandler file, bool contentChunks);
+};
@@ -0,0 +1,1098 @@
+#include "swarm.h"
+#include "tcpclient.h"
+#include "shareindex.h"
+#include "crc32c.h"
+#include "eventlog.h"
+
+#include <condition_variable>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+const size_t SwarmDownloader::NO_PEER;
+
+// Constructor
+SwarmDownloader::SwarmDownloader(const std::vector<std::string>& peers, const std::string& filename, const std::string& outputPath)
+	: m_filename(filename), m_requestName(filename), m_requestFlags(REQ_FLAG_CRC32C | REQ_FLAG_COMPRESS),
+	m_outputPath(outputPath), m_buffers((std::max)((DWORD)peers.size(), (DWORD)1), CHUNK_SIZE),
+	m_pipelineDepth(DEFAULT_PIPELINE_DEPTH), m_engine(NULL),
+	m_cancelled(false), m_bytesDone(0), m_bytesTotal(0), m_bytesReceived(0), m_retries(0),
+	m_probeIndex(0), m_probing(NO_PEER), m_copying(false),
+	m_totalChunks(0), m_nextChunk(0), m_chunksDone(0), m_activePeers(0),
+	m_lastProgress(0), m_finished(false), m_failed(false), m_concluded(false),
+	m_haveRoot(false), m_rootGiven(false), m_leafCount(0), m_localChunks(NULL) {
+	for (size_t i = 0; i < peers.size(); i++) {
+		Peer* peer = new Peer();
+		peer->swarm = this;
+		peer->index = i;
+		size_t colon = peers[i].find(':');
+		peer->ip = peers[i].substr(0, colon);
+		peer->port = (colon == std::string::npos) ? 0 : atoi(peers[i].c_str() + colon + 1);
+		peer->state = PEER_IDLE;
+		peer->connection = 0;
+		peer->timer = 0;
+		peer->chunksServed = 0;
+		peer->servedBefore = 0;
+		peer->badChunks = 0;
+		peer->failures = 0;
+		peer->retryDelay = RETRY_DELAY_MS;
+		peer->noProofs = false;
+		peer->proofs = false;
+		peer->dropped = false;
+		peer->fileNotFound = false;
+		peer->buffer = NULL;
+		peer->proofSize = 0;
+		peer->proofIndex = 0;
+		peer->haveProof = false;
+		m_peers.push_back(peer);
+	}
+}
+
+// Destructor; the download must have reported its result first
+SwarmDownloader::~SwarmDownloader() {
+	for (size_t i = 0; i < m_peers.size(); i++) {
+		if (m_peers[i]->buffer != NULL) {
+			m_buffers.Release(m_peers[i]->buffer);
+		}
+		delete m_peers[i];
+	}
+}
+
+// Set the per-peer request window
+void SwarmDownloader::SetPipelineDepth(DWORD depth) {
+	m_pipelineDepth = (std::max)((DWORD)1, (std::min)(depth, (DWORD)MAX_PIPELINE_DEPTH));
+}
+
+// Download by content instead of by name and verify the result; call before Start
+void SwarmDownloader::SetContentHash(const std::string& sha256Hex) {
+	m_requestName = sha256Hex;
+	m_requestFlags |= REQ_FLAG_BY_HASH;
+	m_file.SetExpectedHash(sha256Hex);
+}
+
+// Check every chunk against this Merkle root instead of trusting the first
+// peer's; call before Start
+bool SwarmDownloader::SetMerkleRoot(const std::string& rootHex) {
+	if (!HexToDigest(rootHex, m_root.bytes, sizeof(m_root.bytes))) {
+		return false;
+	}
+	m_haveRoot = true;
+	m_rootGiven = true;
+	return true;
+}
+
+bool SwarmDownloader::Start(AsyncTransferEngine* engine, const CompletionCallback& done) {
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_engine = engine;
+		m_onFinished = done;
+	}
+	return engine->Post([this] { Begin(); });
+}
+
+bool SwarmDownloader::Run() {
+	AsyncTransferEngine engine;
+	if (!engine.Start()) {
+		return false;
+	}
+
+	std::mutex lock;
+	std::condition_variable finished;
+	bool done = false;
+	bool result = false;
+	if (Start(&engine, [&](bool succeeded) {
+		std::lock_guard<std::mutex> guard(lock);
+		result = succeeded;
+		done = true;
+		finished.notify_all();
+	})) {
+		std::unique_lock<std::mutex> guard(lock);
+		finished.wait(guard, [&] { return done; });
+	}
+	engine.Stop();
+	return result;
+}
+
+void SwarmDownloader::Cancel() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_cancelled = true;
+	if (m_engine != NULL) {
+		m_engine->Post([this] {
+			if (!m_concluded) {
+				Finish(true);
+			}
+		});
+	}
+}
+
+void SwarmDownloader::GetProgress(SwarmProgress& progress) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	progress.bytesDone = m_bytesDone;
+	progress.bytesTotal = m_bytesTotal;
+	progress.bytesReceived = m_bytesReceived;
+	progress.retries = m_retries;
+}
+
+// Whether Cancel was called
+bool SwarmDownloader::IsCancelled() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_cancelled;
+}
+
+// Open the output and connect to every peer at once; the first one to get
+// through probes for the chunk count
+void SwarmDownloader::Begin() {
+	if (m_peers.empty()) {
+		WriteLogMessage("Swarm: no peers given");
+		Conclude(false);
+		return;
+	}
+
+	std::string msg = "Downloading " + m_filename + " from " + std::to_string(m_peers.size()) + " peer(s)";
+	WriteLogMessage(msg.c_str());
+
+	if (IsCancelled() || !m_file.Open(m_outputPath)) {
+		Conclude(false);
+		return;
+	}
+
+	DWORD probeBlock = m_file.FirstMissingBlock();
+	if (probeBlock != 0 && probeBlock == m_file.GetTotalBlocks()) {
+		// Everything arrived last time, only the final step was missed
+		Conclude(m_file.Complete());
+		return;
+	}
+	m_probeIndex = probeBlock / BLOCKS_PER_CHUNK;
+
+	// Everything a peer needs to receive is set up here, a chunk coming in
+	// does not touch the heap
+	for (size_t i = 0; i < m_peers.size(); i++) {
+		Peer& peer = *m_peers[i];
+		peer.buffer = m_buffers.Acquire();
+		if (peer.buffer == NULL) {
+			WriteLogMessage("Swarm: out of receive buffers");
+			Conclude(false);
+			return;
+		}
+		peer.packed.resize(CHUNK_SIZE + sizeof(ChunkCodecHeader));
+		peer.requests.reserve(2 * MAX_PIPELINE_DEPTH);
+		peer.inFlight.reserve(MAX_PIPELINE_DEPTH);
+	}
+
+	m_activePeers = (DWORD)m_peers.size();
+	for (size_t i = 0; i < m_peers.size() && !m_finished; i++) {
+		Connect(*m_peers[i]);
+	}
+}
+
+// Start a new connection to peer
+void SwarmDownloader::Connect(Peer& peer) {
+	if (m_finished) {
+		return;
+	}
+	peer.state = PEER_CONNECTING;
+	peer.connection = m_engine->Connect(peer.ip, peer.port, &peer);
+	if (peer.connection == 0) {
+		std::string msg = "Swarm: " + peer.ip + " is not a peer address";
+		WriteLogMessage(msg.c_str());
+		peer.dropped = true;
+		OnPeerClosed(peer);
+	}
+}
+
+// Give up on a peer for good
+void SwarmDownloader::EndPeer(Peer& peer) {
+	peer.state = PEER_ENDED;
+	if (--m_activePeers == 0) {
+		Finish(true);
+		return;
+	}
+	// A chunk held back from its bad peer may have no one else to go to now
+	Kick();
+}
+
+// Queue one request frame for the next SendQueued
+void SwarmDownloader::QueueRequest(Peer& peer, MessageType msgType, DWORD index) {
+	ChunkRequest request = {};
+	request.msgType = msgType;
+	strncpy_s(request.filename, m_requestName.c_str(), MAX_FILENAME - 1);
+	request.chunkIndex = index;
+	request.flags = m_requestFlags;
+	peer.requests.push_back(request);
+}
+
+// Send the queued frames, which bring responses answers back
+bool SwarmDownloader::SendQueued(Peer& peer, DWORD responses) {
+	bool sent = m_engine->Send(peer.connection, peer.requests.data(),
+		(DWORD)(peer.requests.size() * sizeof(ChunkRequest)), responses);
+	peer.requests.clear();
+	return sent;
+}
+
+bool SwarmDownloader::Peer::OnConnected() {
+	servedBefore = chunksServed;
+	proofs = false;
+	haveProof = false;
+	if (noProofs) {
+		return swarm->CheckPeerRoot(*this, NULL, NULL) && swarm->PeerReady(*this);
+	}
+	// Find out whether the peer can prove its chunks and that its root is ours
+	state = PEER_ROOT;
+	swarm->QueueRequest(*this, MSG_MERKLE_REQUEST, MERKLE_ROOT_INDEX);
+	return swarm->SendQueued(*this, 1);
+}
+
+char* SwarmDownloader::Peer::OnResponseHeader(const ChunkResponse& header, DWORD& payloadSize) {
+	return swarm->PayloadFor(*this, header, payloadSize);
+}
+
+bool SwarmDownloader::Peer::OnResponse(const ChunkResponse& header, char* payload) {
+	ChunkResponse response = header;
+	return swarm->OnPeerResponse(*this, response, payload);
+}
+
+void SwarmDownloader::Peer::OnClosed() {
+	swarm->OnPeerClosed(*this);
+}
+
+// Where the payload of a response goes, given what the peer was asked for.
+// Status answers carry no payload.
+char* SwarmDownloader::PayloadFor(Peer& peer, const ChunkResponse& header, DWORD& payloadSize) {
+	payloadSize = 0;
+	if (header.msgType == MSG_FILE_NOT_FOUND) {
+		std::string msg = "Swarm: peer " + peer.ip + " does not have the file";
+		WriteLogMessage(msg.c_str());
+		peer.fileNotFound = true;
+		return NULL;
+	}
+
+	switch (peer.state) {
+	case PEER_ROOT:
+		if (header.msgType != MSG_MERKLE_RESPONSE) {
+			return (char*)peer.proof;
+		}
+		if (header.chunkIndex != MERKLE_ROOT_INDEX || header.chunkSize != SHA256_DIGEST_SIZE) {
+			WriteLogMessage("Invalid Merkle root response");
+			return NULL;
+		}
+		payloadSize = SHA256_DIGEST_SIZE;
+		return (char*)peer.proof;
+
+	case PEER_LISTING:
+		if (header.msgType != MSG_CHUNK_LIST_RESPONSE) {
+			return (char*)peer.proof;
+		}
+		if (header.chunkSize > CHUNK_LIST_PAGE * sizeof(ChunkListEntry)) {
+			WriteLogMessage("Invalid chunk list response");
+			return NULL;
+		}
+		payloadSize = header.chunkSize;
+		return (char*)&m_copy->page[0];
+
+	case PEER_PROBING:
+	case PEER_READY:
+	case PEER_COPYING:
+		break;
+
+	default:
+		return NULL;
+	}
+
+	if (header.msgType == MSG_MERKLE_RESPONSE) {
+		if (header.chunkSize > MERKLE_MAX_PROOF_SIZE) {
+			WriteLogMessage("Invalid chunk size in response");
+			return NULL;
+		}
+		payloadSize = header.chunkSize;
+		return (char*)peer.proof;
+	}
+	if (header.msgType == MSG_ERROR) {
+		WriteLogMessage("Server error occurred");
+		return NULL;
+	}
+	if (peer.state == PEER_COPYING || (header.msgType != MSG_CHUNK_RESPONSE &&
+		header.msgType != MSG_CHUNK_RESPONSE_CRC32C && header.msgType != MSG_CHUNK_RESPONSE_COMPRESSED)) {
+		WriteLogMessage("Invalid response type");
+		return NULL;
+	}
+
+	// Compressed chunks are smaller than they would be raw, plus their codec header
+	bool compressed = header.msgType == MSG_CHUNK_RESPONSE_COMPRESSED;
+	if (header.chunkSize > CHUNK_SIZE + (compressed ? sizeof(ChunkCodecHeader) : 0)) {
+		WriteLogMessage("Invalid chunk size in response");
+		return NULL;
+	}
+	payloadSize = header.chunkSize;
+	return compressed ? &peer.packed[0] : peer.buffer;
+}
+
+// A whole response from peer is in; false drops the connection
+bool SwarmDownloader::OnPeerResponse(Peer& peer, ChunkResponse& response, char* payload) {
+	switch (peer.state) {
+	case PEER_ROOT:
+		return CheckPeerRoot(peer, &response, payload) && PeerReady(peer);
+	case PEER_LISTING:
+		return OnChunkList(peer, response, payload);
+	case PEER_COPYING:
+		return OnCopyProof(peer, response, payload);
+	case PEER_PROBING:
+	case PEER_READY:
+		break;
+	default:
+		return false;
+	}
+
+	if (response.msgType == MSG_MERKLE_RESPONSE) {
+		// The proof comes right ahead of its chunk
+		if (!peer.proofs || peer.haveProof || Crc32c(payload, response.chunkSize) != response.crc32) {
+			std::string msg = "Swarm: unexpected proof from peer " + peer.ip;
+			WriteLogMessage(msg.c_str());
+			return false;
+		}
+		peer.haveProof = true;
+		peer.proofIndex = response.chunkIndex;
+		peer.proofSize = response.chunkSize;
+		return true;
+	}
+
+	bool valid;
+	if (!VerifyChunk(peer, response, payload, valid)) {
+		return false;
+	}
+	if (peer.state == PEER_PROBING) {
+		return OnProbe(peer, response, valid);
+	}
+
+	std::vector<DWORD>::iterator it = std::find(peer.inFlight.begin(), peer.inFlight.end(), response.chunkIndex);
+	if (it == peer.inFlight.end() || (std::max)(response.totalChunks, (DWORD)1) != m_totalChunks) {
+		std::string msg = "Swarm: unexpected chunk from peer " + peer.ip;
+		WriteLogMessage(msg.c_str());
+		return false;
+	}
+	peer.inFlight.erase(it);
+
+	if (!valid) {
+		if (!RejectChunk(peer, response.chunkIndex, "failed its Merkle proof")) {
+			return false;
+		}
+	}
+	else if (!CompleteChunk(peer.index, response.chunkIndex, peer.buffer, response.chunkSize)) {
+		return false;
+	}
+	return FillWindow(peer);
+}
+
+// Decode a chunk into the peer's buffer and check it against the proof that
+// came ahead of it, if the session has proofs. valid says whether it passed;
+// false if the chunk is corrupt or came out of turn.
+bool SwarmDownloader::VerifyChunk(Peer& peer, ChunkResponse& response, char* payload, bool& valid) {
+	valid = true;
+	if (!DecodeChunkPayload(response, payload, peer.buffer, CHUNK_SIZE)) {
+		return false;
+	}
+	if (!peer.proofs) {
+		return true;
+	}
+	if (!peer.haveProof || peer.proofIndex != response.chunkIndex) {
+		std::string msg = "Swarm: chunk without its proof from peer " + peer.ip;
+		WriteLogMessage(msg.c_str());
+		return false;
+	}
+	peer.haveProof = false;
+
+	MerkleHash leaf;
+	valid = MerkleTree::HashLeaf(m_hasher, peer.buffer, response.chunkSize, leaf) &&
+		MerkleTree::VerifyLeaf(m_hasher, leaf, response.chunkIndex, m_leafCount, peer.proof, peer.proofSize, m_root);
+	return true;
+}
+
+// Decide from its root response whether a freshly connected peer can prove
+// its chunks and whether its root is ours; response is NULL for a peer
+// already known not to have proofs. False if the peer was dropped.
+bool SwarmDownloader::CheckPeerRoot(Peer& peer, const ChunkResponse* response, const char* payload) {
+	MerkleHash root;
+	DWORD leafCount = 0;
+	if (response != NULL && response->msgType == MSG_MERKLE_RESPONSE) {
+		if (Crc32c(payload, SHA256_DIGEST_SIZE) != response->crc32) {
+			WriteLogMessage("Invalid Merkle root response");
+			return false;
+		}
+		memcpy(root.bytes, payload, SHA256_DIGEST_SIZE);
+		leafCount = (std::max)(response->totalChunks, (DWORD)1);
+	}
+	else if (response != NULL) {
+		WriteLogMessage("Server does not serve Merkle proofs");
+		peer.noProofs = true;
+	}
+
+	std::string msg;
+	if (peer.noProofs) {
+		if (!m_rootGiven) {
+			return true;
+		}
+		// Its chunks could not be checked against the root we were given
+		msg = "Swarm: peer " + peer.ip + " cannot prove its chunks, dropping it";
+		WriteLogMessage(msg.c_str());
+		peer.dropped = true;
+		return false;
+	}
+	if (!m_haveRoot) {
+		// Trust on first use; the content hash, when there is one, still
+		// checks the whole file at the end
+		m_root = root;
+		m_haveRoot = true;
+		msg = "Swarm: using Merkle root of peer " + peer.ip;
+		WriteLogMessage(msg.c_str());
+	}
+	if (memcmp(root.bytes, m_root.bytes, SHA256_DIGEST_SIZE) != 0 ||
+		(m_leafCount != 0 && leafCount != m_leafCount) || (m_totalChunks != 0 && leafCount != m_totalChunks)) {
+		msg = "Swarm: peer " + peer.ip + " has a different Merkle root, dropping it";
+		WriteLogMessage(msg.c_str());
+		peer.dropped = true;
+		return false;
+	}
+	m_leafCount = leafCount;
+	peer.proofs = true;
+	return true;
+}
+
+// A connected peer is ready for chunks: probe with it if no one is, or fill its window
+bool SwarmDownloader::PeerReady(Peer& peer) {
+	peer.state = PEER_READY;
+	if (m_totalChunks == 0) {
+		StartProbe();
+		return true;
+	}
+	return FillWindow(peer);
+}
+
+// The first ready peer asks for the first missing chunk alone; its answer
+// tells how many chunks there are
+void SwarmDownloader::StartProbe() {
+	if (m_probing != NO_PEER || m_totalChunks != 0 || m_finished) {
+		return;
+	}
+	for (size_t i = 0; i < m_peers.size(); i++) {
+		Peer& peer = *m_peers[i];
+		if (peer.state != PEER_READY) {
+			continue;
+		}
+		m_probing = i;
+		peer.state = PEER_PROBING;
+		if (peer.proofs) {
+			QueueRequest(peer, MSG_MERKLE_REQUEST, m_probeIndex);
+		}
+		QueueRequest(peer, MSG_CHUNK_REQUEST, m_probeIndex);
+		SendQueued(peer, peer.proofs ? 2 : 1);
+		return;
+	}
+}
+
+// The probe chunk is in: size the download and set every peer to work
+bool SwarmDownloader::OnProbe(Peer& peer, const ChunkResponse& response, bool valid) {
+	if (response.chunkIndex != m_probeIndex || !valid) {
+		std::string msg = "Swarm: peer " + peer.ip + " failed the probe";
+		WriteLogMessage(msg.c_str());
+		return false;
+	}
+	m_probing = NO_PEER;
+
+	// An empty file still answers chunk 0, just without data
+	DWORD totalChunks = (std::max)(response.totalChunks, (DWORD)1);
+	if (m_probeIndex >= totalChunks || !m_file.Prepare(totalChunks * BLOCKS_PER_CHUNK)) {
+		WriteLogMessage("Swarm: cannot resume, chunk count does not match");
+		Finish(true);
+		return false;
+	}
+	// Swarm chunks are Merkle leaves
+	if (m_leafCount != 0 && m_leafCount != totalChunks) {
+		WriteLogMessage("Swarm: Merkle tree does not match the file");
+		Finish(true);
+		return false;
+	}
+	m_totalChunks = totalChunks;
+	m_done.assign(m_totalChunks, false);
+	for (DWORD i = 0; i < m_totalChunks; i++) {
+		DWORD block = i * BLOCKS_PER_CHUNK;
+		while (block < (i + 1) * BLOCKS_PER_CHUNK && m_file.IsBlockDone(block)) {
+			block++;
+		}
+		if (block == (i + 1) * BLOCKS_PER_CHUNK) {
+			m_done[i] = true;
+			m_chunksDone++;
+		}
+	}
+	{
+		// Counted in whole chunks until the short last one is seen
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_bytesTotal = (ULONG64)m_totalChunks * CHUNK_SIZE;
+		m_bytesDone = (ULONG64)m_chunksDone * CHUNK_SIZE;
+	}
+	m_owners.assign(m_totalChunks, 0);
+	m_rejectedBy.assign(m_totalChunks, NO_PEER);
+	m_owners[m_probeIndex] = 1;
+
+	std::string msg = "File has " + std::to_string(m_totalChunks) + " chunks, " +
+		std::to_string(m_totalChunks - m_chunksDone) + " still needed";
+	WriteLogMessage(msg.c_str());
+
+	peer.state = PEER_READY;
+	if (!CompleteChunk(peer.index, m_probeIndex, peer.buffer, response.chunkSize)) {
+		return false;
+	}
+	// Peers that failed before the probe came in get another go
+	for (size_t i = 0; i < m_peers.size() && !m_finished; i++) {
+		if (m_peers[i]->state == PEER_PARKED) {
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_retries++;
+			}
+			Connect(*m_peers[i]);
+		}
+	}
+	if (m_finished) {
+		return true;
+	}
+	if (m_localChunks != NULL && m_localChunks->HasChunks()) {
+		return StartLocalCopy(peer);
+	}
+	Kick();
+	return true;
+}
+
+// A peer's connection is gone: give back its chunks, then reconnect it with
+// backoff, park it until the probe is in, or let it go
+void SwarmDownloader::OnPeerClosed(Peer& peer) {
+	PeerState state = peer.state;
+	peer.state = PEER_IDLE;
+	peer.connection = 0;
+	peer.haveProof = false;
+	ReleaseChunks(peer);
+	if (state == PEER_PROBING) {
+		m_probing = NO_PEER;
+	}
+	if (state == PEER_LISTING || state == PEER_COPYING) {
+		EndLocalCopy();
+	}
+
+	std::string msg;
+	if (m_finished) {
+		peer.state = PEER_ENDED;
+		CheckConcluded();
+		return;
+	}
+	if (state == PEER_CONNECTING) {
+		msg = "Swarm: cannot reach peer " + peer.ip;
+		WriteLogMessage(msg.c_str());
+	}
+
+	if (peer.fileNotFound || peer.dropped) {
+		EndPeer(peer);
+	}
+	else if (state == PEER_ROOT && !peer.noProofs) {
+		// Some old servers hang up on a request they don't know; try once
+		// more without proofs
+		msg = "Swarm: peer " + peer.ip + " hung up on the Merkle root request";
+		WriteLogMessage(msg.c_str());
+		peer.noProofs = true;
+		Connect(peer);
+		return;
+	}
+	else if (m_totalChunks == 0) {
+		peer.state = PEER_PARKED;
+	}
+	else {
+		if (peer.chunksServed != peer.servedBefore) {
+			peer.failures = 0;
+			peer.retryDelay = RETRY_DELAY_MS;
+		}
+		if (++peer.failures >= MAX_DOWNLOAD_RETRIES) {
+			msg = "Swarm: dropping peer " + peer.ip;
+			WriteLogMessage(msg.c_str());
+			EndPeer(peer);
+			return;
+		}
+		Peer* retry = &peer;
+		peer.timer = m_engine->AddTimer(peer.retryDelay, [this, retry] {
+			retry->timer = 0;
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_retries++;
+			}
+			Connect(*retry);
+		});
+		peer.retryDelay = (std::min)(peer.retryDelay * 2, (DWORD)MAX_RETRY_DELAY_MS);
+		if (peer.timer == 0) {
+			EndPeer(peer);
+		}
+		return;
+	}
+
+	// Before the probe is in, the download only goes on while some peer is still trying
+	if (m_totalChunks == 0 && !m_finished) {
+		for (size_t i = 0; i < m_peers.size(); i++) {
+			PeerState other = m_peers[i]->state;
+			if (other == PEER_CONNECTING || other == PEER_ROOT || other == PEER_READY || other == PEER_PROBING) {
+				StartProbe();
+				return;
+			}
+		}
+		WriteLogMessage(IsCancelled() ? "Swarm: download cancelled" : "Swarm: no peer could serve the file");
+		Finish(true);
+	}
+}
+
+// Hand out the next chunk to fetch
+bool SwarmDownloader::ClaimChunk(size_t peerIndex, DWORD& chunkIndex, bool allowDuplicate) {
+	// Chunks given back by a failed peer come first. One that failed its
+	// proof goes to a different peer while there is one.
+	std::deque<DWORD>::iterator it = m_retry.begin();
+	while (it != m_retry.end()) {
+		DWORD index = *it;
+		if (m_done[index]) {
+			it = m_retry.erase(it);
+		}
+		else if (m_rejectedBy[index] == peerIndex && m_activePeers > 1) {
+			++it;
+		}
+		else {
+			m_retry.erase(it);
+			m_owners[index]++;
+			chunkIndex = index;
+			return true;
+		}
+	}
+
+	while (m_nextChunk < m_totalChunks) {
+		DWORD index = m_nextChunk++;
+		if (!m_done[index] && m_owners[index] == 0) {
+			m_owners[index]++;
+			chunkIndex = index;
+			return true;
+		}
+	}
+
+	// Endgame: race a chunk that is still outstanding on another peer
+	if (allowDuplicate) {
+		for (DWORD index = 0; index < m_totalChunks; index++) {
+			if (!m_done[index] && m_owners[index] > 0 && m_owners[index] < MAX_CHUNK_OWNERS) {
+				m_owners[index]++;
+				chunkIndex = index;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Top a ready peer's window back up
+bool SwarmDownloader::FillWindow(Peer& peer) {
+	if (m_finished || m_copying || m_totalChunks == 0 || peer.state != PEER_READY) {
+		return true;
+	}
+	size_t before = peer.inFlight.size();
+	DWORD chunkIndex;
+	while (peer.inFlight.size() < m_pipelineDepth && ClaimChunk(peer.index, chunkIndex, peer.inFlight.empty())) {
+		peer.inFlight.push_back(chunkIndex);
+		if (peer.proofs) {
+			QueueRequest(peer, MSG_MERKLE_REQUEST, chunkIndex);
+		}
+		QueueRequest(peer, MSG_CHUNK_REQUEST, chunkIndex);
+	}
+	DWORD added = (DWORD)(peer.inFlight.size() - before);
+	return added == 0 || SendQueued(peer, added * (peer.proofs ? 2 : 1));
+}
+
+// Chunks went back to the pool: put the peers that ran dry back to work
+void SwarmDownloader::Kick() {
+	if (m_finished || m_copying || m_totalChunks == 0) {
+		return;
+	}
+	for (size_t i = 0; i < m_peers.size(); i++) {
+		if (m_peers[i]->state == PEER_READY && m_peers[i]->inFlight.empty()) {
+			FillWindow(*m_peers[i]);
+		}
+	}
+}
+
+// Give back the chunks a peer will no longer deliver
+void SwarmDownloader::ReleaseChunks(Peer& peer) {
+	if (peer.inFlight.empty()) {
+		return;
+	}
+	for (size_t i = 0; i < peer.inFlight.size(); i++) {
+		DWORD index = peer.inFlight[i];
+		m_owners[index]--;
+		if (!m_done[index] && m_owners[index] == 0) {
+			m_retry.push_back(index);
+		}
+	}
+	peer.inFlight.clear();
+	Kick();
+}
+
+// A chunk was bad, as reason says: queue it again at the front for another
+// peer. False once the peer has sent too many bad chunks to keep it.
+bool SwarmDownloader::RejectChunk(Peer& peer, DWORD chunkIndex, const char* reason) {
+	m_owners[chunkIndex]--;
+	m_rejectedBy[chunkIndex] = peer.index;
+	if (!m_done[chunkIndex] && m_owners[chunkIndex] == 0) {
+		m_retry.push_front(chunkIndex);
+	}
+
+	char msg[160];
+	sprintf_s(msg, "Swarm: chunk %lu from peer %s %s", chunkIndex, peer.ip.c_str(), reason);
+	WriteLogMessage(msg);
+	if (++peer.badChunks >= MAX_BAD_CHUNKS) {
+		std::string drop = "Swarm: dropping peer " + peer.ip + " for bad chunks";
+		WriteLogMessage(drop.c_str());
+		peer.dropped = true;
+		return false;
+	}
+	Kick();
+	return true;
+}
+
+// Read a content-defined chunk from whichever shared file the index has it
+// in, and check that it still hashes to its digest. The last file read
+// stays open in hFile for the next call.
+static bool ReadLocalChunk(ShareIndex* index, const ContentChunk& wanted, Sha256& hasher, char* data,
+	HANDLE& hFile, std::string& openPath) {
+	ChunkLocation location;
+	if (!index->FindChunk(wanted.sha256, location) || location.size != wanted.size) {
+		return false;
+	}
+	if (hFile == INVALID_HANDLE_VALUE || location.path != openPath) {
+		if (hFile != INVALID_HANDLE_VALUE) {
+			CloseHandle(hFile);
+		}
+		openPath = location.path;
+		hFile = CreateFileA(openPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+	}
+
+	OVERLAPPED ov = {};
+	ov.Offset = (DWORD)location.offset;
+	ov.OffsetHigh = (DWORD)(location.offset >> 32);
+	DWORD bytesRead = 0;
+	if (!ReadFile(hFile, data, location.size, &bytesRead, &ov) || bytesRead != location.size) {
+		return false;
+	}
+	BYTE digest[SHA256_DIGEST_SIZE];
+	return hasher.Reset() && hasher.Update(data, bytesRead) && hasher.Final(digest) &&
+		memcmp(digest, wanted.sha256, SHA256_DIGEST_SIZE) == 0;
+}
+
+// Fill missing chunks from shared files, see SetLocalChunks. The peer that
+// answered the probe is asked for its chunk list first; the other peers
+// wait until the copy is over.
+bool SwarmDownloader::StartLocalCopy(Peer& peer) {
+	m_copy.reset(new LocalCopy());
+	m_copy->listLength = 0;
+	m_copy->page.resize(CHUNK_LIST_PAGE);
+	m_copy->hFile = INVALID_HANDLE_VALUE;
+	m_copy->fileSize = 0;
+	m_copy->pieceIndex = 0;
+	m_copy->first = 0;
+	m_copy->next = 0;
+	m_copy->proofsIn = 0;
+	m_copy->copied = 0;
+	m_copying = true;
+
+	peer.state = PEER_LISTING;
+	QueueRequest(peer, MSG_CHUNK_LIST_REQUEST, 0);
+	return SendQueued(peer, 1);
+}
+
+// A page of the peer's content-defined chunks is in
+bool SwarmDownloader::OnChunkList(Peer& peer, const ChunkResponse& response, char* payload) {
+	LocalCopy& copy = *m_copy;
+	if (response.msgType != MSG_CHUNK_LIST_RESPONSE) {
+		WriteLogMessage("Server has no chunk list for the file");
+		peer.state = PEER_READY;
+		EndLocalCopy();
+		return true;
+	}
+
+	DWORD count = response.chunkSize / sizeof(ChunkListEntry);
+	if (copy.remote.empty()) {
+		copy.listLength = response.totalChunks;
+	}
+	if (response.chunkIndex != copy.remote.size() || response.totalChunks != copy.listLength ||
+		response.chunkSize != count * sizeof(ChunkListEntry) || count > copy.listLength - copy.remote.size() ||
+		(count == 0 && copy.listLength != 0) || Crc32c(count ? payload : NULL, response.chunkSize) != response.crc32) {
+		WriteLogMessage("Invalid chunk list response");
+		return false;
+	}
+	for (DWORD i = 0; i < count; i++) {
+		if (copy.page[i].size == 0 || copy.page[i].size > CDC_MAX_SIZE) {
+			WriteLogMessage("Invalid chunk list response");
+			return false;
+		}
+		ContentChunk chunk;
+		chunk.offset = copy.fileSize;
+		chunk.size = copy.page[i].size;
+		memcpy(chunk.sha256, copy.page[i].sha256, sizeof(chunk.sha256));
+		copy.remote.push_back(chunk);
+		copy.fileSize += chunk.size;
+	}
+	if (copy.remote.size() < copy.listLength) {
+		QueueRequest(peer, MSG_CHUNK_LIST_REQUEST, (DWORD)copy.remote.size());
+		return SendQueued(peer, 1);
+	}
+
+	// The list has to describe the file the chunks are counted in
+	if (copy.remote.empty() || (copy.fileSize + CHUNK_SIZE - 1) / CHUNK_SIZE != m_totalChunks) {
+		peer.state = PEER_READY;
+		EndLocalCopy();
+		return true;
+	}
+	copy.piece.resize(CDC_MAX_SIZE);
+	copy.pieceIndex = copy.remote.size();
+	copy.data.resize(m_pipelineDepth * CHUNK_SIZE);
+	peer.state = PEER_COPYING;
+	return CopyNextBatch(peer);
+}
+
+// Gather the next pipeline's worth of chunks that shared files can make up
+// and ask for their proofs, or store them straight away if the peer has
+// none. Ends the copy once every chunk has been looked at.
+bool SwarmDownloader::CopyNextBatch(Peer& peer) {
+	LocalCopy& copy = *m_copy;
+	while (true) {
+		copy.batch.clear();
+		copy.sizes.clear();
+		while (copy.next < m_totalChunks && copy.batch.size() < m_pipelineDepth) {
+			DWORD i = copy.next++;
+			if (m_done[i]) {
+				continue;
+			}
+			ULONG64 start = (ULONG64)i * CHUNK_SIZE;
+			ULONG64 end = (std::min)(start + CHUNK_SIZE, copy.fileSize);
+			while (copy.first < copy.remote.size() && copy.remote[copy.first].offset + copy.remote[copy.first].size <= start) {
+				copy.first++;
+			}
+
+			// A remote chunk often straddles two swarm chunks, piece keeps it for the second
+			char* chunk = &copy.data[copy.batch.size() * CHUNK_SIZE];
+			bool local = true;
+			for (size_t p = copy.first; local && p < copy.remote.size() && copy.remote[p].offset < end; p++) {
+				if (p != copy.pieceIndex) {
+					local = ReadLocalChunk(m_localChunks, copy.remote[p], m_hasher, &copy.piece[0], copy.hFile, copy.openPath);
+					copy.pieceIndex = local ? p : copy.remote.size();
+				}
+				if (local) {
+					ULONG64 from = (std::max)(start, copy.remote[p].offset);
+					ULONG64 to = (std::min)(end, copy.remote[p].offset + copy.remote[p].size);
+					memcpy(chunk + (from - start), &copy.piece[from - copy.remote[p].offset], (size_t)(to - from));
+				}
+			}
+			if (local) {
+				copy.batch.push_back(i);
+				copy.sizes.push_back((DWORD)(end - start));
+			}
+		}
+
+		if (copy.batch.empty()) {
+			peer.state = PEER_READY;
+			EndLocalCopy();
+			return true;
+		}
+		if (peer.proofs) {
+			copy.valid.assign(copy.batch.size(), false);
+			copy.proofsIn = 0;
+			for (size_t i = 0; i < copy.batch.size(); i++) {
+				QueueRequest(peer, MSG_MERKLE_REQUEST, copy.batch[i]);
+			}
+			return SendQueued(peer, (DWORD)copy.batch.size());
+		}
+		copy.valid.assign(copy.batch.size(), true);
+		if (!StoreLocalChunks()) {
+			return false;
+		}
+		if (m_finished) {
+			return true;
+		}
+	}
+}
+
+// The proof for the next chunk of the batch is in
+bool SwarmDownloader::OnCopyProof(Peer& peer, const ChunkResponse& response, char* payload) {
+	LocalCopy& copy = *m_copy;
+	size_t i = copy.proofsIn;
+	if (i >= copy.batch.size() || response.chunkIndex != copy.batch[i] ||
+		Crc32c(payload, response.chunkSize) != response.crc32) {
+		std::string msg = "Swarm: unexpected proof from peer " + peer.ip;
+		WriteLogMessage(msg.c_str());
+		return false;
+	}
+	MerkleHash leaf;
+	copy.valid[i] = MerkleTree::HashLeaf(m_hasher, &copy.data[i * CHUNK_SIZE], copy.sizes[i], leaf) &&
+		MerkleTree::VerifyLeaf(m_hasher, leaf, copy.batch[i], m_leafCount, (const BYTE*)payload, response.chunkSize, m_root);
+	if (++copy.proofsIn < copy.batch.size()) {
+		return true;
+	}
+	if (!StoreLocalChunks()) {
+		return false;
+	}
+	return m_finished || CopyNextBatch(peer);
+}
+
+// Store the chunks of the batch that passed. False if a write failed.
+bool SwarmDownloader::StoreLocalChunks() {
+	LocalCopy& copy = *m_copy;
+	for (size_t i = 0; i < copy.batch.size(); i++) {
+		if (!copy.valid[i]) {
+			// The network copy will have to do
+			continue;
+		}
+		m_owners[copy.batch[i]]++;
+		if (!CompleteChunk(NO_PEER, copy.batch[i], &copy.data[i * CHUNK_SIZE], copy.sizes[i])) {
+			return false;
+		}
+		copy.copied++;
+	}
+	return true;
+}
+
+// The copy is over, finished or not; the peers can download the rest
+void SwarmDownloader::EndLocalCopy() {
+	if (!m_copy) {
+		return;
+	}
+	if (m_copy->hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_copy->hFile);
+	}
+	if (!m_copy->piece.empty()) {
+		char msg[128];
+		sprintf_s(msg, "Swarm: %lu of %lu chunks copied from shared files", m_copy->copied, m_totalChunks);
+		WriteLogMessage(msg);
+	}
+	m_copy.reset();
+	m_copying = false;
+	Kick();
+}
+
+// Store a verified chunk unless another peer already delivered it
+bool SwarmDownloader::CompleteChunk(size_t peerIndex, DWORD chunkIndex, const char* data, DWORD size) {
+	// Only the last chunk can be short; a short one elsewhere would leave a
+	// hole in the file that nothing fills
+	if (size != CHUNK_SIZE && chunkIndex != m_totalChunks - 1) {
+		if (peerIndex != NO_PEER) {
+			return RejectChunk(*m_peers[peerIndex], chunkIndex, "came back short");
+		}
+		m_owners[chunkIndex]--;
+		if (!m_done[chunkIndex] && m_owners[chunkIndex] == 0) {
+			m_retry.push_front(chunkIndex);
+		}
+		return true;
+	}
+	m_owners[chunkIndex]--;
+	if (m_done[chunkIndex] || m_finished) {
+		return true;
+	}
+	m_done[chunkIndex] = true;
+
+	if (!m_file.WriteChunk(chunkIndex * BLOCKS_PER_CHUNK, BLOCKS_PER_CHUNK, data, size)) {
+		Finish(true);
+		return false;
+	}
+
+	// NO_PEER for a chunk copied from a shared file
+	if (peerIndex != NO_PEER) {
+		m_peers[peerIndex]->chunksServed++;
+	}
+	m_chunksDone++;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (peerIndex != NO_PEER) {
+			m_bytesReceived += size;
+		}
+		m_bytesDone += size;
+		// Only the last chunk can be short, it tells the real file size
+		if (chunkIndex == m_totalChunks - 1) {
+			m_bytesTotal -= CHUNK_SIZE - size;
+		}
+	}
+
+	int progressPercent = (int)(((ULONG64)m_chunksDone * 100) / m_totalChunks);
+	if (progressPercent / 10 != m_lastProgress / 10) {
+		m_lastProgress = progressPercent;
+		char msg[128];
+		sprintf_s(msg, "Progress: %lu/%lu chunks (%d%%)", m_chunksDone, m_totalChunks, progressPercent);
+		WriteLogMessage(msg);
+	}
+
+	if (m_chunksDone == m_totalChunks) {
+		Finish(false);
+	}
+	return true;
+}
+
+// End the download: close every peer and stop the reconnect timers. The
+// result goes out once the last connection has closed.
+void SwarmDownloader::Finish(bool failed) {
+	if (m_finished) {
+		return;
+	}
+	m_finished = true;
+	m_failed = failed;
+	for (size_t i = 0; i < m_peers.size(); i++) {
+		Peer& peer = *m_peers[i];
+		if (peer.timer != 0) {
+			m_engine->CancelTimer(peer.timer);
+			peer.timer = 0;
+		}
+		if (peer.connection != 0) {
+			m_engine->Close(peer.connection);
+		}
+	}
+	CheckConcluded();
+}
+
+// Complete the output once a finished download has no connection left
+void SwarmDownloader::CheckConcluded() {
+	if (!m_finished || m_concluded) {
+		return;
+	}
+	for (size_t i = 0; i < m_peers.size(); i++) {
+		if (m_peers[i]->connection != 0) {
+			return;
+		}
+	}
+
+	bool result = !m_failed && m_totalChunks != 0 && m_chunksDone == m_totalChunks;
+	if (result) {
+		result = m_file.Complete();
+	}
+	for (size_t i = 0; i < m_peers.size(); i++) {
+		std::string msg = "Swarm: " + m_peers[i]->ip + " served " + std::to_string(m_peers[i]->chunksServed) + " chunks";
+		WriteLogMessage(msg.c_str());
+	}
+	WriteLogMessage(result ? "Swarm download completed successfully" :
+		IsCancelled() ? "Swarm download cancelled" : "Swarm download failed");
+	Conclude(result);
+}
+
+// Let go of the output and the buffers and report the result
+void SwarmDownloader::Conclude(bool result) {
+	m_concluded = true;
+	m_file.Close();
+	for (size_t i = 0; i < m_peers.size(); i++) {
+		if (m_peers[i]->buffer != NULL) {
+			m_buffers.Release(m_peers[i]->buffer);
+			m_peers[i]->buffer = NULL;
+		}
+	}
+
+	CompletionCallback done;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		done.swap(m_onFinished);
+		m_engine = NULL;
+	}
+	done(result);
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <winsock2.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <functional>
+
+#include "tcpdef.h"
+#include "chunkfile.h"
+#include "bufferpool.h"
+#include "merkle.h"
+#include "cdc.h"
+#include "asyncclient.h"
+
+class ShareIndex;
+
+// How far a swarm download has got
+struct SwarmProgress {
+	ULONG64 bytesDone;		// on disk, including what an earlier run left
+	ULONG64 bytesTotal;		// 0 until a peer has answered, exact once the last chunk is in
+	ULONG64 bytesReceived;	// by this run
+	DWORD retries;			// reconnects to peers that had dropped
+};
+
+/**
+* @brief Downloads one file from several peers at the same time
+*
+* Each peer is a session on an AsyncTransferEngine with a pipelined window of
+* chunk requests; all of them, and all the swarms sharing the engine, run on
+* its one thread. Chunk indices are handed out on demand, so a peer that
+* answers faster comes back for work sooner and ends up serving a bigger
+* share of the file. Once every chunk has been handed out, a peer that runs
+* dry re-requests a chunk still outstanding on another peer (endgame), so a
+* slow peer does not decide when the download finishes. Chunks are written in
+* place through ChunkFile, so an interrupted swarm download resumes from the
+* chunk map like a single-peer one. A peer whose connection drops is
+* reconnected with backoff. Swarm sessions don't negotiate a chunk size:
+* every peer, old or new, serves the same CHUNK_SIZE chunks, so work can move
+* freely between them. With a content hash the peers are asked for the bytes
+* rather than the name, and the result is checked against the hash as it is
+* written. A peer is given as "ip" to find its port among SERVER_PORTS, or as
+* "ip:port".
+*
+* Chunks are also checked one by one against a Merkle root, either given by
+* the caller or taken from the first peer that serves one. Each chunk request
+* goes out behind a request for its proof. A chunk that fails its proof is
+* queued again for a different peer right away, and a peer that keeps sending
+* bad chunks, or has a different root, is dropped. Peers that cannot send
+* proofs are only used while the root is taken on trust; with a root from the
+* caller they are dropped, so no chunk is written without being checked.
+*
+* With SetLocalChunks the first peer to serve the file is also asked for its
+* content-defined chunks. Every missing swarm chunk made up entirely of
+* chunks that some shared file holds is copied from those files instead of
+* downloaded. Each piece is checked against its digest as it is read, and
+* the copied chunk against its Merkle proof when the peer sends proofs.
+*
+* Cancel can be called from any thread while the download is going. It stops
+* the peers the way a finished download does and leaves the chunk map
+* behind, so a later run on the same output picks up from there.
+*/
+class SwarmDownloader {
+public:
+	// Called on the engine thread with the result, as the swarm's last action
+	typedef std::function<void(bool)> CompletionCallback;
+
+	SwarmDownloader(const std::vector<std::string>& peers, const std::string& filename, const std::string& outputPath);
+	~SwarmDownloader();
+	SwarmDownloader(const SwarmDownloader&) = delete;
+	SwarmDownloader& operator=(const SwarmDownloader&) = delete;
+
+	void SetPipelineDepth(DWORD depth);
+	void SetContentHash(const std::string& sha256Hex);
+	bool SetMerkleRoot(const std::string& rootHex);
+	// Copy chunks that shared files already hold instead of downloading them; call before Start
+	void SetLocalChunks(ShareIndex* index) { m_localChunks = index; }
+	// Run the download on a running engine, done hears how it ended; false if the engine refused it
+	bool Start(AsyncTransferEngine* engine, const CompletionCallback& done);
+	// Run the download on an engine of its own and wait for it
+	bool Run();
+	// Make the download give up and report false as soon as it can
+	void Cancel();
+	void GetProgress(SwarmProgress& progress);
+
+private:
+	enum PeerState {
+		PEER_IDLE,			// waiting to reconnect
+		PEER_PARKED,		// failed before the chunk count was known, tried again once it is
+		PEER_CONNECTING,
+		PEER_ROOT,			// asked for the Merkle root
+		PEER_READY,			// streaming chunks, or waiting for the probe
+		PEER_PROBING,		// fetching the first missing chunk alone
+		PEER_LISTING,		// fetching the content-defined chunk list
+		PEER_COPYING,		// fetching proofs for chunks copied from shared files
+		PEER_ENDED
+	};
+
+	// One peer's session on the engine
+	struct Peer : public AsyncSession {
+		SwarmDownloader* swarm;
+		size_t index;
+		std::string ip;
+		int port;			// 0 to discover it
+		PeerState state;
+		DWORD connection;
+		DWORD timer;
+		DWORD chunksServed;
+		DWORD servedBefore;	// chunksServed when the connection was made
+		DWORD badChunks;
+		DWORD failures;		// reconnects in a row without progress
+		DWORD retryDelay;
+		bool noProofs;		// the peer refused MSG_MERKLE_REQUEST, don't ask again
+		bool proofs;		// this session's chunks come with Merkle proofs
+		bool dropped;
+		bool fileNotFound;
+
+		std::vector<DWORD> inFlight;		// chunk indices in the order they were asked for
+		std::vector<ChunkRequest> requests;	// send buffer, reused for every batch
+		char* buffer;						// CHUNK_SIZE from m_buffers
+		std::vector<char> packed;			// a compressed chunk until it is decoded into buffer
+		BYTE proof[MERKLE_MAX_PROOF_SIZE];	// the proof ahead of the next chunk, or the root
+		DWORD proofSize;
+		DWORD proofIndex;
+		bool haveProof;
+
+		bool OnConnected();
+		char* OnResponseHeader(const ChunkResponse& header, DWORD& payloadSize);
+		bool OnResponse(const ChunkResponse& header, char* payload);
+		void OnClosed();
+	};
+
+	// Chunks being copied from shared files, see SetLocalChunks
+	struct LocalCopy {
+		ChunkList remote;
+		DWORD listLength;	// entries the peer says the list has
+		std::vector<ChunkListEntry> page;
+		HANDLE hFile;
+		std::string openPath;
+		std::vector<char> piece;
+		size_t pieceIndex;	// which remote chunk piece holds
+		ULONG64 fileSize;
+		size_t first;		// first remote chunk that can still overlap
+		DWORD next;			// next swarm chunk to look at
+		std::vector<char> data;
+		std::vector<DWORD> batch;
+		std::vector<DWORD> sizes;
+		std::vector<bool> valid;
+		size_t proofsIn;
+		DWORD copied;
+	};
+
+	// At most this many peers ask for the same chunk during the endgame
+	static const BYTE MAX_CHUNK_OWNERS = 2;
+	// Chunks failing their proof before a peer is dropped
+	static const DWORD MAX_BAD_CHUNKS = 3;
+	static const size_t NO_PEER = (size_t)-1;
+
+	std::vector<Peer*> m_peers;
+	std::string m_filename;
+	std::string m_requestName;	// the filename or the content hash
+	DWORD m_requestFlags;
+	std::string m_outputPath;
+	ChunkFile m_file;
+	ChunkBufferPool m_buffers;	// one receive buffer per peer
+	DWORD m_pipelineDepth;
+	AsyncTransferEngine* m_engine;
+	CompletionCallback m_onFinished;
+
+	// Guards what other threads read: the progress figures and m_cancelled
+	std::mutex m_lock;
+	bool m_cancelled;
+	ULONG64 m_bytesDone;
+	ULONG64 m_bytesTotal;
+	ULONG64 m_bytesReceived;
+	DWORD m_retries;
+
+	// Engine thread only
+	DWORD m_probeIndex;
+	size_t m_probing;	// peer fetching the probe chunk, NO_PEER if none
+	bool m_copying;
+	std::unique_ptr<LocalCopy> m_copy;
+	DWORD m_totalChunks;
+	DWORD m_nextChunk;
+	DWORD m_chunksDone;
+	DWORD m_activePeers;
+	int m_lastProgress;
+	bool m_finished;
+	bool m_failed;
+	bool m_concluded;
+	std::vector<bool> m_done;
+	std::vector<BYTE> m_owners;
+	std::deque<DWORD> m_retry;
+	std::vector<size_t> m_rejectedBy;	// last peer whose copy failed its proof
+	Sha256 m_hasher;
+
+	bool m_haveRoot;
+	bool m_rootGiven;	// by SetMerkleRoot, not taken from a peer
+	MerkleHash m_root;
+	DWORD m_leafCount;	// 0 until a peer reports it
+	ShareIndex* m_localChunks;
+
+	bool IsCancelled();
+	void Begin();
+	void Connect(Peer& peer);
+	void EndPeer(Peer& peer);
+	void QueueRequest(Peer& peer, MessageType msgType, DWORD index);
+	bool SendQueued(Peer& peer, DWORD responses);
+	char* PayloadFor(Peer& peer, const ChunkResponse& header, DWORD& payloadSize);
+	bool OnPeerResponse(Peer& peer, ChunkResponse& response, char* payload);
+	void OnPeerClosed(Peer& peer);
+	bool CheckPeerRoot(Peer& peer, const ChunkResponse* response, const char* payload);
+	bool PeerReady(Peer& peer);
+	void StartProbe();
+	bool OnProbe(Peer& peer, const ChunkResponse& response, bool valid);
+	bool VerifyChunk(Peer& peer, ChunkResponse& response, char* payload, bool& valid);
+	bool ClaimChunk(size_t peerIndex, DWORD& chunkIndex, bool allowDuplicate);
+	bool FillWindow(Peer& peer);
+	void Kick();
+	void ReleaseChunks(Peer& peer);
+	bool RejectChunk(Peer& peer, DWORD chunkIndex, const char* reason);
+	bool CompleteChunk(size_t peerIndex, DWORD chunkIndex, const char* data, DWORD size);
+	void Finish(bool failed);
+	void CheckConcluded();
+	void Conclude(bool result);
+	bool StartLocalCopy(Peer& peer);
+	bool OnChunkList(Peer& peer, const ChunkResponse& response, char* payload);
+	bool CopyNextBatch(Peer& peer);
+	bool OnCopyProof(Peer& peer, const ChunkResponse& response, char* payload);
+	bool StoreLocalChunks();
+	void EndLocalCopy();
+};
\ No newline at end of file
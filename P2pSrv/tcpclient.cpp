@@ -1,10 +1,16 @@
 #include "tcpclient.h"
+#include "eventlog.h"
+#include "chunkfile.h"
+#include "crc32c.h"
+#include "bufferpool.h"
+#include "lz4.h"
 
 #include <ws2tcpip.h>
 #include <windows.h>
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <algorithm>
 #include <sstream>
 #include <strsafe.h>
 
@@ -16,52 +22,7 @@
 */
 void TCPFileClient::WriteToEventLog(const char* pszMessage)
 {
-
-	static char logFilePath[MAX_PATH] = { 0 };
-
-	// Build the log file path once
-	if (logFilePath[0] == 0)
-	{
-		char tempPath[MAX_PATH];
-		if (GetTempPathA(MAX_PATH, tempPath))
-		{
-			StringCchPrintfA(logFilePath, MAX_PATH, "%s%s", tempPath, "MyServiceApp.log");
-		}
-		else
-		{
-			return; // Failed to get temp path
-		}
-	}
-
-
-	// Open the log file in append mode
-	HANDLE hFile = CreateFileA(
-		logFilePath,
-		FILE_APPEND_DATA,
-		FILE_SHARE_READ,
-		NULL,
-		OPEN_ALWAYS,
-		FILE_ATTRIBUTE_NORMAL,
-		NULL
-		);
-
-	if (hFile != INVALID_HANDLE_VALUE)
-	{
-		DWORD written;
-		SYSTEMTIME st;
-		GetLocalTime(&st);
-
-		char buffer[1024];
-		StringCchPrintfA(buffer, 1024, "[%04d-%02d-%02d %02d:%02d:%02d] %s\r\n",
-			st.wYear, st.wMonth, st.wDay,
-			st.wHour, st.wMinute, st.wSecond,
-			pszMessage);
-
-		WriteFile(hFile, buffer, lstrlenA(buffer), &written, NULL);
-		CloseHandle(hFile);
-	}
-
-
+	WriteLogMessage(pszMessage);
 }
 
 
@@ -86,7 +47,11 @@ std::string generateOutputPath(const std::string& filename) {
 
 // Constructor
 TCPFileClient::TCPFileClient(const std::string& serverIP, int serverPort)
-	: m_serverIP(serverIP), m_serverPort(serverPort), m_connected(false) {
+	: m_serverIP(serverIP), m_serverPort(serverPort), m_connected(false),
+	m_pipelineDepth(DEFAULT_PIPELINE_DEPTH), m_fileNotFound(false), m_hashMismatch(false), m_chunksReceived(0),
+	m_preferredChunkSize(CHUNK_SIZE), m_adaptive(false), m_legacyPeer(false), m_negotiated(false),
+	m_chunkSize(CHUNK_SIZE), m_rttMs(0), m_haveHandle(false), m_fileHandle(0), m_openTotalChunks(0),
+	m_noProofs(false), m_compression(true) {
 	m_socket = INVALID_SOCKET;
 }
 
@@ -118,6 +83,10 @@ bool TCPFileClient::Connect() {
 	setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
 	setsockopt(m_socket, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
 
+	// Requests are small and pipelined, don't let Nagle hold them back
+	BOOL noDelay = TRUE;
+	setsockopt(m_socket, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+
 	sockaddr_in serverAddr;
 	serverAddr.sin_family = AF_INET;
 	serverAddr.sin_port = htons(m_serverPort);
@@ -144,14 +113,26 @@ void TCPFileClient::Disconnect() {
 		m_socket = INVALID_SOCKET;
 	}
 	m_connected = false;
+	m_negotiated = false;
+	m_chunkSize = CHUNK_SIZE;
+	m_haveHandle = false;
+}
+
+// Shut the connection down so a recv blocked on another thread returns.
+// The socket itself is released by Disconnect on the owning thread.
+void TCPFileClient::Abort() {
+	SOCKET s = m_socket;
+	if (s != INVALID_SOCKET) {
+		shutdown(s, SD_BOTH);
+	}
 }
 
 // Connect with port discovery
 bool TCPFileClient::ConnectWithPortDiscovery() {
-	std::vector<int> ports = { 8080, 9000, 8888, 9001, 9002 };
 	WriteToEventLog("Discovering server port...");
 
-	for (int port : ports) {
+	for (size_t i = 0; i < SERVER_PORT_COUNT; i++) {
+		int port = SERVER_PORTS[i];
 		m_serverPort = port;
 		std::string msg = "Trying to connect to port " + std::to_string(port) + "...";
 		WriteToEventLog(msg.c_str());
@@ -169,124 +150,656 @@ bool TCPFileClient::ConnectWithPortDiscovery() {
 	return false;
 }
 
-// Download file from connected server
-bool TCPFileClient::DownloadFile(const std::string& filename, const std::string& outputPath) {
-	if (!m_connected) {
-		WriteToEventLog("Not connected to server");
+// Fill in a request frame, naming the content hash instead of the file when one is set
+void TCPFileClient::FillRequest(ChunkRequest& request, MessageType msgType, const std::string& filename, DWORD chunkIndex) {
+	const std::string& name = m_contentHash.empty() ? filename : m_contentHash;
+	request.msgType = msgType;
+	strncpy_s(request.filename, name.c_str(), MAX_FILENAME - 1);
+	request.filename[MAX_FILENAME - 1] = '\0';
+	request.chunkIndex = chunkIndex;
+	request.flags = REQ_FLAG_CRC32C | (m_contentHash.empty() ? 0 : REQ_FLAG_BY_HASH) |
+		(m_compression ? REQ_FLAG_COMPRESS : 0);
+}
+
+// Send requests for the given chunks, up to MAX_PIPELINE_DEPTH per send.
+// withProofs puts a MSG_MERKLE_REQUEST for each chunk's leaf in front of it,
+// so every chunk response arrives right after its proof.
+bool TCPFileClient::SendChunkRequests(const std::string& filename, const DWORD* chunkIndices, DWORD count, bool withProofs) {
+	while (count > 0) {
+		DWORD batch = (std::min)(count, (DWORD)MAX_PIPELINE_DEPTH);
+		DWORD frames = 0;
+		for (DWORD i = 0; i < batch; i++) {
+			if (withProofs) {
+				FillRequest(m_requests[frames++], MSG_MERKLE_REQUEST, filename, chunkIndices[i]);
+			}
+			FillRequest(m_requests[frames++], MSG_CHUNK_REQUEST, filename, chunkIndices[i]);
+		}
+
+		int bytes = (int)(frames * sizeof(ChunkRequest));
+		if (send(m_socket, (char*)m_requests, bytes, 0) != bytes) {
+			WriteToEventLog("Failed to send request");
+			return false;
+		}
+		chunkIndices += batch;
+		count -= batch;
+	}
+	return true;
+}
+
+// Send a MSG_MERKLE_REQUEST for each leaf and nothing else, for chunks the
+// caller already has and only needs to check
+bool TCPFileClient::SendProofRequests(const std::string& filename, const DWORD* leafIndices, DWORD count) {
+	while (count > 0) {
+		DWORD batch = (std::min)(count, (DWORD)MAX_PIPELINE_DEPTH);
+		for (DWORD i = 0; i < batch; i++) {
+			FillRequest(m_requests[i], MSG_MERKLE_REQUEST, filename, leafIndices[i]);
+		}
+
+		int bytes = (int)(batch * sizeof(ChunkRequest));
+		if (send(m_socket, (char*)m_requests, bytes, 0) != bytes) {
+			WriteToEventLog("Failed to send proof request");
+			return false;
+		}
+		leafIndices += batch;
+		count -= batch;
+	}
+	return true;
+}
+
+// Receive and validate one response header
+bool TCPFileClient::ReceiveChunkHeader(ChunkResponse& response) {
+	int bytesReceived = recv(m_socket, (char*)&response, sizeof(response), MSG_WAITALL);
+	if (bytesReceived != sizeof(response)) {
+		WriteToEventLog("Failed to receive response header");
 		return false;
 	}
 
-	std::ofstream outputFile(outputPath, std::ios::binary | std::ios::trunc);
-	if (!outputFile.is_open()) {
-		WriteToEventLog("Cannot create output file");
+	if (response.msgType == MSG_FILE_NOT_FOUND) {
+		m_fileNotFound = true;
+		WriteToEventLog("File not found on server");
 		return false;
 	}
 
-	DWORD chunkIndex = 0;
-	DWORD totalChunks = 0;
-	bool firstChunk = true;
+	if (response.msgType == MSG_ERROR) {
+		WriteToEventLog("Server error occurred");
+		return false;
+	}
 
-	std::string msg = "Downloading " + filename + "...";
-	WriteToEventLog(msg.c_str());
+	if (response.msgType != MSG_CHUNK_RESPONSE && response.msgType != MSG_CHUNK_RESPONSE_CRC32C &&
+		response.msgType != MSG_MERKLE_RESPONSE && response.msgType != MSG_CHUNK_RESPONSE_COMPRESSED) {
+		WriteToEventLog("Invalid response type");
+		return false;
+	}
 
-	while (true) {
-		ChunkRequest request;
-		request.msgType = MSG_CHUNK_REQUEST;
-		strncpy_s(request.filename, filename.c_str(), MAX_FILENAME - 1);
-		request.filename[MAX_FILENAME - 1] = '\0';
-		request.chunkIndex = chunkIndex;
-		request.reserved = 0;
-
-		if (send(m_socket, (char*)&request, sizeof(request), 0) == SOCKET_ERROR) {
-			WriteToEventLog("Failed to send request");
+	// Compressed chunks are smaller than they would be raw, plus their codec header
+	DWORD maxSize = m_chunkSize + ((response.msgType == MSG_CHUNK_RESPONSE_COMPRESSED) ? sizeof(ChunkCodecHeader) : 0);
+	if (response.chunkSize > maxSize ||
+		(response.msgType == MSG_MERKLE_RESPONSE && response.chunkSize > MERKLE_MAX_PROOF_SIZE)) {
+		WriteToEventLog("Invalid chunk size in response");
+		return false;
+	}
+	return true;
+}
+
+// Receive one chunk or proof response and its payload into buffer
+// (GetChunkSize() bytes, MERKLE_MAX_PROOF_SIZE is enough for proofs). A
+// compressed chunk is decoded into buffer and handed back as an ordinary
+// MSG_CHUNK_RESPONSE_CRC32C of its uncompressed size.
+bool TCPFileClient::ReceiveChunk(ChunkResponse& response, char* buffer) {
+	if (!ReceiveChunkHeader(response)) {
+		return false;
+	}
+
+	bool compressed = response.msgType == MSG_CHUNK_RESPONSE_COMPRESSED;
+	if (compressed && m_packed.size() < response.chunkSize) {
+		m_packed.resize(response.chunkSize);
+	}
+	char* target = compressed ? &m_packed[0] : buffer;
+	int bytesReceived = recv(m_socket, target, response.chunkSize, MSG_WAITALL);
+	if (bytesReceived != (int)response.chunkSize) {
+		WriteToEventLog("Failed to receive chunk data");
+		return false;
+	}
+
+	return DecodeChunkPayload(response, target, buffer, m_chunkSize);
+}
+
+// Check a chunk or proof payload that came off the wire. A compressed chunk
+// is decoded from packed into buffer, at most maxRawSize bytes, and handed
+// back as an ordinary MSG_CHUNK_RESPONSE_CRC32C of its uncompressed size;
+// any other payload is already in buffer.
+bool DecodeChunkPayload(ChunkResponse& response, const char* packed, char* buffer, DWORD maxRawSize) {
+	if (response.msgType == MSG_CHUNK_RESPONSE_COMPRESSED) {
+		ChunkCodecHeader codec;
+		if (response.chunkSize < sizeof(codec)) {
+			WriteLogMessage("Invalid compressed chunk");
 			return false;
 		}
+		memcpy(&codec, packed, sizeof(codec));
+		if (codec.codec != CODEC_LZ4 || codec.rawSize > maxRawSize ||
+			Lz4Decompress((const BYTE*)packed + sizeof(codec), response.chunkSize - sizeof(codec),
+				(BYTE*)buffer, codec.rawSize) != (int)codec.rawSize) {
+			WriteLogMessage("Compressed chunk does not decode - data corruption detected");
+			return false;
+		}
+		response.msgType = MSG_CHUNK_RESPONSE_CRC32C;
+		response.chunkSize = codec.rawSize;
+	}
 
-		ChunkResponse response;
-		int bytesReceived = recv(m_socket, (char*)&response, sizeof(response), MSG_WAITALL);
-		if (bytesReceived != sizeof(response)) {
-			WriteToEventLog("Failed to receive response header");
+	// Peers that predate REQ_FLAG_CRC32C answer with the byte sum
+	DWORD calculatedCRC = (response.msgType != MSG_CHUNK_RESPONSE) ?
+		Crc32c(buffer, response.chunkSize) : AdditiveChecksum(buffer, response.chunkSize);
+	if (calculatedCRC != response.crc32) {
+		WriteLogMessage("Chunk CRC mismatch - data corruption detected");
+		return false;
+	}
+	return true;
+}
+
+// Set how many chunk requests are kept outstanding (1 = stop-and-wait)
+void TCPFileClient::SetPipelineDepth(DWORD depth) {
+	if (depth < 1) {
+		depth = 1;
+	}
+	if (depth > MAX_PIPELINE_DEPTH) {
+		depth = MAX_PIPELINE_DEPTH;
+	}
+	m_pipelineDepth = depth;
+}
+
+// Chunk size to propose with HELLO, rounded up to a power of two in range
+void TCPFileClient::SetChunkSize(DWORD chunkSize) {
+	DWORD size = MIN_CHUNK_SIZE;
+	while (size < chunkSize && size < MAX_CHUNK_SIZE) {
+		size *= 2;
+	}
+	m_preferredChunkSize = size;
+}
+
+// Agree on a chunk size with the server. Must be called with nothing in
+// flight. A server that does not know HELLO leaves the session on CHUNK_SIZE
+// chunks; false only if the connection failed.
+bool TCPFileClient::Negotiate(DWORD chunkSize) {
+	ChunkRequest hello = {};
+	hello.msgType = MSG_HELLO;
+	hello.chunkIndex = chunkSize;
+	hello.flags = REQ_FLAG_CRC32C;
+
+	ULONGLONG sent = GetTickCount64();
+	if (send(m_socket, (char*)&hello, sizeof(hello), 0) != sizeof(hello)) {
+		WriteToEventLog("Failed to send HELLO");
+		return false;
+	}
+
+	ChunkResponse response;
+	if (recv(m_socket, (char*)&response, sizeof(response), MSG_WAITALL) != sizeof(response)) {
+		// Some old servers just hang up on a message they don't know
+		WriteToEventLog("Server dropped the connection on HELLO, using fixed chunks");
+		m_legacyPeer = true;
+		return false;
+	}
+	m_rttMs = (DWORD)(GetTickCount64() - sent);
+
+	if (response.msgType == MSG_HELLO_RESPONSE && response.chunkSize >= MIN_CHUNK_SIZE &&
+		response.chunkSize <= MAX_CHUNK_SIZE && (response.chunkSize & (response.chunkSize - 1)) == 0) {
+		m_negotiated = true;
+		m_chunkSize = response.chunkSize;
+		char msg[64];
+		sprintf_s(msg, "Chunk size %lu bytes, RTT %lu ms", m_chunkSize, m_rttMs);
+		WriteToEventLog(msg);
+	}
+	else if (!m_negotiated) {
+		WriteToEventLog("Server does not negotiate chunk size, using fixed chunks");
+		m_legacyPeer = true;
+	}
+	return true;
+}
+
+// Fetch the Merkle root and leaf count of filename. Returns false if the
+// connection failed; a server without trees leaves SupportsProofs() false.
+bool TCPFileClient::GetMerkleRoot(const std::string& filename, MerkleHash& root, DWORD& leafCount) {
+	ChunkRequest& request = m_requests[0];
+	FillRequest(request, MSG_MERKLE_REQUEST, filename, MERKLE_ROOT_INDEX);
+	if (send(m_socket, (char*)&request, sizeof(request), 0) != sizeof(request)) {
+		WriteToEventLog("Failed to send Merkle root request");
+		return false;
+	}
+
+	ChunkResponse response;
+	if (recv(m_socket, (char*)&response, sizeof(response), MSG_WAITALL) != sizeof(response)) {
+		// Old servers may hang up instead of answering MSG_ERROR
+		WriteToEventLog("Server dropped the connection on Merkle root request");
+		m_noProofs = true;
+		return false;
+	}
+	if (response.msgType == MSG_FILE_NOT_FOUND) {
+		m_fileNotFound = true;
+		WriteToEventLog("File not found on server");
+		return false;
+	}
+	if (response.msgType != MSG_MERKLE_RESPONSE) {
+		WriteToEventLog("Server does not serve Merkle proofs");
+		m_noProofs = true;
+		return true;
+	}
+
+	if (response.chunkIndex != MERKLE_ROOT_INDEX || response.chunkSize != SHA256_DIGEST_SIZE ||
+		recv(m_socket, (char*)root.bytes, SHA256_DIGEST_SIZE, MSG_WAITALL) != SHA256_DIGEST_SIZE ||
+		Crc32c(root.bytes, SHA256_DIGEST_SIZE) != response.crc32) {
+		WriteToEventLog("Invalid Merkle root response");
+		return false;
+	}
+	leafCount = (std::max)(response.totalChunks, (DWORD)1);
+	return true;
+}
+
+// Fetch the content-defined chunks of filename a page at a time. Returns
+// false if the connection failed; a server that did not cut the file
+// leaves chunks empty.
+bool TCPFileClient::GetContentChunks(const std::string& filename, ChunkList& chunks) {
+	chunks.clear();
+	std::vector<ChunkListEntry> page(CHUNK_LIST_PAGE);
+	ULONG64 offset = 0;
+	DWORD total = 0;
+	do {
+		ChunkRequest& request = m_requests[0];
+		FillRequest(request, MSG_CHUNK_LIST_REQUEST, filename, (DWORD)chunks.size());
+		if (send(m_socket, (char*)&request, sizeof(request), 0) != sizeof(request)) {
+			WriteToEventLog("Failed to send chunk list request");
 			return false;
 		}
 
+		ChunkResponse response;
+		if (recv(m_socket, (char*)&response, sizeof(response), MSG_WAITALL) != sizeof(response)) {
+			// Servers from before chunk lists hang up on the request
+			WriteToEventLog("Server dropped the connection on chunk list request");
+			return false;
+		}
 		if (response.msgType == MSG_FILE_NOT_FOUND) {
+			m_fileNotFound = true;
 			WriteToEventLog("File not found on server");
 			return false;
 		}
-
-		if (response.msgType == MSG_ERROR) {
-			WriteToEventLog("Server error occurred");
-			return false;
+		if (response.msgType != MSG_CHUNK_LIST_RESPONSE) {
+			WriteToEventLog("Server has no chunk list for the file");
+			chunks.clear();
+			return true;
 		}
 
-		if (response.msgType != MSG_CHUNK_RESPONSE) {
-			WriteToEventLog("Invalid response type");
+		DWORD count = response.chunkSize / sizeof(ChunkListEntry);
+		if (chunks.empty()) {
+			total = response.totalChunks;
+		}
+		if (response.chunkIndex != chunks.size() || response.totalChunks != total ||
+			response.chunkSize != count * sizeof(ChunkListEntry) || count > CHUNK_LIST_PAGE ||
+			count > total - chunks.size() || (count == 0 && total != 0) ||
+			(count != 0 && recv(m_socket, (char*)&page[0], response.chunkSize, MSG_WAITALL) != (int)response.chunkSize) ||
+			Crc32c(count ? &page[0] : NULL, response.chunkSize) != response.crc32) {
+			WriteToEventLog("Invalid chunk list response");
 			return false;
 		}
 
-		if (firstChunk) {
-			totalChunks = response.totalChunks;
-			firstChunk = false;
-			msg = "File has " + std::to_string(totalChunks) + " chunks";
-			WriteToEventLog(msg.c_str());
+		for (DWORD i = 0; i < count; i++) {
+			if (page[i].size == 0 || page[i].size > CDC_MAX_SIZE) {
+				WriteToEventLog("Invalid chunk list response");
+				return false;
+			}
+			ContentChunk chunk;
+			chunk.offset = offset;
+			chunk.size = page[i].size;
+			memcpy(chunk.sha256, page[i].sha256, sizeof(chunk.sha256));
+			chunks.push_back(chunk);
+			offset += chunk.size;
 		}
+	} while (chunks.size() < total);
+	return true;
+}
+
+// Open filename on the server for range requests. Returns false if the
+// connection failed or the file is not there; opened says whether the
+// server handed out a handle (old servers don't).
+bool TCPFileClient::OpenFile(const std::string& filename, bool& opened) {
+	opened = false;
+
+	ChunkRequest& request = m_requests[0];
+	FillRequest(request, MSG_OPEN, filename, 0);
+	if (send(m_socket, (char*)&request, sizeof(request), 0) != sizeof(request)) {
+		WriteToEventLog("Failed to send OPEN");
+		return false;
+	}
+
+	ChunkResponse response;
+	if (recv(m_socket, (char*)&response, sizeof(response), MSG_WAITALL) != sizeof(response)) {
+		WriteToEventLog("Failed to receive OPEN response");
+		return false;
+	}
+	if (response.msgType == MSG_FILE_NOT_FOUND) {
+		m_fileNotFound = true;
+		WriteToEventLog("File not found on server");
+		return false;
+	}
+	if (response.msgType != MSG_OPEN_RESPONSE) {
+		WriteToEventLog("Server does not support file handles, requesting chunks by name");
+		return true;
+	}
+
+	ULONGLONG fileSize = 0;
+	if (response.chunkSize != OPEN_RESPONSE_SIZE ||
+		recv(m_socket, (char*)&fileSize, sizeof(fileSize), MSG_WAITALL) != sizeof(fileSize)) {
+		WriteToEventLog("Invalid OPEN response");
+		return false;
+	}
+
+	m_haveHandle = true;
+	m_fileHandle = response.chunkIndex;
+	m_openTotalChunks = response.totalChunks;
+	opened = true;
+
+	char msg[64];
+	sprintf_s(msg, "Opened file, %llu bytes", fileSize);
+	WriteToEventLog(msg);
+	return true;
+}
+
+// Ask for count chunks from startIndex of the open file in one request
+bool TCPFileClient::SendRangeRequest(DWORD startIndex, DWORD count) {
+	RangeRequest request;
+	request.msgType = MSG_RANGE_REQUEST;
+	request.handle = m_fileHandle;
+	request.startIndex = startIndex;
+	request.count = count;
+	if (send(m_socket, (char*)&request, sizeof(request), 0) != sizeof(request)) {
+		WriteToEventLog("Failed to send range request");
+		return false;
+	}
+	return true;
+}
+
+// Release the open file handle, the server does not answer
+void TCPFileClient::CloseFile() {
+	if (!m_haveHandle) {
+		return;
+	}
+	RangeRequest request = {};
+	request.msgType = MSG_CLOSE;
+	request.handle = m_fileHandle;
+	send(m_socket, (char*)&request, sizeof(request), 0);
+	m_haveHandle = false;
+}
+
+// Chunk size for the throughput just measured: one chunk should take about
+// ADAPTIVE_CHUNK_TIME_MS, so a retry on a slow or lossy link stays cheap,
+// and the window should still cover the bandwidth-delay product
+DWORD TCPFileClient::ChooseChunkSize(ULONGLONG bytesPerSecond) const {
+	ULONGLONG target = (std::max)(bytesPerSecond * ADAPTIVE_CHUNK_TIME_MS / 1000,
+		bytesPerSecond * m_rttMs / 1000 / m_pipelineDepth);
+	DWORD size = MIN_CHUNK_SIZE;
+	while (size < target && size < MAX_CHUNK_SIZE) {
+		size *= 2;
+	}
+	return size;
+}
+
+// Download file from connected server
+// Only chunks missing from the output's chunk map are requested, so calling
+// this again after a failure continues where the last attempt stopped. The
+// chunk size is agreed with HELLO first; in adaptive mode it is renegotiated
+// as the measured throughput changes. The chunk count comes from OPEN, or
+// from fetching the first missing chunk alone when the server has no file
+// handles. After that the window is topped up whenever fewer than
+// m_pipelineDepth chunks are in flight, so the link does not idle for a round
+// trip between chunks; with a handle a run of missing chunks is one request.
+// Responses are matched by their first block and written at their own offset.
+bool TCPFileClient::DownloadFile(const std::string& filename, const std::string& outputPath) {
+	if (!m_connected) {
+		WriteToEventLog("Not connected to server");
+		return false;
+	}
 
-		std::vector<char> chunkData(response.chunkSize);
-		bytesReceived = recv(m_socket, chunkData.data(), response.chunkSize, MSG_WAITALL);
-		if (bytesReceived != (int)response.chunkSize) {
-			WriteToEventLog("Failed to receive chunk data");
+	m_hashMismatch = false;
+	ChunkFile outputFile;
+	if (!m_contentHash.empty()) {
+		outputFile.SetExpectedHash(m_contentHash);
+	}
+	if (!outputFile.Open(outputPath)) {
+		return false;
+	}
+
+	std::string msg = "Downloading " + filename + "...";
+	WriteToEventLog(msg.c_str());
+
+	DWORD probeBlock = outputFile.FirstMissingBlock();
+	if (probeBlock != 0 && probeBlock == outputFile.GetTotalBlocks()) {
+		// Everything arrived last time, only the final step was missed
+		if (!outputFile.Complete()) {
 			return false;
 		}
+		WriteToEventLog("Download completed successfully");
+		return true;
+	}
+
+	// Peers that don't negotiate count CHUNK_SIZE chunks instead of blocks
+	if (!m_legacyPeer && !Negotiate(m_adaptive ? CHUNK_SIZE : m_preferredChunkSize)) {
+		return false;
+	}
+	DWORD blockScale = m_negotiated ? 1 : BLOCKS_PER_CHUNK;
+	DWORD spanBlocks = m_chunkSize / BLOCK_SIZE;
+	probeBlock -= probeBlock % spanBlocks;
+
+	// With a file handle the chunk count is known up front and runs of missing
+	// chunks go out as single range requests
+	bool haveHandle = false;
+	if (m_negotiated && !OpenFile(filename, haveHandle)) {
+		return false;
+	}
 
-		DWORD calculatedCRC = CalculateSimpleCRC32(chunkData.data(), response.chunkSize);
-		if (calculatedCRC != response.crc32) {
-			WriteToEventLog("Chunk CRC mismatch - data corruption detected");
+	DWORD totalBlocks = 0;
+	DWORD inFlight = 0;
+	size_t nextRequest = 0;
+	bool planned = false;
+	bool failed = false;
+	std::vector<DWORD> pending;
+	std::vector<bool> outstanding;
+	std::vector<DWORD> batch;
+	int lastProgress = -1;
+	char progressMsg[128];
+	DWORD resizeTo = 0;
+	ULONGLONG intervalStart = GetTickCount64();
+	ULONGLONG intervalBytes = 0;
+
+	if (haveHandle) {
+		msg = "File has " + std::to_string(m_openTotalChunks) + " blocks";
+		WriteToEventLog(msg.c_str());
+		totalBlocks = (std::max)(m_openTotalChunks, (DWORD)1);
+		if (!outputFile.Prepare(totalBlocks)) {
 			return false;
 		}
+		outstanding.assign(totalBlocks, false);
+		outputFile.GetMissingChunks(spanBlocks, pending);
+		planned = true;
+	}
+	else {
+		// The first missing chunk is fetched alone to learn the chunk count
+		DWORD probeIndex = probeBlock / blockScale;
+		if (!SendChunkRequests(filename, &probeIndex, 1)) {
+			return false;
+		}
+		inFlight = 1;
+	}
 
-		outputFile.write(chunkData.data(), response.chunkSize);
+	// Everything the loop below needs is set up here, receiving a chunk does
+	// not touch the heap
+	ChunkBufferPool buffers(1, (m_adaptive && m_negotiated) ? MAX_CHUNK_SIZE : m_chunkSize);
+	char* chunkData = buffers.Acquire();
+	if (chunkData == NULL) {
+		return false;
+	}
+	batch.reserve(m_pipelineDepth);
 
-		int progressPercent = (int)(((chunkIndex + 1) * 100) / totalChunks);
-		msg = "Progress: " + std::to_string(chunkIndex + 1) + "/" + std::to_string(totalChunks) +
-			" chunks (" + std::to_string(progressPercent) + "%)";
-		WriteToEventLog(msg.c_str());
+	while (true) {
+		// Top the window back up
+		batch.clear();
+		DWORD maxRun = haveHandle ? (std::max)((DWORD)(RANGE_MAX_BYTES / m_chunkSize), (DWORD)1) : 1;
+		while (planned && resizeTo == 0 && inFlight < m_pipelineDepth && nextRequest < pending.size()) {
+			DWORD chunkBlock = pending[nextRequest];
+			DWORD count = 1;
+			while (count < maxRun && nextRequest + count < pending.size() &&
+				pending[nextRequest + count] == chunkBlock + count * spanBlocks) {
+				count++;
+			}
+			for (DWORD i = 0; i < count; i++) {
+				outstanding[chunkBlock + i * spanBlocks] = true;
+			}
+			nextRequest += count;
+			inFlight += count;
+
+			if (haveHandle) {
+				if (!SendRangeRequest(chunkBlock / blockScale, count)) {
+					failed = true;
+					break;
+				}
+			}
+			else {
+				batch.push_back(chunkBlock / blockScale);
+			}
+		}
+		if (!batch.empty() && !SendChunkRequests(filename, batch.data(), (DWORD)batch.size())) {
+			failed = true;
+		}
+		if (failed || inFlight == 0) {
+			break;
+		}
+
+		ChunkResponse response;
+		if (!ReceiveChunk(response, chunkData)) {
+			failed = true;
+			break;
+		}
+
+		if (!planned) {
+			planned = true;
+			msg = "File has " + std::to_string(response.totalChunks) + (m_negotiated ? " blocks" : " chunks");
+			WriteToEventLog(msg.c_str());
+			// An empty file still answers chunk 0, just without data
+			totalBlocks = (std::max)(response.totalChunks, (DWORD)1) * blockScale;
+			if (probeBlock >= totalBlocks || !outputFile.Prepare(totalBlocks)) {
+				WriteToEventLog("Cannot resume, chunk count does not match");
+				failed = true;
+				break;
+			}
+			outstanding.assign(totalBlocks, false);
+			outstanding[probeBlock] = true;
+			outputFile.GetMissingChunks(spanBlocks, pending);
+			pending.erase(std::remove(pending.begin(), pending.end(), probeBlock), pending.end());
+		}
+
+		DWORD firstBlock = response.chunkIndex * blockScale;
+		if (response.chunkIndex >= totalBlocks / blockScale || !outstanding[firstBlock]) {
+			WriteToEventLog("Unexpected chunk index in response");
+			failed = true;
+			break;
+		}
+		outstanding[firstBlock] = false;
+		inFlight--;
 
-		chunkIndex++;
-		if (chunkIndex >= totalChunks) {
+		DWORD blockCount = ResponseBlockCount(m_negotiated, response.chunkSize);
+		if (!outputFile.WriteChunk(firstBlock, blockCount, chunkData, response.chunkSize)) {
+			failed = true;
 			break;
 		}
+		m_chunksReceived++;
+
+		// Log only when the percentage moves, the log file is reopened per line
+		DWORD blocksDone = outputFile.GetBlocksDone();
+		int progressPercent = (int)(((ULONG64)blocksDone * 100) / totalBlocks);
+		if (progressPercent != lastProgress) {
+			lastProgress = progressPercent;
+			sprintf_s(progressMsg, "Progress: %lu/%lu blocks (%d%%)", blocksDone, totalBlocks, progressPercent);
+			WriteToEventLog(progressMsg);
+		}
+
+		// Adaptive mode: once per interval pick a chunk size for the measured
+		// throughput, and switch when the window has drained
+		intervalBytes += response.chunkSize;
+		ULONGLONG elapsed = GetTickCount64() - intervalStart;
+		if (m_adaptive && m_negotiated && resizeTo == 0 && elapsed >= ADAPTIVE_INTERVAL_MS) {
+			DWORD size = ChooseChunkSize(intervalBytes * 1000 / elapsed);
+			if (size != m_chunkSize) {
+				resizeTo = size;
+			}
+			intervalStart += elapsed;
+			intervalBytes = 0;
+		}
+		if (resizeTo != 0 && inFlight == 0) {
+			if (!Negotiate(resizeTo)) {
+				failed = true;
+				break;
+			}
+			resizeTo = 0;
+			spanBlocks = m_chunkSize / BLOCK_SIZE;
+			outputFile.GetMissingChunks(spanBlocks, pending);
+			nextRequest = 0;
+			intervalStart = GetTickCount64();
+		}
 	}
 
-	outputFile.close();
+	buffers.Release(chunkData);
+	if (failed) {
+		return false;
+	}
+	CloseFile();
+	if (!outputFile.Complete()) {
+		m_hashMismatch = outputFile.HashMismatch();
+		return false;
+	}
 	WriteToEventLog("Download completed successfully");
 	return true;
 }
 
-// Calculate simple CRC32 checksum
-DWORD TCPFileClient::CalculateSimpleCRC32(const char* data, DWORD size) {
-	DWORD checksum = 0;
-	for (DWORD i = 0; i < size; i++) {
-		checksum += (unsigned char)data[i];
-	}
-	return checksum;
-}
-
 // Download file from specific server
+// A dropped connection is not the end of the download: the client reconnects
+// with backoff and carries on from the chunk map. It gives up after
+// MAX_DOWNLOAD_RETRIES attempts in a row that brought in nothing new.
 bool TCPFileClient::DownloadFileFromServer(const std::string& serverIP, const std::string& filename, const std::string& outputPath) {
 	std::string originalServerIP = m_serverIP;
 	m_serverIP = serverIP;
+	m_fileNotFound = false;
 
 	std::string msg = "Starting download from " + serverIP + ": " + filename;
 	WriteToEventLog(msg.c_str());
 
-	if (!ConnectWithPortDiscovery()) {
-		WriteToEventLog("Failed to connect to server");
-		m_serverIP = originalServerIP;
-		return false;
+	bool result = false;
+	DWORD failures = 0;
+	DWORD retryDelay = RETRY_DELAY_MS;
+	while (true) {
+		DWORD chunksBefore = m_chunksReceived;
+		if (ConnectWithPortDiscovery()) {
+			result = DownloadFile(filename, outputPath);
+			Disconnect();
+			if (result || m_fileNotFound) {
+				break;
+			}
+		}
+		else {
+			WriteToEventLog("Failed to connect to server");
+		}
+
+		// Chunks that only added up to the wrong file are no progress; the
+		// chunk map was cleared, so they would be fetched again every time
+		if (m_chunksReceived != chunksBefore && !m_hashMismatch) {
+			failures = 0;
+			retryDelay = RETRY_DELAY_MS;
+		}
+		if (++failures >= MAX_DOWNLOAD_RETRIES) {
+			break;
+		}
+
+		msg = "Retrying download in " + std::to_string(retryDelay) + " ms";
+		WriteToEventLog(msg.c_str());
+		Sleep(retryDelay);
+		retryDelay = (std::min)(retryDelay * 2, (DWORD)MAX_RETRY_DELAY_MS);
 	}
 
-	bool result = DownloadFile(filename, outputPath);
-	Disconnect();
 	m_serverIP = originalServerIP;
 
 	if (result) {
@@ -298,4 +811,3 @@ bool TCPFileClient::DownloadFileFromServer(const std::string& serverIP, const st
 
 	return result;
 }
-
@@ -2,9 +2,20 @@
 
 #include <winsock2.h>
 #include <string>
+#include <vector>
 
 #include "tcpdef.h"
+#include "merkle.h"
+#include "cdc.h"
 
+// Reconnect attempts in a row without progress before a download gives up
+#define MAX_DOWNLOAD_RETRIES 5
+#define RETRY_DELAY_MS 1000
+#define MAX_RETRY_DELAY_MS 30000
+// Adaptive mode aims for chunks that take about this long to arrive
+#define ADAPTIVE_CHUNK_TIME_MS 50
+// Throughput is measured over this long before the chunk size is reconsidered
+#define ADAPTIVE_INTERVAL_MS 2000
 
 
 class TCPFileClient {
@@ -13,8 +24,28 @@ private:
 	std::string m_serverIP;
 	int m_serverPort;
 	bool m_connected;
+	DWORD m_pipelineDepth;
+	bool m_fileNotFound;
+	bool m_hashMismatch;	// the last DownloadFile got the wrong content
+	DWORD m_chunksReceived;
+	ChunkRequest m_requests[2 * MAX_PIPELINE_DEPTH];	// send buffer, reused for every batch
+	DWORD m_preferredChunkSize;
+	bool m_adaptive;
+	bool m_legacyPeer;		// dropped the connection on HELLO, don't send it again
+	bool m_negotiated;		// this session counts blocks, see MSG_HELLO
+	DWORD m_chunkSize;		// chunk size of this session
+	DWORD m_rttMs;			// round trip of the last HELLO
+	bool m_haveHandle;		// m_fileHandle is open on this session, see MSG_OPEN
+	DWORD m_fileHandle;
+	DWORD m_openTotalChunks;
+	std::string m_contentHash;	// request by this SHA-256 instead of by name
+	bool m_noProofs;		// refused MSG_MERKLE_REQUEST, don't send it again
+	bool m_compression;		// ask for compressed chunks, see REQ_FLAG_COMPRESS
+	std::vector<char> m_packed;	// compressed payload until it is decoded into the caller's buffer
 
-	DWORD CalculateSimpleCRC32(const char* data, DWORD size);
+	void FillRequest(ChunkRequest& request, MessageType msgType, const std::string& filename, DWORD chunkIndex);
+	bool ReceiveChunkHeader(ChunkResponse& response);
+	DWORD ChooseChunkSize(ULONGLONG bytesPerSecond) const;
 
 public:
 	TCPFileClient(const std::string& serverIP, int serverPort);
@@ -23,13 +54,36 @@ public:
 	bool Initialize();
 	bool Connect();
 	void Disconnect();
+	void Abort();
+	bool IsConnected() const { return m_connected; }
+	bool FileNotFound() const { return m_fileNotFound; }
+	DWORD GetChunksReceived() const { return m_chunksReceived; }
+	const std::string& GetServerIP() const { return m_serverIP; }
 	bool ConnectWithPortDiscovery();
+	void SetPipelineDepth(DWORD depth);
+	void SetChunkSize(DWORD chunkSize);
+	void SetAdaptiveChunkSize(bool adaptive) { m_adaptive = adaptive; }
+	void SetCompression(bool compression) { m_compression = compression; }
+	bool Negotiate(DWORD chunkSize);
+	bool IsNegotiated() const { return m_negotiated; }
+	DWORD GetChunkSize() const { return m_chunkSize; }
+	void SetContentHash(const std::string& sha256Hex) { m_contentHash = sha256Hex; }
+	bool OpenFile(const std::string& filename, bool& opened);
+	bool SendRangeRequest(DWORD startIndex, DWORD count);
+	void CloseFile();
+	bool GetMerkleRoot(const std::string& filename, MerkleHash& root, DWORD& leafCount);
+	bool SupportsProofs() const { return !m_noProofs; }
+	bool SendChunkRequests(const std::string& filename, const DWORD* chunkIndices, DWORD count, bool withProofs = false);
+	bool SendProofRequests(const std::string& filename, const DWORD* leafIndices, DWORD count);
+	bool GetContentChunks(const std::string& filename, ChunkList& chunks);
+	bool ReceiveChunk(ChunkResponse& response, char* buffer);
 	bool DownloadFile(const std::string& filename, const std::string& outputPath);
 	bool DownloadFileFromServer(const std::string& serverIP, const std::string& filename, const std::string& outputPath);
 };
 
 // Helper functions
 
+bool DecodeChunkPayload(ChunkResponse& response, const char* packed, char* buffer, DWORD maxRawSize);
 
 std::string trim(const std::string& str);
 
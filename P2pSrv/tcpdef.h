@@ -1,20 +1,109 @@
 #pragma once
 #include <windows.h>
+// Chunk size of sessions that did not negotiate one
 #define CHUNK_SIZE 65536
+// Chunk sizes a session may negotiate with MSG_HELLO, powers of two
+#define MIN_CHUNK_SIZE 16384
+#define MAX_CHUNK_SIZE 4194304
+// Negotiated sessions address files in blocks of this size
+#define BLOCK_SIZE MIN_CHUNK_SIZE
+#define BLOCKS_PER_CHUNK (CHUNK_SIZE / BLOCK_SIZE)
 #define MAX_FILENAME 256
+// Number of chunk requests kept in flight by a pipelined download
+#define DEFAULT_PIPELINE_DEPTH 8
+#define MAX_PIPELINE_DEPTH 64
+// Ports a peer's server may listen on, tried in this order when the port is not known
+static const int SERVER_PORTS[] = { 8080, 9000, 8888, 9001, 9002 };
+#define SERVER_PORT_COUNT (sizeof(SERVER_PORTS) / sizeof(SERVER_PORTS[0]))
 // Protocol message types
 enum MessageType {
 	MSG_CHUNK_REQUEST = 1,
 	MSG_CHUNK_RESPONSE = 2,
 	MSG_FILE_NOT_FOUND = 3,
-	MSG_ERROR = 4
+	MSG_ERROR = 4,
+	MSG_CHUNK_RESPONSE_CRC32C = 5,	// ChunkResponse whose crc32 field holds CRC32C
+	MSG_HELLO = 6,
+	MSG_HELLO_RESPONSE = 7,
+	MSG_OPEN = 8,
+	MSG_OPEN_RESPONSE = 9,
+	MSG_RANGE_REQUEST = 10,
+	MSG_CLOSE = 11,
+	MSG_MERKLE_REQUEST = 12,
+	MSG_MERKLE_RESPONSE = 13,
+	MSG_CHUNK_RESPONSE_COMPRESSED = 14,	// see REQ_FLAG_COMPRESS
+	MSG_CHUNK_LIST_REQUEST = 15,
+	MSG_CHUNK_LIST_RESPONSE = 16
 };
 
+// MSG_HELLO travels in a ChunkRequest frame with the proposed chunk size in
+// chunkIndex and the REQ_FLAG_ bits in flags; filename is unused. The server
+// answers a ChunkResponse of type MSG_HELLO_RESPONSE whose chunkSize is the
+// size it agreed to, a power of two from MIN_CHUNK_SIZE to MAX_CHUNK_SIZE.
+// From then on chunkIndex and totalChunks count BLOCK_SIZE blocks, and each
+// request is answered with up to the agreed size starting at its block.
+// A HELLO can be repeated between requests to change the size. Servers that
+// predate it answer MSG_ERROR and the session keeps CHUNK_SIZE chunks.
+
+// MSG_OPEN also travels in a ChunkRequest frame (filename and flags). The
+// answer is a ChunkResponse of type MSG_OPEN_RESPONSE with the session file
+// handle in chunkIndex and the chunk count in totalChunks, followed by
+// chunkSize (8) bytes holding the file size. A RangeRequest then names the
+// handle instead of the file; the server streams count chunk responses from
+// startIndex on, in order. MSG_CLOSE in a RangeRequest frame releases a
+// handle without an answer; all handles die with the connection. Servers
+// that don't know OPEN answer MSG_ERROR. Requests of different types may be
+// mixed on one connection, so servers read msgType first to learn how long
+// the rest of the frame is.
+#define OPEN_RESPONSE_SIZE sizeof(ULONGLONG)
+// Longest run of chunks a client asks for in one RangeRequest
+#define RANGE_MAX_BYTES (64 * 1024 * 1024)
+
+// MSG_MERKLE_REQUEST travels in a ChunkRequest frame (filename and flags as
+// for a chunk) with a leaf index in chunkIndex, see MerkleTree. Leaves are
+// CHUNK_SIZE pieces whatever chunk size the session negotiated. The answer
+// is a ChunkResponse of type MSG_MERKLE_RESPONSE with the leaf count in
+// totalChunks, CRC32C in crc32 and chunkSize bytes of proof: the sibling
+// hashes from the leaf up. With chunkIndex MERKLE_ROOT_INDEX the payload is
+// the root instead. Servers that don't keep trees answer MSG_ERROR.
+#define MERKLE_ROOT_INDEX 0xFFFFFFFF
+
+// MSG_CHUNK_LIST_REQUEST travels in a ChunkRequest frame (filename and flags
+// as for a chunk) and asks for the file's content-defined chunks, see cdc.h,
+// from entry chunkIndex on. The answer is a ChunkResponse of type
+// MSG_CHUNK_LIST_RESPONSE with that entry in chunkIndex, the length of the
+// whole list in totalChunks, CRC32C in crc32 and chunkSize bytes holding up
+// to CHUNK_LIST_PAGE ChunkListEntry records in file order; each chunk starts
+// where the one before it ended. Servers that did not cut the file answer
+// MSG_ERROR.
+#define CHUNK_LIST_PAGE 1024
+
+// ChunkRequest::flags - what the requesting peer understands. Older peers
+// send 0 here (the field used to be reserved) and get MSG_CHUNK_RESPONSE
+// with the byte-sum checksum.
+#define REQ_FLAG_CRC32C 0x00000001
+// The filename field of a chunk request or OPEN holds the SHA-256 of the
+// content in hex instead of a name, so any file with those bytes will do
+#define REQ_FLAG_BY_HASH 0x00000002
+// Chunks may be answered with MSG_CHUNK_RESPONSE_COMPRESSED, only honoured
+// together with REQ_FLAG_CRC32C. Its ChunkResponse has the CRC32C of the
+// uncompressed data in crc32 and chunkSize counts the payload as sent: a
+// ChunkCodecHeader, then the compressed bytes. Servers compress a chunk
+// only when that saves at least COMPRESS_MIN_SAVING of it; every other
+// chunk keeps coming as MSG_CHUNK_RESPONSE_CRC32C.
+#define REQ_FLAG_COMPRESS 0x00000004
+
 struct ChunkRequest {
 	MessageType msgType;
 	char filename[MAX_FILENAME];
 	DWORD chunkIndex;
-	DWORD reserved;
+	DWORD flags;
+};
+
+struct RangeRequest {
+	MessageType msgType;
+	DWORD handle;
+	DWORD startIndex;
+	DWORD count;
 };
 
 struct ChunkResponse {
@@ -23,4 +112,29 @@ struct ChunkResponse {
 	DWORD chunkSize;
 	DWORD totalChunks;
 	DWORD crc32;
-};
\ No newline at end of file
+};
+
+struct ChunkListEntry {
+	DWORD size;
+	BYTE sha256[32];
+};
+
+// ChunkCodecHeader::codec values
+#define CODEC_LZ4 1		// one LZ4 block, see lz4.h
+// Fraction of a chunk compression has to save, as 1/n, for it to be sent compressed
+#define COMPRESS_MIN_SAVING 8
+
+struct ChunkCodecHeader {
+	DWORD codec;
+	DWORD rawSize;		// chunk size once decompressed
+};
+
+// Blocks a chunk response of chunkSize bytes covers. Negotiated sessions end
+// the file on its last block; legacy chunks always span BLOCKS_PER_CHUNK
+// blocks, the final one just carries less data.
+inline DWORD ResponseBlockCount(bool negotiated, DWORD chunkSize) {
+	if (!negotiated) {
+		return BLOCKS_PER_CHUNK;
+	}
+	return (chunkSize == 0) ? 1 : (chunkSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
@@ -0,0 +1,769 @@
+#include "tcpserver.h"
+#include "shareindex.h"
+#include "filecatalog.h"
+#include "crc32c.h"
+#include "lz4.h"
+#include "eventlog.h"
+
+#include <ws2tcpip.h>
+#include <mswsock.h>
+#include <windows.h>
+#include <map>
+#include <algorithm>
+
+
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "mswsock.lib")
+
+// A file a connection is serving, with its own window of the mapping
+struct TCPFileServer::ServedFile {
+	std::string name;		// as requested, filename or SHA-256
+	DWORD flags;			// REQ_FLAG_ bits of the request that opened it
+	std::shared_ptr<const SharedFile> shared;
+	const BYTE* view;
+	ULONG64 viewOffset;
+	SIZE_T viewSize;
+	std::shared_ptr<const MerkleTree> tree;	// none while pending or once the file changed
+	DWORD incompressible;	// chunks in a row that did not compress
+	DWORD skipped;
+
+	ServedFile() : flags(0), view(NULL), viewOffset(0), viewSize(0), incompressible(0), skipped(0) {
+	}
+
+	~ServedFile() {
+		if (view != NULL) {
+			UnmapViewOfFile(view);
+		}
+	}
+
+	ULONG64 GetSize() const { return shared->identity.size; }
+	bool Map(ULONG64 offset, DWORD length, const BYTE*& data);
+};
+
+// What a connection has agreed and opened
+struct TCPFileServer::Session {
+	SOCKET socket;
+	HANDLE sendEvent;	// for TransmitFile at an offset
+	bool negotiated;	// indices count blocks, see MSG_HELLO
+	DWORD chunkSize;
+	std::map<DWORD, std::unique_ptr<ServedFile> > handles;
+	DWORD nextHandle;
+	std::unique_ptr<ServedFile> lastFile;	// of the last request by name or hash
+	UploadFlow flow;
+	CachedBlock blocks[MAX_CHUNK_SIZE / BLOCK_SIZE];
+	WSABUF buffers[MAX_CHUNK_SIZE / BLOCK_SIZE + 1];
+	std::vector<BYTE> packed;	// compressed chunk behind its ChunkCodecHeader, grown on first use
+};
+
+// Views must start on a multiple of this
+static DWORD ViewGranularity() {
+	static DWORD granularity = 0;
+	if (granularity == 0) {
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		granularity = info.dwAllocationGranularity;
+	}
+	return granularity;
+}
+
+// Point data at length bytes from offset, moving the view if they are
+// outside it. Ranged requests walk a file in order, so the view moves once
+// per SERVER_VIEW_SIZE.
+bool TCPFileServer::ServedFile::Map(ULONG64 offset, DWORD length, const BYTE*& data) {
+	if (view == NULL || offset < viewOffset || offset + length > viewOffset + viewSize) {
+		if (view != NULL) {
+			UnmapViewOfFile(view);
+			view = NULL;
+		}
+		ULONG64 start = offset - offset % ViewGranularity();
+		SIZE_T viewLength = (SIZE_T)(std::min)((ULONG64)SERVER_VIEW_SIZE, GetSize() - start);
+		view = (const BYTE*)MapViewOfFile(shared->mapping, FILE_MAP_READ, (DWORD)(start >> 32), (DWORD)start, viewLength);
+		if (view == NULL) {
+			return false;
+		}
+		viewOffset = start;
+		viewSize = viewLength;
+	}
+	data = view + (offset - viewOffset);
+	return true;
+}
+
+// Chunks in a file of size bytes as the peer counts them, blocks once it negotiated
+static DWORD UnitCount(bool negotiated, ULONG64 size) {
+	ULONG64 unit = negotiated ? BLOCK_SIZE : CHUNK_SIZE;
+	return (DWORD)(std::min)((size + unit - 1) / unit, (ULONG64)MAXDWORD);
+}
+
+// A bare file name, nothing that could reach outside the folder
+static bool IsPlainName(const std::string& name) {
+	return !name.empty() && name != "." && name != ".." && name.find_first_of("\\/:") == std::string::npos;
+}
+
+// Send a response header and its payload in one gather send
+static bool SendResponse(SOCKET s, const ChunkResponse& header, const void* payload, DWORD size) {
+	WSABUF buffers[2];
+	buffers[0].buf = (char*)&header;
+	buffers[0].len = sizeof(header);
+	buffers[1].buf = (char*)payload;
+	buffers[1].len = size;
+	DWORD sent = 0;
+	if (WSASend(s, buffers, (size > 0) ? 2 : 1, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+		return false;
+	}
+	return sent == sizeof(header) + size;
+}
+
+// Answer with a bare MSG_ERROR or MSG_FILE_NOT_FOUND
+static bool SendStatus(SOCKET s, MessageType msgType, DWORD chunkIndex) {
+	ChunkResponse response = {};
+	response.msgType = msgType;
+	response.chunkIndex = chunkIndex;
+	return SendResponse(s, response, NULL, 0);
+}
+
+// Constructor
+TCPFileServer::TCPFileServer(int port, const std::string& folder)
+	: m_port(port), m_folder(folder), m_shareIndex(NULL), m_listenSocket(INVALID_SOCKET),
+	m_wsaStarted(false), m_cacheBytes((size_t)CHUNK_CACHE_DEFAULT_MB * 1024 * 1024), m_compression(true),
+	m_maxConnections(SERVER_MAX_CONNECTIONS), m_running(false) {
+}
+
+// Destructor
+TCPFileServer::~TCPFileServer() {
+	Stop();
+	if (m_wsaStarted) {
+		WSACleanup();
+	}
+}
+
+// Start Windows Sockets and bind the listening socket, to the given port
+// or, when that is taken, to the first free one of SERVER_PORTS, where
+// clients look for it
+bool TCPFileServer::Initialize() {
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+		WriteLogMessage("WSAStartup failed");
+		return false;
+	}
+	m_wsaStarted = true;
+	m_chunkCache.reset(new ChunkCache(m_cacheBytes));
+
+	if (Listen(m_port)) {
+		return true;
+	}
+	for (size_t i = 0; i < SERVER_PORT_COUNT; i++) {
+		if (SERVER_PORTS[i] != m_port && Listen(SERVER_PORTS[i])) {
+			return true;
+		}
+	}
+	WriteLogMessage("TCP server could not listen on any port");
+	return false;
+}
+
+// Bind and listen on port
+bool TCPFileServer::Listen(int port) {
+	SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (s == INVALID_SOCKET) {
+		return false;
+	}
+
+	// Fail instead of sharing the port with another process
+	BOOL exclusive = TRUE;
+	setsockopt(s, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (char*)&exclusive, sizeof(exclusive));
+
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((u_short)port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(s, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR || listen(s, SOMAXCONN) == SOCKET_ERROR) {
+		closesocket(s);
+		return false;
+	}
+
+	m_listenSocket = s;
+	m_port = port;
+	char msg[64];
+	sprintf_s(msg, "TCP server listening on port %d", port);
+	WriteLogMessage(msg);
+	return true;
+}
+
+// Start accepting connections
+bool TCPFileServer::Start() {
+	if (m_listenSocket == INVALID_SOCKET) {
+		return false;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_running = true;
+	}
+	m_scheduler.Start();
+	m_acceptThread = std::thread(&TCPFileServer::AcceptThread, this);
+	return true;
+}
+
+// Stop accepting, drop every connection and wait for their threads
+void TCPFileServer::Stop() {
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_running = false;
+	}
+	if (m_listenSocket != INVALID_SOCKET) {
+		closesocket(m_listenSocket);
+		m_listenSocket = INVALID_SOCKET;
+	}
+	if (m_acceptThread.joinable()) {
+		m_acceptThread.join();
+	}
+	m_scheduler.Stop();
+
+	// Wake threads blocked in recv or in the middle of a TransmitFile, the
+	// scheduler already failed those waiting on it; each closes its own
+	// socket on the way out
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		for (size_t i = 0; i < m_connections.size(); i++) {
+			SOCKET s = m_connections[i]->socket;
+			if (s != INVALID_SOCKET) {
+				shutdown(s, SD_BOTH);
+				CancelIoEx((HANDLE)s, NULL);
+			}
+		}
+	}
+	ReapConnections(true);
+	m_files.Clear();
+}
+
+void TCPFileServer::GetCacheStats(ChunkCacheStats& chunks, FileCacheStats& files) {
+	memset(&chunks, 0, sizeof(chunks));
+	if (m_chunkCache) {
+		m_chunkCache->GetStats(chunks);
+	}
+	m_files.GetStats(files);
+}
+
+// Join the threads of finished connections, or of all of them
+void TCPFileServer::ReapConnections(bool all) {
+	std::vector<std::unique_ptr<Connection> > done;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		for (size_t i = 0; i < m_connections.size();) {
+			if (all || m_connections[i]->finished) {
+				done.push_back(std::move(m_connections[i]));
+				m_connections[i] = std::move(m_connections.back());
+				m_connections.pop_back();
+			}
+			else {
+				i++;
+			}
+		}
+	}
+	for (size_t i = 0; i < done.size(); i++) {
+		done[i]->thread.join();
+	}
+}
+
+// Hand every accepted connection its own thread
+void TCPFileServer::AcceptThread() {
+	SOCKET listenSocket = m_listenSocket;
+	while (true) {
+		sockaddr_in addr = {};
+		int addrLength = sizeof(addr);
+		SOCKET s = accept(listenSocket, (sockaddr*)&addr, &addrLength);
+		if (s == INVALID_SOCKET) {
+			std::lock_guard<std::mutex> lock(m_lock);
+			if (!m_running) {
+				break;
+			}
+			continue;
+		}
+		ReapConnections(false);
+
+		DWORD timeout = SERVER_IDLE_TIMEOUT_MS;
+		setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+		// Small answers such as HELLO must not wait for the next chunk
+		BOOL noDelay = TRUE;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (!m_running || m_connections.size() >= m_maxConnections) {
+			if (m_running) {
+				WriteLogMessage("TCP server busy, connection refused");
+			}
+			closesocket(s);
+			continue;
+		}
+		std::unique_ptr<Connection> connection(new Connection());
+		connection->socket = s;
+		connection->address = addr.sin_addr.s_addr;
+		connection->finished = false;
+		connection->thread = std::thread(&TCPFileServer::ServeConnection, this, connection.get());
+		m_connections.push_back(std::move(connection));
+	}
+}
+
+// Answer requests on one connection until the peer hangs up or Stop. The
+// message type is read first, it tells how long the rest of the frame is.
+void TCPFileServer::ServeConnection(Connection* connection) {
+	Session session;
+	session.socket = connection->socket;
+	session.sendEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	session.negotiated = false;
+	session.chunkSize = CHUNK_SIZE;
+	session.nextHandle = 1;
+	m_scheduler.Join(session.flow, connection->address);
+
+	union {
+		ChunkRequest chunk;
+		RangeRequest range;
+	} request;
+	const int typeSize = sizeof(MessageType);
+
+	while (true) {
+		if (recv(session.socket, (char*)&request, typeSize, MSG_WAITALL) != typeSize) {
+			break;
+		}
+
+		bool ok;
+		MessageType msgType = request.chunk.msgType;
+		if (msgType == MSG_RANGE_REQUEST || msgType == MSG_CLOSE) {
+			int rest = sizeof(RangeRequest) - typeSize;
+			if (recv(session.socket, (char*)&request + typeSize, rest, MSG_WAITALL) != rest) {
+				break;
+			}
+			ok = HandleRange(session, request.range);
+		}
+		else if (msgType == MSG_CHUNK_REQUEST || msgType == MSG_HELLO || msgType == MSG_OPEN ||
+			msgType == MSG_MERKLE_REQUEST || msgType == MSG_CHUNK_LIST_REQUEST) {
+			int rest = sizeof(ChunkRequest) - typeSize;
+			if (recv(session.socket, (char*)&request + typeSize, rest, MSG_WAITALL) != rest) {
+				break;
+			}
+			ok = HandleRequest(session, request.chunk);
+		}
+		else {
+			// Without the frame length the stream can't be followed any further
+			SendStatus(session.socket, MSG_ERROR, 0);
+			break;
+		}
+		if (!ok) {
+			break;
+		}
+	}
+
+	session.handles.clear();
+	session.lastFile.reset();
+	m_scheduler.Leave(session.flow);
+	if (session.sendEvent != NULL) {
+		CloseHandle(session.sendEvent);
+	}
+
+	std::lock_guard<std::mutex> lock(m_lock);
+	closesocket(connection->socket);
+	connection->socket = INVALID_SOCKET;
+	connection->finished = true;
+}
+
+// Answer one request that came in a ChunkRequest frame; false when the
+// connection failed
+bool TCPFileServer::HandleRequest(Session& session, const ChunkRequest& request) {
+	switch (request.msgType) {
+	case MSG_HELLO: {
+		// The largest power of two in range that does not exceed the proposal
+		DWORD size = MIN_CHUNK_SIZE;
+		while (size < MAX_CHUNK_SIZE && size * 2 <= request.chunkIndex) {
+			size *= 2;
+		}
+		session.negotiated = true;
+		session.chunkSize = size;
+
+		ChunkResponse response = {};
+		response.msgType = MSG_HELLO_RESPONSE;
+		response.chunkSize = size;
+		return SendResponse(session.socket, response, NULL, 0);
+	}
+
+	case MSG_CHUNK_REQUEST:
+	case MSG_MERKLE_REQUEST:
+	case MSG_CHUNK_LIST_REQUEST: {
+		ServedFile* file = FindFile(session, request);
+		if (file == NULL) {
+			return SendStatus(session.socket, MSG_FILE_NOT_FOUND, request.chunkIndex);
+		}
+		if (request.msgType == MSG_MERKLE_REQUEST) {
+			return SendMerkle(*file, request.chunkIndex, session.socket);
+		}
+		if (request.msgType == MSG_CHUNK_LIST_REQUEST) {
+			return SendChunkList(*file, request.chunkIndex, session.socket);
+		}
+		return SendChunk(session, *file, request.chunkIndex);
+	}
+
+	case MSG_OPEN: {
+		std::unique_ptr<ServedFile> file = OpenFile(request);
+		if (!file) {
+			return SendStatus(session.socket, MSG_FILE_NOT_FOUND, 0);
+		}
+		if (session.handles.size() >= SERVER_MAX_OPEN_FILES) {
+			return SendStatus(session.socket, MSG_ERROR, 0);
+		}
+
+		DWORD handle = session.nextHandle++;
+		ChunkResponse response = {};
+		response.msgType = MSG_OPEN_RESPONSE;
+		response.chunkIndex = handle;
+		response.chunkSize = OPEN_RESPONSE_SIZE;
+		response.totalChunks = UnitCount(session.negotiated, file->GetSize());
+		ULONGLONG fileSize = file->GetSize();
+		session.handles[handle] = std::move(file);
+		return SendResponse(session.socket, response, &fileSize, sizeof(fileSize));
+	}
+
+	default:
+		return SendStatus(session.socket, MSG_ERROR, request.chunkIndex);
+	}
+}
+
+// Stream count chunks of an open file from startIndex on, or release a handle
+bool TCPFileServer::HandleRange(Session& session, const RangeRequest& request) {
+	std::map<DWORD, std::unique_ptr<ServedFile> >::iterator it = session.handles.find(request.handle);
+	if (request.msgType == MSG_CLOSE) {
+		if (it != session.handles.end()) {
+			session.handles.erase(it);
+		}
+		return true;
+	}
+	if (it == session.handles.end()) {
+		return SendStatus(session.socket, MSG_ERROR, request.startIndex);
+	}
+	if (request.count == 0) {
+		return true;
+	}
+
+	// Check the whole run up front, so a bad request gets one answer
+	ServedFile& file = *it->second;
+	DWORD span = session.negotiated ? session.chunkSize / BLOCK_SIZE : 1;
+	ULONG64 last = request.startIndex + (ULONG64)(request.count - 1) * span;
+	if (last >= (std::max)(UnitCount(session.negotiated, file.GetSize()), (DWORD)1)) {
+		return SendStatus(session.socket, MSG_ERROR, request.startIndex);
+	}
+
+	for (DWORD i = 0; i < request.count; i++) {
+		if (!SendChunk(session, file, request.startIndex + i * span)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// File named by a chunk or Merkle request. Pipelined requests name the same
+// file over and over, so the last one is kept open.
+TCPFileServer::ServedFile* TCPFileServer::FindFile(Session& session, const ChunkRequest& request) {
+	ServedFile* last = session.lastFile.get();
+	if (last != NULL && last->flags == request.flags &&
+		strncmp(last->name.c_str(), request.filename, MAX_FILENAME) == 0) {
+		return last;
+	}
+	session.lastFile = OpenFile(request);
+	return session.lastFile.get();
+}
+
+// Open the file a request names: by hash or short name from the share index
+// while it runs, by plain name from the folder otherwise. Empty if there is
+// no such file.
+std::unique_ptr<TCPFileServer::ServedFile> TCPFileServer::OpenFile(const ChunkRequest& request) {
+	std::unique_ptr<ServedFile> served;
+	std::string name(request.filename, strnlen(request.filename, MAX_FILENAME));
+	bool byHash = (request.flags & REQ_FLAG_BY_HASH) != 0;
+
+	std::string path;
+	std::shared_ptr<const FileCatalog> catalog;
+	size_t index = CATALOG_NOT_FOUND;
+	if (m_shareIndex != NULL && m_shareIndex->IsRunning()) {
+		catalog = m_shareIndex->GetFiles();
+		index = byHash ? catalog->FindByHash(name) : catalog->FindByName(name);
+		if (index == CATALOG_NOT_FOUND) {
+			return served;
+		}
+		path = catalog->GetFullPath(index);
+	}
+	else if (!byHash && IsPlainName(name)) {
+		path = m_folder + "\\" + name;
+	}
+	else {
+		return served;
+	}
+
+	std::shared_ptr<const SharedFile> shared = m_files.Open(path);
+	if (!shared) {
+		return served;
+	}
+
+	// The catalog's digest and tree describe the file as it was hashed; a
+	// cached handle that disagrees may be older than the catalog
+	if (catalog) {
+		const CatalogEntry& entry = catalog->GetEntry(index);
+		bool current = entry.size == shared->identity.size && entry.lastWriteTime == shared->identity.lastWriteTime;
+		if (!current) {
+			shared = m_files.Open(path, true);
+			if (!shared) {
+				return served;
+			}
+			current = entry.size == shared->identity.size && entry.lastWriteTime == shared->identity.lastWriteTime;
+		}
+		if (!current && byHash) {
+			// No longer the content that was asked for
+			return served;
+		}
+		served.reset(new ServedFile());
+		if (current) {
+			served->tree = catalog->GetMerkleTree(index);
+		}
+	}
+	else {
+		served.reset(new ServedFile());
+	}
+	served->name = name;
+	served->flags = request.flags;
+	served->shared = shared;
+	return served;
+}
+
+// Send the chunk at index (a block once negotiated) of file. A peer that
+// takes compressed chunks gets it compressed when that pays off. Otherwise,
+// when every block of it is in the chunk cache, it goes out from there in
+// one gather send; failing that the header is TransmitFile's head buffer,
+// so header and data leave in one call and the data goes from the system
+// cache to the socket without a copy in between. Only blocks whose
+// checksum is not cached are read, through the mapped view.
+bool TCPFileServer::SendChunk(Session& session, ServedFile& file, DWORD index) {
+	DWORD totalChunks = UnitCount(session.negotiated, file.GetSize());
+	// An empty file still answers chunk 0, just without data
+	if (index >= (std::max)(totalChunks, (DWORD)1)) {
+		return SendStatus(session.socket, MSG_ERROR, index);
+	}
+
+	ULONG64 offset = (ULONG64)index * (session.negotiated ? BLOCK_SIZE : CHUNK_SIZE);
+	DWORD length = (DWORD)(std::min)((ULONG64)session.chunkSize, file.GetSize() - offset);
+	bool crc32c = (file.flags & REQ_FLAG_CRC32C) != 0;
+
+	// Compressed first, so the scheduler charges what actually goes out
+	DWORD packed = 0;
+	if (m_compression && crc32c && (file.flags & REQ_FLAG_COMPRESS) != 0) {
+		packed = CompressChunk(session, file, offset, length);
+	}
+	DWORD payload = (packed > 0) ? (DWORD)sizeof(ChunkCodecHeader) + packed : length;
+
+	// Wait for this connection's share of the upload limits
+	if (!m_scheduler.Acquire(session.flow, sizeof(ChunkResponse) + payload)) {
+		return false;
+	}
+
+	ChunkResponse header;
+	header.msgType = crc32c ? MSG_CHUNK_RESPONSE_CRC32C : MSG_CHUNK_RESPONSE;
+	header.chunkIndex = index;
+	header.chunkSize = length;
+	header.totalChunks = totalChunks;
+	header.crc32 = 0;
+
+	DWORD firstBlock = (DWORD)(offset / BLOCK_SIZE);
+	DWORD blockCount = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	CachedBlock* blocks = session.blocks;
+	m_chunkCache->Lookup(file.shared->identity, firstBlock, blockCount, blocks);
+	bool inMemory = true;
+	for (DWORD i = 0; i < blockCount; i++) {
+		inMemory = inMemory && blocks[i].data != NULL;
+	}
+	if (!inMemory && !ChecksumBlocks(file, firstBlock, blockCount, blocks)) {
+		m_chunkCache->Release(blocks, blockCount);
+		return SendStatus(session.socket, MSG_ERROR, index);
+	}
+
+	if (crc32c) {
+		for (DWORD i = 0; i < blockCount; i++) {
+			header.crc32 = (i == 0) ? blocks[i].crc32c : Crc32cCombine(header.crc32, blocks[i].crc32c, blocks[i].length);
+		}
+	}
+	else if (inMemory) {
+		for (DWORD i = 0; i < blockCount; i++) {
+			header.crc32 += AdditiveChecksum((const char*)blocks[i].data, blocks[i].length);
+		}
+	}
+	else if (length > 0) {
+		const BYTE* data;
+		if (!file.Map(offset, length, data)) {
+			m_chunkCache->Release(blocks, blockCount);
+			return SendStatus(session.socket, MSG_ERROR, index);
+		}
+		header.crc32 = AdditiveChecksum((const char*)data, length);
+	}
+
+	if (packed > 0) {
+		m_chunkCache->Release(blocks, blockCount);
+		header.msgType = MSG_CHUNK_RESPONSE_COMPRESSED;
+		header.chunkSize = payload;
+		return SendResponse(session.socket, header, &session.packed[0], payload);
+	}
+
+	if (inMemory) {
+		WSABUF* buffers = session.buffers;
+		buffers[0].buf = (char*)&header;
+		buffers[0].len = sizeof(header);
+		for (DWORD i = 0; i < blockCount; i++) {
+			buffers[i + 1].buf = (char*)blocks[i].data;
+			buffers[i + 1].len = blocks[i].length;
+		}
+		DWORD bytes = 0;
+		bool sent = WSASend(session.socket, buffers, blockCount + 1, &bytes, 0, NULL, NULL) != SOCKET_ERROR &&
+			bytes == sizeof(header) + length;
+		m_chunkCache->Release(blocks, blockCount);
+		return sent;
+	}
+	m_chunkCache->Release(blocks, blockCount);
+
+	// The file is shared with other connections, so the offset goes in the
+	// OVERLAPPED instead of the file pointer
+	OVERLAPPED overlapped = {};
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	overlapped.hEvent = session.sendEvent;
+	TRANSMIT_FILE_BUFFERS buffers = {};
+	buffers.Head = &header;
+	buffers.HeadLength = sizeof(header);
+	if (TransmitFile(session.socket, (length > 0) ? file.shared->file : NULL, length, 0, &overlapped, &buffers, 0)) {
+		return true;
+	}
+	DWORD bytes = 0;
+	DWORD flags = 0;
+	return WSAGetLastError() == WSA_IO_PENDING &&
+		WSAGetOverlappedResult(session.socket, &overlapped, &bytes, TRUE, &flags) != FALSE;
+}
+
+// Compress length bytes at offset into session.packed, behind their
+// ChunkCodecHeader; 0 to send the chunk as it is. A chunk has to save
+// COMPRESS_MIN_SAVING of itself, and its first COMPRESS_TRIAL_SIZE bytes
+// are tried alone first, which rules out media and archives cheaply. After
+// COMPRESS_GIVE_UP failures in a row a file is only tried again every
+// COMPRESS_RETRY_INTERVAL chunks.
+DWORD TCPFileServer::CompressChunk(Session& session, ServedFile& file, ULONG64 offset, DWORD length) {
+	if (length < COMPRESS_MIN_SIZE) {
+		return 0;
+	}
+	if (file.incompressible >= COMPRESS_GIVE_UP && ++file.skipped % COMPRESS_RETRY_INTERVAL != 0) {
+		return 0;
+	}
+	const BYTE* data;
+	if (!file.Map(offset, length, data)) {
+		return 0;
+	}
+
+	size_t capacity = sizeof(ChunkCodecHeader) + length;
+	if (session.packed.size() < capacity) {
+		session.packed.resize(capacity);
+	}
+	BYTE* out = &session.packed[sizeof(ChunkCodecHeader)];
+	DWORD packed = 0;
+	DWORD trial = (std::min)(length, (DWORD)COMPRESS_TRIAL_SIZE);
+	if (trial == length || Lz4Compress(data, trial, out, trial - trial / COMPRESS_MIN_SAVING) > 0) {
+		packed = Lz4Compress(data, length, out, length - length / COMPRESS_MIN_SAVING);
+	}
+	if (packed == 0) {
+		file.incompressible++;
+		return 0;
+	}
+
+	file.incompressible = 0;
+	ChunkCodecHeader codec;
+	codec.codec = CODEC_LZ4;
+	codec.rawSize = length;
+	memcpy(&session.packed[0], &codec, sizeof(codec));
+	return packed;
+}
+
+// Fill in the checksums the cache did not have from the mapped view, and
+// hand it the blocks that have now been asked for twice
+bool TCPFileServer::ChecksumBlocks(ServedFile& file, DWORD firstBlock, DWORD count, CachedBlock* blocks) {
+	for (DWORD i = 0; i < count; i++) {
+		CachedBlock& block = blocks[i];
+		if (block.known && !block.admit) {
+			continue;
+		}
+
+		ULONG64 offset = (ULONG64)(firstBlock + i) * BLOCK_SIZE;
+		DWORD length = (DWORD)(std::min)((ULONG64)BLOCK_SIZE, file.GetSize() - offset);
+		const BYTE* data;
+		if (!file.Map(offset, length, data)) {
+			return false;
+		}
+		if (!block.known) {
+			block.crc32c = Crc32c(data, length);
+			block.length = length;
+			block.known = true;
+		}
+		m_chunkCache->Store(file.shared->identity, firstBlock + i, block.crc32c, length, block.admit ? data : NULL);
+	}
+	return true;
+}
+
+// Send the proof of leaf index of file, or its root for MERKLE_ROOT_INDEX
+bool TCPFileServer::SendMerkle(ServedFile& file, DWORD index, SOCKET s) {
+	const MerkleTree* tree = file.tree.get();
+	if (tree == NULL || tree->IsEmpty()) {
+		return SendStatus(s, MSG_ERROR, index);
+	}
+
+	std::vector<BYTE> proof;
+	const BYTE* payload;
+	DWORD size;
+	if (index == MERKLE_ROOT_INDEX) {
+		payload = tree->GetRoot().bytes;
+		size = SHA256_DIGEST_SIZE;
+	}
+	else if (index < tree->GetLeafCount() && tree->GetProof(index, proof)) {
+		payload = proof.empty() ? NULL : &proof[0];
+		size = (DWORD)proof.size();
+	}
+	else {
+		return SendStatus(s, MSG_ERROR, index);
+	}
+
+	ChunkResponse header;
+	header.msgType = MSG_MERKLE_RESPONSE;
+	header.chunkIndex = index;
+	header.chunkSize = size;
+	header.totalChunks = tree->GetLeafCount();
+	header.crc32 = Crc32c(payload, size);
+	return SendResponse(s, header, payload, size);
+}
+
+// Send up to CHUNK_LIST_PAGE content-defined chunks of file from entry first on
+bool TCPFileServer::SendChunkList(ServedFile& file, DWORD first, SOCKET s) {
+	// Like the tree, the list is only trusted while the catalog still
+	// describes the file as it is on disk
+	std::shared_ptr<const ChunkList> chunks;
+	if (m_shareIndex != NULL && file.tree) {
+		chunks = m_shareIndex->GetChunks(file.shared->path);
+	}
+	ULONG64 listed = (chunks && !chunks->empty()) ? chunks->back().offset + chunks->back().size : 0;
+	if (!chunks || listed != file.GetSize() || first > chunks->size()) {
+		return SendStatus(s, MSG_ERROR, first);
+	}
+
+	DWORD count = (std::min)((DWORD)chunks->size() - first, (DWORD)CHUNK_LIST_PAGE);
+	std::vector<ChunkListEntry> entries(count);
+	for (DWORD i = 0; i < count; i++) {
+		const ContentChunk& chunk = (*chunks)[first + i];
+		entries[i].size = chunk.size;
+		memcpy(entries[i].sha256, chunk.sha256, sizeof(entries[i].sha256));
+	}
+
+	const void* payload = entries.empty() ? NULL : &entries[0];
+	DWORD size = count * sizeof(ChunkListEntry);
+	ChunkResponse header;
+	header.msgType = MSG_CHUNK_LIST_RESPONSE;
+	header.chunkIndex = first;
+	header.chunkSize = size;
+	header.totalChunks = (DWORD)chunks->size();
+	header.crc32 = Crc32c(payload, size);
+	return SendResponse(s, header, payload, size);
+}
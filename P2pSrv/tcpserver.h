@@ -0,0 +1,127 @@
+#pragma once
+
+#include <winsock2.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "tcpdef.h"
+#include "filecache.h"
+#include "chunkcache.h"
+#include "uploadscheduler.h"
+
+class ShareIndex;
+
+// Peers served at once unless SetMaxConnections says otherwise, each on its
+// own thread; more are turned away
+#define SERVER_MAX_CONNECTIONS 64
+// File handles one connection may hold open with MSG_OPEN
+#define SERVER_MAX_OPEN_FILES 16
+// A connection with no request for this long is dropped
+#define SERVER_IDLE_TIMEOUT_MS 120000
+// Chunks shorter than this are never compressed
+#define COMPRESS_MIN_SIZE 1024
+// Leading bytes of a chunk compressed alone to see whether the rest is worth it
+#define COMPRESS_TRIAL_SIZE 8192
+// Chunks of a file in a row that did not compress before it is mostly sent as is
+#define COMPRESS_GIVE_UP 4
+#define COMPRESS_RETRY_INTERVAL 16
+// Window of a served file mapped for checksumming, moved along as chunks go out
+#define SERVER_VIEW_SIZE (64 * 1024 * 1024)
+
+/**
+* @brief Serves shared files to TCPFileClient peers
+*
+* Speaks the whole tcpdef.h protocol: CHUNK_SIZE chunks for peers that
+* don't negotiate, HELLO, OPEN/RANGE/CLOSE handles, requests by content
+* hash, Merkle proofs and chunk lists. Files come from the ShareIndex when
+* one is set and running, which also supplies hashes, trees and
+* content-defined chunks; otherwise plain names are looked up in the folder
+* and there are no hash lookups, proofs or chunk lists.
+*
+* Chunk payloads never pass through a user-space buffer: TransmitFile sends
+* the ChunkResponse header as its head buffer and the file range straight
+* from the system cache, one call per chunk. The checksum in the header is
+* computed from a mapped view of the file, which reads the cached pages in
+* place. Each connection has its own thread; requests on a connection are
+* answered in order.
+*
+* Open files are shared by all connections through an OpenFileCache, and
+* blocks that several peers ask for are kept in a ChunkCache with their
+* checksums. A chunk whose blocks are all in RAM goes out in one gather
+* send from there; otherwise only the blocks whose checksum is not known
+* yet are read.
+*
+* Peers that set REQ_FLAG_COMPRESS get chunks that compress well as LZ4
+* from a per-connection buffer instead; the rest still go out as above.
+*
+* Chunk sends are paced by an UploadScheduler, which shares the upload
+* limits between connections; other answers are small and never wait.
+*/
+class TCPFileServer {
+public:
+	TCPFileServer(int port, const std::string& folder);
+	~TCPFileServer();
+	TCPFileServer(const TCPFileServer&) = delete;
+	TCPFileServer& operator=(const TCPFileServer&) = delete;
+
+	// Serve the files of index instead of the folder whenever it is running
+	void SetShareIndex(ShareIndex* index) { m_shareIndex = index; }
+	// RAM for the chunk cache, 0 to turn it off; takes effect at Initialize
+	void SetCacheSize(size_t bytes) { m_cacheBytes = bytes; }
+	bool Initialize();
+	bool Start();
+	void Stop();
+	int GetPort() const { return m_port; }
+	void GetCacheStats(ChunkCacheStats& chunks, FileCacheStats& files);
+	// Upload limits in bytes per second for all peers together and for each one, 0 for none
+	void SetUploadLimits(ULONG64 totalRate, ULONG64 peerRate) { m_scheduler.SetLimits(totalRate, peerRate); }
+	void GetUploadStats(UploadStats& stats) { m_scheduler.GetStats(stats); }
+	// Compress chunks for peers that ask, on by default; worth turning off on fast links with slow CPUs
+	void SetCompression(bool compression) { m_compression = compression; }
+	// Peers served at once, each costs a thread
+	void SetMaxConnections(DWORD maxConnections) { m_maxConnections = maxConnections; }
+
+private:
+	struct Connection {
+		SOCKET socket;
+		ULONG address;		// of the peer, in network order
+		std::thread thread;
+		bool finished;
+	};
+	struct Session;
+	struct ServedFile;
+
+	int m_port;
+	std::string m_folder;
+	ShareIndex* m_shareIndex;
+	SOCKET m_listenSocket;
+	bool m_wsaStarted;
+	std::thread m_acceptThread;
+	OpenFileCache m_files;
+	size_t m_cacheBytes;
+	std::unique_ptr<ChunkCache> m_chunkCache;
+	UploadScheduler m_scheduler;
+	bool m_compression;
+	DWORD m_maxConnections;
+
+	std::mutex m_lock;
+	bool m_running;
+	std::vector<std::unique_ptr<Connection> > m_connections;
+
+	bool Listen(int port);
+	void AcceptThread();
+	void ReapConnections(bool all);
+	void ServeConnection(Connection* connection);
+	bool HandleRequest(Session& session, const ChunkRequest& request);
+	bool HandleRange(Session& session, const RangeRequest& request);
+	ServedFile* FindFile(Session& session, const ChunkRequest& request);
+	std::unique_ptr<ServedFile> OpenFile(const ChunkRequest& request);
+	bool SendChunk(Session& session, ServedFile& file, DWORD index);
+	DWORD CompressChunk(Session& session, ServedFile& file, ULONG64 offset, DWORD length);
+	bool ChecksumBlocks(ServedFile& file, DWORD firstBlock, DWORD count, CachedBlock* blocks);
+	bool SendMerkle(ServedFile& file, DWORD index, SOCKET s);
+	bool SendChunkList(ServedFile& file, DWORD first, SOCKET s);
+};
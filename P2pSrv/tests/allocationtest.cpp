@@ -0,0 +1,104 @@
+#include "testing.h"
+#include "readsendserver.h"
+#include "tcpclient.h"
+#include "tcpserver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+
+// Heap allocations made by the thread in g_countedThread, 0 for none. The
+// replacements below serve the whole program; only that thread is counted,
+// the servers in the same process allocate on threads of their own.
+static std::atomic<DWORD> g_countedThread(0);
+static std::atomic<ULONG64> g_allocations(0);
+
+static void* CountedAllocation(size_t size) {
+	if (g_countedThread != 0 && g_countedThread == GetCurrentThreadId()) {
+		g_allocations++;
+	}
+	void* memory = malloc((size != 0) ? size : 1);
+	if (memory == NULL) {
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+void* operator new(size_t size) {
+	return CountedAllocation(size);
+}
+
+void* operator new[](size_t size) {
+	return CountedAllocation(size);
+}
+
+void operator delete(void* memory) throw() {
+	free(memory);
+}
+
+void operator delete[](void* memory) throw() {
+	free(memory);
+}
+
+#define ALLOCATION_CHUNKS 256
+
+// Heap allocations of one download of chunks CHUNK_SIZE chunks from the
+// server at port, counted on this thread from connecting to disconnecting;
+// the content is checked afterwards. ~0 if the download failed.
+static ULONG64 CountDownload(int port, const std::string& folder, DWORD chunks) {
+	std::string content((size_t)chunks * CHUNK_SIZE, '\0');
+	FillRandom(&content[0], content.size(), chunks);
+	std::string name = "alloc" + std::to_string(chunks) + ".bin";
+	std::string out = folder + "\\out.bin";
+	if (!WriteWholeFile(folder + "\\" + name, content.data(), content.size())) {
+		return ~0ULL;
+	}
+	DeleteFileA(out.c_str());
+
+	TCPFileClient client("127.0.0.1", port);
+	client.SetPipelineDepth(16);
+	g_allocations = 0;
+	g_countedThread = GetCurrentThreadId();
+	bool downloaded = client.Initialize() && client.Connect() && client.DownloadFile(name, out);
+	client.Disconnect();
+	g_countedThread = 0;
+
+	std::string received;
+	if (!downloaded || !ReadWholeFile(out, received) || received != content) {
+		return ~0ULL;
+	}
+	return g_allocations;
+}
+
+// Setting up a download allocates, receiving its chunks must not: a download
+// of four times as many chunks makes no more than a handful more allocations
+// (the chunk map and the request plan are sized by the chunk count). Once
+// against a server without ranges, where every chunk is requested on its
+// own, and once with range requests.
+LOOPBACK_TEST(DownloadAllocationsPerChunk) {
+	std::string folder = MakeTestDirectory("allocation");
+	ReadSendServer legacy(TEST_PORT_BASE, folder);
+	REQUIRE(legacy.Start());
+	TCPFileServer server(TEST_PORT_BASE + 1, folder);
+	REQUIRE(server.Initialize() && server.Start());
+
+	int ports[] = { legacy.GetPort(), server.GetPort() };
+	const char* names[] = { "chunk requests", "range requests" };
+	for (int i = 0; i < 2; i++) {
+		ULONG64 small = CountDownload(ports[i], folder, ALLOCATION_CHUNKS);
+		ULONG64 large = CountDownload(ports[i], folder, 4 * ALLOCATION_CHUNKS);
+		CHECK(small != ~0ULL && large != ~0ULL);
+		if (small == ~0ULL || large == ~0ULL) {
+			continue;
+		}
+		double perChunk = ((double)large - (double)small) / (3 * ALLOCATION_CHUNKS);
+		CHECK(perChunk < 0.01);
+		printf("  %s: %llu allocations for %d chunks, %llu for %d, %.3f per chunk\n", names[i],
+			small, ALLOCATION_CHUNKS, large, 4 * ALLOCATION_CHUNKS, perChunk);
+	}
+
+	server.Stop();
+	legacy.Stop();
+	DeleteTree(folder);
+}
@@ -0,0 +1,208 @@
+#include "testing.h"
+#include "cdc.h"
+#include "chunkindex.h"
+#include "tcpdef.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <set>
+#include <algorithm>
+
+static void ChunkAll(const std::vector<BYTE>& data, size_t piece, ChunkList& chunks) {
+	ContentChunker chunker;
+	chunks.clear();
+	for (size_t offset = 0; offset < data.size(); offset += piece) {
+		chunker.Update(&data[offset], (std::min)(piece, data.size() - offset), chunks);
+	}
+	chunker.Finish(chunks);
+}
+
+// CHUNK_SIZE blocks, as files are chunked without CDC
+static void ChunkFixed(const std::vector<BYTE>& data, ChunkList& chunks) {
+	Sha256 hasher;
+	chunks.clear();
+	for (size_t offset = 0; offset < data.size(); offset += CHUNK_SIZE) {
+		ContentChunk chunk;
+		chunk.offset = offset;
+		chunk.size = (DWORD)(std::min)((size_t)CHUNK_SIZE, data.size() - offset);
+		hasher.Reset();
+		hasher.Update(&data[offset], chunk.size);
+		hasher.Final(chunk.sha256);
+		chunks.push_back(chunk);
+	}
+}
+
+// Chunks of b whose digest also appears in a, as a share of b's bytes
+static double SharedFraction(const ChunkList& a, const ChunkList& b) {
+	std::set<std::string> digests;
+	for (size_t i = 0; i < a.size(); i++) {
+		digests.insert(std::string((const char*)a[i].sha256, SHA256_DIGEST_SIZE));
+	}
+	ULONG64 shared = 0;
+	ULONG64 total = 0;
+	for (size_t i = 0; i < b.size(); i++) {
+		if (digests.count(std::string((const char*)b[i].sha256, SHA256_DIGEST_SIZE)) != 0) {
+			shared += b[i].size;
+		}
+		total += b[i].size;
+	}
+	return (total == 0) ? 0 : (double)shared / total;
+}
+
+// Chunks cover the data end to end, within the size limits, each with its own digest
+UNIT_TEST(CdcChunkBounds) {
+	std::vector<BYTE> data(8 * 1024 * 1024 + 12345);
+	FillRandom(&data[0], data.size(), 21);
+	ChunkList chunks;
+	ChunkAll(data, data.size(), chunks);
+	REQUIRE(!chunks.empty());
+
+	ULONG64 offset = 0;
+	Sha256 hasher;
+	for (size_t i = 0; i < chunks.size(); i++) {
+		CHECK(chunks[i].offset == offset);
+		CHECK(chunks[i].size <= CDC_MAX_SIZE);
+		CHECK(chunks[i].size >= CDC_MIN_SIZE || i + 1 == chunks.size());
+		BYTE digest[SHA256_DIGEST_SIZE];
+		hasher.Reset();
+		hasher.Update(&data[(size_t)offset], chunks[i].size);
+		hasher.Final(digest);
+		CHECK(memcmp(digest, chunks[i].sha256, SHA256_DIGEST_SIZE) == 0);
+		offset += chunks[i].size;
+	}
+	CHECK(offset == data.size());
+	double average = (double)data.size() / chunks.size();
+	CHECK(average > CDC_AVG_SIZE / 2 && average < CDC_AVG_SIZE * 2);
+
+	// Runs of one byte never roll to a cut, so they end at the maximum
+	std::vector<BYTE> zeros(CDC_MAX_SIZE * 3, 0);
+	ChunkAll(zeros, zeros.size(), chunks);
+	CHECK(chunks.size() == 3 && chunks[0].size == CDC_MAX_SIZE && chunks[2].size == CDC_MAX_SIZE);
+
+	// Less than the minimum is one chunk, nothing is no chunk
+	zeros.resize(100);
+	ChunkAll(zeros, zeros.size(), chunks);
+	CHECK(chunks.size() == 1 && chunks[0].size == 100);
+	ContentChunker chunker;
+	chunks.clear();
+	chunker.Finish(chunks);
+	CHECK(chunks.empty());
+}
+
+// The cut points may not depend on how the file was read
+UNIT_TEST(CdcPiecesMatchWhole) {
+	std::vector<BYTE> data(3 * 1024 * 1024);
+	FillRandom(&data[0], data.size(), 22);
+	ChunkList whole;
+	ChunkAll(data, data.size(), whole);
+	const size_t pieces[] = { 1000, 4096, 65536, 100003, CDC_MAX_SIZE + 1 };
+	for (size_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+		ChunkList chunks;
+		ChunkAll(data, pieces[i], chunks);
+		REQUIRE(chunks.size() == whole.size());
+		for (size_t c = 0; c < chunks.size(); c++) {
+			CHECK(chunks[c].offset == whole[c].offset && chunks[c].size == whole[c].size);
+			CHECK(memcmp(chunks[c].sha256, whole[c].sha256, SHA256_DIGEST_SIZE) == 0);
+		}
+	}
+}
+
+// What the mode is for: an edit in the middle keeps the rest of the chunks
+UNIT_TEST(CdcSurvivesEdits) {
+	std::vector<BYTE> original(16 * 1024 * 1024);
+	FillRandom(&original[0], original.size(), 23);
+	ChunkList before;
+	ChunkAll(original, original.size(), before);
+
+	std::vector<BYTE> inserted(original);
+	std::vector<BYTE> extra(100);
+	FillRandom(&extra[0], extra.size(), 24);
+	inserted.insert(inserted.begin() + 5000000, extra.begin(), extra.end());
+	ChunkList after;
+	ChunkAll(inserted, inserted.size(), after);
+	double insertShared = SharedFraction(before, after);
+	CHECK(insertShared > 0.95);
+
+	std::vector<BYTE> deleted(original);
+	deleted.erase(deleted.begin() + 9000000, deleted.begin() + 9000777);
+	ChunkAll(deleted, deleted.size(), after);
+	double deleteShared = SharedFraction(before, after);
+	CHECK(deleteShared > 0.95);
+	if (g_verbose) {
+		printf("  shared after 100-byte insert %.1f%%, 777-byte delete %.1f%%\n", insertShared * 100, deleteShared * 100);
+	}
+}
+
+UNIT_TEST(ChunkIndexFindsSharedChunks) {
+	std::vector<BYTE> v1(4 * 1024 * 1024);
+	FillRandom(&v1[0], v1.size(), 25);
+	std::vector<BYTE> v2(v1);
+	v2.insert(v2.begin() + 2000000, 50, 'x');
+	std::shared_ptr<ChunkList> chunks1(new ChunkList());
+	std::shared_ptr<ChunkList> chunks2(new ChunkList());
+	ChunkAll(v1, v1.size(), *chunks1);
+	ChunkAll(v2, v2.size(), *chunks2);
+
+	ChunkIndex index;
+	index.AddFile("C:\\share\\v1.bin", chunks1);
+	index.AddFile("C:\\share\\v2.bin", chunks2);
+	CHECK(index.GetTotalBytes() == v1.size() + v2.size());
+	CHECK(index.GetUniqueBytes() < v1.size() + v1.size() / 4);
+	CHECK(index.GetChunkCount() == chunks1->size() + chunks2->size());
+
+	// Every chunk of the new version is found, either file will do for the shared ones
+	for (size_t i = 0; i < chunks2->size(); i++) {
+		ChunkLocation location;
+		REQUIRE(index.Find((*chunks2)[i].sha256, location));
+		CHECK(location.size == (*chunks2)[i].size);
+		const std::vector<BYTE>& file = (location.path == "C:\\share\\v1.bin") ? v1 : v2;
+		CHECK(memcmp(&file[(size_t)location.offset], &v2[(size_t)(*chunks2)[i].offset], location.size) == 0);
+	}
+
+	// Once v2 is gone its own chunks are too, the shared ones still point at v1
+	index.RemoveFile("C:\\share\\v2.bin");
+	CHECK(index.GetTotalBytes() == v1.size());
+	CHECK(index.GetUniqueBytes() == v1.size());
+	size_t found = 0;
+	for (size_t i = 0; i < chunks2->size(); i++) {
+		ChunkLocation location;
+		if (index.Find((*chunks2)[i].sha256, location)) {
+			CHECK(location.path == "C:\\share\\v1.bin");
+			found++;
+		}
+	}
+	CHECK(found > 0 && found < chunks2->size());
+
+	// Adding a file again replaces it
+	index.AddFile("C:\\share\\v1.bin", chunks1);
+	CHECK(index.GetChunkCount() == chunks1->size());
+	index.Clear();
+	ChunkLocation location;
+	CHECK(!index.Find((*chunks1)[0].sha256, location));
+}
+
+// Chunking speed, gear hash and SHA-256 together, and what CDC and fixed
+// CHUNK_SIZE blocks keep of a 64 MB file after a small insert
+BENCHMARK(CdcThroughput) {
+	std::vector<BYTE> data(64 * 1024 * 1024);
+	FillRandom(&data[0], data.size(), 26);
+	Stopwatch watch;
+	ChunkList before;
+	ChunkAll(data, 1024 * 1024, before);
+	double seconds = watch.Seconds();
+
+	std::vector<BYTE> edited(data);
+	edited.insert(edited.begin() + 1000, 10, 'x');
+	ChunkList after;
+	ChunkAll(edited, 1024 * 1024, after);
+
+	ChunkList fixedBefore;
+	ChunkList fixedAfter;
+	ChunkFixed(data, fixedBefore);
+	ChunkFixed(edited, fixedAfter);
+
+	printf("  chunking %8.0f MB/s, %lu chunks, average %lu bytes\n",
+		data.size() / (1024.0 * 1024) / seconds, (DWORD)before.size(), (DWORD)(data.size() / before.size()));
+	printf("  after a 10-byte insert: CDC keeps %.1f%%, fixed %d-byte blocks keep %.1f%%\n",
+		SharedFraction(before, after) * 100, CHUNK_SIZE, SharedFraction(fixedBefore, fixedAfter) * 100);
+}
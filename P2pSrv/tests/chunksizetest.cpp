@@ -0,0 +1,87 @@
+#include "testing.h"
+#include "delayproxy.h"
+#include "tcpclient.h"
+#include "tcpserver.h"
+
+#include <stdio.h>
+
+#define SWEEP_FILE_SIZE (64 * 1024 * 1024)
+#define SWEEP_DELAY_MS 5
+// The slow link runs long enough for the adaptive client to pick a size
+#define SWEEP_SLOW_RATE (10 * 1024 * 1024)
+#define SWEEP_SLOW_FILE_SIZE (48 * 1024 * 1024)
+
+// Download name through the proxy with a fixed chunk size, or adaptively when
+// chunkSize is 0; seconds taken and the chunk size in use at the end, or a
+// negative number if the download failed or the content differs
+static double SweepDownload(int port, DWORD chunkSize, const std::string& name, const std::string& outPath,
+	const std::string& expected, DWORD& finalSize) {
+	DeleteFileA(outPath.c_str());
+	TCPFileClient client("127.0.0.1", port);
+	if (chunkSize == 0) {
+		client.SetAdaptiveChunkSize(true);
+	}
+	else {
+		client.SetChunkSize(chunkSize);
+	}
+	if (!client.Initialize() || !client.Connect()) {
+		return -1;
+	}
+	Stopwatch watch;
+	bool downloaded = client.DownloadFile(name, outPath);
+	double seconds = watch.Seconds();
+	finalSize = client.GetChunkSize();
+	client.Disconnect();
+
+	std::string received;
+	if (!downloaded || !ReadWholeFile(outPath, received) || received != expected) {
+		return -1;
+	}
+	return seconds;
+}
+
+// Every chunk size a session can agree on, then the adaptive mode, over
+// 10 ms round trips. Small chunks pay a header and a send per 16 KB; the
+// adaptive client starts at CHUNK_SIZE and moves after ADAPTIVE_INTERVAL_MS,
+// which only the download over the slow link lasts long enough to see.
+BENCHMARK(ChunkSizeSweep) {
+	std::string folder = MakeTestDirectory("chunksize");
+	std::string content(SWEEP_FILE_SIZE, '\0');
+	FillRandom(&content[0], content.size(), 12);
+	REQUIRE(WriteWholeFile(folder + "\\sweep.bin", content.data(), content.size()));
+
+	TCPFileServer server(TEST_PORT_BASE, folder);
+	server.SetCompression(false);
+	REQUIRE(server.Initialize() && server.Start());
+	DelayProxy proxy("127.0.0.1", TEST_PORT_BASE + 1, server.GetPort(), SWEEP_DELAY_MS);
+	REQUIRE(proxy.Start());
+
+	std::string out = folder + "\\out.bin";
+	double megabytes = (double)SWEEP_FILE_SIZE / (1024 * 1024);
+	printf("  %d ms each way, %.0f MB\n", SWEEP_DELAY_MS, megabytes);
+	for (DWORD size = MIN_CHUNK_SIZE; size <= MAX_CHUNK_SIZE; size *= 2) {
+		DWORD finalSize = 0;
+		double seconds = SweepDownload(proxy.GetPort(), size, "sweep.bin", out, content, finalSize);
+		CHECK(seconds > 0 && finalSize == size);
+		printf("  %7lu KB chunks  %7.1f MB/s\n", size / 1024, (seconds > 0) ? megabytes / seconds : 0.0);
+	}
+	DWORD finalSize = 0;
+	double seconds = SweepDownload(proxy.GetPort(), 0, "sweep.bin", out, content, finalSize);
+	CHECK(seconds > 0);
+	printf("  adaptive        %7.1f MB/s, ended at %lu KB\n", (seconds > 0) ? megabytes / seconds : 0.0, finalSize / 1024);
+
+	DelayProxy slowProxy("127.0.0.1", TEST_PORT_BASE + 2, server.GetPort(), SWEEP_DELAY_MS, SWEEP_SLOW_RATE);
+	REQUIRE(slowProxy.Start());
+	content.resize(SWEEP_SLOW_FILE_SIZE);
+	REQUIRE(WriteWholeFile(folder + "\\slow.bin", content.data(), content.size()));
+	megabytes = (double)SWEEP_SLOW_FILE_SIZE / (1024 * 1024);
+	seconds = SweepDownload(slowProxy.GetPort(), 0, "slow.bin", out, content, finalSize);
+	CHECK(seconds > 0 && finalSize != CHUNK_SIZE);
+	printf("  adaptive at %lu MB/s  %5.1f MB/s, ended at %lu KB\n", (DWORD)(SWEEP_SLOW_RATE / (1024 * 1024)),
+		(seconds > 0) ? megabytes / seconds : 0.0, finalSize / 1024);
+
+	slowProxy.Stop();
+	proxy.Stop();
+	server.Stop();
+	DeleteTree(folder);
+}
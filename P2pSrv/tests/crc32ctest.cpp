@@ -0,0 +1,110 @@
+#include "testing.h"
+#include "crc32c.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Bit at a time, straight from the definition
+static DWORD ReferenceCrc32c(const void* data, size_t size, DWORD crc = 0) {
+	const BYTE* p = (const BYTE*)data;
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) {
+		crc ^= p[i];
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+		}
+	}
+	return ~crc;
+}
+
+// Check values from RFC 3720, B.4
+UNIT_TEST(Crc32cKnownValues) {
+	BYTE data[32];
+	CHECK(Crc32c("123456789", 9) == 0xE3069283);
+	CHECK(Crc32c(data, 0) == 0);
+	memset(data, 0, sizeof(data));
+	CHECK(Crc32c(data, sizeof(data)) == 0x8A9136AA);
+	memset(data, 0xFF, sizeof(data));
+	CHECK(Crc32c(data, sizeof(data)) == 0x62A8AB43);
+	for (int i = 0; i < 32; i++) {
+		data[i] = (BYTE)i;
+	}
+	CHECK(Crc32c(data, sizeof(data)) == 0x46DD794E);
+	for (int i = 0; i < 32; i++) {
+		data[i] = (BYTE)(31 - i);
+	}
+	CHECK(Crc32c(data, sizeof(data)) == 0x113FDB5C);
+}
+
+// Every alignment and the lengths around the fast path's block sizes
+UNIT_TEST(Crc32cMatchesReference) {
+	std::vector<BYTE> data(70000);
+	FillRandom(&data[0], data.size(), 1);
+	for (size_t offset = 0; offset < 16; offset++) {
+		for (size_t size = 0; size < 600; size++) {
+			CHECK(Crc32c(&data[offset], size) == ReferenceCrc32c(&data[offset], size));
+		}
+	}
+	const size_t sizes[] = { 4095, 4096, 4097, 8191, 8192, 24576, 65535, 65536, 65537, 69984 };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		CHECK(Crc32c(&data[3], sizes[i]) == ReferenceCrc32c(&data[3], sizes[i]));
+	}
+	printf("  %s path\n", Crc32cHardwareAccelerated() ? "SSE4.2/PCLMUL" : "slicing-by-8");
+}
+
+UNIT_TEST(Crc32cInPieces) {
+	std::vector<BYTE> data(100000);
+	FillRandom(&data[0], data.size(), 2);
+	DWORD whole = Crc32c(&data[0], data.size());
+	const size_t splits[] = { 0, 1, 7, 8, 63, 4096, 33333, 65536, 99999, 100000 };
+	for (size_t i = 0; i < sizeof(splits) / sizeof(splits[0]); i++) {
+		size_t split = splits[i];
+		DWORD first = Crc32c(&data[0], split);
+		DWORD second = Crc32c(&data[0] + split, data.size() - split);
+		CHECK(Crc32c(&data[0] + split, data.size() - split, first) == whole);
+		CHECK(Crc32cCombine(first, second, data.size() - split) == whole);
+	}
+}
+
+UNIT_TEST(Crc32cCatchesWhatTheByteSumMisses) {
+	char data[64];
+	FillRandom(data, sizeof(data), 3);
+	DWORD crc = Crc32c(data, sizeof(data));
+	DWORD sum = AdditiveChecksum(data, sizeof(data));
+	char swapped[64];
+	memcpy(swapped, data, sizeof(data));
+	swapped[10] = data[20];
+	swapped[20] = data[10];
+	CHECK(data[10] != data[20]);
+	CHECK(AdditiveChecksum(swapped, sizeof(swapped)) == sum);
+	CHECK(Crc32c(swapped, sizeof(swapped)) != crc);
+	CHECK(AdditiveChecksum("\x01\x02\xFF", 3) == 0x102);
+}
+
+// Chunk-sized buffers as the receive path sees them, CRC32C against the byte sum
+BENCHMARK(Crc32cThroughput) {
+	const DWORD chunk = 65536;
+	const int rounds = 16384;	// 1 GB
+	std::vector<char> data(chunk);
+	FillRandom(&data[0], data.size(), 4);
+
+	Stopwatch watch;
+	DWORD crc = 0;
+	for (int i = 0; i < rounds; i++) {
+		crc ^= Crc32c(&data[0], chunk);
+	}
+	double crcSeconds = watch.Seconds();
+
+	watch.Restart();
+	DWORD sum = 0;
+	for (int i = 0; i < rounds; i++) {
+		sum ^= AdditiveChecksum(&data[0], chunk);
+	}
+	double sumSeconds = watch.Seconds();
+
+	double megabytes = (double)chunk * rounds / (1024 * 1024);
+	printf("  Crc32c (%-13s) %8.0f MB/s\n", Crc32cHardwareAccelerated() ? "SSE4.2/PCLMUL" : "slicing-by-8", megabytes / crcSeconds);
+	printf("  AdditiveChecksum       %8.0f MB/s\n", megabytes / sumSeconds);
+	// Keeps the loops from being optimized away
+	CHECK(crc != 0x12345678 || sum != 0x12345678);
+}
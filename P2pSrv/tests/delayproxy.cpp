@@ -0,0 +1,204 @@
+#include "delayproxy.h"
+
+#include <ws2tcpip.h>
+#include <mmsystem.h>
+#include <algorithm>
+
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "winmm.lib")
+
+#define PROXY_BUFFER_SIZE 65536
+
+DelayProxy::DelayProxy(const std::string& address, int port, int targetPort, DWORD delayMs, ULONG64 bytesPerSecond)
+	: m_address(address), m_port(port), m_targetPort(targetPort), m_delayMs(delayMs), m_rate(bytesPerSecond),
+	m_listenSocket(INVALID_SOCKET), m_timerPeriod(false) {
+}
+
+DelayProxy::~DelayProxy() {
+	Stop();
+}
+
+double DelayProxy::NowMs() {
+	static LARGE_INTEGER frequency;
+	if (frequency.QuadPart == 0) {
+		QueryPerformanceFrequency(&frequency);
+	}
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart * 1000 / frequency.QuadPart;
+}
+
+// Sleep to within a millisecond of due; the timer period set in Start makes
+// Sleep(1) take about 1 ms instead of a whole scheduler tick
+void DelayProxy::WaitUntil(double due) {
+	double now = NowMs();
+	while (now < due) {
+		Sleep((DWORD)(std::max)(1.0, due - now - 0.5));
+		now = NowMs();
+	}
+}
+
+bool DelayProxy::Start() {
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+		return false;
+	}
+	m_listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (m_listenSocket == INVALID_SOCKET) {
+		WSACleanup();
+		return false;
+	}
+
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((u_short)m_port);
+	if (inet_pton(AF_INET, m_address.c_str(), &addr.sin_addr) != 1 ||
+		bind(m_listenSocket, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR || listen(m_listenSocket, SOMAXCONN) == SOCKET_ERROR) {
+		closesocket(m_listenSocket);
+		m_listenSocket = INVALID_SOCKET;
+		WSACleanup();
+		return false;
+	}
+
+	m_timerPeriod = timeBeginPeriod(1) == TIMERR_NOERROR;
+	m_acceptThread = std::thread(&DelayProxy::AcceptThread, this);
+	return true;
+}
+
+void DelayProxy::Stop() {
+	if (m_listenSocket == INVALID_SOCKET) {
+		return;
+	}
+	closesocket(m_listenSocket);
+	m_listenSocket = INVALID_SOCKET;
+	m_acceptThread.join();
+
+	// Cut both ends so blocked reads return, then wake the senders
+	for (size_t i = 0; i < m_links.size(); i++) {
+		Link& link = *m_links[i];
+		shutdown(link.client, SD_BOTH);
+		shutdown(link.server, SD_BOTH);
+		Pipe* pipes[] = { &link.up, &link.down };
+		for (int p = 0; p < 2; p++) {
+			std::lock_guard<std::mutex> lock(pipes[p]->lock);
+			pipes[p]->stopping = true;
+			pipes[p]->changed.notify_all();
+		}
+	}
+	for (size_t i = 0; i < m_links.size(); i++) {
+		Link& link = *m_links[i];
+		link.up.reader.join();
+		link.up.sender.join();
+		link.down.reader.join();
+		link.down.sender.join();
+		closesocket(link.client);
+		closesocket(link.server);
+	}
+	m_links.clear();
+
+	if (m_timerPeriod) {
+		timeEndPeriod(1);
+		m_timerPeriod = false;
+	}
+	WSACleanup();
+}
+
+void DelayProxy::AcceptThread() {
+	while (true) {
+		SOCKET client = accept(m_listenSocket, NULL, NULL);
+		if (client == INVALID_SOCKET) {
+			return;
+		}
+		SOCKET server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons((u_short)m_targetPort);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (server == INVALID_SOCKET || connect(server, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+			closesocket(client);
+			if (server != INVALID_SOCKET) {
+				closesocket(server);
+			}
+			continue;
+		}
+		// The delay is the proxy's to add, Nagle would add its own
+		BOOL noDelay = TRUE;
+		setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+		setsockopt(server, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+
+		std::unique_ptr<Link> link(new Link());
+		link->client = client;
+		link->server = server;
+		StartPipe(link->up, client, server);
+		StartPipe(link->down, server, client);
+		m_links.push_back(std::move(link));
+	}
+}
+
+void DelayProxy::StartPipe(Pipe& pipe, SOCKET from, SOCKET to) {
+	pipe.from = from;
+	pipe.to = to;
+	pipe.queued = 0;
+	pipe.ended = false;
+	pipe.stopping = false;
+	pipe.reader = std::thread(&DelayProxy::ReadPipe, this, &pipe);
+	pipe.sender = std::thread(&DelayProxy::SendPipe, this, &pipe);
+}
+
+void DelayProxy::ReadPipe(Pipe* pipe) {
+	std::vector<char> buffer(PROXY_BUFFER_SIZE);
+	while (true) {
+		int received = recv(pipe->from, &buffer[0], (int)buffer.size(), 0);
+		std::unique_lock<std::mutex> lock(pipe->lock);
+		if (received <= 0) {
+			pipe->ended = true;
+			pipe->changed.notify_all();
+			return;
+		}
+		Segment segment;
+		segment.due = NowMs() + m_delayMs;
+		segment.data.assign(buffer.begin(), buffer.begin() + received);
+		pipe->segments.push_back(std::move(segment));
+		pipe->queued += received;
+		pipe->changed.notify_all();
+		pipe->changed.wait(lock, [pipe] { return pipe->queued < PROXY_MAX_QUEUED || pipe->stopping; });
+		if (pipe->stopping) {
+			return;
+		}
+	}
+}
+
+void DelayProxy::SendPipe(Pipe* pipe) {
+	double nextFree = 0;	// when the paced link is idle again
+	while (true) {
+		Segment segment;
+		{
+			std::unique_lock<std::mutex> lock(pipe->lock);
+			pipe->changed.wait(lock, [pipe] { return !pipe->segments.empty() || pipe->ended || pipe->stopping; });
+			if (pipe->stopping || pipe->segments.empty()) {
+				// Pass the end of the stream on once everything before it is out
+				shutdown(pipe->to, SD_SEND);
+				return;
+			}
+			segment = std::move(pipe->segments.front());
+			pipe->segments.pop_front();
+			pipe->queued -= segment.data.size();
+			pipe->changed.notify_all();
+		}
+
+		double start = segment.due;
+		if (m_rate != 0) {
+			start = (std::max)(start, nextFree);
+			nextFree = start + (double)segment.data.size() * 1000 / m_rate;
+		}
+		WaitUntil(start);
+		if (send(pipe->to, &segment.data[0], (int)segment.data.size(), 0) != (int)segment.data.size()) {
+			// The other side is gone, stop reading this one too
+			shutdown(pipe->from, SD_BOTH);
+			std::lock_guard<std::mutex> lock(pipe->lock);
+			pipe->stopping = true;
+			pipe->changed.notify_all();
+			return;
+		}
+	}
+}
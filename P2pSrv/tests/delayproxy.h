@@ -0,0 +1,82 @@
+#pragma once
+
+#include <winsock2.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+// Bytes a direction holds before it stops reading, so the sender still
+// feels the limit through TCP flow control
+#define PROXY_MAX_QUEUED (4 * 1024 * 1024)
+
+/**
+* @brief TCP relay that adds latency and, optionally, a bandwidth limit
+*
+* Listens on address:port and forwards every connection to 127.0.0.1 at the
+* target port. Whatever arrives is held back delayMs in each direction, so a
+* round trip through the proxy takes 2 * delayMs longer than without it;
+* with a rate each direction is also paced to that many bytes per second.
+* Several proxies on 127.0.0.x addresses let peers that only know an address
+* reach servers on other ports.
+*
+* Each connection has a reader and a sender thread per direction. The reader
+* timestamps what it receives and queues it; the sender sends it once it is
+* due. Stop cuts every connection.
+*/
+class DelayProxy {
+public:
+	DelayProxy(const std::string& address, int port, int targetPort, DWORD delayMs, ULONG64 bytesPerSecond = 0);
+	~DelayProxy();
+	DelayProxy(const DelayProxy&) = delete;
+	DelayProxy& operator=(const DelayProxy&) = delete;
+
+	bool Start();
+	void Stop();
+	int GetPort() const { return m_port; }
+
+private:
+	struct Segment {
+		double due;		// ms on the proxy clock
+		std::vector<char> data;
+	};
+	// One direction of a connection
+	struct Pipe {
+		SOCKET from;
+		SOCKET to;
+		std::mutex lock;
+		std::condition_variable changed;
+		std::deque<Segment> segments;
+		size_t queued;
+		bool ended;
+		bool stopping;
+		std::thread reader;
+		std::thread sender;
+	};
+	struct Link {
+		SOCKET client;
+		SOCKET server;
+		Pipe up;
+		Pipe down;
+	};
+
+	std::string m_address;
+	int m_port;
+	int m_targetPort;
+	DWORD m_delayMs;
+	ULONG64 m_rate;
+	SOCKET m_listenSocket;
+	std::thread m_acceptThread;
+	std::vector<std::unique_ptr<Link> > m_links;	// only touched by the accept thread until Stop joins it
+	bool m_timerPeriod;
+
+	void AcceptThread();
+	void StartPipe(Pipe& pipe, SOCKET from, SOCKET to);
+	void ReadPipe(Pipe* pipe);
+	void SendPipe(Pipe* pipe);
+	static double NowMs();
+	static void WaitUntil(double due);
+};
@@ -0,0 +1,103 @@
+#include "testing.h"
+#include "dirwalker.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <mutex>
+
+// Walk root from startDir on threads threads; the relative paths found,
+// sorted, and the count Walk returned
+static std::vector<std::string> WalkPaths(const std::string& root, const std::string& startDir, DWORD threads,
+	ULONGLONG& count) {
+	std::vector<std::string> paths;
+	std::mutex lock;
+	DirectoryWalker walker(threads);
+	count = walker.Walk(root, startDir, [&](const std::vector<WalkEntry>& files) {
+		std::lock_guard<std::mutex> guard(lock);
+		for (size_t i = 0; i < files.size(); i++) {
+			paths.push_back(files[i].relativePath);
+		}
+	});
+	std::sort(paths.begin(), paths.end());
+	return paths;
+}
+
+UNIT_TEST(DirectoryWalkerFindsNestedFiles) {
+	std::string root = MakeTestDirectory("dirwalker");
+	REQUIRE(CreateDirectoryA((root + "\\a").c_str(), NULL));
+	REQUIRE(CreateDirectoryA((root + "\\a\\b").c_str(), NULL));
+	REQUIRE(CreateDirectoryA((root + "\\empty").c_str(), NULL));
+	REQUIRE(WriteWholeFile(root + "\\top.txt", "1", 1));
+	REQUIRE(WriteWholeFile(root + "\\a\\middle.txt", "22", 2));
+	REQUIRE(WriteWholeFile(root + "\\a\\b\\deep.txt", "333", 3));
+
+	for (DWORD threads = 1; threads <= 4; threads += 3) {
+		ULONGLONG count = 0;
+		std::vector<std::string> paths = WalkPaths(root, "", threads, count);
+		CHECK(count == 3);
+		REQUIRE(paths.size() == 3);
+		CHECK(paths[0] == "a\\b\\deep.txt");
+		CHECK(paths[1] == "a\\middle.txt");
+		CHECK(paths[2] == "top.txt");
+
+		// Part of the tree, still relative to the root
+		paths = WalkPaths(root, "a", threads, count);
+		CHECK(count == 2 && paths.size() == 2 && paths[0] == "a\\b\\deep.txt");
+	}
+
+	DirectoryWalker walker(1);
+	ULONG64 size = 0;
+	walker.Walk(root, "a\\b", [&](const std::vector<WalkEntry>& files) {
+		size += files[0].size;
+	});
+	CHECK(size == 3);
+	CHECK(walker.GetDirectoryCount() == 1);
+	CHECK(JoinSharePath("C:\\Share", "a\\b.txt") == "C:\\Share\\a\\b.txt");
+	CHECK(JoinSharePath("C:\\Share\\", "a\\b.txt") == "C:\\Share\\a\\b.txt");
+	DeleteTree(root);
+}
+
+#define WALK_FANOUT 10
+#define WALK_FILES_PER_DIRECTORY 100
+
+// 100,000 empty files, 100 in each of the 1,000 directories three levels
+// down, listed on one thread and on the default thread count. The tree was
+// just written, so its metadata is cached; the first walk warms it anyway.
+BENCHMARK(DirectoryWalkerTree) {
+	std::string root = MakeTestDirectory("dirwalkertree");
+	char path[MAX_PATH];
+	for (int a = 0; a < WALK_FANOUT; a++) {
+		sprintf(path, "%s\\%d", root.c_str(), a);
+		REQUIRE(CreateDirectoryA(path, NULL));
+		for (int b = 0; b < WALK_FANOUT; b++) {
+			sprintf(path, "%s\\%d\\%d", root.c_str(), a, b);
+			REQUIRE(CreateDirectoryA(path, NULL));
+			for (int c = 0; c < WALK_FANOUT; c++) {
+				sprintf(path, "%s\\%d\\%d\\%d", root.c_str(), a, b, c);
+				REQUIRE(CreateDirectoryA(path, NULL));
+				for (int f = 0; f < WALK_FILES_PER_DIRECTORY; f++) {
+					sprintf(path, "%s\\%d\\%d\\%d\\file%03d.dat", root.c_str(), a, b, c, f);
+					REQUIRE(WriteWholeFile(path, "", 0));
+				}
+			}
+		}
+	}
+	const ULONGLONG expected = WALK_FANOUT * WALK_FANOUT * WALK_FANOUT * WALK_FILES_PER_DIRECTORY;
+
+	DirectoryWalker many;
+	DWORD threadCounts[] = { 1, 1, many.GetThreadCount() };
+	double seconds[3];
+	for (int i = 0; i < 3; i++) {
+		DirectoryWalker walker(threadCounts[i]);
+		Stopwatch watch;
+		ULONGLONG count = walker.Walk(root, "", [](const std::vector<WalkEntry>&) {});
+		seconds[i] = watch.Seconds();
+		CHECK(count == expected);
+	}
+	DeleteTree(root);
+
+	printf("  %llu files in %d directories\n", expected, 1 + WALK_FANOUT + WALK_FANOUT * WALK_FANOUT +
+		WALK_FANOUT * WALK_FANOUT * WALK_FANOUT);
+	printf("  %2lu thread   %7.0f ms, %8.0f files/s\n", threadCounts[1], seconds[1] * 1000, expected / seconds[1]);
+	printf("  %2lu threads  %7.0f ms, %8.0f files/s\n", threadCounts[2], seconds[2] * 1000, expected / seconds[2]);
+}
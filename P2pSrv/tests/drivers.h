@@ -0,0 +1,9 @@
+#pragma once
+
+// Drivers take the command line after their own name and return the exit code
+
+// Requests per second and latency of GET /api/status on a running service
+int RunLoadTest(int argc, char* argv[]);
+
+// Many simultaneous downloads from a server started in this process
+int RunStressTest(int argc, char* argv[]);
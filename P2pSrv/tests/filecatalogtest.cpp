@@ -0,0 +1,246 @@
+#include "testing.h"
+#include "filecatalog.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static FILETIME MakeTime(ULONG64 time) {
+	FILETIME ft;
+	ft.dwLowDateTime = (DWORD)time;
+	ft.dwHighDateTime = (DWORD)(time >> 32);
+	return ft;
+}
+
+// A digest that depends only on seed, in hex
+static std::string MakeHash(DWORD seed) {
+	BYTE digest[SHA256_DIGEST_SIZE];
+	FillRandom(digest, sizeof(digest), seed);
+	return DigestToHex(digest, sizeof(digest));
+}
+
+static const std::shared_ptr<const MerkleTree>& SomeTree() {
+	static std::shared_ptr<const MerkleTree> tree(new MerkleTree());
+	return tree;
+}
+
+// Adds the files of the small share the tests use, in path order as the share index does
+static void AddFiles(FileCatalog& catalog, bool modified) {
+	static std::shared_ptr<const MerkleTree> none;
+	FILETIME created = MakeTime(0x01D9000012345678ULL);
+	catalog.Add("Docs\\Notes.txt", 100, created, MakeTime(1000), MakeHash(1), SomeTree());
+	catalog.Add("Docs\\old\\report.pdf", 2000, created, MakeTime(2000), MakeHash(2), SomeTree());
+	if (!modified) {
+		catalog.Add("Docs\\removed.bin", 3, created, MakeTime(3000), MakeHash(3), SomeTree());
+	}
+	catalog.Add("Video.mkv", modified ? 5000001 : 5000000, created, MakeTime(modified ? 4001 : 4000), MakeHash(modified ? 44 : 4), SomeTree());
+	catalog.Add("pending.iso", 1ULL << 33, created, MakeTime(5000), "", none);
+	if (modified) {
+		catalog.Add("zz-new.txt", 6, created, MakeTime(6000), MakeHash(6), SomeTree());
+	}
+	catalog.BuildIndexes();
+}
+
+UNIT_TEST(FileCatalogLookups) {
+	FileCatalog catalog("C:\\Share");
+	AddFiles(catalog, false);
+	REQUIRE(catalog.GetCount() == 5);
+	CHECK(catalog.GetPendingCount() == 1);
+
+	size_t notes = catalog.FindByName("notes.TXT");
+	REQUIRE(notes == 0);
+	CHECK(strcmp(catalog.GetShortName(notes), "Notes.txt") == 0);
+	CHECK(catalog.GetRelativePath(notes) == "Docs\\Notes.txt");
+	CHECK(catalog.GetFullPath(notes) == "C:\\Share\\Docs\\Notes.txt");
+	CHECK(catalog.GetFullPath(catalog.FindByName("Video.mkv")) == "C:\\Share\\Video.mkv");
+	CHECK(catalog.GetRelativePath(catalog.FindByName("report.pdf")) == "Docs\\old\\report.pdf");
+	CHECK(catalog.FindByName("Notes") == CATALOG_NOT_FOUND);
+	CHECK(catalog.FindByName("") == CATALOG_NOT_FOUND);
+
+	CHECK(catalog.FindByHash(MakeHash(2)) == 1);
+	std::string upper = MakeHash(4);
+	for (size_t i = 0; i < upper.size(); i++) {
+		upper[i] = (char)toupper(upper[i]);
+	}
+	CHECK(catalog.FindByHash(upper) == 3);
+	CHECK(catalog.GetHashHex(3) == MakeHash(4));
+	CHECK(catalog.FindByHash(MakeHash(99)) == CATALOG_NOT_FOUND);
+	CHECK(catalog.FindByHash("not a hash") == CATALOG_NOT_FOUND);
+
+	// Waiting to be hashed: found by name, never by its zero digest
+	size_t pending = catalog.FindByName("PENDING.iso");
+	REQUIRE(pending != CATALOG_NOT_FOUND);
+	CHECK(catalog.IsHashPending(pending));
+	CHECK(catalog.GetEntry(pending).size == 1ULL << 33);
+	BYTE zero[SHA256_DIGEST_SIZE] = {};
+	CHECK(catalog.FindByHash(zero) == CATALOG_NOT_FOUND);
+
+	FILETIME created = catalog.GetCreationTime(notes);
+	CHECK(created.dwHighDateTime == 0x01D90000 && created.dwLowDateTime == 0x12345678);
+	CHECK(catalog.GetWriteTime(notes).dwLowDateTime == 1000);
+
+	CHECK(!catalog.Add("bad.txt", 1, created, created, "xyz", SomeTree()));
+	FileCatalog empty("C:\\Share\\");
+	CHECK(empty.FindByName("Notes.txt") == CATALOG_NOT_FOUND);
+	CHECK(empty.FindByHash(MakeHash(1)) == CATALOG_NOT_FOUND);
+	empty.BuildIndexes();
+	CHECK(empty.FindByName("Notes.txt") == CATALOG_NOT_FOUND);
+}
+
+// Same name in several directories: one of them is found, and both still by hash
+UNIT_TEST(FileCatalogDuplicateNames) {
+	FileCatalog catalog("C:\\Share");
+	FILETIME time = MakeTime(1);
+	catalog.Add("a\\same.txt", 1, time, time, MakeHash(10), SomeTree());
+	catalog.Add("b\\SAME.txt", 2, time, time, MakeHash(11), SomeTree());
+	catalog.BuildIndexes();
+	size_t found = catalog.FindByName("same.txt");
+	CHECK(found == 0 || found == 1);
+	CHECK(catalog.FindByHash(MakeHash(10)) == 0);
+	CHECK(catalog.FindByHash(MakeHash(11)) == 1);
+}
+
+UNIT_TEST(FileCatalogVersions) {
+	FileCatalog first("C:\\Share");
+	AddFiles(first, false);
+	FileCatalog none("C:\\Share");
+	first.SetVersion(1, none);
+	CHECK(first.GetVersion() == 1 && first.GetDeltaBase() == 1);
+	for (size_t i = 0; i < first.GetCount(); i++) {
+		CHECK(first.GetEntry(i).version == 1);
+	}
+
+	// Video.mkv changed, removed.bin is gone, zz-new.txt is new
+	FileCatalog second("C:\\Share");
+	AddFiles(second, true);
+	second.SetVersion(2, first);
+	CHECK(second.GetDeltaBase() == 1);
+	CHECK(second.GetEntry(second.FindByName("Notes.txt")).version == 1);
+	CHECK(second.GetEntry(second.FindByName("report.pdf")).version == 1);
+	CHECK(second.GetEntry(second.FindByName("pending.iso")).version == 1);
+	CHECK(second.GetEntry(second.FindByName("Video.mkv")).version == 2);
+	CHECK(second.GetEntry(second.FindByName("zz-new.txt")).version == 2);
+	REQUIRE(second.GetRemoved().size() == 1);
+	CHECK(second.GetRemoved()[0].relativePath == "Docs\\removed.bin");
+	CHECK(second.GetRemoved()[0].version == 2);
+
+	// Unchanged entries keep their version, removals are carried forward
+	FileCatalog third("C:\\Share");
+	AddFiles(third, true);
+	third.SetVersion(3, second);
+	CHECK(third.GetEntry(third.FindByName("Video.mkv")).version == 2);
+	CHECK(third.GetRemoved().size() == 1);
+
+	// Another root has nothing in common with the catalog before
+	FileCatalog moved("D:\\Other");
+	AddFiles(moved, true);
+	moved.SetVersion(4, third);
+	CHECK(moved.GetDeltaBase() == 4 && moved.GetRemoved().empty());
+	CHECK(moved.GetEntry(0).version == 4);
+}
+
+// The layout of the catalog before FileCatalog, for the comparison in the benchmark
+struct ListedFile {
+	std::string fileName;
+	std::string relativeName;
+	std::string sha256Hash;
+	FILETIME ftCreationTime;
+	FILETIME ftLastWriteTime;
+	ULONG64 fileSize;
+	std::shared_ptr<const MerkleTree> merkleTree;
+};
+
+// Heap bytes behind a string, beyond what the string object itself holds
+static size_t StringHeap(const std::string& str) {
+	std::string empty;
+	return (str.capacity() > empty.capacity()) ? str.capacity() + 1 : 0;
+}
+
+// 1M files in 10k directories: memory per entry and lookup time, against
+// a vector of strings searched front to back
+BENCHMARK(FileCatalogMillion) {
+	const DWORD count = 1000000;
+	const DWORD lookups = 1000000;
+	FILETIME time = MakeTime(0x01D9000000000000ULL);
+	std::vector<BYTE> digests(count * SHA256_DIGEST_SIZE);
+	FillRandom(&digests[0], digests.size(), 27);
+
+	Stopwatch watch;
+	FileCatalog catalog("D:\\Shares\\Builds");
+	catalog.Reserve(count);
+	char path[MAX_PATH];
+	for (DWORD i = 0; i < count; i++) {
+		sprintf(path, "projects\\project-%04lu\\build-output\\artifact-%07lu.bin", i / 100, i);
+		catalog.Add(path, i, time, time, DigestToHex(&digests[i * SHA256_DIGEST_SIZE], SHA256_DIGEST_SIZE), SomeTree());
+	}
+	catalog.BuildIndexes();
+	double buildSeconds = watch.Seconds();
+
+	std::vector<std::string> names(lookups);
+	std::vector<DWORD> wanted(lookups);
+	FillRandom(&wanted[0], wanted.size() * sizeof(DWORD), 28);
+	for (DWORD i = 0; i < lookups; i++) {
+		wanted[i] %= count;
+		sprintf(path, "ARTIFACT-%07lu.bin", wanted[i]);
+		names[i] = path;
+	}
+
+	watch.Restart();
+	DWORD hits = 0;
+	for (DWORD i = 0; i < lookups; i++) {
+		hits += (catalog.FindByName(names[i]) == wanted[i]) ? 1 : 0;
+	}
+	double nameSeconds = watch.Seconds();
+	CHECK(hits == lookups);
+
+	watch.Restart();
+	hits = 0;
+	for (DWORD i = 0; i < lookups; i++) {
+		hits += (catalog.FindByHash(&digests[wanted[i] * SHA256_DIGEST_SIZE]) == wanted[i]) ? 1 : 0;
+	}
+	double hashSeconds = watch.Seconds();
+	CHECK(hits == lookups);
+
+	watch.Restart();
+	hits = 0;
+	for (DWORD i = 0; i < lookups; i++) {
+		names[i][0] = 'X';	// never there
+		hits += (catalog.FindByName(names[i]) == CATALOG_NOT_FOUND) ? 1 : 0;
+	}
+	double missSeconds = watch.Seconds();
+	CHECK(hits == lookups);
+
+	// The same files as structs of strings, found by scanning
+	std::vector<ListedFile> listed(count);
+	size_t listedBytes = listed.capacity() * sizeof(ListedFile);
+	for (DWORD i = 0; i < count; i++) {
+		ListedFile& file = listed[i];
+		sprintf(path, "projects\\project-%04lu\\build-output\\artifact-%07lu.bin", i / 100, i);
+		file.relativeName = path;
+		file.fileName = std::string("D:\\Shares\\Builds\\") + path;
+		file.sha256Hash = DigestToHex(&digests[i * SHA256_DIGEST_SIZE], SHA256_DIGEST_SIZE);
+		file.fileSize = i;
+		listedBytes += StringHeap(file.fileName) + StringHeap(file.relativeName) + StringHeap(file.sha256Hash);
+	}
+	const DWORD scans = 20;
+	watch.Restart();
+	hits = 0;
+	for (DWORD i = 0; i < scans; i++) {
+		std::string hex = catalog.GetHashHex(wanted[i]);
+		for (DWORD j = 0; j < count; j++) {
+			if (listed[j].sha256Hash == hex) {
+				hits++;
+				break;
+			}
+		}
+	}
+	double scanSeconds = watch.Seconds();
+	CHECK(hits == scans);
+
+	printf("  %lu files added and indexed in %.0f ms\n", count, buildSeconds * 1000);
+	printf("  FileCatalog   %6.1f bytes per file\n", (double)catalog.GetMemoryUsage() / count);
+	printf("  strings       %6.1f bytes per file\n", (double)listedBytes / count);
+	printf("  FindByName    %8.0f ns\n", nameSeconds * 1e9 / lookups);
+	printf("  FindByHash    %8.0f ns\n", hashSeconds * 1e9 / lookups);
+	printf("  name missing  %8.0f ns\n", missSeconds * 1e9 / lookups);
+	printf("  scan by hash  %8.0f ns\n", scanSeconds * 1e9 / scans);
+}
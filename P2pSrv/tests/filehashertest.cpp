@@ -0,0 +1,97 @@
+#include "testing.h"
+#include "filehasher.h"
+
+#include <stdio.h>
+#include <atomic>
+#include <memory>
+
+#define HASHER_FILES 10000
+#define HASHER_DIRECTORIES 100
+#define HASHER_MAX_FILE_SIZE (100 * 1024)
+
+// Hash every file on a HashWorkerPool of workers threads, one job per file,
+// as ShareIndex hashes its share. With readOnly the jobs only read the files
+// through, for the ceiling. Seconds taken; bytes and the digests in file
+// order come back.
+static double HashAll(const std::vector<std::string>& paths, DWORD workers, bool readOnly,
+	std::vector<std::string>& digests, ULONGLONG& bytes) {
+	digests.assign(paths.size(), std::string());
+	std::atomic<ULONGLONG> total(0);
+	HashWorkerPool pool;
+	Stopwatch watch;
+	pool.Start(workers);
+	for (size_t i = 0; i < paths.size(); i++) {
+		pool.Submit([&, i](FileHasher& hasher) {
+			ULONGLONG bytesRead = 0;
+			if (readOnly) {
+				std::unique_ptr<char[]> buffer(new char[HASH_WINDOW_READ_SIZE]);
+				HANDLE hFile = CreateFileA(paths[i].c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+					FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+				DWORD read = 0;
+				while (hFile != INVALID_HANDLE_VALUE && ReadFile(hFile, buffer.get(), HASH_WINDOW_READ_SIZE, &read, NULL) &&
+					read > 0) {
+					bytesRead += read;
+				}
+				if (hFile != INVALID_HANDLE_VALUE) {
+					CloseHandle(hFile);
+				}
+			}
+			else {
+				std::vector<MerkleHash> leaves;
+				hasher.HashFile(paths[i], digests[i], leaves, bytesRead);
+			}
+			total += bytesRead;
+		});
+	}
+	pool.Wait();
+	double seconds = watch.Seconds();
+	pool.Stop();
+	bytes = total;
+	return seconds;
+}
+
+// A share of 10,000 files of up to 100 KB in 100 directories, hashed on one
+// thread and on as many as ChooseHashWorkerCount picks, against reading the
+// same files without hashing them. The files were just written, so this
+// measures from the system cache: how well hashing scales, not the disk.
+BENCHMARK(FileHasherShare) {
+	std::string folder = MakeTestDirectory("filehasher");
+	std::vector<DWORD> sizes(HASHER_FILES);
+	FillRandom(&sizes[0], sizes.size() * sizeof(DWORD), 15);
+	std::vector<char> data(HASHER_MAX_FILE_SIZE);
+	FillRandom(&data[0], data.size(), 16);
+	std::vector<std::string> paths;
+	char name[64];
+	for (DWORD i = 0; i < HASHER_FILES; i++) {
+		if (i % (HASHER_FILES / HASHER_DIRECTORIES) == 0) {
+			sprintf(name, "\\dir%03lu", i / (HASHER_FILES / HASHER_DIRECTORIES));
+			REQUIRE(CreateDirectoryA((folder + name).c_str(), NULL));
+		}
+		sprintf(name, "\\dir%03lu\\file%05lu.bin", i / (HASHER_FILES / HASHER_DIRECTORIES), i);
+		paths.push_back(folder + name);
+		data[0] = (char)i;	// no two files alike
+		data[1] = (char)(i >> 8);
+		REQUIRE(WriteWholeFile(paths.back(), &data[0], sizes[i] % HASHER_MAX_FILE_SIZE + 1));
+	}
+
+	DWORD workers = ChooseHashWorkerCount(folder);
+	std::vector<std::string> single;
+	std::vector<std::string> parallel;
+	std::vector<std::string> unused;
+	ULONGLONG singleBytes = 0;
+	ULONGLONG parallelBytes = 0;
+	ULONGLONG readBytes = 0;
+	double readSeconds = HashAll(paths, workers, true, unused, readBytes);
+	double singleSeconds = HashAll(paths, 1, false, single, singleBytes);
+	double parallelSeconds = HashAll(paths, workers, false, parallel, parallelBytes);
+	DeleteTree(folder);
+
+	CHECK(singleBytes == readBytes && parallelBytes == readBytes);
+	CHECK(!single[0].empty() && single == parallel);
+	double megabytes = (double)readBytes / (1024 * 1024);
+	printf("  %d files, %.0f MB\n", HASHER_FILES, megabytes);
+	printf("  read only, %2lu threads  %7.1f MB/s\n", workers, megabytes / readSeconds);
+	printf("  hashed,     1 thread   %7.1f MB/s, %5.0f files/s\n", megabytes / singleSeconds, HASHER_FILES / singleSeconds);
+	printf("  hashed,    %2lu threads  %7.1f MB/s, %5.0f files/s\n", workers, megabytes / parallelSeconds,
+		HASHER_FILES / parallelSeconds);
+}
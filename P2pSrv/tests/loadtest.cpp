@@ -0,0 +1,188 @@
+#include "drivers.h"
+#include "testing.h"
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+
+#pragma comment(lib, "ws2_32.lib")
+
+// DEFAULT_HTTP_PORT of the service
+#define LOAD_DEFAULT_PORT 8847
+#define LOAD_DEFAULT_CLIENTS 32
+#define LOAD_DEFAULT_SECONDS 10
+#define LOAD_PATH "/api/status"
+
+struct LoadClient {
+	std::vector<double> latencies;	// milliseconds, one per answered request
+	DWORD errors;
+	DWORD connects;
+};
+
+static SOCKET ConnectTo(const char* host, int port) {
+	SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (s == INVALID_SOCKET) {
+		return s;
+	}
+	BOOL noDelay = TRUE;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+	DWORD timeout = 10000;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((u_short)port);
+	if (inet_pton(AF_INET, host, &addr.sin_addr) != 1 || connect(s, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	return s;
+}
+
+// Value of header name in the header block, empty if it is not there
+static std::string FindHeader(const std::string& headers, const char* name) {
+	size_t length = strlen(name);
+	size_t line = headers.find("\r\n");
+	while (line != std::string::npos && line + 2 < headers.size()) {
+		size_t start = line + 2;
+		line = headers.find("\r\n", start);
+		if (line != std::string::npos && line - start > length && headers[start + length] == ':' &&
+			_strnicmp(headers.c_str() + start, name, length) == 0) {
+			size_t value = headers.find_first_not_of(' ', start + length + 1);
+			return headers.substr(value, line - value);
+		}
+	}
+	return std::string();
+}
+
+// Read one response: a 200 with a Content-Length and that much body. Bytes
+// of the next response stay in pending.
+static bool ReadResponse(SOCKET s, std::string& pending, bool& keepAlive) {
+	char buffer[4096];
+	size_t end;
+	while ((end = pending.find("\r\n\r\n")) == std::string::npos) {
+		int received = recv(s, buffer, sizeof(buffer), 0);
+		if (received <= 0) {
+			return false;
+		}
+		pending.append(buffer, received);
+	}
+
+	std::string headers = pending.substr(0, end + 2);
+	std::string length = FindHeader(headers, "Content-Length");
+	if (headers.compare(0, 9, "HTTP/1.1 ") != 0 || headers.compare(9, 3, "200") != 0 || length.empty()) {
+		return false;
+	}
+	keepAlive = _stricmp(FindHeader(headers, "Connection").c_str(), "close") != 0;
+
+	size_t total = end + 4 + (size_t)strtoul(length.c_str(), NULL, 10);
+	while (pending.size() < total) {
+		int received = recv(s, buffer, sizeof(buffer), 0);
+		if (received <= 0) {
+			return false;
+		}
+		pending.append(buffer, received);
+	}
+	pending.erase(0, total);
+	return true;
+}
+
+// One keep-alive connection sending the next request as soon as the last is answered
+static void LoadWorker(const char* host, int port, const std::atomic<bool>* stop, LoadClient* client) {
+	std::string request = std::string("GET ") + LOAD_PATH + " HTTP/1.1\r\nHost: " + host + "\r\n\r\n";
+	std::string pending;
+	SOCKET s = INVALID_SOCKET;
+	while (!*stop) {
+		if (s == INVALID_SOCKET) {
+			s = ConnectTo(host, port);
+			if (s == INVALID_SOCKET) {
+				client->errors++;
+				Sleep(10);
+				continue;
+			}
+			client->connects++;
+			pending.clear();
+		}
+
+		Stopwatch watch;
+		bool keepAlive = false;
+		if (send(s, request.c_str(), (int)request.size(), 0) != (int)request.size() || !ReadResponse(s, pending, keepAlive)) {
+			client->errors++;
+			keepAlive = false;
+		}
+		else {
+			client->latencies.push_back(watch.Seconds() * 1000);
+		}
+		if (!keepAlive) {
+			closesocket(s);
+			s = INVALID_SOCKET;
+		}
+	}
+	if (s != INVALID_SOCKET) {
+		closesocket(s);
+	}
+}
+
+// load [port] [clients] [seconds] [host]: every client keeps one request
+// outstanding for the whole run, then the latencies of all of them are
+// merged. Fails if any request failed or none was answered.
+int RunLoadTest(int argc, char* argv[]) {
+	int port = (argc > 0) ? atoi(argv[0]) : LOAD_DEFAULT_PORT;
+	int clients = (argc > 1) ? atoi(argv[1]) : LOAD_DEFAULT_CLIENTS;
+	int seconds = (argc > 2) ? atoi(argv[2]) : LOAD_DEFAULT_SECONDS;
+	const char* host = (argc > 3) ? argv[3] : "127.0.0.1";
+	if (port <= 0 || clients <= 0 || seconds <= 0) {
+		printf("usage: P2pTests load [port] [clients] [seconds] [host]\n");
+		return 2;
+	}
+
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+		printf("WSAStartup failed\n");
+		return 1;
+	}
+	printf("GET %s on %s:%d, %d client(s) for %d s\n", LOAD_PATH, host, port, clients, seconds);
+
+	std::vector<LoadClient> results(clients);
+	std::vector<std::thread> workers;
+	std::atomic<bool> stop(false);
+	Stopwatch watch;
+	for (int i = 0; i < clients; i++) {
+		results[i].errors = 0;
+		results[i].connects = 0;
+		workers.push_back(std::thread(LoadWorker, host, port, &stop, &results[i]));
+	}
+	Sleep(seconds * 1000);
+	stop = true;
+	for (size_t i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+	double elapsed = watch.Seconds();
+	WSACleanup();
+
+	std::vector<double> latencies;
+	DWORD errors = 0;
+	DWORD connects = 0;
+	for (size_t i = 0; i < results.size(); i++) {
+		latencies.insert(latencies.end(), results[i].latencies.begin(), results[i].latencies.end());
+		errors += results[i].errors;
+		connects += results[i].connects;
+	}
+	if (latencies.empty()) {
+		printf("no answers from %s:%d, is the service running?\n", host, port);
+		return 1;
+	}
+
+	size_t answered = latencies.size();
+	double p50 = Percentile(latencies, 0.50);
+	double p90 = Percentile(latencies, 0.90);
+	double p99 = Percentile(latencies, 0.99);
+	printf("%lu requests in %.1f s: %.0f req/s\n", (DWORD)answered, elapsed, answered / elapsed);
+	printf("latency ms: p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n", p50, p90, p99, latencies.back());
+	printf("connections %lu, failed requests %lu\n", connects, errors);
+	return (errors == 0) ? 0 : 1;
+}
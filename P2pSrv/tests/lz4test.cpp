@@ -0,0 +1,170 @@
+#include "testing.h"
+#include "lz4.h"
+#include "tcpserver.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Log lines and CSV rows, what the compression was added for
+static void FillText(std::vector<BYTE>& data, size_t size, ULONG64 seed) {
+	static const char* levels[] = { "INFO", "WARN", "DEBUG", "ERROR" };
+	std::vector<DWORD> numbers(size / 16 + 1);
+	FillRandom(&numbers[0], numbers.size() * sizeof(DWORD), seed);
+	data.clear();
+	char line[160];
+	for (size_t i = 0; data.size() < size; i++) {
+		DWORD n = numbers[i % numbers.size()];
+		int length = sprintf(line, "2024-03-%02lu 12:%02lu:%02lu,%s,worker-%lu,request %lu took %lu ms\r\n",
+			n % 28 + 1, n / 28 % 60, n / 1680 % 60, levels[n % 4], n % 16, n % 100000, n % 900);
+		data.insert(data.end(), line, line + length);
+	}
+	data.resize(size);
+}
+
+static bool RoundTrip(const std::vector<BYTE>& data, DWORD* packedSize) {
+	std::vector<BYTE> packed(data.size() + data.size() / 255 + 16);
+	std::vector<BYTE> unpacked(data.size() + 1);
+	DWORD size = Lz4Compress(data.empty() ? NULL : &data[0], (DWORD)data.size(), &packed[0], (DWORD)packed.size());
+	if (packedSize != NULL) {
+		*packedSize = size;
+	}
+	return size > 0 &&
+		Lz4Decompress(&packed[0], size, &unpacked[0], (DWORD)unpacked.size()) == (int)data.size() &&
+		(data.empty() || memcmp(&data[0], &unpacked[0], data.size()) == 0);
+}
+
+UNIT_TEST(Lz4RoundTrip) {
+	std::vector<BYTE> data;
+	DWORD packed = 0;
+	for (size_t size = 0; size < 300; size++) {
+		FillText(data, size, 9);
+		CHECK(RoundTrip(data, NULL));
+		FillRandom(data.empty() ? NULL : &data[0], data.size(), 10);
+		CHECK(RoundTrip(data, NULL));
+	}
+
+	FillText(data, CHUNK_SIZE, 11);
+	CHECK(RoundTrip(data, &packed));
+	CHECK(packed < CHUNK_SIZE / 2);
+	data.assign(CHUNK_SIZE, 'x');
+	CHECK(RoundTrip(data, &packed));
+	CHECK(packed < 300);
+	FillRandom(&data[0], data.size(), 12);
+	CHECK(RoundTrip(data, &packed));
+	data.resize(MAX_CHUNK_SIZE);
+	FillText(data, MAX_CHUNK_SIZE, 13);
+	CHECK(RoundTrip(data, NULL));
+}
+
+// Blocks written by hand, so the decoder is checked against the format and
+// not only against our own compressor
+UNIT_TEST(Lz4DecodesTheFormat) {
+	BYTE out[32];
+	// "abcd", match of 8 at distance 4, last literals "efghi"
+	const BYTE block[] = { 0x44, 'a', 'b', 'c', 'd', 0x04, 0x00, 0x50, 'e', 'f', 'g', 'h', 'i' };
+	CHECK(Lz4Decompress(block, sizeof(block), out, sizeof(out)) == 17);
+	CHECK(memcmp(out, "abcdabcdabcdefghi", 17) == 0);
+	// A run: match at distance 1 overlapping its own output
+	const BYTE run[] = { 0x14, 'a', 0x01, 0x00, 0x50, 'b', 'c', 'd', 'e', 'f' };
+	CHECK(Lz4Decompress(run, sizeof(run), out, sizeof(out)) == 14);
+	CHECK(memcmp(out, "aaaaaaaaabcdef", 14) == 0);
+	// Literal length continued in a second byte: 15 + 3
+	BYTE longer[1 + 1 + 18] = { 0xF0, 3 };
+	memcpy(longer + 2, "abcdefghijklmnopqr", 18);
+	CHECK(Lz4Decompress(longer, sizeof(longer), out, sizeof(out)) == 18);
+	CHECK(memcmp(out, "abcdefghijklmnopqr", 18) == 0);
+}
+
+UNIT_TEST(Lz4RejectsBadInput) {
+	std::vector<BYTE> data;
+	FillText(data, CHUNK_SIZE, 14);
+	std::vector<BYTE> packed(CHUNK_SIZE + CHUNK_SIZE / 255 + 16);
+	std::vector<BYTE> out(CHUNK_SIZE);
+	DWORD size = Lz4Compress(&data[0], CHUNK_SIZE, &packed[0], (DWORD)packed.size());
+	REQUIRE(size > 0);
+
+	// Output one byte too small, input cut short
+	CHECK(Lz4Decompress(&packed[0], size, &out[0], CHUNK_SIZE - 1) == -1);
+	for (DWORD cut = 1; cut < 64; cut++) {
+		CHECK(Lz4Decompress(&packed[0], size - cut, &out[0], CHUNK_SIZE) != CHUNK_SIZE);
+	}
+	// Distance before the start of the output, zero distance
+	const BYTE before[] = { 0x14, 'a', 0x02, 0x00, 0x50, 'b', 'c', 'd', 'e', 'f' };
+	CHECK(Lz4Decompress(before, sizeof(before), &out[0], CHUNK_SIZE) == -1);
+	const BYTE zero[] = { 0x14, 'a', 0x00, 0x00, 0x50, 'b', 'c', 'd', 'e', 'f' };
+	CHECK(Lz4Decompress(zero, sizeof(zero), &out[0], CHUNK_SIZE) == -1);
+	// Literal length running past the input
+	const BYTE overrun[] = { 0xF0, 0xFF, 0xFF, 'a' };
+	CHECK(Lz4Decompress(overrun, sizeof(overrun), &out[0], CHUNK_SIZE) == -1);
+
+	// Random bytes may decode to something, but never outside the buffer
+	std::vector<BYTE> noise(4096);
+	for (int i = 0; i < 2000; i++) {
+		FillRandom(&noise[0], noise.size(), 100 + i);
+		int result = Lz4Decompress(&noise[0], (DWORD)(i % noise.size()) + 1, &out[0], 1000);
+		CHECK(result >= -1 && result <= 1000);
+	}
+}
+
+// The capacity is how the server asks for a minimum saving
+UNIT_TEST(Lz4StopsAtCapacity) {
+	std::vector<BYTE> data(CHUNK_SIZE);
+	std::vector<BYTE> packed(CHUNK_SIZE);
+	FillRandom(&data[0], data.size(), 15);
+	CHECK(Lz4Compress(&data[0], CHUNK_SIZE, &packed[0], CHUNK_SIZE - CHUNK_SIZE / COMPRESS_MIN_SAVING) == 0);
+	FillText(data, CHUNK_SIZE, 16);
+	DWORD size = Lz4Compress(&data[0], CHUNK_SIZE, &packed[0], CHUNK_SIZE);
+	CHECK(size > 0);
+	CHECK(Lz4Compress(&data[0], CHUNK_SIZE, &packed[0], size - 1) == 0);
+	CHECK(Lz4Compress(&data[0], CHUNK_SIZE, &packed[0], size) == size);
+}
+
+// Chunk-sized blocks of text and of random data; for random data the cost is
+// mostly what the server's trial compression spends before giving up
+BENCHMARK(Lz4Throughput) {
+	const int rounds = 2048;	// 128 MB of chunks
+	std::vector<BYTE> text;
+	std::vector<BYTE> noise(CHUNK_SIZE);
+	FillText(text, CHUNK_SIZE, 17);
+	FillRandom(&noise[0], noise.size(), 18);
+	std::vector<BYTE> packed(CHUNK_SIZE + CHUNK_SIZE / 255 + 16);
+	std::vector<BYTE> out(CHUNK_SIZE);
+	double megabytes = (double)CHUNK_SIZE * rounds / (1024 * 1024);
+
+	Stopwatch watch;
+	DWORD textSize = 0;
+	for (int i = 0; i < rounds; i++) {
+		textSize = Lz4Compress(&text[0], CHUNK_SIZE, &packed[0], (DWORD)packed.size());
+	}
+	double compressSeconds = watch.Seconds();
+
+	watch.Restart();
+	bool decoded = true;
+	for (int i = 0; i < rounds; i++) {
+		decoded = Lz4Decompress(&packed[0], textSize, &out[0], CHUNK_SIZE) == CHUNK_SIZE && decoded;
+	}
+	double decompressSeconds = watch.Seconds();
+	CHECK(decoded);
+
+	watch.Restart();
+	DWORD noiseSize = 0;
+	for (int i = 0; i < rounds; i++) {
+		noiseSize = Lz4Compress(&noise[0], CHUNK_SIZE, &packed[0], (DWORD)packed.size());
+	}
+	double noiseSeconds = watch.Seconds();
+
+	watch.Restart();
+	DWORD trials = 0;
+	for (int i = 0; i < rounds; i++) {
+		if (Lz4Compress(&noise[0], COMPRESS_TRIAL_SIZE, &packed[0], COMPRESS_TRIAL_SIZE - COMPRESS_TRIAL_SIZE / COMPRESS_MIN_SAVING) == 0) {
+			trials++;
+		}
+	}
+	double trialSeconds = watch.Seconds();
+	CHECK(trials == (DWORD)rounds);
+
+	printf("  text:   ratio %.2f, compress %6.0f MB/s, decompress %6.0f MB/s\n",
+		(double)CHUNK_SIZE / textSize, megabytes / compressSeconds, megabytes / decompressSeconds);
+	printf("  random: ratio %.2f, compress %6.0f MB/s, trial of %d bytes %6.0f MB/s of chunks\n",
+		(double)CHUNK_SIZE / noiseSize, megabytes / noiseSeconds, COMPRESS_TRIAL_SIZE, megabytes / trialSeconds);
+}
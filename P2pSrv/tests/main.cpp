@@ -0,0 +1,93 @@
+#include "testing.h"
+#include "drivers.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/**
+* @brief Test and benchmark runner for the P2pSrv sources
+*
+* P2pTests [-v] [unit|loopback|bench|all] [name]
+*     Runs the tests of that kind, unit tests when none is given; a name runs
+*     only the tests whose name contains it.
+* P2pTests [-v] load [port] [clients] [seconds]
+*     Load test of a running service's /api/status, see loadtest.cpp.
+* P2pTests [-v] stress [transfers] [size KB]
+*     Simultaneous downloads from an in-process server, see stresstest.cpp.
+* P2pTests list
+*     Lists every test and its kind.
+*/
+
+// The sources log through this; the tests keep quiet unless asked
+void WriteLogMessage(const char* pszMessage) {
+	if (g_verbose) {
+		fprintf(stderr, "%s\n", pszMessage);
+	}
+}
+
+static const char* KindName(TestKind kind) {
+	switch (kind) {
+	case TEST_UNIT:     return "unit";
+	case TEST_LOOPBACK: return "loopback";
+	case TEST_BENCH:    return "bench";
+	default:            return "unknown";
+	}
+}
+
+static int RunTests(const char* kind, const char* filter) {
+	std::vector<TestCase>& tests = GetTests();
+	DWORD run = 0;
+	DWORD failed = 0;
+	for (size_t i = 0; i < tests.size(); i++) {
+		const TestCase& test = tests[i];
+		if ((strcmp(kind, "all") != 0 && strcmp(kind, KindName(test.kind)) != 0) ||
+			(filter != NULL && strstr(test.name, filter) == NULL)) {
+			continue;
+		}
+		printf("[ RUN  ] %s\n", test.name);
+		DWORD failuresBefore = GetFailureCount();
+		Stopwatch watch;
+		test.run();
+		bool passed = GetFailureCount() == failuresBefore;
+		printf("[ %s ] %s (%.0f ms)\n", passed ? " OK " : "FAIL", test.name, watch.Seconds() * 1000);
+		run++;
+		if (!passed) {
+			failed++;
+		}
+	}
+	printf("%lu test(s) run, %lu failed\n", run, failed);
+	return (failed != 0 || run == 0) ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+	setvbuf(stdout, NULL, _IONBF, 0);
+	int first = 1;
+	if (argc > first && strcmp(argv[first], "-v") == 0) {
+		g_verbose = true;
+		first++;
+	}
+	const char* command = (argc > first) ? argv[first] : "unit";
+
+	if (strcmp(command, "load") == 0) {
+		return RunLoadTest(argc - first - 1, argv + first + 1);
+	}
+	if (strcmp(command, "stress") == 0) {
+		return RunStressTest(argc - first - 1, argv + first + 1);
+	}
+	if (strcmp(command, "list") == 0) {
+		std::vector<TestCase>& tests = GetTests();
+		for (size_t i = 0; i < tests.size(); i++) {
+			printf("%-9s %s\n", KindName(tests[i].kind), tests[i].name);
+		}
+		return 0;
+	}
+	if (strcmp(command, "unit") == 0 || strcmp(command, "loopback") == 0 ||
+		strcmp(command, "bench") == 0 || strcmp(command, "all") == 0) {
+		return RunTests(command, (argc > first + 1) ? argv[first + 1] : NULL);
+	}
+	printf("usage: P2pTests [-v] [unit|loopback|bench|all] [name]\n"
+		"       P2pTests [-v] load [port] [clients] [seconds]\n"
+		"       P2pTests [-v] stress [transfers] [size KB]\n"
+		"       P2pTests list\n");
+	return 2;
+}
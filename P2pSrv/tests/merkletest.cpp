@@ -0,0 +1,176 @@
+#include "testing.h"
+#include "merkle.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static bool SameHash(const MerkleHash& a, const MerkleHash& b) {
+	return memcmp(a.bytes, b.bytes, SHA256_DIGEST_SIZE) == 0;
+}
+
+// Leaves of count pieces of random data, the last one short
+static void MakeLeaves(DWORD count, std::vector<MerkleHash>& leaves) {
+	Sha256 hasher;
+	std::vector<BYTE> piece(1000);
+	leaves.resize(count);
+	for (DWORD i = 0; i < count; i++) {
+		FillRandom(&piece[0], piece.size(), 1000 + i);
+		MerkleTree::HashLeaf(hasher, &piece[0], (i + 1 == count) ? 333 : piece.size(), leaves[i]);
+	}
+}
+
+// The layout written out by hand for three leaves: ((0 1) 2)
+UNIT_TEST(MerkleShape) {
+	Sha256 hasher;
+	std::vector<MerkleHash> leaves;
+	MakeLeaves(3, leaves);
+	std::vector<MerkleHash> copy = leaves;
+	MerkleTree tree;
+	tree.Build(copy);
+	CHECK(copy.empty());
+	CHECK(tree.GetLeafCount() == 3);
+
+	BYTE node[1 + 2 * SHA256_DIGEST_SIZE] = { 0x01 };
+	memcpy(node + 1, leaves[0].bytes, SHA256_DIGEST_SIZE);
+	memcpy(node + 1 + SHA256_DIGEST_SIZE, leaves[1].bytes, SHA256_DIGEST_SIZE);
+	MerkleHash left;
+	hasher.Update(node, sizeof(node));
+	hasher.Final(left.bytes);
+	memcpy(node + 1, left.bytes, SHA256_DIGEST_SIZE);
+	memcpy(node + 1 + SHA256_DIGEST_SIZE, leaves[2].bytes, SHA256_DIGEST_SIZE);
+	MerkleHash root;
+	hasher.Reset();
+	hasher.Update(node, sizeof(node));
+	hasher.Final(root.bytes);
+	CHECK(SameHash(tree.GetRoot(), root));
+
+	// A leaf is SHA-256 of 0x00 and the piece
+	MerkleHash leaf;
+	BYTE prefixed[4] = { 0x00, 'a', 'b', 'c' };
+	MerkleTree::HashLeaf(hasher, "abc", 3, leaf);
+	std::string expected;
+	hasher.Reset();
+	hasher.Update(prefixed, sizeof(prefixed));
+	hasher.FinalHex(expected);
+	CHECK(DigestToHex(leaf.bytes, SHA256_DIGEST_SIZE) == expected);
+
+	// A single leaf is its own root with an empty proof
+	MakeLeaves(1, leaves);
+	MerkleHash only = leaves[0];
+	tree.Build(leaves);
+	std::vector<BYTE> proof;
+	CHECK(SameHash(tree.GetRoot(), only));
+	CHECK(tree.GetProof(0, proof) && proof.empty());
+	CHECK(MerkleTree::VerifyLeaf(hasher, only, 0, 1, NULL, 0, tree.GetRoot()));
+	CHECK(!tree.GetProof(1, proof));
+}
+
+// Every leaf of trees of awkward sizes checks out with its proof, and only
+// at its own index
+UNIT_TEST(MerkleProofs) {
+	const DWORD counts[] = { 2, 3, 5, 7, 8, 9, 1000 };
+	Sha256 hasher;
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		DWORD count = counts[c];
+		std::vector<MerkleHash> leaves;
+		MakeLeaves(count, leaves);
+		std::vector<MerkleHash> copy = leaves;
+		MerkleTree tree;
+		tree.Build(copy);
+		REQUIRE(tree.GetLeafCount() == count);
+
+		std::vector<BYTE> proof;
+		for (DWORD i = 0; i < count; i++) {
+			REQUIRE(tree.GetProof(i, proof));
+			CHECK(proof.size() <= MERKLE_MAX_PROOF_SIZE && proof.size() % SHA256_DIGEST_SIZE == 0);
+			CHECK(MerkleTree::VerifyLeaf(hasher, leaves[i], i, count, proof.data(), proof.size(), tree.GetRoot()));
+			DWORD other = (i + 1) % count;
+			CHECK(!MerkleTree::VerifyLeaf(hasher, leaves[other], i, count, proof.data(), proof.size(), tree.GetRoot()));
+			CHECK(!MerkleTree::VerifyLeaf(hasher, leaves[i], other, count, proof.data(), proof.size(), tree.GetRoot()) ||
+				SameHash(leaves[i], leaves[other]));
+		}
+	}
+}
+
+// Anything a peer could change about a proof makes it fail
+UNIT_TEST(MerkleRejectsTampering) {
+	Sha256 hasher;
+	std::vector<MerkleHash> leaves;
+	MakeLeaves(37, leaves);
+	std::vector<MerkleHash> copy = leaves;
+	MerkleTree tree;
+	tree.Build(copy);
+	const MerkleHash& root = tree.GetRoot();
+
+	std::vector<BYTE> proof;
+	REQUIRE(tree.GetProof(20, proof));
+	REQUIRE(MerkleTree::VerifyLeaf(hasher, leaves[20], 20, 37, proof.data(), proof.size(), root));
+	for (size_t i = 0; i < proof.size(); i += 7) {
+		std::vector<BYTE> bad = proof;
+		bad[i] ^= 0x10;
+		CHECK(!MerkleTree::VerifyLeaf(hasher, leaves[20], 20, 37, bad.data(), bad.size(), root));
+	}
+	MerkleHash badLeaf = leaves[20];
+	badLeaf.bytes[31] ^= 1;
+	CHECK(!MerkleTree::VerifyLeaf(hasher, badLeaf, 20, 37, proof.data(), proof.size(), root));
+	// Cut short, one digest too many, a wrong leaf count, an index past the end
+	CHECK(!MerkleTree::VerifyLeaf(hasher, leaves[20], 20, 37, proof.data(), proof.size() - SHA256_DIGEST_SIZE, root));
+	std::vector<BYTE> longer = proof;
+	longer.insert(longer.end(), proof.begin(), proof.begin() + SHA256_DIGEST_SIZE);
+	CHECK(!MerkleTree::VerifyLeaf(hasher, leaves[20], 20, 37, longer.data(), longer.size(), root));
+	CHECK(!MerkleTree::VerifyLeaf(hasher, leaves[20], 20, 21, proof.data(), proof.size(), root));
+	CHECK(!MerkleTree::VerifyLeaf(hasher, leaves[20], 37, 37, proof.data(), proof.size(), root));
+	// An inner node does not pass for a leaf
+	std::vector<BYTE> upper;
+	REQUIRE(tree.GetProof(0, upper));
+	MerkleHash pair;
+	MerkleTree::HashNode(hasher, leaves[0], leaves[1], pair);
+	CHECK(!MerkleTree::VerifyLeaf(hasher, pair, 0, 37, upper.data() + SHA256_DIGEST_SIZE, upper.size() - SHA256_DIGEST_SIZE, root));
+}
+
+UNIT_TEST(MerkleLanesMatchSingle) {
+	std::vector<BYTE> data(SHA256_LANES * MERKLE_LEAF_SIZE);
+	FillRandom(&data[0], data.size(), 19);
+	Sha256Lanes lanes;
+	Sha256 hasher;
+	MerkleHash fast[SHA256_LANES];
+	MerkleTree::HashLeaves(lanes, &data[0], fast);
+	for (int lane = 0; lane < SHA256_LANES; lane++) {
+		MerkleHash slow;
+		MerkleTree::HashLeaf(hasher, &data[lane * MERKLE_LEAF_SIZE], MERKLE_LEAF_SIZE, slow);
+		CHECK(SameHash(fast[lane], slow));
+	}
+}
+
+// Leaves of a 1 GB file, eight at a time and one at a time, then the tree
+BENCHMARK(MerkleLeafHashing) {
+	const DWORD leafCount = 16384;
+	std::vector<BYTE> data(SHA256_LANES * MERKLE_LEAF_SIZE);
+	FillRandom(&data[0], data.size(), 20);
+	std::vector<MerkleHash> leaves(leafCount);
+
+	Stopwatch watch;
+	Sha256Lanes lanes;
+	for (DWORD i = 0; i < leafCount; i += SHA256_LANES) {
+		MerkleTree::HashLeaves(lanes, &data[0], &leaves[i]);
+	}
+	double lanesSeconds = watch.Seconds();
+
+	watch.Restart();
+	Sha256 hasher;
+	for (DWORD i = 0; i < leafCount; i++) {
+		MerkleTree::HashLeaf(hasher, &data[(i % SHA256_LANES) * MERKLE_LEAF_SIZE], MERKLE_LEAF_SIZE, leaves[i]);
+	}
+	double singleSeconds = watch.Seconds();
+
+	watch.Restart();
+	MerkleTree tree;
+	tree.Build(leaves);
+	double buildSeconds = watch.Seconds();
+	CHECK(tree.GetLeafCount() == leafCount);
+
+	double megabytes = (double)leafCount * MERKLE_LEAF_SIZE / (1024 * 1024);
+	printf("  leaves, HashLeaves   %8.0f MB/s\n", megabytes / lanesSeconds);
+	printf("  leaves, HashLeaf     %8.0f MB/s\n", megabytes / singleSeconds);
+	printf("  tree over %lu leaves  %8.2f ms\n", leafCount, buildSeconds * 1000);
+}
@@ -0,0 +1,74 @@
+#include "testing.h"
+#include "delayproxy.h"
+#include "readsendserver.h"
+#include "tcpclient.h"
+#include "tcpserver.h"
+
+#include <stdio.h>
+
+#define PIPELINE_FILE_SIZE (4 * 1024 * 1024)
+// Each way, so 10 ms round trips
+#define PIPELINE_DELAY_MS 5
+
+// Download name from a server at port into a fresh file; seconds taken, or a
+// negative number if the download failed or the content differs
+static double TimedDownload(int port, DWORD depth, const std::string& name, const std::string& outPath,
+	const std::string& expected) {
+	DeleteFileA(outPath.c_str());
+	TCPFileClient client("127.0.0.1", port);
+	client.SetPipelineDepth(depth);
+	if (!client.Initialize() || !client.Connect()) {
+		return -1;
+	}
+	Stopwatch watch;
+	bool downloaded = client.DownloadFile(name, outPath);
+	double seconds = watch.Seconds();
+	client.Disconnect();
+
+	std::string received;
+	if (!downloaded || !ReadWholeFile(outPath, received) || received != expected) {
+		return -1;
+	}
+	return seconds;
+}
+
+// 64 requests of one chunk each over 10 ms round trips: one at a time every
+// chunk waits for a round trip, pipelined they overlap. The server that
+// knows ranges is asked for whole ranges and does not depend on the depth.
+LOOPBACK_TEST(PipelinedDownloadOverLatency) {
+	std::string folder = MakeTestDirectory("pipeline");
+	std::string content(PIPELINE_FILE_SIZE, '\0');
+	FillRandom(&content[0], content.size(), 11);
+	REQUIRE(WriteWholeFile(folder + "\\pipeline.bin", content.data(), content.size()));
+
+	ReadSendServer legacy(TEST_PORT_BASE, folder);
+	REQUIRE(legacy.Start());
+	DelayProxy legacyProxy("127.0.0.1", TEST_PORT_BASE + 1, legacy.GetPort(), PIPELINE_DELAY_MS);
+	REQUIRE(legacyProxy.Start());
+
+	TCPFileServer server(TEST_PORT_BASE + 2, folder);
+	REQUIRE(server.Initialize() && server.Start());
+	DelayProxy serverProxy("127.0.0.1", TEST_PORT_BASE + 3, server.GetPort(), PIPELINE_DELAY_MS);
+	REQUIRE(serverProxy.Start());
+
+	std::string out = folder + "\\out.bin";
+	double serial = TimedDownload(legacyProxy.GetPort(), 1, "pipeline.bin", out, content);
+	double pipelined = TimedDownload(legacyProxy.GetPort(), 16, "pipeline.bin", out, content);
+	double ranges = TimedDownload(serverProxy.GetPort(), 1, "pipeline.bin", out, content);
+	serverProxy.Stop();
+	server.Stop();
+	legacyProxy.Stop();
+	legacy.Stop();
+	DeleteTree(folder);
+
+	REQUIRE(serial > 0 && pipelined > 0 && ranges > 0);
+	// 64 round trips against 4 and change; leave room for a busy machine
+	CHECK(serial > 4 * pipelined);
+	CHECK(serial > 4 * ranges);
+
+	double megabytes = (double)PIPELINE_FILE_SIZE / (1024 * 1024);
+	printf("  %d ms each way, %.0f MB\n", PIPELINE_DELAY_MS, megabytes);
+	printf("  one chunk at a time  %7.1f MB/s\n", megabytes / serial);
+	printf("  16 chunks in flight  %7.1f MB/s\n", megabytes / pipelined);
+	printf("  range requests       %7.1f MB/s\n", megabytes / ranges);
+}
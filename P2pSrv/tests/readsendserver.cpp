@@ -0,0 +1,142 @@
+#include "readsendserver.h"
+#include "tcpdef.h"
+#include "crc32c.h"
+
+#include <string.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+ReadSendServer::ReadSendServer(int port, const std::string& folder)
+	: m_port(port), m_folder(folder), m_listenSocket(INVALID_SOCKET) {
+}
+
+ReadSendServer::~ReadSendServer() {
+	Stop();
+}
+
+bool ReadSendServer::Start() {
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+		return false;
+	}
+	m_listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((u_short)m_port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (m_listenSocket == INVALID_SOCKET || bind(m_listenSocket, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+		listen(m_listenSocket, SOMAXCONN) == SOCKET_ERROR) {
+		if (m_listenSocket != INVALID_SOCKET) {
+			closesocket(m_listenSocket);
+			m_listenSocket = INVALID_SOCKET;
+		}
+		WSACleanup();
+		return false;
+	}
+	m_acceptThread = std::thread(&ReadSendServer::AcceptThread, this);
+	return true;
+}
+
+void ReadSendServer::Stop() {
+	if (m_listenSocket == INVALID_SOCKET) {
+		return;
+	}
+	closesocket(m_listenSocket);
+	m_listenSocket = INVALID_SOCKET;
+	m_acceptThread.join();
+	for (size_t i = 0; i < m_connections.size(); i++) {
+		shutdown(m_connections[i]->socket, SD_BOTH);
+	}
+	for (size_t i = 0; i < m_connections.size(); i++) {
+		m_connections[i]->thread.join();
+		closesocket(m_connections[i]->socket);
+	}
+	m_connections.clear();
+	WSACleanup();
+}
+
+void ReadSendServer::AcceptThread() {
+	while (true) {
+		SOCKET s = accept(m_listenSocket, NULL, NULL);
+		if (s == INVALID_SOCKET) {
+			return;
+		}
+		BOOL noDelay = TRUE;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+		std::unique_ptr<Connection> connection(new Connection());
+		connection->socket = s;
+		connection->thread = std::thread(&ReadSendServer::Serve, this, s);
+		m_connections.push_back(std::move(connection));
+	}
+}
+
+// Answer requests until the peer hangs up; the file of the last request stays open
+void ReadSendServer::Serve(SOCKET s) {
+	std::vector<char> buffer(sizeof(ChunkResponse) + CHUNK_SIZE);
+	ChunkResponse* response = (ChunkResponse*)&buffer[0];
+	char* data = &buffer[sizeof(ChunkResponse)];
+	std::string openName;
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	ULONGLONG fileSize = 0;
+
+	ChunkRequest request;
+	while (recv(s, (char*)&request, sizeof(request), MSG_WAITALL) == sizeof(request)) {
+		request.filename[MAX_FILENAME - 1] = '\0';
+		memset(response, 0, sizeof(ChunkResponse));
+		response->chunkIndex = request.chunkIndex;
+		DWORD length = 0;
+
+		if (request.msgType != MSG_CHUNK_REQUEST || (request.flags & REQ_FLAG_BY_HASH) != 0) {
+			response->msgType = MSG_ERROR;
+		}
+		else {
+			if (openName != request.filename) {
+				if (hFile != INVALID_HANDLE_VALUE) {
+					CloseHandle(hFile);
+				}
+				openName = request.filename;
+				hFile = CreateFileA((m_folder + "\\" + openName).c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+					OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+				LARGE_INTEGER size;
+				if (hFile != INVALID_HANDLE_VALUE && GetFileSizeEx(hFile, &size)) {
+					fileSize = size.QuadPart;
+				}
+			}
+
+			ULONGLONG offset = (ULONGLONG)request.chunkIndex * CHUNK_SIZE;
+			DWORD totalChunks = (DWORD)((fileSize + CHUNK_SIZE - 1) / CHUNK_SIZE);
+			if (hFile == INVALID_HANDLE_VALUE) {
+				response->msgType = MSG_FILE_NOT_FOUND;
+			}
+			else if (offset > fileSize || (offset == fileSize && fileSize != 0)) {
+				response->msgType = MSG_ERROR;
+			}
+			else {
+				length = (DWORD)((fileSize - offset < CHUNK_SIZE) ? fileSize - offset : CHUNK_SIZE);
+				OVERLAPPED position = {};
+				position.Offset = (DWORD)offset;
+				position.OffsetHigh = (DWORD)(offset >> 32);
+				DWORD read = 0;
+				if (length != 0 && (!ReadFile(hFile, data, length, &read, &position) || read != length)) {
+					response->msgType = MSG_ERROR;
+					length = 0;
+				}
+				else {
+					bool crc32c = (request.flags & REQ_FLAG_CRC32C) != 0;
+					response->msgType = crc32c ? MSG_CHUNK_RESPONSE_CRC32C : MSG_CHUNK_RESPONSE;
+					response->crc32 = crc32c ? Crc32c(data, length) : AdditiveChecksum(data, length);
+					response->chunkSize = length;
+					response->totalChunks = (totalChunks == 0) ? 1 : totalChunks;
+				}
+			}
+		}
+
+		int bytes = (int)(sizeof(ChunkResponse) + length);
+		if (send(s, &buffer[0], bytes, 0) != bytes) {
+			break;
+		}
+	}
+	if (hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(hFile);
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <winsock2.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+
+/**
+* @brief The chunk server done the simple way, for comparison
+*
+* Speaks only the original protocol: CHUNK_SIZE chunks by name, one
+* ChunkResponse per ChunkRequest, answered in order. HELLO, OPEN and every
+* other request get MSG_ERROR, as from a peer that predates them, so a
+* TCPFileClient falls back to pipelined requests for single chunks. Each
+* chunk is read into a buffer with ReadFile, checksummed there (CRC32C when
+* the peer asks for it) and sent from there together with its header.
+*/
+class ReadSendServer {
+public:
+	ReadSendServer(int port, const std::string& folder);
+	~ReadSendServer();
+	ReadSendServer(const ReadSendServer&) = delete;
+	ReadSendServer& operator=(const ReadSendServer&) = delete;
+
+	bool Start();
+	void Stop();
+	int GetPort() const { return m_port; }
+
+private:
+	struct Connection {
+		SOCKET socket;
+		std::thread thread;
+	};
+
+	int m_port;
+	std::string m_folder;
+	SOCKET m_listenSocket;
+	std::thread m_acceptThread;
+	std::vector<std::unique_ptr<Connection> > m_connections;	// accept thread only, until Stop joins it
+
+	void AcceptThread();
+	void Serve(SOCKET s);
+};
@@ -0,0 +1,175 @@
+#include "testing.h"
+#include "sha256.h"
+
+#include <bcrypt.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#pragma comment(lib, "bcrypt.lib")
+
+// SHA-256 through CNG the way calcHash did it before sha256.cpp had its own
+// kernels: a provider opened and closed for every message
+static bool CngSha256(const void* data, size_t size, BYTE digest[SHA256_DIGEST_SIZE]) {
+	BCRYPT_ALG_HANDLE hAlg = NULL;
+	BCRYPT_HASH_HANDLE hHash = NULL;
+	DWORD objectSize = 0, cbData = 0;
+	if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&hAlg, BCRYPT_SHA256_ALGORITHM, NULL, 0))) {
+		return false;
+	}
+	bool ok = false;
+	if (BCRYPT_SUCCESS(BCryptGetProperty(hAlg, BCRYPT_OBJECT_LENGTH, (PUCHAR)&objectSize, sizeof(DWORD), &cbData, 0))) {
+		std::vector<BYTE> object(objectSize);
+		if (BCRYPT_SUCCESS(BCryptCreateHash(hAlg, &hHash, object.data(), objectSize, NULL, 0, 0))) {
+			ok = BCRYPT_SUCCESS(BCryptHashData(hHash, (PUCHAR)data, (ULONG)size, 0)) &&
+				BCRYPT_SUCCESS(BCryptFinishHash(hHash, digest, SHA256_DIGEST_SIZE, 0));
+			BCryptDestroyHash(hHash);
+		}
+	}
+	BCryptCloseAlgorithmProvider(hAlg, 0);
+	return ok;
+}
+
+static std::string HashHex(const void* data, size_t size) {
+	Sha256 sha;
+	std::string hex;
+	sha.Update(data, size);
+	sha.FinalHex(hex);
+	return hex;
+}
+
+// FIPS 180-2, appendix B, and the empty message
+UNIT_TEST(Sha256KnownValues) {
+	CHECK(HashHex("abc", 3) == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+	CHECK(HashHex("", 0) == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+	const char* message = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+	CHECK(HashHex(message, strlen(message)) == "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+
+	std::vector<char> million(1000000, 'a');
+	CHECK(HashHex(&million[0], million.size()) == "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+	printf("  %s, lanes %s\n", Sha256Implementation(), Sha256LanesImplementation());
+}
+
+// Lengths around the block and padding boundaries, against CNG
+UNIT_TEST(Sha256MatchesCng) {
+	std::vector<BYTE> data(5000);
+	FillRandom(&data[0], data.size(), 5);
+	for (size_t size = 0; size <= 300; size++) {
+		BYTE expected[SHA256_DIGEST_SIZE];
+		BYTE actual[SHA256_DIGEST_SIZE];
+		REQUIRE(CngSha256(&data[0], size, expected));
+		Sha256 sha;
+		sha.Update(&data[0], size);
+		sha.Final(actual);
+		CHECK(memcmp(expected, actual, sizeof(actual)) == 0);
+	}
+	BYTE expected[SHA256_DIGEST_SIZE];
+	REQUIRE(CngSha256(&data[1], data.size() - 1, expected));
+	CHECK(HashHex(&data[1], data.size() - 1) == DigestToHex(expected, sizeof(expected)));
+}
+
+UNIT_TEST(Sha256InPieces) {
+	std::vector<BYTE> data(10000);
+	FillRandom(&data[0], data.size(), 6);
+	std::string whole = HashHex(&data[0], data.size());
+	const size_t pieces[] = { 1, 3, 55, 56, 63, 64, 65, 127, 4096 };
+	Sha256 sha;
+	for (size_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+		sha.Reset();
+		for (size_t offset = 0; offset < data.size(); offset += pieces[i]) {
+			sha.Update(&data[offset], (std::min)(pieces[i], data.size() - offset));
+		}
+		std::string hex;
+		sha.FinalHex(hex);
+		CHECK(hex == whole);
+	}
+}
+
+// Every lane has to come out as if it was hashed on its own
+UNIT_TEST(Sha256LanesMatchSingle) {
+	std::vector<BYTE> data(SHA256_LANES * 3000);
+	FillRandom(&data[0], data.size(), 7);
+	const size_t sizes[] = { 0, 1, 55, 56, 64, 100, 1000, 3000 };
+	Sha256Lanes lanes;
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		const void* messages[SHA256_LANES];
+		for (int lane = 0; lane < SHA256_LANES; lane++) {
+			messages[lane] = &data[lane * 3000];
+		}
+		lanes.Reset();
+		// Two updates, so the buffered tail is carried over too
+		size_t first = sizes[i] / 3;
+		lanes.Update(messages, first);
+		for (int lane = 0; lane < SHA256_LANES; lane++) {
+			messages[lane] = (const BYTE*)messages[lane] + first;
+		}
+		lanes.Update(messages, sizes[i] - first);
+
+		BYTE digests[SHA256_LANES][SHA256_DIGEST_SIZE];
+		lanes.Final(digests);
+		for (int lane = 0; lane < SHA256_LANES; lane++) {
+			CHECK(DigestToHex(digests[lane], SHA256_DIGEST_SIZE) == HashHex(&data[lane * 3000], sizes[i]));
+		}
+	}
+}
+
+UNIT_TEST(Sha256Hex) {
+	BYTE digest[SHA256_DIGEST_SIZE];
+	std::string hex = HashHex("abc", 3);
+	CHECK(IsSha256Hex(hex));
+	CHECK(IsSha256Hex("BA7816BF8F01CFEA414140DE5DAE2223B00361A396177A9CB410FF61F20015AD"));
+	CHECK(!IsSha256Hex(hex.substr(1)));
+	CHECK(!IsSha256Hex(hex.substr(1) + "g"));
+	CHECK(HexToDigest(hex, digest, sizeof(digest)));
+	CHECK(DigestToHex(digest, sizeof(digest)) == hex);
+	CHECK(!HexToDigest(hex + "00", digest, sizeof(digest)));
+	CHECK(!HexToDigest("zz", digest, 1));
+}
+
+// Per-file hashing as FileHasher does it, 64 KB messages: CNG with a
+// provider per file, the single-message kernel and the lanes
+BENCHMARK(Sha256Throughput) {
+	const size_t size = 65536;
+	const int files = 4096;	// 256 MB
+	std::vector<BYTE> data(size * SHA256_LANES);
+	FillRandom(&data[0], data.size(), 8);
+	BYTE digest[SHA256_DIGEST_SIZE];
+	volatile BYTE check = 0;	// keeps the digests from being optimized away
+
+	Stopwatch watch;
+	for (int i = 0; i < files; i++) {
+		CngSha256(&data[(i % SHA256_LANES) * size], size, digest);
+		check = check ^ digest[0];
+	}
+	double cngSeconds = watch.Seconds();
+
+	watch.Restart();
+	Sha256 sha;
+	for (int i = 0; i < files; i++) {
+		sha.Reset();
+		sha.Update(&data[(i % SHA256_LANES) * size], size);
+		sha.Final(digest);
+		check = check ^ digest[0];
+	}
+	double singleSeconds = watch.Seconds();
+
+	watch.Restart();
+	Sha256Lanes lanes;
+	const void* messages[SHA256_LANES];
+	for (int lane = 0; lane < SHA256_LANES; lane++) {
+		messages[lane] = &data[lane * size];
+	}
+	BYTE digests[SHA256_LANES][SHA256_DIGEST_SIZE];
+	for (int i = 0; i < files; i += SHA256_LANES) {
+		lanes.Reset();
+		lanes.Update(messages, size);
+		lanes.Final(digests);
+		check = check ^ digests[0][0];
+	}
+	double lanesSeconds = watch.Seconds();
+
+	double megabytes = (double)size * files / (1024 * 1024);
+	printf("  %-28s %8.0f MB/s\n", "CNG, provider per file", megabytes / cngSeconds);
+	printf("  %-28s %8.0f MB/s\n", (std::string("Sha256, ") + Sha256Implementation()).c_str(), megabytes / singleSeconds);
+	printf("  %-28s %8.0f MB/s\n", (std::string("Sha256Lanes, ") + Sha256LanesImplementation()).c_str(), megabytes / lanesSeconds);
+}
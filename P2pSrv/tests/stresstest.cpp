@@ -0,0 +1,111 @@
+#include "drivers.h"
+#include "testing.h"
+#include "asyncclient.h"
+#include "swarm.h"
+#include "tcpserver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+#define STRESS_DEFAULT_TRANSFERS 500
+#define STRESS_DEFAULT_KB 256
+
+struct StressTransfer {
+	double seconds;		// from the start to the reported result
+	bool ok;
+};
+
+// stress [transfers] [size KB]: starts a TCPFileServer on TEST_PORT_BASE that
+// takes that many connections, and that many swarm downloads of the same
+// file, each from the one server, all on a single AsyncTransferEngine
+// thread. Reports the time to the last finished transfer and the spread of
+// transfer times. Fails if any transfer did not finish, came out different
+// or had to reconnect.
+int RunStressTest(int argc, char* argv[]) {
+	int transfers = (argc > 0) ? atoi(argv[0]) : STRESS_DEFAULT_TRANSFERS;
+	int kilobytes = (argc > 1) ? atoi(argv[1]) : STRESS_DEFAULT_KB;
+	if (transfers <= 0 || kilobytes <= 0) {
+		printf("usage: P2pTests stress [transfers] [size KB]\n");
+		return 2;
+	}
+
+	std::string folder = MakeTestDirectory("stress");
+	std::string content((size_t)kilobytes * 1024, '\0');
+	FillRandom(&content[0], content.size(), 17);
+	TCPFileServer server(TEST_PORT_BASE, folder);
+	server.SetMaxConnections(transfers);
+	AsyncTransferEngine engine;
+	if (!WriteWholeFile(folder + "\\stress.bin", content.data(), content.size()) ||
+		!server.Initialize() || !server.Start() || !engine.Start()) {
+		printf("cannot start a server in %s\n", folder.c_str());
+		DeleteTree(folder);
+		return 1;
+	}
+	printf("%d simultaneous downloads of %d KB from 127.0.0.1:%d on one thread\n", transfers, kilobytes, server.GetPort());
+
+	std::string peer = "127.0.0.1:" + std::to_string(server.GetPort());
+	std::vector<StressTransfer> results(transfers);
+	std::vector<std::unique_ptr<SwarmDownloader> > swarms;
+	std::mutex lock;
+	std::condition_variable finished;
+	int pending = transfers;
+	Stopwatch watch;
+	for (int i = 0; i < transfers; i++) {
+		std::string out = folder + "\\out" + std::to_string(i) + ".bin";
+		swarms.push_back(std::unique_ptr<SwarmDownloader>(new SwarmDownloader(std::vector<std::string>(1, peer), "stress.bin", out)));
+		StressTransfer* result = &results[i];
+		result->ok = false;
+		result->seconds = 0;
+		bool started = swarms.back()->Start(&engine, [&, result](bool ok) {
+			std::lock_guard<std::mutex> guard(lock);
+			result->ok = ok;
+			result->seconds = watch.Seconds();
+			if (--pending == 0) {
+				finished.notify_all();
+			}
+		});
+		if (!started) {
+			std::lock_guard<std::mutex> guard(lock);
+			pending--;
+		}
+	}
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		finished.wait(guard, [&] { return pending == 0; });
+	}
+	double elapsed = watch.Seconds();
+	engine.Stop();
+	server.Stop();
+
+	std::vector<double> times;
+	DWORD failed = 0;
+	DWORD retries = 0;
+	for (int i = 0; i < transfers; i++) {
+		SwarmProgress progress;
+		swarms[i]->GetProgress(progress);
+		retries += progress.retries;
+		std::string received;
+		if (results[i].ok && ReadWholeFile(folder + "\\out" + std::to_string(i) + ".bin", received) && received == content) {
+			times.push_back(results[i].seconds * 1000);
+		}
+		else {
+			failed++;
+		}
+	}
+	swarms.clear();
+	DeleteTree(folder);
+
+	printf("%lu of %d transfers in %.2f s: %.1f MB/s\n", (DWORD)times.size(), transfers, elapsed,
+		(double)content.size() * times.size() / (1024 * 1024) / elapsed);
+	if (!times.empty()) {
+		double p50 = Percentile(times, 0.50);
+		double p90 = Percentile(times, 0.90);
+		double p99 = Percentile(times, 0.99);
+		printf("transfer ms: p50 %.0f  p90 %.0f  p99 %.0f  max %.0f\n", p50, p90, p99, times.back());
+	}
+	printf("retries %lu, failed transfers %lu\n", retries, failed);
+	return (failed == 0 && retries == 0) ? 0 : 1;
+}
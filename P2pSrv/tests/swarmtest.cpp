@@ -0,0 +1,73 @@
+#include "testing.h"
+#include "delayproxy.h"
+#include "swarm.h"
+#include "tcpserver.h"
+
+#include <stdio.h>
+#include <memory>
+
+#define SWARM_FILE_SIZE (24 * 1024 * 1024)
+#define SWARM_DELAY_MS 2
+#define SWARM_PEERS 3
+
+// Upload limit of each seeder in bytes per second; the last one is slow
+static const ULONG64 SWARM_RATES[SWARM_PEERS] = { 8 * 1024 * 1024, 8 * 1024 * 1024, 2 * 1024 * 1024 };
+
+// Swarm download of name from peers into a fresh file; seconds taken, or a
+// negative number if the download failed or the content differs
+static double TimedSwarm(const std::vector<std::string>& peers, const std::string& name, const std::string& outPath,
+	const std::string& expected) {
+	DeleteFileA(outPath.c_str());
+	Stopwatch watch;
+	SwarmDownloader swarm(peers, name, outPath);
+	bool downloaded = swarm.Run();
+	double seconds = watch.Seconds();
+
+	std::string received;
+	if (!downloaded || !ReadWholeFile(outPath, received) || received != expected) {
+		return -1;
+	}
+	return seconds;
+}
+
+// Three seeders with upload limits of 8, 8 and 2 MB/s. Each seeder sits
+// behind a delaying proxy on 127.0.0.x at SERVER_PORTS[0], found by port
+// discovery, which has to be free on all three. Together the seeders should be much
+// faster than the fastest one alone, and the slow one must not hold the
+// download back.
+LOOPBACK_TEST(SwarmAddsUpPeers) {
+	std::string folder = MakeTestDirectory("swarm");
+	std::string content(SWARM_FILE_SIZE, '\0');
+	FillRandom(&content[0], content.size(), 14);
+	REQUIRE(WriteWholeFile(folder + "\\swarm.bin", content.data(), content.size()));
+
+	std::unique_ptr<TCPFileServer> servers[SWARM_PEERS];
+	std::unique_ptr<DelayProxy> proxies[SWARM_PEERS];
+	std::vector<std::string> peers;
+	for (int i = 0; i < SWARM_PEERS; i++) {
+		servers[i].reset(new TCPFileServer(TEST_PORT_BASE + i, folder));
+		servers[i]->SetUploadLimits(SWARM_RATES[i], 0);
+		REQUIRE(servers[i]->Initialize() && servers[i]->Start());
+		std::string address = "127.0.0." + std::to_string(i + 2);
+		proxies[i].reset(new DelayProxy(address, SERVER_PORTS[0], servers[i]->GetPort(), SWARM_DELAY_MS));
+		REQUIRE(proxies[i]->Start());
+		peers.push_back(address);
+	}
+
+	std::string out = folder + "\\out.bin";
+	double single = TimedSwarm(std::vector<std::string>(1, peers[0]), "swarm.bin", out, content);
+	double all = TimedSwarm(peers, "swarm.bin", out, content);
+	for (int i = 0; i < SWARM_PEERS; i++) {
+		proxies[i]->Stop();
+		servers[i]->Stop();
+	}
+	DeleteTree(folder);
+
+	REQUIRE(single > 0 && all > 0);
+	// 18 MB/s against 8 at best; a swarm waiting on the slow peer would be slower than one peer
+	CHECK(single > 1.6 * all);
+
+	double megabytes = (double)SWARM_FILE_SIZE / (1024 * 1024);
+	printf("  one peer     %6.1f MB/s\n", megabytes / single);
+	printf("  %d peers      %6.1f MB/s, %.1fx\n", SWARM_PEERS, megabytes / all, single / all);
+}
@@ -0,0 +1,147 @@
+#include "testing.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <mutex>
+
+static std::mutex s_reportLock;
+static DWORD s_failures = 0;
+
+bool g_verbose = false;
+
+std::vector<TestCase>& GetTests() {
+	// Built on first use, registrars in other files may run before this one's statics
+	static std::vector<TestCase> tests;
+	return tests;
+}
+
+TestRegistrar::TestRegistrar(const char* name, TestKind kind, TestFunction run) {
+	TestCase test = { name, kind, run };
+	GetTests().push_back(test);
+}
+
+void ReportFailure(const char* file, int line, const char* expression) {
+	std::lock_guard<std::mutex> lock(s_reportLock);
+	s_failures++;
+	printf("  FAILED %s(%d): %s\n", file, line, expression);
+}
+
+DWORD GetFailureCount() {
+	std::lock_guard<std::mutex> lock(s_reportLock);
+	return s_failures;
+}
+
+// Constructor
+Stopwatch::Stopwatch() {
+	QueryPerformanceFrequency(&m_frequency);
+	Restart();
+}
+
+void Stopwatch::Restart() {
+	QueryPerformanceCounter(&m_start);
+}
+
+double Stopwatch::Seconds() const {
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return (double)(now.QuadPart - m_start.QuadPart) / (double)m_frequency.QuadPart;
+}
+
+// xorshift64*, fast enough that generating test data never shows up in a benchmark
+void FillRandom(void* data, size_t size, DWORD seed) {
+	ULONG64 state = 0x9E3779B97F4A7C15ULL ^ ((ULONG64)seed << 32 | seed);
+	BYTE* out = (BYTE*)data;
+	size_t i = 0;
+	while (i < size) {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		ULONG64 value = state * 0x2545F4914F6CDD1DULL;
+		size_t n = (std::min)(size - i, sizeof(value));
+		memcpy(out + i, &value, n);
+		i += n;
+	}
+}
+
+std::string MakeTestDirectory(const std::string& name) {
+	char temp[MAX_PATH];
+	if (!GetTempPathA(MAX_PATH, temp)) {
+		return std::string();
+	}
+	std::string root = std::string(temp) + "P2pTests";
+	CreateDirectoryA(root.c_str(), NULL);
+	std::string path = root + "\\" + name;
+	DeleteTree(path);
+	CreateDirectoryA(path.c_str(), NULL);
+	return path;
+}
+
+void DeleteTree(const std::string& path) {
+	WIN32_FIND_DATAA data;
+	HANDLE hFind = FindFirstFileA((path + "\\*").c_str(), &data);
+	if (hFind != INVALID_HANDLE_VALUE) {
+		do {
+			if (strcmp(data.cFileName, ".") == 0 || strcmp(data.cFileName, "..") == 0) {
+				continue;
+			}
+			std::string child = path + "\\" + data.cFileName;
+			if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				DeleteTree(child);
+			}
+			else {
+				DeleteFileA(child.c_str());
+			}
+		} while (FindNextFileA(hFind, &data));
+		FindClose(hFind);
+	}
+	RemoveDirectoryA(path.c_str());
+}
+
+bool WriteWholeFile(const std::string& path, const void* data, size_t size) {
+	HANDLE hFile = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	const char* next = (const char*)data;
+	bool ok = true;
+	while (ok && size > 0) {
+		DWORD written = 0;
+		DWORD part = (DWORD)(std::min)(size, (size_t)(16 << 20));
+		ok = WriteFile(hFile, next, part, &written, NULL) && written == part;
+		next += part;
+		size -= part;
+	}
+	CloseHandle(hFile);
+	return ok;
+}
+
+bool ReadWholeFile(const std::string& path, std::string& data) {
+	data.clear();
+	HANDLE hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER size;
+	bool ok = GetFileSizeEx(hFile, &size) != 0;
+	if (ok) {
+		data.resize((size_t)size.QuadPart);
+	}
+	size_t done = 0;
+	while (ok && done < data.size()) {
+		DWORD read = 0;
+		DWORD part = (DWORD)(std::min)(data.size() - done, (size_t)(16 << 20));
+		ok = ReadFile(hFile, &data[done], part, &read, NULL) && read == part;
+		done += part;
+	}
+	CloseHandle(hFile);
+	return ok;
+}
+
+double Percentile(std::vector<double>& samples, double fraction) {
+	if (samples.empty()) {
+		return 0;
+	}
+	std::sort(samples.begin(), samples.end());
+	size_t index = (size_t)(fraction * (double)(samples.size() - 1) + 0.5);
+	return samples[(std::min)(index, samples.size() - 1)];
+}
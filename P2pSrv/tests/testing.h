@@ -0,0 +1,77 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+// How a test is run: unit tests on every run, loopback tests start servers
+// on TEST_PORT_BASE and up, benchmarks only print numbers
+enum TestKind {
+	TEST_UNIT,
+	TEST_LOOPBACK,
+	TEST_BENCH
+};
+
+// Loopback tests listen from here up, clear of SERVER_PORTS
+#define TEST_PORT_BASE 18080
+
+typedef void (*TestFunction)();
+
+struct TestCase {
+	const char* name;
+	TestKind kind;
+	TestFunction run;
+};
+
+// Every test in the program, in link order
+std::vector<TestCase>& GetTests();
+
+// Adds a test to GetTests before main runs
+class TestRegistrar {
+public:
+	TestRegistrar(const char* name, TestKind kind, TestFunction run);
+};
+
+#define TEST_CASE(kind, name) \
+	static void name(); \
+	static TestRegistrar name##Registrar(#name, kind, name); \
+	static void name()
+#define UNIT_TEST(name) TEST_CASE(TEST_UNIT, name)
+#define LOOPBACK_TEST(name) TEST_CASE(TEST_LOOPBACK, name)
+#define BENCHMARK(name) TEST_CASE(TEST_BENCH, name)
+
+void ReportFailure(const char* file, int line, const char* expression);
+DWORD GetFailureCount();
+
+// CHECK carries on after a failure, REQUIRE leaves the test
+#define CHECK(expression) \
+	do { if (!(expression)) ReportFailure(__FILE__, __LINE__, #expression); } while (0)
+#define REQUIRE(expression) \
+	do { if (!(expression)) { ReportFailure(__FILE__, __LINE__, #expression); return; } } while (0)
+
+// Whether -v was given; the program's log lines go to stderr only then
+extern bool g_verbose;
+
+/**
+* @brief Wall-clock time since construction or the last Restart
+*/
+class Stopwatch {
+private:
+	LARGE_INTEGER m_start;
+	LARGE_INTEGER m_frequency;
+
+public:
+	Stopwatch();
+	void Restart();
+	double Seconds() const;
+};
+
+// Reproducible pseudo-random bytes, different for every seed
+void FillRandom(void* data, size_t size, DWORD seed);
+// Empty directory %TEMP%\P2pTests\<name>, whatever was there before is deleted
+std::string MakeTestDirectory(const std::string& name);
+void DeleteTree(const std::string& path);
+bool WriteWholeFile(const std::string& path, const void* data, size_t size);
+bool ReadWholeFile(const std::string& path, std::string& data);
+// The value below which fraction of samples lie; sorts samples
+double Percentile(std::vector<double>& samples, double fraction);
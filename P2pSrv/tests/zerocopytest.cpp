@@ -0,0 +1,126 @@
+#include "testing.h"
+#include "readsendserver.h"
+#include "tcpserver.h"
+#include "crc32c.h"
+
+#include <ws2tcpip.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+
+#define ZEROCOPY_FILE_SIZE (64 * 1024 * 1024)
+#define ZEROCOPY_CONNECTIONS 8
+#define ZEROCOPY_DEPTH 16
+
+// Fetch every CHUNK_SIZE chunk of name from the server at port with
+// ZEROCOPY_DEPTH requests in flight, checking each against its CRC32C.
+// Plain ChunkRequests, so every server gets the same requests.
+static bool FetchAllChunks(int port, const char* name, DWORD chunkCount) {
+	SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((u_short)port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (s == INVALID_SOCKET || connect(s, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+		if (s != INVALID_SOCKET) {
+			closesocket(s);
+		}
+		return false;
+	}
+	BOOL noDelay = TRUE;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+
+	ChunkRequest request = {};
+	request.msgType = MSG_CHUNK_REQUEST;
+	strncpy_s(request.filename, name, MAX_FILENAME - 1);
+	request.flags = REQ_FLAG_CRC32C;
+	std::vector<char> data(CHUNK_SIZE);
+	DWORD sent = 0;
+	DWORD received = 0;
+	bool ok = true;
+	while (ok && received < chunkCount) {
+		while (sent < chunkCount && sent - received < ZEROCOPY_DEPTH) {
+			request.chunkIndex = sent++;
+			if (send(s, (char*)&request, sizeof(request), 0) != sizeof(request)) {
+				ok = false;
+				break;
+			}
+		}
+		ChunkResponse response;
+		ok = ok && recv(s, (char*)&response, sizeof(response), MSG_WAITALL) == sizeof(response) &&
+			response.msgType == MSG_CHUNK_RESPONSE_CRC32C && response.chunkIndex == received &&
+			response.chunkSize == CHUNK_SIZE &&
+			recv(s, &data[0], CHUNK_SIZE, MSG_WAITALL) == CHUNK_SIZE &&
+			Crc32c(&data[0], CHUNK_SIZE) == response.crc32;
+		received++;
+	}
+	closesocket(s);
+	return ok;
+}
+
+// ZEROCOPY_CONNECTIONS connections each fetching the whole file; MB/s over
+// all of them, 0 if any connection failed
+static double MeasureServer(int port) {
+	DWORD chunkCount = ZEROCOPY_FILE_SIZE / CHUNK_SIZE;
+	std::atomic<DWORD> failures(0);
+	std::vector<std::thread> threads;
+	Stopwatch watch;
+	for (int i = 0; i < ZEROCOPY_CONNECTIONS; i++) {
+		threads.push_back(std::thread([&] {
+			if (!FetchAllChunks(port, "zerocopy.bin", chunkCount)) {
+				failures++;
+			}
+		}));
+	}
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i].join();
+	}
+	double seconds = watch.Seconds();
+	CHECK(failures == 0);
+	return (failures == 0) ? (double)ZEROCOPY_FILE_SIZE * ZEROCOPY_CONNECTIONS / (1024 * 1024) / seconds : 0;
+}
+
+// TCPFileServer against ReadSendServer, which reads every chunk into a
+// buffer and sends it from there. With the chunk cache off TCPFileServer
+// sends straight from the file with TransmitFile; with it on, chunks that
+// are cached go out from RAM in one gather send. Every server is measured
+// twice and the second run counts, so each starts from a warm system cache.
+BENCHMARK(ZeroCopyServing) {
+	WSADATA wsaData;
+	REQUIRE(WSAStartup(MAKEWORD(2, 2), &wsaData) == 0);
+	std::string folder = MakeTestDirectory("zerocopy");
+	std::string content(ZEROCOPY_FILE_SIZE, '\0');
+	FillRandom(&content[0], content.size(), 13);
+	REQUIRE(WriteWholeFile(folder + "\\zerocopy.bin", content.data(), content.size()));
+
+	ReadSendServer readSend(TEST_PORT_BASE, folder);
+	REQUIRE(readSend.Start());
+	MeasureServer(readSend.GetPort());
+	double readSendRate = MeasureServer(readSend.GetPort());
+	readSend.Stop();
+
+	TCPFileServer transmit(TEST_PORT_BASE + 1, folder);
+	transmit.SetCacheSize(0);
+	transmit.SetCompression(false);
+	REQUIRE(transmit.Initialize() && transmit.Start());
+	MeasureServer(transmit.GetPort());
+	double transmitRate = MeasureServer(transmit.GetPort());
+	transmit.Stop();
+
+	TCPFileServer cached(TEST_PORT_BASE + 2, folder);
+	cached.SetCompression(false);
+	REQUIRE(cached.Initialize() && cached.Start());
+	MeasureServer(cached.GetPort());
+	double cachedRate = MeasureServer(cached.GetPort());
+	cached.Stop();
+
+	DeleteTree(folder);
+	WSACleanup();
+
+	printf("  %d connections, %d MB each, %d requests in flight\n", ZEROCOPY_CONNECTIONS,
+		ZEROCOPY_FILE_SIZE / (1024 * 1024), ZEROCOPY_DEPTH);
+	printf("  ReadFile + send        %7.1f MB/s\n", readSendRate);
+	printf("  TransmitFile           %7.1f MB/s\n", transmitRate);
+	printf("  chunk cache            %7.1f MB/s\n", cachedRate);
+}
@@ -0,0 +1,203 @@
+#include "uploadscheduler.h"
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+// Add what bucket earned since it was last refilled, up to one burst
+static void Refill(TokenBucket& bucket, ULONGLONG now) {
+	if (bucket.rate == 0) {
+		bucket.tokens = 0;
+		bucket.refilled = now;
+		return;
+	}
+	ULONG64 earned = bucket.rate * (now - bucket.refilled) / 1000;
+	// Below a byte per elapsed tick the time is kept until it adds up
+	if (earned == 0) {
+		return;
+	}
+	LONG64 burst = (LONG64)(std::max)(bucket.rate * SCHEDULER_BURST_MS / 1000, (ULONG64)1);
+	bucket.tokens = (std::min)(bucket.tokens + (LONG64)earned, burst);
+	bucket.refilled = now;
+}
+
+// Whether bucket lets a send out now
+static bool IsOpen(const TokenBucket& bucket) {
+	return bucket.rate == 0 || bucket.tokens >= 0;
+}
+
+// Milliseconds until a closed bucket is open again. An open one with
+// waiters behind it is held for a connection that is still sending.
+static DWORD TimeToOpen(const TokenBucket& bucket) {
+	if (IsOpen(bucket)) {
+		return SCHEDULER_SEND_GRACE_MS;
+	}
+	ULONG64 ms = ((ULONG64)-bucket.tokens * 1000 + bucket.rate - 1) / bucket.rate;
+	return (DWORD)(std::max)((std::min)(ms, (ULONG64)1000), (ULONG64)1);
+}
+
+static void SetRate(TokenBucket& bucket, ULONG64 rate, ULONGLONG now) {
+	bucket.rate = rate;
+	bucket.tokens = (std::min)(bucket.tokens, (LONG64)0);
+	bucket.refilled = now;
+}
+
+// Constructor
+UploadScheduler::UploadScheduler() : m_stopped(false), m_peerRate(0), m_waiting(0) {
+	memset(&m_total, 0, sizeof(m_total));
+	memset(&m_stats, 0, sizeof(m_stats));
+}
+
+void UploadScheduler::SetLimits(ULONG64 totalRate, ULONG64 peerRate) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	ULONGLONG now = GetTickCount64();
+	SetRate(m_total, totalRate, now);
+	m_peerRate = peerRate;
+	for (std::map<ULONG, Peer>::iterator it = m_peers.begin(); it != m_peers.end(); ++it) {
+		SetRate(it->second.bucket, peerRate, now);
+	}
+	// Waiters recompute how long they sleep
+	m_wake.notify_all();
+}
+
+// Register a connection from address, before its first Acquire
+void UploadScheduler::Join(UploadFlow& flow, ULONG address) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	std::map<ULONG, Peer>::iterator it = m_peers.find(address);
+	if (it == m_peers.end()) {
+		Peer peer;
+		peer.bucket.rate = m_peerRate;
+		peer.bucket.tokens = 0;
+		peer.bucket.refilled = GetTickCount64();
+		peer.connections = 0;
+		it = m_peers.insert(std::make_pair(address, peer)).first;
+	}
+	it->second.connections++;
+	flow.peer = &it->second.bucket;
+	flow.address = address;
+	flow.request = 0;
+	flow.deficit = 0;
+	flow.waiting = false;
+	flow.granted = false;
+	flow.sending = false;
+	flow.grantedAt = 0;
+	m_line.push_back(&flow);
+}
+
+void UploadScheduler::Leave(UploadFlow& flow) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	std::deque<UploadFlow*>::iterator found = std::find(m_line.begin(), m_line.end(), &flow);
+	if (found != m_line.end()) {
+		m_line.erase(found);
+	}
+	std::map<ULONG, Peer>::iterator it = m_peers.find(flow.address);
+	if (it != m_peers.end() && --it->second.connections == 0) {
+		m_peers.erase(it);
+	}
+	flow.peer = NULL;
+}
+
+bool UploadScheduler::Acquire(UploadFlow& flow, DWORD bytes) {
+	std::unique_lock<std::mutex> lock(m_lock);
+	ULONGLONG now = GetTickCount64();
+	bool delayed = false;
+
+	// The peer limit comes first, a throttled peer must not hold up the line
+	Refill(*flow.peer, now);
+	while (!m_stopped && !IsOpen(*flow.peer)) {
+		delayed = true;
+		m_wake.wait_for(lock, std::chrono::milliseconds(TimeToOpen(*flow.peer)));
+		now = GetTickCount64();
+		Refill(*flow.peer, now);
+	}
+	if (m_stopped) {
+		return false;
+	}
+
+	if (m_total.rate == 0) {
+		flow.peer->tokens -= (flow.peer->rate != 0) ? bytes : 0;
+		flow.granted = true;
+	}
+	else {
+		flow.request = bytes;
+		flow.waiting = true;
+		flow.sending = false;
+		m_waiting++;
+		Dispatch(now);
+		while (!m_stopped && !flow.granted) {
+			delayed = true;
+			m_wake.wait_for(lock, std::chrono::milliseconds(TimeToOpen(m_total)));
+			Dispatch(GetTickCount64());
+		}
+		if (!flow.granted) {
+			flow.waiting = false;
+			m_waiting--;
+			return false;
+		}
+	}
+
+	flow.granted = false;
+	m_stats.bytes += bytes;
+	m_stats.delayed += delayed ? 1 : 0;
+	return true;
+}
+
+void UploadScheduler::Start() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_stopped = false;
+}
+
+void UploadScheduler::Stop() {
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_stopped = true;
+	m_wake.notify_all();
+}
+
+void UploadScheduler::GetStats(UploadStats& stats) {
+	std::lock_guard<std::mutex> lock(m_lock);
+	stats = m_stats;
+	stats.totalRate = m_total.rate;
+	stats.peerRate = m_peerRate;
+}
+
+// Grant sends in deficit round robin order for as long as the global
+// bucket is open. A connection whose deficit does not cover its chunk goes
+// to the back of the line and keeps the deficit for its next turn.
+void UploadScheduler::Dispatch(ULONGLONG now) {
+	Refill(m_total, now);
+	bool granted = false;
+	while (m_waiting > 0 && IsOpen(m_total)) {
+		UploadFlow* flow = m_line.front();
+		if (!flow->waiting) {
+			if (flow->sending && now - flow->grantedAt < SCHEDULER_SEND_GRACE_MS) {
+				break;
+			}
+			flow->sending = false;
+			flow->deficit = 0;
+			m_line.pop_front();
+			m_line.push_back(flow);
+			continue;
+		}
+
+		m_line.pop_front();
+		m_line.push_back(flow);
+		flow->deficit += SCHEDULER_QUANTUM;
+		if (flow->deficit < flow->request) {
+			continue;
+		}
+		flow->deficit -= flow->request;
+		m_total.tokens -= flow->request;
+		if (flow->peer->rate != 0) {
+			flow->peer->tokens -= flow->request;
+		}
+		flow->waiting = false;
+		flow->granted = true;
+		flow->sending = true;
+		flow->grantedAt = now;
+		m_waiting--;
+		granted = true;
+	}
+	if (granted) {
+		m_wake.notify_all();
+	}
+}
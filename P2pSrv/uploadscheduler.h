@@ -0,0 +1,96 @@
+#pragma once
+
+#include <windows.h>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+
+// Bytes added to a waiting connection's deficit each time its turn comes round
+#define SCHEDULER_QUANTUM (64 * 1024)
+// How long a connection keeps its turn while it sends the chunk it was last granted
+#define SCHEDULER_SEND_GRACE_MS 20
+// Largest burst a token bucket lets out after being idle, in milliseconds of its rate
+#define SCHEDULER_BURST_MS 100
+
+// Bytes a limit lets through, refilled at rate bytes per second; 0 is no limit
+struct TokenBucket {
+	ULONG64 rate;
+	LONG64 tokens;		// may go negative, a large send is paid off afterwards
+	ULONGLONG refilled;	// GetTickCount64 of the last refill
+};
+
+// A connection's place in the UploadScheduler, kept by the connection and
+// filled in by Join
+struct UploadFlow {
+	TokenBucket* peer;	// shared by every connection from the same address
+	ULONG address;
+	DWORD request;		// bytes asked for
+	DWORD deficit;
+	bool waiting;		// for its request to be granted
+	bool granted;
+	bool sending;		// what it was granted, and may come back for more
+	ULONGLONG grantedAt;
+};
+
+struct UploadStats {
+	ULONG64 bytes;			// granted to all connections
+	ULONG64 delayed;		// sends that had to wait for a limit
+	ULONG64 totalRate;		// limits in bytes per second, 0 if none
+	ULONG64 peerRate;
+};
+
+/**
+* @brief Shares upload capacity between connections of the TCP file server
+*
+* Every chunk a connection is about to send is first asked for here. Its
+* peer's token bucket has to allow it, then it waits in line for the global
+* bucket. The line is served deficit round robin: each turn adds
+* SCHEDULER_QUANTUM to a connection's deficit and it sends once the deficit
+* covers the chunk. Connections share the global rate by bytes, whatever
+* chunk size they negotiated, and a small download is served within a
+* round instead of waiting behind the multi-megabyte chunks of big ones.
+*
+* Connections block in Acquire, one chunk at a time, so each connection's
+* queue is the requests it has pipelined on its socket. Between two of its
+* chunks a connection is briefly not waiting, so the line holds its turn
+* for up to SCHEDULER_SEND_GRACE_MS instead of skipping it; otherwise a
+* lone big download would collect all its quanta in that gap. A connection
+* with nothing to send is skipped and, as in DRR, loses its deficit.
+* Without a global limit nothing waits in line; a peer limit still holds.
+*/
+class UploadScheduler {
+public:
+	UploadScheduler();
+	UploadScheduler(const UploadScheduler&) = delete;
+	UploadScheduler& operator=(const UploadScheduler&) = delete;
+
+	// Upload limits in bytes per second, 0 for none; can change at any time
+	void SetLimits(ULONG64 totalRate, ULONG64 peerRate);
+	void Join(UploadFlow& flow, ULONG address);
+	void Leave(UploadFlow& flow);
+	// Wait until flow may send bytes; false once Stop was called
+	bool Acquire(UploadFlow& flow, DWORD bytes);
+	void Start();
+	// Wake and fail every Acquire, until Start
+	void Stop();
+	void GetStats(UploadStats& stats);
+
+private:
+	struct Peer {
+		TokenBucket bucket;
+		DWORD connections;
+	};
+
+	std::mutex m_lock;
+	std::condition_variable m_wake;
+	bool m_stopped;
+	TokenBucket m_total;
+	ULONG64 m_peerRate;
+	std::map<ULONG, Peer> m_peers;
+	std::deque<UploadFlow*> m_line;		// every connection, in round robin order
+	DWORD m_waiting;
+	UploadStats m_stats;
+
+	void Dispatch(ULONGLONG now);
+};